@@ -0,0 +1,79 @@
+//
+//  Batch.cpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Batch.hpp"
+#include <thread>
+#include <atomic>
+
+auto BatchReconstruction::parse_options(int argc, const char *argv[], BatchOptions &options) -> bool {
+    auto positional = 0;
+    for (auto i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        auto has_value = i + 1 < argc;
+        if (arg == "--mvg" && has_value) {
+            options.mvg_path = argv[++i];
+        } else if (arg == "--mvs" && has_value) {
+            options.mvs_path = argv[++i];
+        } else if (arg.rfind("--", 0) != 0 && positional == 0) {
+            options.images_path = arg;
+            positional++;
+        } else if (arg.rfind("--", 0) != 0 && positional == 1) {
+            options.session_name = arg;
+            positional++;
+        } else {
+            std::cerr << "未知参数：" << arg << std::endl;
+            positional = -1;
+            break;
+        }
+    }
+    if (positional != 2) {
+        std::cerr << "用法：Reconing --reconstruct <图片文件夹> <保存名称> [--mvg openMVG 路径] [--mvs openMVS 路径]"
+            << std::endl;
+        return false;
+    }
+    return true;
+}
+
+auto BatchReconstruction::run() -> int {
+    std::vector<std::string> image_listing;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(options.images_path, error)) {
+        const auto extension = entry.path().extension();
+        if (extension == ".jpg" || extension == ".bmp" || extension == ".png") {
+            image_listing.push_back(entry.path().string());
+        }
+    }
+    if (image_listing.size() < 2) {
+        std::cerr << "图片不足，无法重建：" << options.images_path << std::endl;
+        return 1;
+    }
+
+    PipelineNS::Pipeline pipeline(image_listing, options.images_path, options.mvg_path, options.mvs_path);
+    std::atomic<bool> finished(false);
+    auto succeeded = false;
+    std::thread runner([&] () {
+        succeeded = pipeline.run();
+        finished = true;
+    });
+    // The pipeline only exposes its state, the way the pipeline window polls it
+    auto reported = PipelineNS::PipelineState::FINISHED_ERR;
+    while (!finished) {
+        auto state = pipeline.state;
+        if (state != reported) {
+            reported = state;
+            std::cout << "stage " << (int) state << " " << pipeline.progress << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    runner.join();
+    if (!succeeded || !pipeline.save_session(options.session_name)) {
+        std::cerr << get_log().str() << std::endl;
+        return 1;
+    }
+    std::cout << "stage " << (int) PipelineNS::PipelineState::FINISHED_SUCCESS << " 1" << std::endl;
+    return 0;
+}
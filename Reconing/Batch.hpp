@@ -0,0 +1,41 @@
+//
+//  Batch.hpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Batch_hpp
+#define Batch_hpp
+
+#include "common.hpp"
+#include "Modules/Pipeline.hpp"
+#include <string>
+
+#define BATCH "批处理"
+
+struct BatchOptions {
+    std::string images_path;
+    std::string session_name;
+    std::string mvg_path = PIPELINE_MVG_PATH;
+    std::string mvs_path = PIPELINE_MVS_PATH;
+};
+
+/// Runs the whole pipeline on a folder of images without any UI, then saves the session into
+/// recons/ like the pipeline window's "保存" does. Everything is relative to the working
+/// directory, which is how the server runs several of these side by side.
+///
+/// Progress goes to stdout as `stage <PipelineState> <progress>` lines, one per stage change.
+class BatchReconstruction {
+public:
+    BatchReconstruction(BatchOptions options) : options(options) {}
+
+    auto run() -> int;
+
+    static auto parse_options(int argc, const char *argv[], BatchOptions &options) -> bool;
+
+private:
+    BatchOptions options;
+};
+
+#endif /* Batch_hpp */
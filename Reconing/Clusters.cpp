@@ -0,0 +1,212 @@
+//
+//  Clusters.cpp
+//  Reconing
+//
+//  Created by apple on 24/04/2021.
+//
+
+#include "Clusters.hpp"
+#include "Profiler.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <glm/gtc/type_ptr.hpp>
+
+auto ClusteredMesh::build(std::vector<Vertex> &vertices, int triangles_per_cluster) -> void {
+    destroy();
+    auto num_triangles = (int) vertices.size() / 3;
+    std::vector<glm::vec3> centroids(num_triangles);
+    std::vector<int> triangles(num_triangles);
+    for (auto i = 0; i < num_triangles; i++) {
+        centroids[i] = (vertices[i * 3].position + vertices[i * 3 + 1].position + vertices[i * 3 + 2].position) / 3.0f;
+        triangles[i] = i;
+    }
+    split(triangles, 0, num_triangles, centroids, triangles_per_cluster);
+
+    // Clusters come out in split order, so lay the triangles out the same way
+    std::vector<Vertex> reordered;
+    reordered.reserve(vertices.size());
+    auto cursor = 0;
+    for (auto &cluster : clusters) {
+        auto triangle_count = cluster.count;
+        cluster.first = (GLint) reordered.size();
+        cluster.count = triangle_count * 3;
+        cluster.min = glm::vec3(FLT_MAX);
+        cluster.max = glm::vec3(-FLT_MAX);
+        for (auto i = cursor; i < cursor + triangle_count; i++) {
+            for (auto j = 0; j < 3; j++) {
+                const auto &v = vertices[triangles[i] * 3 + j];
+                cluster.min = glm::min(cluster.min, v.position);
+                cluster.max = glm::max(cluster.max, v.position);
+                reordered.push_back(v);
+            }
+        }
+        cursor += triangle_count;
+    }
+    vertices = std::move(reordered);
+    drawn = (int) clusters.size();
+}
+
+auto ClusteredMesh::split(std::vector<int> &triangles, int begin, int end,
+                          const std::vector<glm::vec3> &centroids, int triangles_per_cluster) -> void {
+    if (end - begin <= triangles_per_cluster) {
+        if (end > begin) {
+            Cluster cluster;
+            cluster.first = begin;
+            cluster.count = end - begin; // In triangles until build() lays them out
+            clusters.push_back(cluster);
+        }
+        return;
+    }
+    glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+    for (auto i = begin; i < end; i++) {
+        min = glm::min(min, centroids[triangles[i]]);
+        max = glm::max(max, centroids[triangles[i]]);
+    }
+    auto extent = max - min;
+    auto axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    auto mid = begin + (end - begin) / 2;
+    std::nth_element(triangles.begin() + begin, triangles.begin() + mid, triangles.begin() + end,
+                     [&](int a, int b) {
+        return centroids[a][axis] < centroids[b][axis];
+    });
+    split(triangles, begin, mid, centroids, triangles_per_cluster);
+    split(triangles, mid, end, centroids, triangles_per_cluster);
+}
+
+auto ClusteredMesh::draw(const glm::mat4 &model, const glm::mat4 &view, const glm::mat4 &perspective,
+                         bool occlusion_culling) -> void {
+    RECON_PROFILE_CPU("簇剔除");
+    auto mvp = perspective * view * model;
+    // Frustum planes in model space (Gribb & Hartmann)
+    glm::vec4 rows[4];
+    for (auto i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+    }
+    glm::vec4 planes[6] = {
+        rows[3] + rows[0], rows[3] - rows[0],
+        rows[3] + rows[1], rows[3] - rows[1],
+        rows[3] + rows[2], rows[3] - rows[2]
+    };
+
+    firsts.clear();
+    counts.clear();
+    std::vector<int> candidates;
+    for (size_t i = 0; i < clusters.size(); i++) {
+        auto &cluster = clusters[i];
+        auto inside = true;
+        for (const auto &plane : planes) {
+            // The box corner furthest along the plane normal
+            glm::vec3 positive(plane.x >= 0.0f ? cluster.max.x : cluster.min.x,
+                               plane.y >= 0.0f ? cluster.max.y : cluster.min.y,
+                               plane.z >= 0.0f ? cluster.max.z : cluster.min.z);
+            if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f) {
+                inside = false;
+                break;
+            }
+        }
+        if (!inside) {
+            // Re-entering clusters get drawn first and re-tested, rather than trusting a stale result
+            cluster.visible = true;
+            continue;
+        }
+        if (!occlusion_culling) {
+            cluster.visible = true;
+        } else if (cluster.query_pending) {
+            GLint available = 0;
+            glGetQueryObjectiv(cluster.query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint passed = 0;
+                glGetQueryObjectuiv(cluster.query, GL_QUERY_RESULT, &passed);
+                cluster.visible = passed != 0;
+                cluster.query_pending = false;
+            }
+        }
+        candidates.push_back((int) i);
+        if (cluster.visible) {
+            firsts.push_back(cluster.first);
+            counts.push_back(cluster.count);
+        }
+    }
+    drawn = (int) firsts.size();
+    if (!firsts.empty()) {
+        glMultiDrawArrays(GL_TRIANGLES, firsts.data(), counts.data(), (GLsizei) firsts.size());
+    }
+    if (occlusion_culling && !candidates.empty()) {
+        auto eye = glm::vec3(glm::inverse(view * model)[3]);
+        test_occlusion(mvp, eye, candidates);
+    }
+}
+
+auto ClusteredMesh::test_occlusion(const glm::mat4 &mvp, const glm::vec3 &eye, const std::vector<int> &candidates) -> void {
+    if (box_VAO == GL_NONE) {
+        // Unit cube, scaled onto each cluster's box in the vertex shader
+        const float cube[] = {
+            0, 0, 0,  1, 0, 0,  1, 1, 0,  0, 0, 0,  1, 1, 0,  0, 1, 0,
+            0, 0, 1,  1, 1, 1,  1, 0, 1,  0, 0, 1,  0, 1, 1,  1, 1, 1,
+            0, 0, 0,  0, 1, 0,  0, 1, 1,  0, 0, 0,  0, 1, 1,  0, 0, 1,
+            1, 0, 0,  1, 1, 1,  1, 1, 0,  1, 0, 0,  1, 0, 1,  1, 1, 1,
+            0, 0, 0,  1, 0, 1,  1, 0, 0,  0, 0, 0,  0, 0, 1,  1, 0, 1,
+            0, 1, 0,  1, 1, 0,  1, 1, 1,  0, 1, 0,  1, 1, 1,  0, 1, 1
+        };
+        glGenVertexArrays(1, &box_VAO);
+        glGenBuffers(1, &box_VBO);
+        glBindVertexArray(box_VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, box_VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, nullptr);
+        glEnableVertexAttribArray(0);
+        box_program = shared_program("shaders/bounds_vertex.glsl", "shaders/bounds_fragment.glsl");
+    }
+    GLint previous_program = GL_NONE;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previous_program);
+
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glUseProgram(box_program);
+    glUniformMatrix4fv(glGetUniformLocation(box_program, "mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
+    auto box_min_location = glGetUniformLocation(box_program, "box_min");
+    auto box_max_location = glGetUniformLocation(box_program, "box_max");
+    glBindVertexArray(box_VAO);
+    for (auto i : candidates) {
+        auto &cluster = clusters[i];
+        if (cluster.query_pending) {
+            continue;
+        }
+        // Nudge the box outwards so it doesn't z-fight with its own triangles
+        auto padding = (cluster.max - cluster.min) * 0.01f + 0.0001f;
+        auto min = cluster.min - padding, max = cluster.max + padding;
+        if (glm::all(glm::greaterThanEqual(eye, min)) && glm::all(glm::lessThanEqual(eye, max))) {
+            // Inside the box, its faces get clipped away; just assume we can see it
+            cluster.visible = true;
+            continue;
+        }
+        if (cluster.query == GL_NONE) {
+            glGenQueries(1, &cluster.query);
+        }
+        glUniform3fv(box_min_location, 1, glm::value_ptr(min));
+        glUniform3fv(box_max_location, 1, glm::value_ptr(max));
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, cluster.query);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        cluster.query_pending = true;
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glUseProgram(previous_program);
+    glBindVertexArray(GL_NONE);
+}
+
+auto ClusteredMesh::destroy() -> void {
+    for (auto &cluster : clusters) {
+        if (cluster.query != GL_NONE) {
+            glDeleteQueries(1, &cluster.query);
+        }
+    }
+    clusters.clear();
+    if (box_VAO != GL_NONE) {
+        glDeleteVertexArrays(1, &box_VAO);
+        glDeleteBuffers(1, &box_VBO);
+        box_VAO = GL_NONE;
+        box_VBO = GL_NONE;
+    }
+}
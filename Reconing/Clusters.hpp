@@ -0,0 +1,63 @@
+//
+//  Clusters.hpp
+//  Reconing
+//
+//  Created by apple on 24/04/2021.
+//
+
+#ifndef Clusters_hpp
+#define Clusters_hpp
+
+#include "common.hpp"
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#define CLUSTER_TRIANGLES 2048
+
+/// A spatially coherent run of triangles, [first, first + count) in the vertex buffer.
+struct Cluster {
+    glm::vec3 min, max;
+    GLint first;
+    GLsizei count;
+
+    // O C C L U S I O N /////////////////////////////
+    GLuint query = GL_NONE;
+    bool query_pending = false;
+    bool visible = true; // Last known occlusion result
+};
+
+/// Splits a triangle soup into clusters with bounding boxes, so whole clusters can be
+/// frustum culled on the CPU and occlusion culled with hardware queries.
+///
+/// Occlusion uses the previous frame's query results: clusters that were visible get drawn
+/// normally, and all clusters in the frustum then get their bounding box tested against
+/// the fresh depth buffer. Results are read back once available, so we never stall.
+class ClusteredMesh {
+public:
+    ClusteredMesh() : drawn(0), box_VAO(GL_NONE), box_VBO(GL_NONE), box_program(GL_NONE) {}
+
+    /// Reorders the vertices (triangle by triangle) so every cluster is contiguous.
+    auto build(std::vector<Vertex> &vertices, int triangles_per_cluster = CLUSTER_TRIANGLES) -> void;
+
+    /// Draws the surviving clusters from the currently bound program & VAO.
+    auto draw(const glm::mat4 &model, const glm::mat4 &view, const glm::mat4 &perspective,
+              bool occlusion_culling) -> void;
+
+    auto destroy() -> void;
+
+    std::vector<Cluster> clusters;
+    int drawn; // Clusters drawn last time, for the UI
+
+private:
+    auto split(std::vector<int> &triangles, int begin, int end,
+               const std::vector<glm::vec3> &centroids, int triangles_per_cluster) -> void;
+
+    auto test_occlusion(const glm::mat4 &mvp, const glm::vec3 &eye, const std::vector<int> &candidates) -> void;
+
+    GLuint box_VAO, box_VBO, box_program;
+    std::vector<GLint> firsts;
+    std::vector<GLsizei> counts;
+};
+
+#endif /* Clusters_hpp */
@@ -10,6 +10,8 @@
 #include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_opengl3.h>
 #include "common.hpp"
+#include "Profiler.hpp"
+#include <algorithm>
 
 
 Engine::Engine() { 
@@ -32,6 +34,7 @@ Engine::Engine() {
     ImGui_ImplOpenGL3_Init("#version 330 core");
     io.Fonts->AddFontFromFileTTF("assets/noto_sans_sc.otf", 18, nullptr, io.Fonts->GetGlyphRangesChineseFull());
     log_autoscroll = true;
+    show_profiler = false;
     
     ImGuiStyle &style = ImGui::GetStyle();
     style.FrameRounding = 7.0f;
@@ -47,6 +50,8 @@ Engine::Engine() {
     // R E N D E R S ////////////////////////////////
     currently_selected_render = 0;
     available_renders.clear();
+    split_view = false;
+    sync_camera = true;
     
     RECON_LOG(ENGINE) << "初始化完毕。";
 }
@@ -57,9 +62,13 @@ auto Engine::run() -> int {
         float this_instant = glfwGetTime();
         auto delta_time = this_instant - last_instant;
         last_instant = this_instant;
+        profiler().begin_frame();
         
         // E V E N T S ///////////////////////////////
-        glfwPollEvents();
+        {
+            RECON_PROFILE_CPU("事件");
+            glfwPollEvents();
+        }
         glfwGetFramebufferSize(window, &window_size.x, &window_size.y);
         auto old_render_size = available_renders.size();
         available_renders.clear();
@@ -67,21 +76,38 @@ auto Engine::run() -> int {
             auto &m = modules[i];
             m->window_size = { window_size.x, window_size.y };
             m->window = window;
+            m->camera = split_view && sync_camera ? &shared_camera : &m->own_camera;
+            RECON_PROFILE_CPU(m->name + " update");
             if (m->update(delta_time)) {
-                available_renders.push_back(i);
+                available_renders.push_back({ i, -1, m->name });
+                auto snapshots = m->snapshots();
+                for (auto s = 0; s < snapshots.size(); s++) {
+                    available_renders.push_back({ i, s, m->name + " · " + snapshots[s] });
+                }
             }
         }
         if (available_renders.size() != old_render_size) {
             currently_selected_render = 0;
         }
+        
+        // C A M E R A S /////////////////////////////
+        // Shared cameras must only move once per frame
+        if (!ImGui::GetIO().WantCaptureKeyboard) {
+            std::set<Camera *> cameras;
+            for (const auto &view : available_renders) {
+                cameras.insert(modules[view.module]->camera);
+            }
+            for (auto *camera : cameras) {
+                camera->update(window, delta_time);
+            }
+        }
 
         // R E N D E R S /////////////////////////////
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        if (available_renders.size() > currently_selected_render) {
-            modules[available_renders[currently_selected_render]]->render();
-        }
+        render_views();
 
         // I M G U I /////////////////////////////////
+        auto imgui_start = std::chrono::steady_clock::now();
+        auto imgui_section = profiler().begin_cpu("ImGui");
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
@@ -92,39 +118,32 @@ auto Engine::run() -> int {
         auto str = get_log().str();
         ImGui::TextWrapped("%s", str.c_str());
         ImGui::Checkbox("自动滚动", &log_autoscroll);
+        ImGui::SameLine();
+        ImGui::Checkbox("性能分析", &show_profiler);
         if (log_autoscroll) {
             ImGui::SetScrollHereY(1.0f);
         }
         ImGui::End();
         for (auto &m : modules) {
+            RECON_PROFILE_CPU(m->name + " ui");
             m->update_ui();
         }
-        if (available_renders.size() > 1) {
-            ImGui::SetNextWindowPos({ 50, 50 }, ImGuiCond_FirstUseEver);
-            ImGui::SetNextWindowSize({ 300, 200 }, ImGuiCond_FirstUseEver);
-            ImGui::Begin("选择输出 ");
-            ImGui::TextWrapped("大于一个模块尝试渲染内容到主界面。选择一个你想要查看的模块：");
-            if (ImGui::BeginListBox("", ImVec2 { -FLT_MIN, 5 * ImGui::GetTextLineHeightWithSpacing() })) {
-                for (auto i = 0; i < available_renders.size(); i++) {
-                    auto selected = currently_selected_render == i;
-                    if (ImGui::Selectable(modules[available_renders[i]]->name.c_str(),
-                                          selected)) {
-                        currently_selected_render = i;
-                    }
-                    if (selected) {
-                        ImGui::SetItemDefaultFocus();
-                    }
-                }
-                ImGui::EndListBox();
-            }
-            ImGui::End();
-        }
+        update_render_ui();
+        profiler().update_ui(&show_profiler);
         ImGui::Render();
 
         glViewport(0, 0, window_size.x, window_size.y);
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        {
+            RECON_PROFILE_GPU("ImGui");
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
+        profiler().end_cpu(imgui_section, imgui_start);
 
-        glfwSwapBuffers(window);
+        {
+            RECON_PROFILE_CPU("交换缓冲");
+            glfwSwapBuffers(window);
+        }
+        profiler().end_frame(delta_time);
     }
     return 0;
 }
@@ -133,6 +152,10 @@ Engine::~Engine() {
     for (auto &m : modules) {
         m->destroy();
     }
+    for (auto &viewport : viewports) {
+        viewport.destroy();
+    }
+    profiler().destroy();
     glfwDestroyWindow(window);
 }
 
@@ -141,3 +164,108 @@ auto Engine::register_module(Module *module) -> bool {
     RECON_LOG(ENGINE) << "模块已注册：" << module->name;
     return true;
 }
+
+auto Engine::render_views() -> void {
+    std::vector<RenderView> views;
+    if (split_view) {
+        for (const auto &view : available_renders) {
+            if (split_selection.count(view.name) > 0 && views.size() < ENGINE_MAX_SPLIT) {
+                views.push_back(view);
+            }
+        }
+    }
+    if (views.empty() && available_renders.size() > currently_selected_render) {
+        views.push_back(available_renders[currently_selected_render]);
+    }
+    rendered_views = views;
+    glBindFramebuffer(GL_FRAMEBUFFER, GL_NONE);
+    glViewport(0, 0, window_size.x, window_size.y);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (views.empty()) {
+        return;
+    }
+
+    // Every view gets its own column; the modules' GPU buffers are drawn as they are, nothing is copied
+    glm::ivec2 tile = { window_size.x / (int) views.size(), window_size.y };
+    if (tile.x <= 0 || tile.y <= 0) {
+        return;
+    }
+    if (viewports.size() < views.size()) {
+        viewports.resize(views.size());
+    }
+    for (auto i = 0; i < views.size(); i++) {
+        const auto &view = views[i];
+        auto *m = modules[view.module];
+        auto &viewport = viewports[i];
+        viewport.resize(tile);
+        viewport.bind();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        m->viewport_size = tile;
+        {
+            RECON_PROFILE_CPU(view.name + " render");
+            RECON_PROFILE_GPU(view.name + " render");
+            if (view.snapshot < 0) {
+                m->render();
+            } else {
+                m->render_snapshot(view.snapshot);
+            }
+        }
+        viewport.blit({ tile.x * i, 0 });
+    }
+    glViewport(0, 0, window_size.x, window_size.y);
+}
+
+auto Engine::update_render_ui() -> void {
+    if (rendered_views.size() > 1) {
+        const auto &io = ImGui::GetIO();
+        auto tile_width = io.DisplaySize.x / rendered_views.size();
+        for (auto i = 0; i < rendered_views.size(); i++) {
+            ImGui::GetForegroundDrawList()->AddText({ tile_width * i + 10, io.DisplaySize.y - 30 },
+                                                    IM_COL32(255, 255, 255, 255), rendered_views[i].name.c_str());
+        }
+    }
+    if (available_renders.size() <= 1) {
+        return;
+    }
+    // Forget outputs that went away, e.g. stages of a pipeline run that got restarted
+    for (auto it = split_selection.begin(); it != split_selection.end();) {
+        auto found = std::find_if(available_renders.begin(), available_renders.end(), [&] (const auto &view) {
+            return view.name == *it;
+        });
+        it = found == available_renders.end() ? split_selection.erase(it) : std::next(it);
+    }
+    ImGui::SetNextWindowPos({ 50, 50 }, ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize({ 300, 200 }, ImGuiCond_FirstUseEver);
+    ImGui::Begin("选择输出 ");
+    if (ImGui::Checkbox("分屏对比", &split_view) && split_view) {
+        split_selection.insert(available_renders[currently_selected_render].name);
+        shared_camera = *modules[available_renders[currently_selected_render].module]->camera;
+    }
+    if (split_view) {
+        ImGui::SameLine();
+        ImGui::Checkbox("同步相机", &sync_camera);
+        ImGui::TextWrapped("选择最多 %d 个想要并排比较的输出：", ENGINE_MAX_SPLIT);
+    } else {
+        ImGui::TextWrapped("大于一个模块尝试渲染内容到主界面。选择一个你想要查看的模块：");
+    }
+    if (ImGui::BeginListBox("", ImVec2 { -FLT_MIN, 5 * ImGui::GetTextLineHeightWithSpacing() })) {
+        for (auto i = 0; i < available_renders.size(); i++) {
+            const auto &name = available_renders[i].name;
+            auto selected = split_view ? split_selection.count(name) > 0 : currently_selected_render == i;
+            if (ImGui::Selectable(name.c_str(), selected)) {
+                if (!split_view) {
+                    currently_selected_render = i;
+                } else if (selected) {
+                    split_selection.erase(name);
+                } else if (split_selection.size() < ENGINE_MAX_SPLIT) {
+                    split_selection.insert(name);
+                }
+            }
+            if (selected) {
+                ImGui::SetItemDefaultFocus();
+            }
+        }
+        ImGui::EndListBox();
+    }
+    ImGui::End();
+}
@@ -13,9 +13,19 @@
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <memory>
+#include <set>
 #include "Module.hpp"
+#include "Viewport.hpp"
 
 #define ENGINE "引擎"
+#define ENGINE_MAX_SPLIT 4
+
+/// Something that can be drawn into a viewport: a module's live output or one of its snapshots.
+struct RenderView {
+    int module;
+    int snapshot; // -1 for the live output
+    std::string name;
+};
 
 /// Engine is the class which drives this thing.
 class Engine {
@@ -32,12 +42,23 @@ private:
     GLFWwindow *window;
     glm::ivec2 window_size;
     bool log_autoscroll;
+    bool show_profiler;
     std::vector<Module *> modules;
     float last_instant;
     
     // R E N D E R S ///////////////////////////////
-    std::vector<int> available_renders;
+    auto render_views() -> void;
+    
+    auto update_render_ui() -> void;
+
+    std::vector<RenderView> available_renders;
+    std::vector<RenderView> rendered_views;
     int currently_selected_render;
+    bool split_view;
+    bool sync_camera;
+    std::set<std::string> split_selection;
+    std::vector<Viewport> viewports;
+    Camera shared_camera;
 };
 
 #endif /* Engine_hpp */
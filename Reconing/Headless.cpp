@@ -0,0 +1,295 @@
+//
+//  Headless.cpp
+//  Reconing
+//
+//  Created by apple on 21/04/2021.
+//
+
+#include "Headless.hpp"
+#include <future>
+#include <cstring>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+
+auto HeadlessRenderer::parse_options(int argc, const char *argv[], HeadlessOptions &options) -> bool {
+    for (auto i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        auto has_value = i + 1 < argc;
+        if (arg == "--size" && has_value) {
+            options.width = options.height = std::atoi(argv[++i]);
+        } else if (arg == "--width" && has_value) {
+            options.width = std::atoi(argv[++i]);
+        } else if (arg == "--height" && has_value) {
+            options.height = std::atoi(argv[++i]);
+        } else if (arg == "--frames" && has_value) {
+            options.turntable_frames = std::atoi(argv[++i]);
+        } else if (arg == "--records" && has_value) {
+            options.records_path = argv[++i];
+        } else if (arg == "--out" && has_value) {
+            options.output_path = argv[++i];
+        } else if (arg == "--force") {
+            options.skip_existing = false;
+        } else {
+            std::cerr << "未知参数：" << arg << std::endl;
+            std::cerr << "用法：Reconing --headless [--size N | --width W --height H] [--frames N] "
+                "[--records recons/records.bin] [--out thumbnails] [--force]" << std::endl;
+            return false;
+        }
+    }
+    return options.width > 0 && options.height > 0 && options.turntable_frames >= 0;
+}
+
+auto HeadlessRenderer::create_context() -> bool {
+#ifdef RECON_HEADLESS_EGL
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        RECON_LOG(HEADLESS) << "EGL 初始化失败。没有显示服务器时可尝试 EGL_PLATFORM=surfaceless。";
+        return false;
+    }
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+        RECON_LOG(HEADLESS) << "找不到可用的 EGL 配置。";
+        return false;
+    }
+    // We render into our own framebuffer; the pbuffer only exists to make the context current
+    const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+    eglBindAPI(EGL_OPENGL_API);
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) {
+        RECON_LOG(HEADLESS) << "无法创建 OpenGL 3.3 核心上下文。";
+        return false;
+    }
+    if (!gladLoadGLLoader((GLADloadproc) eglGetProcAddress)) {
+        RECON_LOG(HEADLESS) << "OpenGL 函数加载失败。";
+        destroy_context();
+        return false;
+    }
+    has_context = true;
+    RECON_LOG(HEADLESS) << "EGL " << major << "." << minor << " 上下文已建立：" << glGetString(GL_RENDERER);
+#else
+    if (!glfwInit()) {
+        return false;
+    }
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    window = glfwCreateWindow(1, 1, "RECONING", nullptr, nullptr);
+    if (window == nullptr) {
+        RECON_LOG(HEADLESS) << "无法创建隐藏窗口。";
+        return false;
+    }
+    glfwMakeContextCurrent(window);
+    gladLoadGL();
+    has_context = true;
+    RECON_LOG(HEADLESS) << "隐藏窗口上下文已建立：" << glGetString(GL_RENDERER);
+#endif
+    return true;
+}
+
+auto HeadlessRenderer::destroy_context() -> void {
+#ifdef RECON_HEADLESS_EGL
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglDestroySurface(display, surface);
+    eglTerminate(display);
+#else
+    glfwDestroyWindow(window);
+    glfwTerminate();
+#endif
+}
+
+auto HeadlessRenderer::init() -> bool {
+    if (!create_context()) {
+        return false;
+    }
+    program = link(compile(GL_VERTEX_SHADER, "shaders/vertex.glsl"),
+                   compile(GL_FRAGMENT_SHADER, "shaders/fragment.glsl"));
+
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(1, &color_rbo);
+    glGenRenderbuffers(1, &depth_rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, color_rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, options.width, options.height);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, options.width, options.height);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rbo);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        RECON_LOG(HEADLESS) << "离屏帧缓冲不完整。";
+        return false;
+    }
+    glViewport(0, 0, options.width, options.height);
+    glEnable(GL_DEPTH_TEST);
+    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+
+    pixels.resize(options.width * options.height * 4);
+    flipped.resize(options.width * options.height * 4);
+    ready = true;
+    return true;
+}
+
+auto HeadlessRenderer::run() -> int {
+    if (!ready) {
+        return 1;
+    }
+    auto records = read_recon_records(options.records_path);
+    auto records_dir = std::filesystem::path(options.records_path).parent_path();
+
+    // Figure out what is actually stale first, so the loader below never wastes time
+    std::vector<ReconRecord> work;
+    for (const auto &record : records) {
+        auto obj_path = records_dir / record.obj_file;
+        auto thumbnail = std::filesystem::path(options.output_path) /
+            std::filesystem::path(record.obj_file).replace_extension(".png");
+        std::error_code ec;
+        if (options.skip_existing && std::filesystem::exists(thumbnail) && std::filesystem::exists(obj_path) &&
+            std::filesystem::last_write_time(thumbnail, ec) >= std::filesystem::last_write_time(obj_path, ec)) {
+            continue;
+        }
+        work.push_back(record);
+    }
+    std::cout << "共 " << records.size() << " 条记录，需要渲染 " << work.size() << " 条。" << std::endl;
+
+    auto load = [records_dir] (ReconRecord record) -> Mesh {
+        Mesh mesh;
+        mesh.ok = load_obj(records_dir / record.obj_file, mesh.vertices, mesh.texture_path);
+        if (mesh.ok) {
+            mesh.radius = std::max(center_vertices(mesh.vertices), 0.001f);
+        }
+        return mesh;
+    };
+
+    // Parse the next OBJ on a worker thread while the GPU renders the current one
+    auto failed = 0;
+    std::future<Mesh> next;
+    if (work.size() > 0) {
+        next = std::async(std::launch::async, load, work[0]);
+    }
+    for (size_t i = 0; i < work.size(); i++) {
+        auto mesh = next.get();
+        if (i + 1 < work.size()) {
+            next = std::async(std::launch::async, load, work[i + 1]);
+        }
+        if (!mesh.ok || !render_record(work[i], mesh)) {
+            failed++;
+            std::cerr << "渲染失败：" << work[i].name << std::endl;
+            continue;
+        }
+        std::cout << "[" << (i + 1) << "/" << work.size() << "] " << work[i].name << std::endl;
+    }
+    std::cout << "离屏渲染结束。失败：" << failed << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+auto HeadlessRenderer::render_record(const ReconRecord &record, Mesh &mesh) -> bool {
+    auto base = std::filesystem::path(options.output_path) / std::filesystem::path(record.obj_file).replace_extension("");
+    std::filesystem::create_directories(base.parent_path());
+
+    GLuint VAO, VBO;
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * mesh.vertices.size(), mesh.vertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), nullptr);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void *) (sizeof(float) * 3));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void *) (sizeof(float) * 6));
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void *) (sizeof(float) * 8));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+    auto num_vertices = (int) mesh.vertices.size();
+    // The CPU copy isn't needed anymore; free it before the next mesh arrives
+    std::vector<Vertex>().swap(mesh.vertices);
+
+    auto texture = load_texture(mesh.texture_path);
+    auto ok = true;
+
+    draw_frame(VAO, num_vertices, texture, mesh.radius, 0.0f);
+    ok &= save_frame(base.string() + ".png");
+    if (options.turntable_frames > 0) {
+        std::filesystem::create_directories(base);
+        for (auto f = 0; f < options.turntable_frames && ok; f++) {
+            char name[64] = { 0 };
+            snprintf(name, sizeof(name), "turntable_%03d.png", f);
+            draw_frame(VAO, num_vertices, texture, mesh.radius, 360.0f * f / options.turntable_frames);
+            ok &= save_frame((base / name).string());
+        }
+    }
+
+    glBindVertexArray(GL_NONE);
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+    if (texture != GL_NONE) {
+        glDeleteTextures(1, &texture);
+    }
+    return ok;
+}
+
+auto HeadlessRenderer::draw_frame(GLuint VAO, int num_vertices, GLuint texture, float radius, float angle) -> void {
+    // Frame the whole bounding sphere with the viewer's 45 degree FOV
+    auto distance = radius / std::sin(glm::radians(22.5f));
+    auto model_mat = glm::mat4(1.0f);
+    model_mat = glm::rotate(model_mat, glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    model_mat = glm::rotate(model_mat, glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
+    auto view_mat = glm::lookAt(glm::vec3(0.0f, 0.0f, distance), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    auto perspective_mat = glm::perspective(glm::radians(45.0f), (float) options.width / options.height,
+                                            distance * 0.01f, distance + radius * 2.0f);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glUseProgram(program);
+    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(model_mat));
+    glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(view_mat));
+    glUniformMatrix4fv(glGetUniformLocation(program, "perspective"), 1, GL_FALSE, glm::value_ptr(perspective_mat));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1i(glGetUniformLocation(program, "use_texture"), texture != GL_NONE);
+    glBindVertexArray(VAO);
+    glDrawArrays(GL_TRIANGLES, 0, num_vertices);
+}
+
+auto HeadlessRenderer::save_frame(std::string path) -> bool {
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, options.width, options.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    // GL's origin is bottom left, PNG's is top left
+    auto stride = options.width * 4;
+    for (auto y = 0; y < options.height; y++) {
+        std::memcpy(&flipped[y * stride], &pixels[(options.height - 1 - y) * stride], stride);
+    }
+    return write_png(path, options.width, options.height, flipped.data());
+}
+
+HeadlessRenderer::~HeadlessRenderer() {
+    if (!has_context) {
+        return;
+    }
+    // Names never generated are 0, which GL ignores
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &color_rbo);
+    glDeleteRenderbuffers(1, &depth_rbo);
+    glDeleteProgram(program);
+    destroy_context();
+}
@@ -0,0 +1,87 @@
+//
+//  Headless.hpp
+//  Reconing
+//
+//  Created by apple on 21/04/2021.
+//
+
+#ifndef Headless_hpp
+#define Headless_hpp
+
+#include "common.hpp"
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#define HEADLESS "离屏渲染"
+
+// EGL lets us get a GL context without any display server (Mesa's llvmpipe works fine
+// on GPU-less machines). Everywhere else we fall back to an invisible GLFW window.
+#if defined(__linux__) && !defined(RECON_HEADLESS_GLFW)
+#define RECON_HEADLESS_EGL
+#endif
+
+#ifdef RECON_HEADLESS_EGL
+#include <EGL/egl.h>
+#else
+#include <GLFW/glfw3.h>
+#endif
+
+struct HeadlessOptions {
+    int width = 256;
+    int height = 256;
+    int turntable_frames = 36;
+    bool skip_existing = true;
+    std::string records_path = "recons/records.bin";
+    std::string output_path = "thumbnails";
+};
+
+/// Renders thumbnails and turntable frames for every reconstruction record
+/// into an offscreen framebuffer, using the same shaders as the interactive viewer.
+class HeadlessRenderer {
+public:
+    HeadlessRenderer(HeadlessOptions options) : options(options), ready(false), has_context(false),
+        fbo(GL_NONE), color_rbo(GL_NONE), depth_rbo(GL_NONE), program(GL_NONE) {}
+
+    ~HeadlessRenderer();
+
+    auto init() -> bool;
+
+    auto run() -> int;
+
+    static auto parse_options(int argc, const char *argv[], HeadlessOptions &options) -> bool;
+
+private:
+    struct Mesh {
+        bool ok = false;
+        std::vector<Vertex> vertices;
+        std::string texture_path;
+        float radius = 1.0f;
+    };
+
+    auto create_context() -> bool;
+
+    auto destroy_context() -> void;
+
+    auto render_record(const ReconRecord &record, Mesh &mesh) -> bool;
+
+    auto draw_frame(GLuint VAO, int num_vertices, GLuint texture, float radius, float angle) -> void;
+
+    auto save_frame(std::string path) -> bool;
+
+    HeadlessOptions options;
+    bool ready;
+    bool has_context; // Made, even if init() failed after it; the destructor tears it down
+    GLuint fbo, color_rbo, depth_rbo, program;
+    std::vector<unsigned char> pixels, flipped;
+
+#ifdef RECON_HEADLESS_EGL
+    EGLDisplay display;
+    EGLSurface surface;
+    EGLContext context;
+#else
+    GLFWwindow *window;
+#endif
+};
+
+#endif /* Headless_hpp */
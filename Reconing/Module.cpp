@@ -6,6 +6,7 @@
 //
 
 #include "Module.hpp"
+#include <glm/gtc/matrix_transform.hpp>
 
 
 auto Module::destroy() -> bool { 
@@ -24,4 +25,60 @@ auto Module::render() -> void {
 
 }
 
+auto Module::snapshots() -> std::vector<std::string> {
+    return {};
+}
+
+auto Module::render_snapshot(int) -> void {
+    render();
+}
+
+// C A M E R A ////////////////////////////////
+auto Camera::update(GLFWwindow *window, float delta_time) -> void {
+    float horizontal_rotation_delta = horizontal_rotation_target - horizontal_rotation;
+    horizontal_rotation += (horizontal_rotation_delta * delta_time) * 10.0f;
+
+    if (glfwGetKey(window, GLFW_KEY_A)) {
+        horizontal_rotation_target -= glm::radians(delta_time * 180.0f);
+    }
+    if (glfwGetKey(window, GLFW_KEY_D)) {
+        horizontal_rotation_target += glm::radians(delta_time * 180.0f);
+    }
+    if (glfwGetKey(window, GLFW_KEY_S)) {
+        radius += delta_time * 5.0f;
+    }
+    if (glfwGetKey(window, GLFW_KEY_W)) {
+        radius -= delta_time * 5.0f;
+    }
+    
+    const auto front = glm::normalize(center - eye);
+    const auto right = glm::cross(front, glm::vec3(0.0f, 1.0f, 0.0f));
+    if (glfwGetKey(window, GLFW_KEY_LEFT)) {
+        center -= right * delta_time;
+    }
+    if (glfwGetKey(window, GLFW_KEY_RIGHT)) {
+        center += right * delta_time;
+    }
+    if (glfwGetKey(window, GLFW_KEY_UP)) {
+        center += glm::vec3(0.0f, 1.0f, 0.0f) * delta_time;
+    }
+    if (glfwGetKey(window, GLFW_KEY_DOWN)) {
+        center -= glm::vec3(0.0f, 1.0f, 0.0f) * delta_time;
+    }
+}
 
+auto Camera::model() const -> glm::mat4 {
+    auto model_mat = glm::mat4(1.0f);
+    model_mat = glm::rotate(model_mat, glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    model_mat = glm::rotate(model_mat, glm::radians(horizontal_rotation * 180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    return model_mat;
+}
+
+auto Camera::view() const -> glm::mat4 {
+    return glm::lookAt(glm::vec3(0.0f, 0.0f, radius), center, glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+auto Camera::perspective(glm::ivec2 viewport_size) const -> glm::mat4 {
+    auto aspect = viewport_size.y > 0 ? (float) viewport_size.x / viewport_size.y : 1.0f;
+    return glm::perspective(glm::radians(45.0f), aspect, near_plane, far_plane);
+}
@@ -9,15 +9,36 @@
 #define Module_hpp
 
 #include <iostream>
+#include <vector>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 
 
+/// Orbit camera driven by WASD / arrow keys. Engine owns the input handling so that
+/// several modules can share a single camera when they are shown side by side.
+struct Camera {
+    auto update(GLFWwindow *window, float delta_time) -> void;
+    
+    auto model() const -> glm::mat4;
+    
+    auto view() const -> glm::mat4;
+    
+    auto perspective(glm::ivec2 viewport_size) const -> glm::mat4;
+
+    glm::vec3 eye = glm::vec3(0.0f, 0.0f, 5.0f);
+    glm::vec3 center = glm::vec3(0.0f);
+    float radius = 5.0f;
+    float horizontal_rotation = 0.0f;
+    float horizontal_rotation_target = 0.0f;
+    float near_plane = 0.01f;
+    float far_plane = 200.0f;
+};
+
 class Module {
 public:
-    Module(std::string name) : name(name) {}
+    Module(std::string name) : name(name), camera(&own_camera) {}
     
-    Module() : name("未知") {}
+    Module() : name("未知"), camera(&own_camera) {}
     
     virtual auto update(float delta_time) -> bool;
     
@@ -27,9 +48,19 @@ public:
     
     virtual auto render() -> void;
     
+    /// Extra things this module can draw besides its live output, e.g. earlier pipeline stages
+    /// which are still resident on the GPU.
+    virtual auto snapshots() -> std::vector<std::string>;
+    
+    virtual auto render_snapshot(int index) -> void;
+    
     glm::ivec2 window_size;
+    glm::ivec2 viewport_size;
     std::string name;
     GLFWwindow *window;
+
+    Camera own_camera;
+    Camera *camera;
 };
 
 #endif /* Module_hpp */
@@ -0,0 +1,405 @@
+//
+//  Channel.cpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Channel.hpp"
+#include <vector>
+#include <cstring>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// E X C H A N G E ////////////////////////////////////////////
+
+Exchange::~Exchange() {
+    size_t unread = 0;
+    for (const auto &payload : arrived) {
+        unread += payload.size();
+    }
+    channel.consumed(generation, unread);
+    channel.forget(id);
+}
+
+auto Exchange::send_bytes(const char *data, int size) -> bool {
+    return channel.write(*this, data, size);
+}
+
+auto Exchange::reply() -> std::future<std::optional<std::string>> {
+    std::promise<std::optional<std::string>> promise;
+    auto future = promise.get_future();
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!arrived.empty()) {
+        auto payload = std::move(arrived.front());
+        arrived.pop_front();
+        lock.unlock();
+        channel.consumed(generation, payload.size());
+        promise.set_value(std::move(payload));
+    } else if (failed) {
+        lock.unlock();
+        promise.set_value(std::nullopt);
+    } else {
+        waiting.push_back(std::move(promise));
+    }
+    return future;
+}
+
+auto Exchange::receive_bytes(std::string &payload) -> bool {
+    auto reply_opt = reply().get();
+    if (!reply_opt.has_value()) {
+        return false;
+    }
+    payload = std::move(*reply_opt);
+    return true;
+}
+
+auto Exchange::codec() const -> Codec {
+    return channel.codec;
+}
+
+auto Exchange::deliver(std::string payload) -> bool {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (waiting.empty()) {
+        arrived.push_back(std::move(payload));
+        return true;
+    }
+    auto promise = std::move(waiting.front());
+    waiting.pop_front();
+    lock.unlock();
+    promise.set_value(std::move(payload));
+    return false;
+}
+
+auto Exchange::fail() -> void {
+    std::deque<std::promise<std::optional<std::string>>> waiters;
+    mutex.lock();
+    failed = true;
+    waiters.swap(waiting);
+    mutex.unlock();
+    for (auto &promise : waiters) {
+        promise.set_value(std::nullopt);
+    }
+}
+
+// C H A N N E L //////////////////////////////////////////////
+
+static auto write_all(int sock, const char *data, size_t size) -> bool {
+    while (size > 0) {
+        auto sent = ::send(sock, data, size, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static auto read_all(int sock, char *data, size_t size) -> bool {
+    while (size > 0) {
+        auto received = recv(sock, data, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+Channel::~Channel() {
+    close();
+}
+
+auto Channel::open(const std::string &host, int port) -> bool {
+    std::lock_guard<std::mutex> lifecycle(opening);
+    stop();
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin;
+    std::memset(&sin, 0, sizeof(sin));
+    inet_pton(AF_INET, host.c_str(), &sin.sin_addr.s_addr);
+    sin.sin_port = htons(port);
+    sin.sin_family = AF_INET;
+    int pipe_fds[2];
+    if (sock == -1 || ::connect(sock, (sockaddr *) &sin, sizeof(sin)) == -1 || !greet() || pipe(pipe_fds) == -1) {
+        if (sock != -1) {
+            ::close(sock);
+        }
+        sock = -1;
+        return false;
+    }
+    // Only the I/O thread touches the socket from here on, writing whatever has queued up at once
+    int no_delay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    fcntl(pipe_fds[0], F_SETFL, fcntl(pipe_fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(pipe_fds[1], F_SETFL, fcntl(pipe_fds[1], F_GETFL) | O_NONBLOCK);
+    mutex.lock();
+    wake_pipe[0] = pipe_fds[0];
+    wake_pipe[1] = pipe_fds[1];
+    generation++;
+    out.clear();
+    out_offset = 0;
+    buffered = 0;
+    running = true;
+    mutex.unlock();
+    thread = std::thread([this] () {
+        run();
+    });
+    return true;
+}
+
+auto Channel::close() -> void {
+    std::lock_guard<std::mutex> lifecycle(opening);
+    stop();
+}
+
+auto Channel::stop() -> void {
+    running = false;
+    wake();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (sock != -1) {
+        ::close(sock);
+        sock = -1;
+    }
+    mutex.lock();
+    for (auto &fd : wake_pipe) {
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    generation++;
+    mutex.unlock();
+    fail_all();
+}
+
+auto Channel::connected() const -> bool {
+    return running;
+}
+
+auto Channel::greet() -> bool {
+    codec = Codec::NONE;
+    tagged = false;
+    online::Request hello = make_request("hello", "server", codec_name(Codec::LZ4), TRANSFER_TAGS);
+    std::string payload;
+    hello.SerializeToString(&payload);
+    int size = (int) payload.size();
+    if (!write_all(sock, (const char *) &size, sizeof(size)) || !write_all(sock, payload.data(), payload.size()) ||
+        !read_all(sock, (char *) &size, sizeof(size)) || size < 0) {
+        return false;
+    }
+    payload.resize(size);
+    online::Request response;
+    if (!read_all(sock, &payload[0], size) || !response.ParseFromString(payload) ||
+        response.arg_size() < 1 || response.arg(0) != "hello") {
+        return false;
+    }
+    // An older server answers a bare hello: plain checked chunks, untagged frames
+    for (auto i = 1; i < response.arg_size(); i++) {
+        if (response.arg(i) == TRANSFER_TAGS) {
+            tagged = true;
+        } else if (codec == Codec::NONE) {
+            codec = parse_codec(response.arg(i));
+        }
+    }
+    return true;
+}
+
+auto Channel::request() -> std::shared_ptr<Exchange> {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!tagged) {
+        // Replies can't say whose they are, so they all go to the one exchange there is
+        room.wait(lock, [this] () { return exchanges.empty() || !running; });
+    }
+    auto id = next_id++;
+    auto exchange = std::make_shared<Exchange>(*this, id, generation);
+    if (running) {
+        exchanges[id] = exchange;
+    } else {
+        exchange->failed = true;
+    }
+    return exchange;
+}
+
+auto Channel::write(const Exchange &exchange, const char *data, int size) -> bool {
+    std::unique_lock<std::mutex> lock(mutex);
+    room.wait(lock, [&] () {
+        return out.size() - out_offset < CHANNEL_WINDOW || !running || exchange.generation != generation;
+    });
+    if (!running || exchange.generation != generation) {
+        return false;
+    }
+    int length = size + (tagged ? TRANSFER_TAG : 0);
+    out.append((const char *) &length, sizeof(length));
+    if (tagged) {
+        out.append((const char *) &exchange.id, TRANSFER_TAG);
+    }
+    out.append(data, size);
+    lock.unlock();
+    wake();
+    return true;
+}
+
+auto Channel::consumed(uint64_t of, size_t size) -> void {
+    if (size == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (of != generation) {
+        return;
+    }
+    auto was_full = buffered >= CHANNEL_WINDOW;
+    buffered -= (int64_t) size;
+    auto has_room = buffered < CHANNEL_WINDOW;
+    lock.unlock();
+    if (was_full && has_room) {
+        wake();
+    }
+}
+
+auto Channel::forget(uint32_t id) -> void {
+    mutex.lock();
+    exchanges.erase(id);
+    mutex.unlock();
+    room.notify_all();
+}
+
+auto Channel::route(uint32_t id, std::string payload) -> void {
+    std::shared_ptr<Exchange> exchange;
+    uint64_t of;
+    mutex.lock();
+    // Untagged, the oldest exchange is the only one
+    auto it = tagged ? exchanges.find(id) : exchanges.begin();
+    if (it != exchanges.end()) {
+        exchange = it->second.lock();
+    }
+    of = generation;
+    mutex.unlock();
+    if (!exchange) {
+        // Whoever asked has stopped listening
+        return;
+    }
+    // Outside the lock: the caller it wakes may let go of the exchange, which then forgets itself
+    auto size = (int64_t) payload.size();
+    if (exchange->deliver(std::move(payload))) {
+        mutex.lock();
+        if (of == generation) {
+            buffered += size;
+        }
+        mutex.unlock();
+    }
+}
+
+auto Channel::fail_all() -> void {
+    std::vector<std::shared_ptr<Exchange>> open;
+    mutex.lock();
+    for (auto &[id, weak] : exchanges) {
+        if (auto exchange = weak.lock()) {
+            open.push_back(exchange);
+        }
+    }
+    exchanges.clear();
+    mutex.unlock();
+    room.notify_all();
+    for (auto &exchange : open) {
+        exchange->fail();
+    }
+}
+
+auto Channel::wake() -> void {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (wake_pipe[1] != -1) {
+        char byte = 0;
+        (void) !::write(wake_pipe[1], &byte, 1);
+    }
+}
+
+auto Channel::run() -> void {
+    std::string in;
+    std::vector<char> buffer(1 << 18);
+    auto healthy = true;
+    while (running && healthy) {
+        pollfd fds[2];
+        mutex.lock();
+        fds[0].fd = sock;
+        fds[0].events = (buffered < CHANNEL_WINDOW ? POLLIN : 0) | (out_offset < out.size() ? POLLOUT : 0);
+        mutex.unlock();
+        fds[1].fd = wake_pipe[0];
+        fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) == -1) {
+            healthy = errno == EINTR;
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (::read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            auto received = recv(sock, buffer.data(), buffer.size(), 0);
+            if (received > 0) {
+                in.append(buffer.data(), received);
+            } else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                healthy = false;
+            }
+        }
+        // Hand out every complete frame, even when the connection just broke behind them
+        size_t parsed = 0;
+        auto header = sizeof(int) + (tagged ? TRANSFER_TAG : 0);
+        while (in.size() - parsed >= sizeof(int)) {
+            int size = 0;
+            std::memcpy(&size, in.data() + parsed, sizeof(size));
+            if (size < 0 || (tagged && size < TRANSFER_TAG)) {
+                healthy = false;
+                break;
+            }
+            if (in.size() - parsed < sizeof(size) + size) {
+                break;
+            }
+            uint32_t id = 0;
+            if (tagged) {
+                std::memcpy(&id, in.data() + parsed + sizeof(size), TRANSFER_TAG);
+            }
+            route(id, in.substr(parsed + header, sizeof(size) + size - header));
+            parsed += sizeof(size) + size;
+        }
+        in.erase(0, parsed);
+
+        mutex.lock();
+        while (healthy && out_offset < out.size()) {
+            auto sent = ::send(sock, out.data() + out_offset, out.size() - out_offset, 0);
+            if (sent > 0) {
+                out_offset += sent;
+            } else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (sent == -1 && errno == EINTR) {
+                continue;
+            } else {
+                healthy = false;
+            }
+        }
+        if (out_offset == out.size()) {
+            out.clear();
+            out_offset = 0;
+        } else if (out_offset >= CHANNEL_WINDOW) {
+            out.erase(0, out_offset);
+            out_offset = 0;
+        }
+        mutex.unlock();
+        room.notify_all();
+    }
+    if (!healthy) {
+        // Nobody is going to answer; let every waiting caller know now
+        running = false;
+        fail_all();
+    }
+}
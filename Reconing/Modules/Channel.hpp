@@ -0,0 +1,161 @@
+//
+//  Channel.hpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Channel_hpp
+#define Channel_hpp
+
+#include <string>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <optional>
+#include <condition_variable>
+#include <cstdint>
+#include "Protocol.hpp"
+#include "Compress.hpp"
+
+#define CHANNEL_WINDOW (4 << 20) // Bytes queued either way before the other side has to wait
+
+class Channel;
+
+/// One request on a Channel and the frames answering it. Whatever thread holds it sends its
+/// frames and waits for its replies; the channel's I/O thread does the socket work for all of
+/// them. Frames sent by one exchange go out in order, and so do its replies.
+class Exchange {
+public:
+    Exchange(Channel &channel, uint32_t id, uint64_t generation) : id(id), channel(channel), generation(generation) {}
+
+    Exchange(const Exchange &) = delete;
+
+    ~Exchange();
+
+    template<typename T>
+    auto send(const T &what) -> bool;
+
+    /// A raw frame, for chunked transfers.
+    auto send_bytes(const char *data, int size) -> bool;
+
+    /// The next frame for this exchange; empty if the connection went away first.
+    auto reply() -> std::future<std::optional<std::string>>;
+
+    template<typename T>
+    auto receive() -> std::optional<T>;
+
+    auto receive_bytes(std::string &payload) -> bool;
+
+    /// Of checked chunks on this exchange's connection.
+    auto codec() const -> Codec;
+
+    const uint32_t id; // The request tag on the wire
+
+private:
+    friend class Channel;
+
+    /// False if a waiting caller took it straight away.
+    auto deliver(std::string payload) -> bool;
+
+    auto fail() -> void;
+
+    Channel &channel;
+    uint64_t generation; // Of the connection this exchange was opened on
+    std::mutex mutex;
+    std::deque<std::string> arrived; // Nobody asked for them yet
+    std::deque<std::promise<std::optional<std::string>>> waiting;
+    bool failed = false;
+};
+
+/// The client's connection to the server, owned by a single I/O thread. When the server takes
+/// request tags, any number of exchanges can be in flight and replies find theirs by tag; an
+/// older server gets one exchange at a time, as it expects.
+class Channel {
+public:
+    Channel() : codec(Codec::NONE), tagged(false), sock(-1), generation(0), next_id(1), out_offset(0),
+        buffered(0), running(false) {}
+
+    Channel(const Channel &) = delete;
+
+    ~Channel();
+
+    /// Connects and says hello; the codec and tags are settled before it returns.
+    auto open(const std::string &host, int port) -> bool;
+
+    /// Fails every open exchange and joins the I/O thread.
+    auto close() -> void;
+
+    auto connected() const -> bool;
+
+    /// A new exchange. Without tags, waits until the previous one is done with.
+    auto request() -> std::shared_ptr<Exchange>;
+
+    Codec codec; // Of checked chunks
+    bool tagged;
+
+private:
+    friend class Exchange;
+
+    auto greet() -> bool;
+
+    auto stop() -> void;
+
+    auto run() -> void;
+
+    /// Queues a frame for the I/O thread, waiting while CHANNEL_WINDOW bytes are already queued.
+    auto write(const Exchange &exchange, const char *data, int size) -> bool;
+
+    /// A delivered frame was taken by its exchange, making room for more.
+    auto consumed(uint64_t of, size_t size) -> void;
+
+    auto forget(uint32_t id) -> void;
+
+    auto route(uint32_t id, std::string payload) -> void;
+
+    auto fail_all() -> void;
+
+    auto wake() -> void;
+
+    int sock;
+    int wake_pipe[2] = { -1, -1 };
+    std::thread thread;
+    std::mutex opening; // Serializes open and close
+    std::mutex mutex;
+    std::condition_variable room; // In `out`, or for the next untagged exchange
+    uint64_t generation; // Counts connections, so exchanges of an old one can't write to a new one
+    uint32_t next_id;
+    std::map<uint32_t, std::weak_ptr<Exchange>> exchanges;
+    std::string out; // Framed, waiting for the socket
+    size_t out_offset;
+    int64_t buffered; // Delivered but not yet taken; reading stops above CHANNEL_WINDOW
+    std::atomic<bool> running;
+};
+
+template<typename T>
+auto Exchange::send(const T &what) -> bool {
+    std::string payload;
+    if (!what.SerializeToString(&payload)) {
+        return false;
+    }
+    return send_bytes(payload.data(), (int) payload.size());
+}
+
+template<typename T>
+auto Exchange::receive() -> std::optional<T> {
+    std::string payload;
+    if (!receive_bytes(payload)) {
+        return {};
+    }
+    T t;
+    if (!t.ParseFromString(payload)) {
+        return {};
+    }
+    return t;
+}
+
+#endif /* Channel_hpp */
@@ -8,35 +8,20 @@
 #include "Online.hpp"
 #include <imgui.h>
 #include <thread>
+#include <chrono>
+#include <set>
 #include <fstream>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <unistd.h>
+#include <stb_image.h>
 
 using namespace OnlineNS;
 
 
-template<typename T>
-auto request_append(online::Request &request, T last) -> void {
-    request.add_arg(std::string(last));
-}
-
-template<typename T, typename ...Ar>
-auto request_append(online::Request &request, T first, Ar... args) -> void {
-    request.add_arg(std::string(first));
-    request_append(request, args...);
-}
-
-template<typename ...Ar>
-auto make_request(Ar... args) -> online::Request {
-    online::Request request;
-    request_append(request, args...);
-    return request;
+auto OnlineModule::update(float delta_time) -> bool {
+    return preview.update(*camera);
 }
 
-auto OnlineModule::update(float delta_time) -> bool {
-    return false;
+auto OnlineModule::render() -> void {
+    preview.render(*camera, viewport_size);
 }
 
 auto OnlineModule::update_ui() -> void {
@@ -54,6 +39,9 @@ auto OnlineModule::update_ui() -> void {
             
         case State::CONNECTING:
             ImGui::TextWrapped("稍等...");
+            if (transfer_progress >= 0.0f) {
+                ImGui::ProgressBar(transfer_progress);
+            }
             break;
 
         case State::LOGIN:
@@ -91,7 +79,11 @@ auto OnlineModule::update_ui() -> void {
                 state = State::UPLOAD;
                 mkdir_if_not_exists("recons");
                 records = read_recon_records("recons/records.bin");
-                upload_index = 0;
+                upload_selection.clear();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("远程重建")) {
+                state = State::REMOTE_RECON;
             }
             if (online_records.records_size() > 0) {
                 ImGui::TextWrapped("服务端内容");
@@ -99,27 +91,66 @@ auto OnlineModule::update_ui() -> void {
             if (online_records.records_size() > 0 &&
                 ImGui::BeginListBox("", ImVec2 { -FLT_MIN, 5 * ImGui::GetTextLineHeightWithSpacing() })) {
                 for (auto i = 0; i < online_records.records_size() ; i++) {
-                    const auto is_selected = online_index == i;
+                    const auto is_selected = online_selection.count(i) > 0;
                     const auto rec = online_records.records(i);
                     if (ImGui::Selectable((rec.name() + " 由 " + rec.owner() + " 创作").c_str(), is_selected)) {
-                        online_index = i;
+                        select(online_selection, i);
+                        for (auto index : online_selection) {
+                            prefetcher.hint(online_records.records(index), PrefetchNS::Hint::SELECTED);
+                        }
+                    }
+                    if (ImGui::IsItemHovered()) {
+                        // Whatever the pointer rests on is the likeliest download
+                        prefetcher.hint(rec, PrefetchNS::Hint::HOVERED);
+                        record_tooltip(rec);
                     }
                     if (is_selected) {
                         ImGui::SetItemDefaultFocus();
                     }
                 }
                 ImGui::EndListBox();
-                if (ImGui::Button("下载")) {
-                    download();
+                if (ImGui::Button("全选")) {
+                    for (auto i = 0; i < online_records.records_size(); i++) {
+                        online_selection.insert(i);
+                    }
+                }
+                if (!online_selection.empty()) {
+                    ImGui::SameLine();
+                    if (ImGui::Button(("下载 " + std::to_string(online_selection.size()) + " 项").c_str())) {
+                        download();
+                    }
+                }
+                if (online_selection.size() == 1 && *online_selection.begin() < online_records.records_size()) {
+                    ImGui::SameLine();
+                    if (ImGui::Button("预览")) {
+                        preview.start(channel, online_records.records(*online_selection.begin()));
+                    }
+                }
+            }
+            if (!preview.name.empty()) {
+                ImGui::Text("预览：%s（%s）", preview.name.c_str(), preview.status().c_str());
+                ImGui::SameLine();
+                if (ImGui::Button("关闭预览")) {
+                    preview.stop();
                 }
             }
+            transfers_ui();
+            sync_ui();
             break;
             
         case State::UPLOAD:
             ImGui::TextWrapped("选择想上传的记录。");
             if (records.size() > 0) {
                 ImGui::SameLine();
-                if (ImGui::Button("上传")) {
+                if (ImGui::Button("全选")) {
+                    for (auto i = 0; i < records.size(); i++) {
+                        upload_selection.insert(i);
+                    }
+                }
+            }
+            if (!upload_selection.empty()) {
+                ImGui::SameLine();
+                if (ImGui::Button(("上传 " + std::to_string(upload_selection.size()) + " 项").c_str())) {
                     upload();
                 }
             }
@@ -130,9 +161,9 @@ auto OnlineModule::update_ui() -> void {
             if (records.size() > 0 &&
                 ImGui::BeginListBox("", ImVec2 { -FLT_MIN, 5 * ImGui::GetTextLineHeightWithSpacing() })) {
                 for (auto i = 0; i < records.size(); i++) {
-                    const auto is_selected = upload_index == i;
+                    const auto is_selected = upload_selection.count(i) > 0;
                     if (ImGui::Selectable(records[i].name, is_selected)) {
-                        upload_index = i;
+                        select(upload_selection, i);
                     }
                     if (is_selected) {
                         ImGui::SetItemDefaultFocus();
@@ -143,16 +174,122 @@ auto OnlineModule::update_ui() -> void {
                 ImGui::TextWrapped("现在还没有重建记录。在管线内进行重建吧。");
             }
             break;
+
+        case State::REMOTE_RECON:
+            ImGui::TextWrapped("把一个图片文件夹交给服务器重建。完成后结果会自动出现在服务端内容里。");
+            ImGui::InputText("图片文件夹", remote_folder, sizeof(remote_folder));
+            ImGui::InputText("保存名称", remote_name, sizeof(remote_name));
+            if (ImGui::Button("提交")) {
+                reconstruct_remotely();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("返回")) {
+                state = State::MAIN_INTERFACE;
+            }
+            break;
     }
 
     ImGui::End();
 }
 
+auto OnlineModule::select(std::set<int> &selection, int index) -> void {
+    // Ctrl adds or removes one, Shift extends from the last one picked; a plain click picks one
+    auto &io = ImGui::GetIO();
+    if (io.KeyShift && !selection.empty()) {
+        auto from = std::min(index, *selection.rbegin());
+        auto to = std::max(index, *selection.rbegin());
+        for (auto i = from; i <= to; i++) {
+            selection.insert(i);
+        }
+    } else if (io.KeyCtrl) {
+        if (selection.erase(index) == 0) {
+            selection.insert(index);
+        }
+    } else {
+        selection = { index };
+    }
+}
+
+auto OnlineModule::transfers_ui() -> void {
+    std::unique_lock<std::mutex> lock(transfers_mutex);
+    if (transfers.empty()) {
+        return;
+    }
+    ImGui::Separator();
+    auto failed = 0, finished = 0;
+    for (const auto &item : transfers) {
+        failed += item->state == ItemState::FAILED;
+        finished += item->state == ItemState::DONE || item->state == ItemState::FAILED;
+    }
+    ImGui::TextWrapped("传输：%d / %d 完成，%d 失败", finished, (int) transfers.size(), failed);
+    std::vector<std::shared_ptr<TransferItem>> retry;
+    if (failed > 0 && ImGui::Button("重试失败项")) {
+        for (const auto &item : transfers) {
+            if (item->state == ItemState::FAILED) {
+                item->attempts = 0;
+                retry.push_back(item);
+            }
+        }
+    }
+    if (finished > 0) {
+        if (failed > 0) {
+            ImGui::SameLine();
+        }
+        if (ImGui::Button("清除已完成")) {
+            transfers.erase(std::remove_if(transfers.begin(), transfers.end(), [] (const auto &item) {
+                return item->state == ItemState::DONE;
+            }), transfers.end());
+        }
+    }
+    static const char *STATES[] = { "排队中", "传输中", "完成", "失败" };
+    for (const auto &item : transfers) {
+        ImGui::TextWrapped("%s %s %s", item->upload ? "↑" : "↓", item->name.c_str(), STATES[(int) item->state.load()]);
+        char overlay[64] = { 0 };
+        if (item->state != ItemState::QUEUED) {
+            std::snprintf(overlay, sizeof(overlay), "%.1f MB/s", item->rate() / (1 << 20));
+        }
+        ImGui::ProgressBar(item->progress(), ImVec2 { -FLT_MIN, 0 }, overlay);
+    }
+    lock.unlock();
+    enqueue(std::move(retry));
+}
+
+auto OnlineModule::sync_ui() -> void {
+    ImGui::Separator();
+    if (ImGui::Checkbox("后台同步", &sync_enabled)) {
+        if (sync_enabled) {
+            SyncOptions options;
+            options.username = std::string(username);
+            options.password = std::string(password);
+            options.limit = (int64_t) sync_limit * 1024;
+            sync = std::make_unique<SyncEngine>(options);
+            sync->start();
+        } else {
+            sync.reset();
+        }
+    }
+    if (ImGui::InputInt("限速 KB/s", &sync_limit, 64, 1024)) {
+        sync_limit = std::max(sync_limit, 0);
+        if (sync) {
+            sync->set_limit((int64_t) sync_limit * 1024);
+        }
+    }
+    if (sync) {
+        auto progress = -1.0f;
+        auto line = sync->status(progress);
+        ImGui::TextWrapped("%s", line.empty() ? "等待第一次同步..." : line.c_str());
+        if (progress >= 0.0f) {
+            ImGui::ProgressBar(progress);
+        }
+    }
+}
+
 #define BAIL(why) mutex().lock(); \
     RECON_LOG(ONLINE) << why; \
     state = State::WELCOME; \
-    close(sock); \
+    transfer_progress = -1.0f; \
     mutex().unlock(); \
+    channel.close(); \
     return;
 
 auto OnlineModule::connect() -> void {
@@ -160,26 +297,10 @@ auto OnlineModule::connect() -> void {
         mutex().lock();
         state = State::CONNECTING;
         mutex().unlock();
-        sock = socket(AF_INET, SOCK_STREAM, 0);
-        sockaddr_in sin;
-        inet_pton(AF_INET, ONLINE_REMOTE, &sin.sin_addr.s_addr);
-        sin.sin_port = htons(ONLINE_PORT);
-        sin.sin_family = AF_INET;
-        
-        if (::connect(sock, (sockaddr *) &sin, sizeof(sin)) == -1) {
+        if (!channel.open(ONLINE_REMOTE, ONLINE_PORT)) {
             BAIL("与服务器建立连接失败。");
         }
         mutex().lock();
-        RECON_LOG(ONLINE) << "与服务器建立连接成功。";
-        mutex().unlock();
-
-        auto request = make_request("hello", "server");
-        send(request);
-        auto response = receive<online::Request>();
-        if (!response.has_value() || response->arg(0) != "hello") {
-            BAIL("错误！服务器返回了未知数据。正在断开...");
-        }
-        mutex().lock();
         RECON_LOG(ONLINE) << "与服务器连接已稳定。";
         state = State::LOGIN;
         mutex().unlock();
@@ -187,29 +308,44 @@ auto OnlineModule::connect() -> void {
     thread.detach();
 }
 
+auto OnlineModule::reconnect(Channel &channel) -> bool {
+    // Every action on the connection sees it drop; the first one here brings it back for all
+    std::lock_guard<std::mutex> lock(reconnecting);
+    if (channel.connected()) {
+        return true;
+    }
+    if (!channel.open(ONLINE_REMOTE, ONLINE_PORT)) {
+        return false;
+    }
+    return ::login(channel, username, password);
+}
+
 auto OnlineModule::login() -> void { 
     std::thread thread([&] () {
         mutex().lock();
         state = State::CONNECTING;
         mutex().unlock();
         
-        if (!send(make_request("login"))) {
+        auto exchange = channel.request();
+        if (!exchange->send(make_request("login"))) {
             BAIL("发送信息给服务器失败。请重新建立连接。");
         }
         
         online::User user;
         user.set_username(std::string(username));
         user.set_password(std::string(password));
-        if (!send(user)) {
+        if (!exchange->send(user)) {
             BAIL("发送用户信息失败。请重新建立连接。");
         }
         
-        auto response = receive<online::Request>();
+        auto response = exchange->receive<online::Request>();
         if (response.has_value() && response->arg_size() == 1 && response->arg(0) == "success") {
+            exchange.reset();
             mutex().lock();
             RECON_LOG(ONLINE) << "登陆成功。";
             state = State::MAIN_INTERFACE;
             mutex().unlock();
+            prefetcher.start(ONLINE_REMOTE, ONLINE_PORT, std::string(username), std::string(password));
             update_online_list();
             return;
         }
@@ -227,18 +363,19 @@ auto OnlineModule::register_account() -> void {
         state = State::CONNECTING;
         mutex().unlock();
         
-        if (!send(make_request("register"))) {
+        auto exchange = channel.request();
+        if (!exchange->send(make_request("register"))) {
             BAIL("发送信息给服务器失败。请重新建立连接。");
         }
         
         online::User user;
         user.set_username(std::string(username));
         user.set_password(std::string(password));
-        if (!send(user)) {
+        if (!exchange->send(user)) {
             BAIL("发送用户信息失败。请重新建立连接。");
         }
         
-        auto response = receive<online::Request>();
+        auto response = exchange->receive<online::Request>();
         if (response.has_value() && response->arg_size() == 1 && response->arg(0) == "success") {
             mutex().lock();
             RECON_LOG(ONLINE) << "注册成功。可以登陆了。";
@@ -254,206 +391,424 @@ auto OnlineModule::register_account() -> void {
     thread.detach();
 }
 
-auto OnlineModule::upload() -> void { 
+auto OnlineModule::upload() -> void {
+    std::vector<std::shared_ptr<TransferItem>> items;
+    for (auto index : upload_selection) {
+        if (index >= records.size()) {
+            continue;
+        }
+        auto record = records[index];
+        auto plan = std::make_shared<UploadPlan>();
+        items.push_back(std::make_shared<TransferItem>(record.name, true,
+                                                       [this, record, plan] (Channel &channel, TransferItem &item) {
+            // Cut once; a retry skips whatever arrived before the connection dropped
+            if (plan->hash.empty() && !plan_upload(record, *plan)) {
+                return Transfer::REJECTED;
+            }
+            return upload_chunks(channel, *plan, item);
+        }));
+    }
+    upload_selection.clear();
+    state = State::MAIN_INTERFACE;
+    enqueue(std::move(items));
+}
+
+auto OnlineModule::reconstruct_remotely() -> void {
     std::thread thread([&] () {
         mutex().lock();
-        RECON_LOG(ONLINE) << "正在上传记录到服务端...";
+        RECON_LOG(ONLINE) << "正在上传图片到服务器进行重建...";
         state = State::CONNECTING;
+        transfer_progress = 0.0f;
         mutex().unlock();
-        
-        const auto &selected = records[upload_index];
-        std::filesystem::path path = std::filesystem::path("recons") / selected.obj_file;
-        std::stringstream obj_stream, mtl_stream, tex_stream;
-        std::ifstream obj_reader(path), mtl_reader(path.replace_extension(".mtl")), tex_reader(path.replace_extension(".png"));
-        if (!obj_reader.good() || !mtl_reader.good() || !tex_reader.good()) {
-            if (obj_reader.good()) {
-                obj_reader.close();
-            }
-            if (mtl_reader.good()) {
-                mtl_reader.close();
-            }
-            if (tex_reader.good()) {
-                tex_reader.close();
-            }
+
+        auto fail = [this] (const std::string &why) {
             mutex().lock();
-            RECON_LOG(ONLINE) << "无法打开 obj 文件。";
-            state = State::UPLOAD;
+            RECON_LOG(ONLINE) << why;
+            state = State::REMOTE_RECON;
+            transfer_progress = -1.0f;
             mutex().unlock();
+        };
+        std::vector<std::filesystem::path> images;
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(std::string(remote_folder), error)) {
+            const auto extension = entry.path().extension();
+            if (extension == ".jpg" || extension == ".jpeg" || extension == ".bmp" || extension == ".png") {
+                images.push_back(entry.path());
+            }
+        }
+        if (images.size() < 2 || std::string(remote_name).empty()) {
+            fail("至少需要两张图片和一个保存名称。");
             return;
         }
-        obj_stream << obj_reader.rdbuf();
-        mtl_stream << mtl_reader.rdbuf();
-        tex_stream << tex_reader.rdbuf();
-        obj_reader.close();
-        mtl_reader.close();
-        tex_reader.close();
-        online::ReconBuffer buffer;
-        buffer.set_file_base(path.replace_extension("").filename().string());
-        buffer.set_obj_content(obj_stream.str());
-        buffer.set_mtl_content(mtl_stream.str());
-        buffer.set_texture_content(tex_stream.str());
-        if (!send(make_request("upload"))) {
-            BAIL("无法发送指令给服务器。");
-        }
-        if (!send(buffer)) {
-            BAIL("无法发送数据给服务器。");
-        }
-        auto response = receive<online::Request>();
+
+        auto submit = channel.request();
+        if (!submit->send(make_request("job_submit", std::string(remote_name)))) {
+            BAIL("指令发送失败。");
+        }
+        auto response = submit->receive<online::Request>();
+        submit.reset();
         if (!response.has_value()) {
-            BAIL("服务端未发回有效数据。");
+            BAIL("服务器没有回应。");
         }
-        if (response->arg_size() == 1 && response->arg(0) == "success") {
-            mutex().lock();
-            RECON_LOG(ONLINE) << "上传成功。";
-            state = State::MAIN_INTERFACE;
-            mutex().unlock();
-            update_online_list();
+        if (response->arg_size() != 2 || response->arg(0) != "job") {
+            fail("服务器拒绝了重建任务。");
+            return;
+        }
+        auto id = response->arg(1);
+        std::vector<char> chunk(TRANSFER_CHUNK);
+        for (size_t i = 0; i < images.size(); i++) {
+            auto size = (int64_t) std::filesystem::file_size(images[i], error);
+            std::ifstream reader(images[i], std::ios::binary);
+            if (error || !reader.good()) {
+                fail("无法读取图片：" + images[i].string());
+                return;
+            }
+            auto exchange = channel.request();
+            if (!exchange->send(make_request("job_image", id, images[i].filename().string(), std::to_string(size)))) {
+                BAIL("指令发送失败。");
+            }
+            response = exchange->receive<online::Request>();
+            if (!response.has_value() || response->arg_size() < 1 || response->arg(0) != "ready") {
+                fail("服务器拒绝了图片：" + images[i].filename().string());
+                return;
+            }
+            while (reader.read(chunk.data(), chunk.size()) || reader.gcount() > 0) {
+                if (!exchange->send_bytes(chunk.data(), (int) reader.gcount())) {
+                    BAIL("图片上传中断。");
+                }
+            }
+            response = exchange->receive<online::Request>();
+            if (!response.has_value() || response->arg_size() != 1 || response->arg(0) != "success") {
+                BAIL("图片上传失败。");
+            }
+            transfer_progress = (float) (i + 1) / images.size();
+        }
+        auto start = channel.request();
+        if (!start->send(make_request("job_start", id))) {
+            BAIL("指令发送失败。");
+        }
+        response = start->receive<online::Request>();
+        start.reset();
+        if (!response.has_value() || response->arg_size() < 1 || response->arg(0) != "queued") {
+            fail("服务器无法开始重建。");
             return;
         }
         mutex().lock();
-        RECON_LOG(ONLINE) << "上传失败。";
-        state = State::UPLOAD;
+        RECON_LOG(ONLINE) << "图片上传完成。重建任务 " << id << " 已排队。";
+        transfer_progress = 0.0f;
         mutex().unlock();
-    });
-    thread.detach();
-}
 
-auto OnlineModule::update_online_list() -> void { 
-    std::thread thread([&] () {
-        mutex().lock();
-        RECON_LOG(ONLINE) << "正在获取服务器重建列表...";
-        mutex().unlock();
-        
-        if (!send(make_request("records"))) {
-            BAIL("指令发送失败。");
+        auto result = Transfer::DROPPED;
+        for (auto attempt = 0; attempt <= TRANSFER_RETRIES && result == Transfer::DROPPED; attempt++) {
+            if (attempt > 0) {
+                mutex().lock();
+                RECON_LOG(ONLINE) << "连接中断，正在重新连接以继续跟踪重建任务...";
+                mutex().unlock();
+                std::this_thread::sleep_for(std::chrono::seconds(attempt));
+                if (!reconnect(channel)) {
+                    continue;
+                }
+            }
+            result = watch_job(std::atoi(id.c_str()));
         }
-        auto records_opt = receive<online::ReconRecords>();
-        if (!records_opt.has_value()) {
-            BAIL("获取重建列表失败。");
+        transfer_progress = -1.0f;
+        if (result == Transfer::DROPPED) {
+            BAIL("与服务器的连接已无法恢复。任务仍在服务器上运行。");
+        }
+        if (result == Transfer::REJECTED) {
+            fail("服务器重建失败。");
+            return;
         }
-        online_records = *records_opt;
+        mutex().lock();
+        state = State::MAIN_INTERFACE;
+        mutex().unlock();
+        update_online_list();
     });
     thread.detach();
 }
 
-auto OnlineModule::download() -> void {
-    std::thread thread([&] () {
-        mutex().lock();
-        RECON_LOG(ONLINE) << "正在下载选定记录到本地...";
-        state = State::CONNECTING;
-        mutex().unlock();
-        
-        const auto &record = online_records.records(online_index);
-        if (!send(make_request("download", std::to_string(record.id())))) {
-            BAIL("无法发送下载指令到服务器。");
+auto OnlineModule::watch_job(int id) -> Transfer {
+    // On a tagged connection the watch leaves the connection free for everything else
+    auto exchange = channel.request();
+    if (!exchange->send(make_request("job_watch", std::to_string(id)))) {
+        return Transfer::DROPPED;
+    }
+    auto stage = -1;
+    while (true) {
+        // job <id> <state> <stage> <progress> <record id>
+        auto update = exchange->receive<online::Request>();
+        if (!update.has_value()) {
+            return Transfer::DROPPED;
         }
-        auto buffer = receive<online::ReconBuffer>();
-        if (!buffer.has_value()) {
-            BAIL("接受下载信息失败。");
+        if (update->arg_size() != 6 || update->arg(0) != "job") {
+            return Transfer::REJECTED;
         }
-        
-        if (buffer->has_file_base() && buffer->has_obj_content() &&
-            buffer->has_mtl_content() && buffer->has_texture_content()) {
-            mkdir_if_not_exists("recons");
-            mkdir_if_not_exists("recons/" + record.owner());
-            auto base = std::filesystem::path("recons") / buffer->file_base();
-            std::ofstream obj_writer(base.string() + ".obj");
-            std::ofstream mtl_writer(base.string() + ".mtl");
-            std::ofstream tex_writer(base.string() + ".png");
-            if (!obj_writer.good() || !mtl_writer.good() || !tex_writer.good()) {
-                if (obj_writer.good()) {
-                    obj_writer.close();
-                }
-                if (mtl_writer.good()) {
-                    mtl_writer.close();
-                }
-                if (tex_writer.good()) {
-                    tex_writer.close();
-                }
-                BAIL("尝试文件写入失败。");
-                return;
-            }
-            obj_writer << buffer->obj_content();
-            mtl_writer << buffer->mtl_content();
-            tex_writer << buffer->texture_content();
-            obj_writer.close();
-            mtl_writer.close();
-            tex_writer.close();
-            
+        auto job_state = (JobState) std::atoi(update->arg(2).c_str());
+        transfer_progress = std::atof(update->arg(4).c_str());
+        if (job_state == JobState::RUNNING && std::atoi(update->arg(3).c_str()) != stage) {
+            stage = std::atoi(update->arg(3).c_str());
             mutex().lock();
-            records = read_recon_records("recons/records.bin");
-            auto file_name = base.filename().string();
-            auto name = record.owner() + " 创作的 " + base.filename().string();
-            auto record_in_db = std::find_if(records.begin(), records.end(), [&] (auto &r) {
-                return std::string(r.name) == name;
-            });
-            if (record_in_db == records.end()) {
-                records.push_back(ReconRecord(name,
-                                              record.owner() + "/" + file_name + ".obj"));
-                write_recon_records(records, "recons/records.bin");
-            }
-            RECON_LOG(ONLINE) << "文件下载结束。";
-            state = State::MAIN_INTERFACE;
+            RECON_LOG(ONLINE) << "远程重建进入第 " << stage << " 阶段。";
             mutex().unlock();
-        } else {
+        }
+        if (job_state == JobState::DONE) {
             mutex().lock();
-            RECON_LOG(ONLINE) << "错误！服务端传输信息未齐全。";
-            state = State::MAIN_INTERFACE;
+            RECON_LOG(ONLINE) << "远程重建完成，已发布为记录 " << update->arg(5) << "。";
             mutex().unlock();
+            return Transfer::DONE;
+        }
+        if (job_state == JobState::FAILED) {
+            return Transfer::REJECTED;
+        }
+    }
+}
+
+auto OnlineModule::record_tooltip(const online::ReconRecord &record) -> void {
+    std::unique_lock<std::mutex> lock(thumbnails_mutex);
+    auto &thumbnail = thumbnails[record.id()];
+    if (!thumbnail) {
+        thumbnail = std::make_shared<Thumbnail>();
+        std::thread thread([&, id = record.id(), thumbnail = thumbnail] () {
+            std::string png;
+            int width = 0, height = 0, channels;
+            unsigned char *data = nullptr;
+            if (fetch_artifact(channel, id, "thumbnail.png", png) == Transfer::DONE) {
+                stbi_set_flip_vertically_on_load(true);
+                data = stbi_load_from_memory((const unsigned char *) png.data(), (int) png.size(), &width, &height, &channels, 3);
+            }
+            std::lock_guard<std::mutex> lock(thumbnails_mutex);
+            if (data) {
+                thumbnail->pixels.assign(data, data + (size_t) width * height * 3);
+                thumbnail->width = width;
+                thumbnail->height = height;
+                stbi_image_free(data);
+            }
+            thumbnail->fetched = true;
+        });
+        thread.detach();
+    }
+    if (!thumbnail->pixels.empty()) {
+        // Here on the UI thread, which has the GL context
+        thumbnail->texture = make_texture(thumbnail->pixels.data(), thumbnail->width, thumbnail->height);
+        thumbnail->pixels.clear();
+    }
+    auto texture = thumbnail->texture;
+    lock.unlock();
+
+    PrefetchInfo info;
+    auto has_info = prefetcher.info(record.id(), info);
+    if (texture == GL_NONE && !has_info) {
+        return;
+    }
+    ImGui::BeginTooltip();
+    if (texture != GL_NONE) {
+        ImGui::Image((ImTextureID) (intptr_t) texture, ImVec2 { ARTIFACT_THUMBNAIL, ARTIFACT_THUMBNAIL },
+                     ImVec2 { 0, 1 }, ImVec2 { 1, 0 });
+    }
+    if (has_info) {
+        ImGui::Text(info.local ? "%.1f MB，已在本地" : "%.1f MB，已预取 %.0f%%", info.total / 1048576.0,
+                    info.total > 0 ? 100.0 * info.fetched / info.total : 100.0);
+    }
+    ImGui::EndTooltip();
+}
+
+auto OnlineModule::update_online_list() -> void { 
+    {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        if (refreshing) {
+            refresh_again = true;
+            return;
+        }
+        refreshing = true;
+    }
+    std::thread thread([this] () {
+        while (true) {
+            fetch_online_list();
+            std::lock_guard<std::mutex> lock(transfers_mutex);
+            if (!refresh_again) {
+                refreshing = false;
+                return;
+            }
+            refresh_again = false;
         }
     });
     thread.detach();
 }
 
+auto OnlineModule::fetch_online_list() -> void {
+    mutex().lock();
+    RECON_LOG(ONLINE) << "正在获取服务器重建列表...";
+    mutex().unlock();
+    
+    // Only what changed since the last refresh, a page at a time. The list is current to the
+    // first page's version; anything changed while paging comes again next time
+    std::string cursor;
+    std::optional<std::string> version;
+    while (true) {
+        auto exchange = channel.request();
+        if (!exchange->send(make_request("list", online_version, cursor,
+                                         std::to_string(ONLINE_LIST_PAGE), "", ""))) {
+            BAIL("指令发送失败。");
+        }
+        auto page = exchange->receive<online::Request>();
+        auto records_opt = exchange->receive<online::ReconRecords>();
+        if (!page.has_value() || page->arg_size() != 3 || page->arg(0) != "page" || !records_opt.has_value()) {
+            BAIL("获取重建列表失败。");
+        }
+        // Opaque: one number from a server, one per node through a router
+        const auto &page_version = page->arg(1);
+        cursor = page->arg(2);
+        if (!version.has_value() && page_version == "0" && online_version != "0") {
+            // A different or rebuilt catalogue; start over from a full listing
+            known_records.clear();
+            online_version = "0";
+            cursor.clear();
+            continue;
+        }
+        if (!version.has_value()) {
+            version = page_version;
+        }
+        for (const auto &record : records_opt->records()) {
+            known_records[record.id()] = record;
+            if (online_version != "0") {
+                // Published or changed since the last refresh
+                prefetcher.hint(record, PrefetchNS::Hint::RECENT);
+            }
+        }
+        if (cursor.empty()) {
+            break;
+        }
+    }
+    if (online_version == "0") {
+        // The first listing: the newest few are the likeliest to be opened
+        auto newest = known_records.rbegin();
+        for (auto i = 0; i < PREFETCH_RECENT && newest != known_records.rend(); i++, newest++) {
+            prefetcher.hint(newest->second, PrefetchNS::Hint::RECENT);
+        }
+    }
+    online_version = *version;
 
+    online::ReconRecords merged;
+    for (const auto &[id, record] : known_records) {
+        *merged.add_records() = record;
+    }
+    mutex().lock();
+    online_records = std::move(merged);
+    RECON_LOG(ONLINE) << "重建列表已更新，共 " << online_records.records_size() << " 条。";
+    mutex().unlock();
+}
 
+auto OnlineModule::download() -> void {
+    std::vector<std::shared_ptr<TransferItem>> items;
+    for (auto index : online_selection) {
+        if (index >= online_records.records_size()) {
+            continue;
+        }
+        auto record = online_records.records(index);
+        items.push_back(std::make_shared<TransferItem>(record.name() + " 由 " + record.owner() + " 创作", false,
+                                                       [this, record] (Channel &channel, TransferItem &item) {
+            std::string file_base;
+            auto result = download_resumable(channel, record, file_base, item);
+            if (result == Transfer::DONE) {
+                auto file_name = std::filesystem::path(file_base).filename().string();
+                add_local_record(ReconRecord(record.owner() + " 创作的 " + file_name,
+                                             record.owner() + "/" + file_name + ".obj"));
+            }
+            return result;
+        }));
+    }
+    online_selection.clear();
+    enqueue(std::move(items));
+}
 
+// B U L K /////////////////////////////////////////////////////
 
-
-template<typename T>
-auto OnlineModule::receive() -> std::optional<T> {
-    int request_size;
-    
-    auto recv_len = recv(sock, &request_size, sizeof(request_size), 0);
-    if (recv_len != sizeof(request_size)) {
-        return {};
+auto OnlineModule::enqueue(std::vector<std::shared_ptr<TransferItem>> items) -> void {
+    if (items.empty()) {
+        return;
     }
-    
-    char *packet = new char[request_size];
-    auto left_to_receive = request_size;
-    auto offset = 0;
-    while (left_to_receive != 0) {
-        recv_len = recv(sock, packet + offset, left_to_receive, 0);
-        if (recv_len <= 0) {
-            delete[] packet;
-            return {};
-        }
-        offset += recv_len;
-        left_to_receive -= recv_len;
+    std::lock_guard<std::mutex> lock(transfers_mutex);
+    auto queued = 0;
+    for (auto &item : items) {
+        auto busy = std::find_if(transfers.begin(), transfers.end(), [&] (const auto &other) {
+            return other != item && other->upload == item->upload && other->name == item->name &&
+                (other->state == ItemState::QUEUED || other->state == ItemState::RUNNING);
+        });
+        if (busy != transfers.end()) {
+            // Already on its way; two of them would fight over the same files
+            continue;
+        }
+        item->state = ItemState::QUEUED;
+        if (std::find(transfers.begin(), transfers.end(), item) == transfers.end()) {
+            transfers.push_back(item);
+        }
+        pending.push_back(item);
+        queued++;
+    }
+    mutex().lock();
+    RECON_LOG(ONLINE) << "已排队 " << queued << " 项传输。";
+    mutex().unlock();
+    while (transfer_workers < ONLINE_BULK_WINDOW && transfer_workers < (int) pending.size()) {
+        transfer_workers++;
+        std::thread thread([this] () {
+            transfer_worker();
+        });
+        thread.detach();
     }
-    
-    T t;
-    t.ParseFromArray(packet, request_size);
-    
-    delete[] packet;
-    return t;
 }
 
-template<typename T>
-auto OnlineModule::send(T what) -> bool {
-    int size = (int) what.ByteSizeLong();
-    char *packet = new char[size];
-    what.SerializeToArray(packet, size);
+auto OnlineModule::transfer_worker() -> void {
+    // Each worker has a connection of its own, so the server serves the window side by side
+    Channel worker_channel;
+    while (true) {
+        std::shared_ptr<TransferItem> item;
+        transfers_mutex.lock();
+        if (pending.empty()) {
+            auto last = --transfer_workers == 0;
+            auto refresh = last && uploaded;
+            uploaded = uploaded && !refresh;
+            transfers_mutex.unlock();
+            if (last) {
+                mutex().lock();
+                RECON_LOG(ONLINE) << "批量传输结束。";
+                mutex().unlock();
+            }
+            if (refresh) {
+                update_online_list();
+            }
+            return;
+        }
+        item = pending.front();
+        pending.pop_front();
+        transfers_mutex.unlock();
 
-    if (::send(sock, (char *) &size, sizeof(size), 0) != sizeof(size)) {
-        delete[] packet;
-        return false;
-    }
-    if (::send(sock, packet, size, 0) != size) {
-        delete[] packet;
-        return false;
+        item->state = ItemState::RUNNING;
+        auto result = Transfer::DROPPED;
+        for (auto attempt = 0; attempt <= TRANSFER_RETRIES && result == Transfer::DROPPED; attempt++) {
+            if (attempt > 0) {
+                std::this_thread::sleep_for(std::chrono::seconds(attempt));
+            }
+            item->attempts++;
+            if (!reconnect(worker_channel)) {
+                continue;
+            }
+            item->moved = 0;
+            item->started = std::chrono::steady_clock::now();
+            result = item->work(worker_channel, *item);
+            if (result == Transfer::DROPPED) {
+                // Whatever broke, the next attempt starts on a fresh connection
+                worker_channel.close();
+            }
+        }
+        item->finished = std::chrono::steady_clock::now();
+        item->state = result == Transfer::DONE ? ItemState::DONE : ItemState::FAILED;
+        mutex().lock();
+        RECON_LOG(ONLINE) << (item->upload ? "上传" : "下载") << (result == Transfer::DONE ? "成功：" : "失败：") << item->name;
+        mutex().unlock();
+        if (result == Transfer::DONE && item->upload) {
+            transfers_mutex.lock();
+            uploaded = true;
+            transfers_mutex.unlock();
+        }
     }
-    
-    delete[] packet;
-    return true;
 }
@@ -9,13 +9,28 @@
 #define Online_hpp
 
 #include <optional>
+#include <array>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <cstdint>
 #include "common.hpp"
 #include "Module.hpp"
 #include "online.pb.h"
+#include "Protocol.hpp"
+#include "Compress.hpp"
+#include "Channel.hpp"
+#include "Transfers.hpp"
+#include "Sync.hpp"
+#include "Prefetch.hpp"
+#include "Preview.hpp"
 
 #define ONLINE "在线功能"
-#define ONLINE_REMOTE "127.0.0.1"
-#define ONLINE_PORT 17290
+#define ONLINE_LIST_PAGE 200
+#define ONLINE_BULK_WINDOW 4 // Transfers running at once, each on its own connection
 
 namespace OnlineNS {
 
@@ -25,7 +40,16 @@ enum class State {
     LOGIN = 2,
     REGISTER = 3,
     MAIN_INTERFACE = 4,
-    UPLOAD = 5
+    UPLOAD = 5,
+    REMOTE_RECON = 6
+};
+
+/// A server record's thumbnail artifact, fetched the first time its row is hovered.
+struct Thumbnail {
+    bool fetched = false; // Pixels below are filled in, or there's none to be had
+    std::vector<unsigned char> pixels; // RGB, until uploaded
+    int width = 0, height = 0;
+    GLuint texture = GL_NONE;
 };
 
 };
@@ -33,14 +57,32 @@ enum class State {
 
 class OnlineModule : public Module {
 public:
-    OnlineModule() : Module(ONLINE), state(OnlineNS::State::WELCOME), sock(-1), online_index(0) {
+    OnlineModule() : Module(ONLINE), state(OnlineNS::State::WELCOME), online_version("0"), transfer_progress(-1.0f),
+        transfer_workers(0), uploaded(false), refreshing(false), refresh_again(false), sync_enabled(false), sync_limit(0) {
         std::memset(username, 0, sizeof(username));
         std::memset(password, 0, sizeof(password));
+        std::memset(remote_folder, 0, sizeof(remote_folder));
+        std::memset(remote_name, 0, sizeof(remote_name));
     }
 
     virtual auto update(float delta_time) -> bool override;
     
     virtual auto update_ui() -> void override;
+
+    /// The preview of a server record, while there is one.
+    virtual auto render() -> void override;
+
+    /// Bulk transfers with their progress and throughput, under the server's list.
+    auto transfers_ui() -> void;
+
+    /// The background sync toggle, its bandwidth limit and how it's doing.
+    auto sync_ui() -> void;
+
+    /// The thumbnail of a hovered server record, with what's known of its size and prefetching.
+    auto record_tooltip(const online::ReconRecord &record) -> void;
+
+    /// Applies a click on list row `index` to `selection`.
+    auto select(std::set<int> &selection, int index) -> void;
     
     // O N L I N E ////////////////////////////////
     auto connect() -> void;
@@ -49,17 +91,34 @@ public:
     
     auto register_account() -> void;
     
+    /// Queues every selected local record for upload.
     auto upload() -> void;
     
+    /// Refreshes the list on a thread of its own; asked again while one runs, it runs once more after.
     auto update_online_list() -> void;
     
-    auto download() -> void;
+    /// Brings known_records up to date with the server's catalogue. One refresh thread at a time.
+    auto fetch_online_list() -> void;
     
-    template<typename T>
-    auto receive() -> std::optional<T>;
-    
-    template<typename T>
-    auto send(T what) -> bool;
+    /// Queues every selected server record for download.
+    auto download() -> void;
+
+    /// Adds items to the bulk queue, and starts workers up to ONLINE_BULK_WINDOW to run them.
+    auto enqueue(std::vector<std::shared_ptr<OnlineNS::TransferItem>> items) -> void;
+
+    /// Runs queued items until none are left, retrying dropped ones on a fresh connection.
+    auto transfer_worker() -> void;
+
+    /// Uploads a folder of images as a server-side reconstruction job and follows it until the
+    /// result is published as a record.
+    auto reconstruct_remotely() -> void;
+
+    /// Follows a started job; reconnects and watches again if the connection drops.
+    auto watch_job(int id) -> OnlineNS::Transfer;
+
+    /// Opens a fresh connection and logs in again with the remembered credentials, unless another
+    /// action already did.
+    auto reconnect(Channel &channel) -> bool;
     
 private:
     OnlineNS::State state;
@@ -67,13 +126,43 @@ private:
     // I M G U I ///////////////////////////////////
     char username[512];
     char password[512];
+    char remote_folder[512];
+    char remote_name[512];
 
     // O N L I N E /////////////////////////////////
-    int sock;
+    Channel channel; // Every action's requests share it, each as its own exchange
+    std::mutex reconnecting;
     std::vector<ReconRecord> records;
     online::ReconRecords online_records;
-    int upload_index;
-    int online_index;
+    std::map<int, online::ReconRecord> known_records; // Everything listed so far, by id
+    std::string online_version; // Catalogue version the list is current to, as the server put it
+    std::set<int> upload_selection; // Into records
+    std::set<int> online_selection; // Into online_records
+    float transfer_progress; // [0, 1] while a remote reconstruction is uploading or running, negative otherwise
+
+    // B U L K /////////////////////////////////////
+    std::mutex transfers_mutex; // Guards the lists below; workers update items without it
+    std::vector<std::shared_ptr<OnlineNS::TransferItem>> transfers; // As shown, oldest first
+    std::deque<std::shared_ptr<OnlineNS::TransferItem>> pending;
+    int transfer_workers;
+    bool uploaded; // Since the last refresh of the list
+    bool refreshing; // A thread is fetching the list; it alone touches known_records and online_version
+    bool refresh_again; // Asked for while it was
+
+    // P R E F E T C H /////////////////////////////
+    Prefetcher prefetcher; // Started on logging in
+
+    // T H U M B N A I L S /////////////////////////
+    std::mutex thumbnails_mutex; // Guards the thumbnails while they're fetched
+    std::map<int, std::shared_ptr<OnlineNS::Thumbnail>> thumbnails; // By record id
+
+    // P R E V I E W ///////////////////////////////
+    RemotePreview preview; // Of a server record, streamed coarse to fine
+
+    // S Y N C /////////////////////////////////////
+    std::unique_ptr<SyncEngine> sync; // While enabled, with the credentials logged in with
+    bool sync_enabled;
+    int sync_limit; // KB/s, zero for none
 };
 
 #endif /* Online_hpp */
@@ -10,6 +10,8 @@
 #include <ImGuiFileDialog.h>
 #include <thread>
 #include <cstdio>
+#include <random>
+#include <algorithm>
 
 
 // P I P E L I N E ///////////////////////////
@@ -567,7 +569,8 @@ auto PipelineModule::update_ui() -> void {
             ImGui::TextWrapped("一切已经准备就绪。点击下一步开始。");
             if (ImGui::Button("下一步")) {
                 state = State::RUNNING;
-                mesh_texture = GL_NONE; // Reset mesh_texture so we won't accidentally sample it
+                clear_snapshots(); // Stages of the previous run shouldn't be mixed with this one
+                opengl_ready = false;
                 std::thread pipeline_runner(run_pipeline, &pipeline);
                 pipeline_runner.detach();
             }
@@ -663,6 +666,26 @@ auto PipelineModule::update_ui() -> void {
             }
             break;
     }
+    if (opengl_ready) {
+        ImGui::Separator();
+        ImGui::Checkbox("圆形点片", &splatting);
+        if (splatting) {
+            ImGui::SameLine();
+            ImGui::Checkbox("EDL 光照", &eye_dome_lighting);
+            ImGui::SliderFloat("点片大小", &splat_scale, 0.1f, 4.0f);
+            if (eye_dome_lighting) {
+                ImGui::SliderFloat("EDL 强度", &edl_strength, 0.0f, 5.0f);
+                ImGui::SliderFloat("EDL 半径", &edl_radius, 0.5f, 4.0f);
+            }
+        }
+        ImGui::SliderFloat("点预算", &point_budget, 0.05f, 1.0f, "%.2f");
+        if (!render_snapshots.empty() && !render_snapshots.back().clusters.clusters.empty()) {
+            const auto &clusters = render_snapshots.back().clusters;
+            ImGui::Checkbox("遮挡剔除", &occlusion_culling);
+            ImGui::SameLine();
+            ImGui::Text("绘制簇：%d / %d", clusters.drawn, (int) clusters.clusters.size());
+        }
+    }
     ImGui::End();
     if (state == State::CHOOSING_FILE) {
         ImGuiFileDialog::Instance()->OpenDialog("Folder", "选择输入目录...", nullptr, ".");
@@ -674,10 +697,7 @@ auto PipelineModule::update_ui() -> void {
                 RECON_LOG(PIPELINE) << "有效数据：" <<
                     list_images(path);
                 state = State::FOLDER_CHOSEN;
-                pipeline.init(image_listing,
-                              path,
-                              "/Users/apple/Projects/openMVG/build/Darwin-x86_64-DEBUG/",
-                              "/Users/apple/Projects/openMVS/build/bin/");
+                pipeline.init(image_listing, path, PIPELINE_MVG_PATH, PIPELINE_MVS_PATH);
             }
             ImGuiFileDialog::Instance()->Close();
         }
@@ -686,15 +706,20 @@ auto PipelineModule::update_ui() -> void {
 
 auto PipelineModule::update(float delta_time) -> bool {
     if (!opengl_ready && pipeline.state == PipelineState::GLOBAL_SFM) {
-        program = link(compile(GL_VERTEX_SHADER, "shaders/vertex.glsl"),
-                       compile(GL_FRAGMENT_SHADER, "shaders/fragment.glsl"));
+        program = shared_program("shaders/vertex.glsl", "shaders/fragment.glsl");
+        splat_program = shared_program("shaders/splat_vertex.glsl", "shaders/splat_fragment.glsl");
+        edl_program = shared_program("shaders/edl_vertex.glsl", "shaders/edl_fragment.glsl");
+        if (empty_VAO == GL_NONE) {
+            glGenVertexArrays(1, &empty_VAO);
+            float point_size_range[2] = { 1.0f, 64.0f };
+            glGetFloatv(GL_POINT_SIZE_RANGE, point_size_range);
+            max_point_size = std::min(point_size_range[1], 64.0f);
+        }
 
         load_ply_as_pointcloud("products/sfm/cloud_and_poses.ply");
         
-        eye = glm::vec3(0.0f, 0.0f, 5.0f);
-        center = glm::vec3(0.0f);
-        perspective_mat = glm::perspective(glm::radians(45.0f), (float) window_size.x / window_size.y, 0.01f, 200.0f);
-        view_mat = glm::lookAt(glm::vec3(0.0f, 0.0f, 5.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        camera->eye = glm::vec3(0.0f, 0.0f, 5.0f);
+        camera->center = glm::vec3(0.0f);
         render_state = pipeline.state;
 
         opengl_ready = true;
@@ -702,15 +727,15 @@ auto PipelineModule::update(float delta_time) -> bool {
     }
     if (opengl_ready && render_state != pipeline.state && pipeline.state == PipelineState::STRUCTURE_FROM_KNOWN_POSES) {
         render_state = pipeline.state;
-        load_colorized_ply_as_pointcloud("products/sfm/colorized.ply");
+        load_colorized_ply_as_pointcloud("products/sfm/colorized.ply", "上色点云");
     }
     if (opengl_ready && render_state != pipeline.state && pipeline.state == PipelineState::MVG2MVS) {
         render_state = pipeline.state;
-        load_colorized_ply_as_pointcloud("products/sfm/robust_colorized.ply");
+        load_colorized_ply_as_pointcloud("products/sfm/robust_colorized.ply", "鲁棒点云");
     }
     if (opengl_ready && render_state != pipeline.state && pipeline.state == PipelineState::RECONSTRUCT_MESH) {
         render_state = pipeline.state;
-        load_colorized_ply_as_pointcloud("products/mvs/scene_dense.ply");
+        load_colorized_ply_as_pointcloud("products/mvs/scene_dense.ply", "稠密点云");
     }
     if (opengl_ready && render_state != pipeline.state && pipeline.state == PipelineState::REFINE_MESH) {
         render_state = pipeline.state;
@@ -722,42 +747,6 @@ auto PipelineModule::update(float delta_time) -> bool {
                                  "products/mvs/scene_dense_mesh_refine_texture.png");
     }
     time += delta_time;
-
-    float horizontal_rotation_delta = horizontal_rotation_target - horizontal_rotation;
-    horizontal_rotation += (horizontal_rotation_delta * delta_time) * 10.0f;
-
-    model_mat = glm::mat4(1.0f);
-    model_mat = glm::rotate(model_mat, glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    model_mat = glm::rotate(model_mat, glm::radians(horizontal_rotation * 180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    view_mat = glm::lookAt(glm::vec3(0.0f, 0.0f, radius), center, glm::vec3(0.0f, 1.0f, 0.0f));
-
-    if (glfwGetKey(window, GLFW_KEY_A)) {
-        horizontal_rotation_target -= glm::radians(delta_time * 180.0f);
-    }
-    if (glfwGetKey(window, GLFW_KEY_D)) {
-        horizontal_rotation_target += glm::radians(delta_time * 180.0f);
-    }
-    if (glfwGetKey(window, GLFW_KEY_S)) {
-        radius += delta_time * 5.0f;
-    }
-    if (glfwGetKey(window, GLFW_KEY_W)) {
-        radius -= delta_time * 5.0f;
-    }
-    
-    const auto front = glm::normalize(center - eye);
-    const auto right = glm::cross(front, glm::vec3(0.0f, 1.0f, 0.0f));
-    if (glfwGetKey(window, GLFW_KEY_LEFT)) {
-        center -= right * delta_time;
-    }
-    if (glfwGetKey(window, GLFW_KEY_RIGHT)) {
-        center += right * delta_time;
-    }
-    if (glfwGetKey(window, GLFW_KEY_UP)) {
-        center += glm::vec3(0.0f, 1.0f, 0.0f) * delta_time;
-    }
-    if (glfwGetKey(window, GLFW_KEY_DOWN)) {
-        center -= glm::vec3(0.0f, 1.0f, 0.0f) * delta_time;
-    }
     return opengl_ready;
 }
 
@@ -781,26 +770,106 @@ auto PipelineModule::list_images(std::filesystem::path path) -> int {
 }
 
 auto PipelineModule::render() -> void {
-    if (!opengl_ready) {
+    if (!opengl_ready || render_snapshots.empty()) {
         // Not ready yet
         return;
     }
+    draw(render_snapshots.back());
+}
+
+auto PipelineModule::snapshots() -> std::vector<std::string> {
+    // The last one is what render() shows already
+    std::vector<std::string> names;
+    for (auto i = 0; i + 1 < (int) render_snapshots.size(); i++) {
+        names.push_back(render_snapshots[i].name);
+    }
+    return names;
+}
+
+auto PipelineModule::render_snapshot(int index) -> void {
+    if (!opengl_ready || index < 0 || index >= (int) render_snapshots.size()) {
+        return;
+    }
+    draw(render_snapshots[index]);
+}
+
+auto PipelineModule::draw(RenderSnapshot &snapshot) -> void {
+    auto count = snapshot.num_vertices;
+    if (snapshot.render_mode == GL_POINTS) {
+        // Points are shuffled on load, so any prefix is a uniform subsample
+        count = std::max(1, (int) (snapshot.num_vertices * point_budget));
+        if (splatting) {
+            draw_splats(snapshot, count);
+            return;
+        }
+    }
     glUseProgram(program);
-    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(model_mat));
-    glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(view_mat));
-    glUniformMatrix4fv(glGetUniformLocation(program, "perspective"), 1, GL_FALSE, glm::value_ptr(perspective_mat));
-    if (mesh_texture != GL_NONE) {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, mesh_texture);
-        glUniform1i(glGetUniformLocation(program, "tex"), 0);
-        glUniform1i(glGetUniformLocation(program, "use_texture"), 1);
+    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(camera->model()));
+    glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(camera->view()));
+    glUniformMatrix4fv(glGetUniformLocation(program, "perspective"), 1, GL_FALSE, glm::value_ptr(camera->perspective(viewport_size)));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, snapshot.texture);
+    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1i(glGetUniformLocation(program, "use_texture"), snapshot.texture != GL_NONE);
+    glBindVertexArray(snapshot.VAO);
+    if (snapshot.render_mode == GL_TRIANGLES && !snapshot.clusters.clusters.empty()) {
+        snapshot.clusters.draw(camera->model(), camera->view(), camera->perspective(viewport_size), occlusion_culling);
+    } else {
+        glPointSize(5.0f);
+        glDrawArrays(snapshot.render_mode, 0, count);
     }
-    glBindVertexArray(VAO);
-    glPointSize(5.0f);
-    glDrawArrays(render_mode, 0, num_vertices);
     glBindVertexArray(GL_NONE);
 }
 
+auto PipelineModule::draw_splats(const RenderSnapshot &snapshot, int count) -> void {
+    GLint target = GL_NONE;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+    if (eye_dome_lighting) {
+        // EDL needs the depth of the whole cloud first, so splat into our own target
+        splat_target.resize(viewport_size);
+        splat_target.bind();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+    // Fewer points cover the same area with bigger splats
+    auto radius = snapshot.splat_radius * splat_scale / std::sqrt(point_budget);
+    glEnable(GL_PROGRAM_POINT_SIZE);
+    glUseProgram(splat_program);
+    glUniformMatrix4fv(glGetUniformLocation(splat_program, "model"), 1, GL_FALSE, glm::value_ptr(camera->model()));
+    glUniformMatrix4fv(glGetUniformLocation(splat_program, "view"), 1, GL_FALSE, glm::value_ptr(camera->view()));
+    glUniformMatrix4fv(glGetUniformLocation(splat_program, "perspective"), 1, GL_FALSE, glm::value_ptr(camera->perspective(viewport_size)));
+    glUniform1f(glGetUniformLocation(splat_program, "splat_radius"), radius);
+    glUniform1f(glGetUniformLocation(splat_program, "viewport_height"), (float) viewport_size.y);
+    glUniform1f(glGetUniformLocation(splat_program, "max_point_size"), max_point_size);
+    glBindVertexArray(snapshot.VAO);
+    glDrawArrays(GL_POINTS, 0, count);
+    glDisable(GL_PROGRAM_POINT_SIZE);
+    if (!eye_dome_lighting) {
+        glBindVertexArray(GL_NONE);
+        return;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glViewport(0, 0, viewport_size.x, viewport_size.y);
+    glUseProgram(edl_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, splat_target.color_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, splat_target.depth_texture);
+    glUniform1i(glGetUniformLocation(edl_program, "color_tex"), 0);
+    glUniform1i(glGetUniformLocation(edl_program, "depth_tex"), 1);
+    glUniform2f(glGetUniformLocation(edl_program, "screen_size"), (float) viewport_size.x, (float) viewport_size.y);
+    glUniform1f(glGetUniformLocation(edl_program, "strength"), edl_strength);
+    glUniform1f(glGetUniformLocation(edl_program, "radius"), edl_radius);
+    glUniform1f(glGetUniformLocation(edl_program, "near"), camera->near_plane);
+    glUniform1f(glGetUniformLocation(edl_program, "far"), camera->far_plane);
+    glBindVertexArray(empty_VAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(GL_NONE);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, GL_NONE);
+    glActiveTexture(GL_TEXTURE0);
+}
+
 auto PipelineModule::load_ply_as_pointcloud(std::string path) -> void {
     tinyply::PlyFile file;
     std::ifstream reader(path);
@@ -840,10 +909,10 @@ auto PipelineModule::load_ply_as_pointcloud(std::string path) -> void {
         verts[i].position -= center_of_gravity;
     }
 
-    setup_render(verts, GL_POINTS);
+    setup_render(verts, GL_POINTS, "稀疏点云");
 }
 
-auto PipelineModule::load_colorized_ply_as_pointcloud(std::string path) -> void { 
+auto PipelineModule::load_colorized_ply_as_pointcloud(std::string path, std::string name) -> void { 
     tinyply::PlyFile file;
     std::ifstream reader(path);
     if (!reader.good()) {
@@ -889,7 +958,7 @@ auto PipelineModule::load_colorized_ply_as_pointcloud(std::string path) -> void
         verts[i].position -= center_of_gravity;
     }
 
-    setup_render(verts, GL_POINTS);
+    setup_render(verts, GL_POINTS, name);
 }
 
 auto PipelineModule::load_ply_as_mesh(std::string path) -> void {
@@ -951,7 +1020,7 @@ auto PipelineModule::load_ply_as_mesh(std::string path) -> void {
     }
     RECON_LOG(PIPELINE) << "重心：" << center_of_gravity.x << ", " << center_of_gravity.y << ", " << center_of_gravity.z;
 
-    setup_render(verts, GL_TRIANGLES);
+    setup_render(verts, GL_TRIANGLES, "网格");
 }
 
 auto PipelineModule::load_ply_and_texture_map(std::string path, std::string texture_path) -> void {
@@ -1017,41 +1086,41 @@ auto PipelineModule::load_ply_and_texture_map(std::string path, std::string text
     }
     RECON_LOG(PIPELINE) << "重心：" << center_of_gravity.x << ", " << center_of_gravity.y << ", " << center_of_gravity.z;
     
-    if (mesh_texture != GL_NONE) {
-        glDeleteTextures(1, &mesh_texture);
-    }
-    glGenTextures(1, &mesh_texture);
-    glBindTexture(GL_TEXTURE_2D, mesh_texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    
-    stbi_set_flip_vertically_on_load(true);
-    int width, height, channels;
-    auto *data = stbi_load(texture_path.c_str(), &width, &height, &channels, 0);
-    if (!data) {
+    auto texture = load_texture(texture_path);
+    if (texture == GL_NONE) {
         RECON_LOG(PIPELINE) << "加载材质失败：" << texture_path << " 未找到或无权限";
         return;
     }
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    stbi_image_free(data);
-    glBindTexture(GL_TEXTURE_2D, GL_NONE);
 
-    setup_render(verts, GL_TRIANGLES);
+    setup_render(verts, GL_TRIANGLES, "贴图网格", texture);
 }
 
-auto PipelineModule::setup_render(std::vector<Vertex> vertices, GLuint render_mode) -> void { 
-    if (VAO != GL_NONE) {
-        glDeleteVertexArrays(1, &VAO);
-    }
-    if (VBO != GL_NONE) {
-        glDeleteBuffers(1, &VBO);
+auto PipelineModule::setup_render(std::vector<Vertex> vertices, GLuint render_mode, std::string name,
+                                  GLuint texture) -> void {
+    RenderSnapshot snapshot;
+    snapshot.name = name;
+    snapshot.render_mode = render_mode;
+    snapshot.texture = texture;
+    snapshot.num_vertices = (int) vertices.size();
+    snapshot.splat_radius = 0.0f;
+    if (render_mode == GL_POINTS && !vertices.empty()) {
+        std::shuffle(vertices.begin(), vertices.end(), std::mt19937(42));
+        // Assume the points sample a surface about as large as their bounding box' surface
+        glm::vec3 min_corner = vertices[0].position, max_corner = vertices[0].position;
+        for (const auto &v : vertices) {
+            min_corner = glm::min(min_corner, v.position);
+            max_corner = glm::max(max_corner, v.position);
+        }
+        auto extent = max_corner - min_corner;
+        auto area = 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+        snapshot.splat_radius = 0.5f * std::sqrt(area / vertices.size());
+    } else if (render_mode == GL_TRIANGLES) {
+        snapshot.clusters.build(vertices);
     }
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glGenVertexArrays(1, &snapshot.VAO);
+    glGenBuffers(1, &snapshot.VBO);
+    glBindVertexArray(snapshot.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, snapshot.VBO);
 
     glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), nullptr);
@@ -1064,7 +1133,27 @@ auto PipelineModule::setup_render(std::vector<Vertex> vertices, GLuint render_mo
     glEnableVertexAttribArray(3);
     glBindVertexArray(GL_NONE);
     
-    this->render_mode = render_mode;
-    num_vertices = (int) vertices.size();
+    render_snapshots.push_back(snapshot);
+}
+
+auto PipelineModule::clear_snapshots() -> void {
+    for (auto &snapshot : render_snapshots) {
+        glDeleteVertexArrays(1, &snapshot.VAO);
+        glDeleteBuffers(1, &snapshot.VBO);
+        if (snapshot.texture != GL_NONE) {
+            glDeleteTextures(1, &snapshot.texture);
+        }
+        snapshot.clusters.destroy();
+    }
+    render_snapshots.clear();
+}
+
+auto PipelineModule::destroy() -> bool {
+    clear_snapshots();
+    splat_target.destroy();
+    if (empty_VAO != GL_NONE) {
+        glDeleteVertexArrays(1, &empty_VAO);
+    }
+    return true;
 }
 
@@ -9,9 +9,13 @@
 #define Pipeline_hpp
 
 #define PIPELINE "管线"
+#define PIPELINE_MVG_PATH "/Users/apple/Projects/openMVG/build/Darwin-x86_64-DEBUG/"
+#define PIPELINE_MVS_PATH "/Users/apple/Projects/openMVS/build/bin/"
 
 #include "common.hpp"
 #include "Module.hpp"
+#include "Viewport.hpp"
+#include "Clusters.hpp"
 #include <vector>
 #include <chrono>
 #include <glad/glad.h>
@@ -131,6 +135,18 @@ private:
 };
 
 
+/// A loaded stage of the pipeline output. Earlier stages stay resident so they can be compared
+/// side by side with the current one.
+struct RenderSnapshot {
+    std::string name;
+    GLuint VAO, VBO;
+    int num_vertices;
+    GLuint render_mode;
+    GLuint texture;
+    float splat_radius; // World space, estimated from the point density
+    ClusteredMesh clusters; // Meshes only
+};
+
 /// Files to load when states change:
 /// 1. AFTER incremental SfM, we can load the initial PLY;
 /// 2. AFTER global SfM, we can simply load it again.
@@ -140,11 +156,9 @@ public:
     PipelineModule() : Module(PIPELINE),
         state(PipelineNS::State::ASKING_FOR_INPUT),
         image_listing(std::vector<std::string>()),
-        VAO(0), VBO(0), program(0), opengl_ready(false), time(0.0f), radius(5.0f),
-        horizontal_rotation_target(0.0f), horizontal_rotation(0.0f),
-        center(0.0f, 0.0f, 0.0f),
-        render_mode(GL_POINTS),
-        mesh_texture(GL_NONE) {
+        program(0), splat_program(0), edl_program(0), empty_VAO(0), opengl_ready(false), time(0.0f),
+        splatting(true), eye_dome_lighting(true), splat_scale(1.0f), edl_strength(1.0f), edl_radius(1.4f),
+        point_budget(1.0f), max_point_size(64.0f), occlusion_culling(true) {
             auto now = std::chrono::system_clock::now();
             auto time_t = std::chrono::system_clock::to_time_t(now);
             std::memset(session_name, 0, sizeof(session_name));
@@ -157,19 +171,32 @@ public:
     virtual auto update_ui() -> void override;
     
     virtual auto render() -> void override;
+    
+    virtual auto snapshots() -> std::vector<std::string> override;
+    
+    virtual auto render_snapshot(int index) -> void override;
+    
+    virtual auto destroy() -> bool override;
 
     virtual auto list_images(std::filesystem::path path) -> int;
     
 private:
     auto load_ply_as_pointcloud(std::string path) -> void;
     
-    auto load_colorized_ply_as_pointcloud(std::string path) -> void;
+    auto load_colorized_ply_as_pointcloud(std::string path, std::string name) -> void;
     
     auto load_ply_as_mesh(std::string path) -> void;
     
     auto load_ply_and_texture_map(std::string path, std::string texture_path) -> void;
     
-    auto setup_render(std::vector<Vertex> vertices, GLuint render_mode) -> void;
+    auto setup_render(std::vector<Vertex> vertices, GLuint render_mode, std::string name,
+                      GLuint texture = GL_NONE) -> void;
+    
+    auto draw(RenderSnapshot &snapshot) -> void;
+    
+    auto draw_splats(const RenderSnapshot &snapshot, int count) -> void;
+    
+    auto clear_snapshots() -> void;
 
     PipelineNS::PipelineState render_state;
     PipelineNS::State state;
@@ -180,14 +207,19 @@ private:
     
     // O P E N G L //////////////////////////////////
     bool opengl_ready;
-    int num_vertices;
-    GLuint VAO, VBO, program;
-    glm::vec3 eye, center;
-    glm::mat4 model_mat, view_mat, perspective_mat;
-    float time, radius, horizontal_rotation, horizontal_rotation_target;
-    GLuint render_mode;
+    GLuint program;
+    float time;
+    std::vector<RenderSnapshot> render_snapshots;
+    
+    // P O I N T   S P L A T T I N G ////////////////
+    GLuint splat_program, edl_program, empty_VAO;
+    Viewport splat_target;
+    bool splatting, eye_dome_lighting;
+    float splat_scale, edl_strength, edl_radius;
+    float point_budget; // Fraction of the points to draw
+    float max_point_size;
+    bool occlusion_culling;
     
-    GLuint mesh_texture;
     char session_name[512];
 };
 
@@ -0,0 +1,278 @@
+//
+//  Prefetch.cpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Prefetch.hpp"
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+using namespace OnlineNS;
+using namespace PrefetchNS;
+
+/// A hover only counts while it's recent; after that the record is as wanted as a selected one.
+static auto level(const Candidate &candidate, std::chrono::steady_clock::time_point now) -> Hint {
+    if (candidate.hint == Hint::HOVERED && now - candidate.hinted > std::chrono::seconds(PREFETCH_HOVER_SECONDS)) {
+        return Hint::SELECTED;
+    }
+    return candidate.hint;
+}
+
+/// Whether `a` is more wanted than `b`.
+static auto ahead(const Candidate &a, const Candidate &b, std::chrono::steady_clock::time_point now) -> bool {
+    auto level_a = level(a, now), level_b = level(b, now);
+    return level_a != level_b ? level_a > level_b : a.hinted > b.hinted;
+}
+
+Prefetcher::~Prefetcher() {
+    stop();
+}
+
+auto Prefetcher::start(const std::string &remote, int port, const std::string &username, const std::string &password) -> void {
+    stop();
+    this->remote = remote;
+    this->port = port;
+    this->username = username;
+    this->password = password;
+    stopping = false;
+    thread = std::thread([this] () {
+        run();
+    });
+}
+
+auto Prefetcher::stop() -> void {
+    candidates_mutex.lock();
+    stopping = true;
+    candidates_mutex.unlock();
+    wakeup.notify_all();
+    channel.close();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    channel.close();
+}
+
+auto Prefetcher::hint(const online::ReconRecord &record, Hint why) -> void {
+    std::unique_lock<std::mutex> lock(candidates_mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto &candidate = candidates[record.id()];
+    if (!candidate) {
+        candidate = std::make_shared<Candidate>();
+        candidate->record = record;
+        candidate->hint = why;
+    } else if (why <= level(*candidate, now) && now - candidate->hinted < std::chrono::seconds(PREFETCH_HOVER_SECONDS)) {
+        // The same hover every frame; nothing new to do
+        return;
+    } else {
+        candidate->hint = std::max(why, level(*candidate, now));
+        candidate->settled = false;
+        if (candidate->record.name() != record.name()) {
+            candidate->record = record;
+            candidate->probed = false;
+        }
+    }
+    candidate->hinted = now;
+    if (candidates.size() > PREFETCH_CANDIDATES) {
+        // Ordered by `ahead`, the largest is the least wanted
+        auto last = std::max_element(candidates.begin(), candidates.end(), [&] (const auto &a, const auto &b) {
+            return ahead(*a.second, *b.second, now);
+        });
+        candidates.erase(last);
+    }
+    lock.unlock();
+    wakeup.notify_all();
+}
+
+auto Prefetcher::info(int id, PrefetchInfo &info) -> bool {
+    std::lock_guard<std::mutex> lock(candidates_mutex);
+    auto it = candidates.find(id);
+    if (it == candidates.end() || !it->second->probed) {
+        return false;
+    }
+    const auto &candidate = *it->second;
+    info.hash = candidate.hash;
+    info.total = candidate.total;
+    info.fetched = candidate.fetched;
+    std::error_code error;
+    info.local = std::filesystem::exists(std::filesystem::path("recons") / (candidate.name + ".obj"), error);
+    return true;
+}
+
+auto Prefetcher::pick() -> std::shared_ptr<Candidate> {
+    std::unique_lock<std::mutex> lock(candidates_mutex);
+    std::shared_ptr<Candidate> best;
+    wakeup.wait(lock, [&] () {
+        auto now = std::chrono::steady_clock::now();
+        best.reset();
+        for (const auto &[id, candidate] : candidates) {
+            if (!candidate->settled && (!best || ahead(*candidate, *best, now))) {
+                best = candidate;
+            }
+        }
+        return stopping || best;
+    });
+    return stopping ? nullptr : best;
+}
+
+auto Prefetcher::connect() -> bool {
+    if (channel.connected()) {
+        return true;
+    }
+    if (!channel.open(remote, port)) {
+        return false;
+    }
+    if (!login(channel, username, password)) {
+        channel.close();
+        return false;
+    }
+    return true;
+}
+
+auto Prefetcher::run() -> void {
+    while (true) {
+        auto candidate = pick();
+        if (!candidate) {
+            return;
+        }
+        if (!connect()) {
+            // The server's away; try again in a while, or as soon as something new is hinted
+            std::unique_lock<std::mutex> lock(candidates_mutex);
+            wakeup.wait_for(lock, std::chrono::seconds(5), [this] () { return stopping; });
+            continue;
+        }
+        if (!candidate->probed) {
+            auto result = probe(*candidate);
+            if (result == Transfer::DROPPED) {
+                channel.close();
+            } else if (result == Transfer::REJECTED) {
+                candidates_mutex.lock();
+                candidate->settled = true;
+                candidates_mutex.unlock();
+            }
+            continue;
+        }
+
+        auto partial = partial_path(candidate->hash);
+        auto want = std::min<int64_t>(candidate->total, PREFETCH_RECORD_CAP);
+        auto lock = lock_partial(candidate->hash, false);
+        std::error_code error;
+        auto fetched = lock.owns_lock() && std::filesystem::exists(partial, error) ?
+            (int64_t) std::filesystem::file_size(partial, error) : 0;
+        auto local = std::filesystem::exists(std::filesystem::path("recons") / (candidate->name + ".obj"), error);
+        auto step = std::min<int64_t>(PREFETCH_STEP, want - fetched);
+        // Settled if a download has it, it's here already, it has enough, or there's no room
+        if (!lock.owns_lock() || local || step <= 0 || !make_room(candidate->hash, step)) {
+            candidates_mutex.lock();
+            candidate->fetched = fetched;
+            candidate->settled = true;
+            candidates_mutex.unlock();
+            continue;
+        }
+        TransferItem item(candidate->name, false, nullptr);
+        auto result = fetch_range(channel, candidate->record.id(), candidate->hash, fetched, step, item);
+        candidates_mutex.lock();
+        candidate->fetched = fetched + item.moved;
+        if (result == Transfer::DROPPED) {
+            // Maybe it changed on the server: the header is fetched again on reconnecting
+            candidate->probed = false;
+        }
+        candidates_mutex.unlock();
+        if (result == Transfer::DROPPED) {
+            channel.close();
+        }
+    }
+}
+
+auto Prefetcher::probe(Candidate &candidate) -> Transfer {
+    auto exchange = channel.request();
+    if (!exchange->send(make_request("download_range", std::to_string(candidate.record.id()), "0", "0"))) {
+        return Transfer::DROPPED;
+    }
+    auto header = exchange->receive<online::Request>();
+    if (!header.has_value()) {
+        return Transfer::DROPPED;
+    }
+    if (header->arg_size() != 5 + TRANSFER_FILES || header->arg(0) != "range") {
+        return Transfer::REJECTED;
+    }
+    int64_t total = 0;
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        total += std::atoll(header->arg(5 + i).c_str());
+    }
+    std::lock_guard<std::mutex> lock(candidates_mutex);
+    candidate.name = header->arg(1);
+    candidate.hash = header->arg(2);
+    candidate.total = total;
+    candidate.probed = true;
+    return Transfer::DONE;
+}
+
+auto Prefetcher::make_room(const std::string &hash, int64_t bytes) -> bool {
+    struct Partial {
+        std::filesystem::path path;
+        int64_t size;
+        std::filesystem::file_time_type modified;
+    };
+    std::vector<Partial> partials;
+    int64_t used = 0;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator("recons/.partial", error)) {
+        auto size = (int64_t) entry.file_size(error);
+        auto modified = entry.last_write_time(error);
+        if (!error) {
+            partials.push_back({ entry.path(), size, modified });
+            used += size;
+        }
+    }
+    if (used + bytes <= budget) {
+        return true;
+    }
+
+    // Anything at least as wanted as this record keeps its bytes
+    std::set<std::string> keep = { hash };
+    candidates_mutex.lock();
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<Candidate> current;
+    for (const auto &[id, candidate] : candidates) {
+        if (candidate->hash == hash) {
+            current = candidate;
+        }
+    }
+    for (const auto &[id, candidate] : candidates) {
+        if (current && candidate->probed && !ahead(*current, *candidate, now)) {
+            keep.insert(candidate->hash);
+        }
+    }
+    candidates_mutex.unlock();
+
+    std::sort(partials.begin(), partials.end(), [] (const auto &a, const auto &b) {
+        return a.modified < b.modified;
+    });
+    for (const auto &partial : partials) {
+        if (used + bytes <= budget) {
+            break;
+        }
+        auto name = partial.path.filename().string();
+        if (keep.count(name) > 0) {
+            continue;
+        }
+        // One a download is writing to isn't ours to drop
+        auto lock = lock_partial(name, false);
+        if (!lock.owns_lock() || !std::filesystem::remove(partial.path, error)) {
+            continue;
+        }
+        used -= partial.size;
+        candidates_mutex.lock();
+        for (auto &[id, candidate] : candidates) {
+            if (candidate->hash == name) {
+                candidate->fetched = 0;
+                candidate->settled = true;
+            }
+        }
+        candidates_mutex.unlock();
+    }
+    return used + bytes <= budget;
+}
@@ -0,0 +1,113 @@
+//
+//  Prefetch.hpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Prefetch_hpp
+#define Prefetch_hpp
+
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include "common.hpp"
+#include "online.pb.h"
+#include "Channel.hpp"
+#include "Transfers.hpp"
+
+#define PREFETCH "预取"
+#define PREFETCH_BUDGET_DEFAULT (256 << 20) // Bytes of recons/.partial prefetching may fill
+#define PREFETCH_RECORD_CAP (32 << 20) // Most bytes prefetched of any one record
+#define PREFETCH_STEP TRANSFER_CHUNK // Per request, so a download never waits on more than one
+#define PREFETCH_CANDIDATES 32 // Records remembered as worth prefetching, latest hints first
+#define PREFETCH_HOVER_SECONDS 5 // How long a hover outranks a selection
+#define PREFETCH_RECENT 4 // Newest records hinted from the first full listing
+
+namespace PrefetchNS {
+
+/// Why a record may be opened soon; later ones go first.
+enum class Hint {
+    RECENT = 0, // Published since the list was last refreshed
+    SELECTED = 1,
+    HOVERED = 2
+};
+
+/// A record worth fetching ahead, and what's known of it so far.
+struct Candidate {
+    online::ReconRecord record;
+    Hint hint;
+    std::chrono::steady_clock::time_point hinted;
+    bool probed = false; // The header below is filled in
+    std::string name; // File base, as a download would save it
+    std::string hash;
+    int64_t total = 0;
+    int64_t fetched = 0; // Into its partial file
+    bool settled = false; // Has all it's going to get, or can't get any more for now
+};
+
+};
+
+/// What the list shows of a record before anyone downloads it.
+struct PrefetchInfo {
+    std::string hash;
+    int64_t total = 0;
+    int64_t fetched = 0;
+    bool local = false; // Already in recons/
+};
+
+/// Pulls the header and the leading bytes of records the user is likely to open next into
+/// recons/.partial, where a download resumes from them. Works on a connection of its own, one
+/// PREFETCH_STEP at a time, and keeps the partial files under a disk budget by dropping the
+/// ones touched longest ago.
+class Prefetcher {
+public:
+    Prefetcher(int64_t budget = PREFETCH_BUDGET_DEFAULT) : budget(budget), port(0), stopping(false) {}
+
+    ~Prefetcher();
+
+    /// Logs in a connection of its own and starts working through hints.
+    auto start(const std::string &remote, int port, const std::string &username, const std::string &password) -> void;
+
+    auto stop() -> void;
+
+    /// Moves a record up the list, or onto it.
+    auto hint(const online::ReconRecord &record, PrefetchNS::Hint why) -> void;
+
+    /// False until the record's header has been fetched.
+    auto info(int id, PrefetchInfo &info) -> bool;
+
+private:
+    auto run() -> void;
+
+    /// The candidate to work on next, if any.
+    auto pick() -> std::shared_ptr<PrefetchNS::Candidate>;
+
+    auto connect() -> bool;
+
+    auto probe(PrefetchNS::Candidate &candidate) -> OnlineNS::Transfer;
+
+    /// Drops the oldest partial files of records that aren't more wanted than `hash` until
+    /// `bytes` more fit the budget.
+    auto make_room(const std::string &hash, int64_t bytes) -> bool;
+
+    int64_t budget;
+    std::string remote;
+    int port;
+    std::string username;
+    std::string password;
+    Channel channel;
+    std::thread thread;
+    std::mutex candidates_mutex; // Guards the candidates and stopping
+    std::condition_variable wakeup;
+    bool stopping;
+    std::map<int, std::shared_ptr<PrefetchNS::Candidate>> candidates; // By record id
+};
+
+#endif /* Prefetch_hpp */
@@ -0,0 +1,254 @@
+//
+//  Preview.cpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Preview.hpp"
+#include <thread>
+#include <cstring>
+#include <stb_image.h>
+#include <glm/gtc/type_ptr.hpp>
+#include "Protocol.hpp"
+#include "Transfers.hpp"
+
+using namespace PreviewNS;
+
+/// A level as a flat triangle list around the bounding box's center. Until the texture is
+/// there, faces are shaded by which way they point, so the shape reads on its own.
+static auto decode_level(const std::string &bytes, glm::vec3 min, glm::vec3 max, std::vector<Vertex> &vertices) -> bool {
+    uint32_t vertex_count = 0, triangle_count = 0;
+    if (bytes.size() < sizeof(uint32_t) * 2) {
+        return false;
+    }
+    std::memcpy(&vertex_count, bytes.data(), sizeof(uint32_t));
+    std::memcpy(&triangle_count, bytes.data() + sizeof(uint32_t), sizeof(uint32_t));
+    auto positions_at = sizeof(uint32_t) * 2;
+    auto triangles_at = positions_at + (size_t) vertex_count * 3 * sizeof(uint16_t);
+    auto triangle_size = 3 * sizeof(uint32_t) + 6 * sizeof(uint16_t);
+    if (bytes.size() != triangles_at + (size_t) triangle_count * triangle_size) {
+        return false;
+    }
+
+    auto center = (min + max) * 0.5f;
+    auto scale = (max - min) / PROGRESSIVE_QUANTA;
+    std::vector<glm::vec3> positions(vertex_count);
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        uint16_t quanta[3];
+        std::memcpy(quanta, bytes.data() + positions_at + i * sizeof(quanta), sizeof(quanta));
+        positions[i] = min + glm::vec3(quanta[0], quanta[1], quanta[2]) * scale - center;
+    }
+    const auto light = glm::normalize(glm::vec3(0.4f, 0.8f, 0.6f));
+    vertices.clear();
+    vertices.reserve((size_t) triangle_count * 3);
+    for (uint32_t i = 0; i < triangle_count; i++) {
+        const auto *at = bytes.data() + triangles_at + i * triangle_size;
+        uint32_t corners[3];
+        uint16_t uvs[6];
+        std::memcpy(corners, at, sizeof(corners));
+        std::memcpy(uvs, at + sizeof(corners), sizeof(uvs));
+        if (corners[0] >= vertex_count || corners[1] >= vertex_count || corners[2] >= vertex_count) {
+            return false;
+        }
+        const auto &a = positions[corners[0]], &b = positions[corners[1]], &c = positions[corners[2]];
+        auto normal = glm::cross(b - a, c - a);
+        normal = glm::length(normal) > 0.0f ? glm::normalize(normal) : glm::vec3(0.0f, 0.0f, 1.0f);
+        auto color = glm::vec3(0.35f + 0.55f * std::max(glm::dot(normal, light), 0.0f));
+        for (auto corner = 0; corner < 3; corner++) {
+            vertices.push_back({ positions[corners[corner]], normal,
+                glm::vec2(uvs[corner * 2], uvs[corner * 2 + 1]) / PROGRESSIVE_QUANTA, color });
+        }
+    }
+    return true;
+}
+
+/// Fetches the levels and then the texture, handing each over as soon as it's decoded.
+static auto fetch_preview(Channel &channel, int id, std::shared_ptr<Pending> pending) -> bool {
+    auto exchange = channel.request();
+    if (!exchange->send(make_request("progressive", std::to_string(id)))) {
+        return false;
+    }
+    auto header = exchange->receive<online::Request>();
+    if (!header.has_value() || header->arg_size() != 11 || header->arg(0) != "progressive") {
+        return false;
+    }
+    auto hash = header->arg(1);
+    auto levels = std::atoi(header->arg(2).c_str());
+    glm::vec3 min(std::atof(header->arg(3).c_str()), std::atof(header->arg(4).c_str()), std::atof(header->arg(5).c_str()));
+    glm::vec3 max(std::atof(header->arg(6).c_str()), std::atof(header->arg(7).c_str()), std::atof(header->arg(8).c_str()));
+    auto texture_offset = header->arg(9);
+    auto texture_bytes = std::atoll(header->arg(10).c_str());
+    pending->pending_mutex.lock();
+    pending->levels = levels;
+    pending->radius = glm::length(max - min) * 0.5f;
+    pending->pending_mutex.unlock();
+
+    std::string bytes;
+    std::vector<Vertex> vertices;
+    for (auto level = 0; level < levels; level++) {
+        if (!exchange->receive_bytes(bytes) || !decode_level(bytes, min, max, vertices)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(pending->pending_mutex);
+        if (pending->cancelled) {
+            // Whatever the server still sends for this exchange is dropped once it's gone
+            return true;
+        }
+        pending->mesh = std::move(vertices);
+        pending->received = level + 1;
+        pending->bytes += bytes.size();
+    }
+    if (texture_bytes <= 0) {
+        return true;
+    }
+
+    // The .png is the record's last file: a range of it, checked like any download
+    exchange = channel.request();
+    if (!exchange->send(make_request("download_range", std::to_string(id), texture_offset, std::to_string(texture_bytes)))) {
+        return false;
+    }
+    header = exchange->receive<online::Request>();
+    if (!header.has_value() || header->arg_size() != 5 + TRANSFER_FILES || header->arg(2) != hash) {
+        // Overwritten since the levels were sent; they're still a fair preview
+        return true;
+    }
+    std::string png, chunk;
+    auto left = std::atoll(header->arg(4).c_str());
+    while (left > 0) {
+        if (!receive_checked_chunk(*exchange, chunk)) {
+            return false;
+        }
+        png += chunk;
+        left -= chunk.size();
+        std::lock_guard<std::mutex> lock(pending->pending_mutex);
+        if (pending->cancelled) {
+            return true;
+        }
+        pending->bytes += chunk.size();
+    }
+    stbi_set_flip_vertically_on_load(true);
+    int width, height, channels;
+    auto *data = stbi_load_from_memory((const unsigned char *) png.data(), (int) png.size(), &width, &height, &channels, 3);
+    if (!data) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(pending->pending_mutex);
+    pending->pixels.assign(data, data + (size_t) width * height * 3);
+    pending->width = width;
+    pending->height = height;
+    stbi_image_free(data);
+    return true;
+}
+
+auto RemotePreview::start(Channel &channel, const online::ReconRecord &record) -> void {
+    stop();
+    name = record.name();
+    if (texture != GL_NONE) {
+        glDeleteTextures(1, &texture);
+        texture = GL_NONE;
+    }
+    pending = std::make_shared<Pending>();
+    std::thread thread([&channel, id = record.id(), pending = pending] () {
+        if (!fetch_preview(channel, id, pending)) {
+            pending->pending_mutex.lock();
+            pending->failed = true;
+            pending->pending_mutex.unlock();
+            mutex().lock();
+            RECON_LOG(PREVIEW) << "获取预览失败。";
+            mutex().unlock();
+        }
+    });
+    thread.detach();
+}
+
+auto RemotePreview::stop() -> void {
+    if (pending) {
+        pending->pending_mutex.lock();
+        pending->cancelled = true;
+        pending->pending_mutex.unlock();
+        pending.reset();
+    }
+    name.clear();
+    num_vertices = 0;
+}
+
+auto RemotePreview::update(Camera &camera) -> bool {
+    if (!pending) {
+        return false;
+    }
+    std::optional<std::vector<Vertex>> mesh;
+    std::vector<unsigned char> pixels;
+    int width = 0, height = 0;
+    float radius;
+    pending->pending_mutex.lock();
+    mesh.swap(pending->mesh);
+    pixels.swap(pending->pixels);
+    width = pending->width;
+    height = pending->height;
+    radius = pending->radius;
+    pending->pending_mutex.unlock();
+
+    if (mesh.has_value() && !mesh->empty()) {
+        if (program == 0) {
+            program = shared_program("shaders/vertex.glsl", "shaders/fragment.glsl");
+        }
+        if (num_vertices == 0) {
+            // The first level of this record; frame it
+            camera.radius = std::max(camera.radius, radius);
+            camera.eye = glm::vec3(0.0f, 0.0f, camera.radius);
+        }
+        if (VAO == 0) {
+            glGenVertexArrays(1, &VAO);
+            glGenBuffers(1, &VBO);
+            glBindVertexArray(VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, VBO);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), nullptr);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void *) (sizeof(float) * 3));
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void *) (sizeof(float) * 6));
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void *) (sizeof(float) * 8));
+            glEnableVertexAttribArray(0);
+            glEnableVertexAttribArray(1);
+            glEnableVertexAttribArray(2);
+            glEnableVertexAttribArray(3);
+            glBindVertexArray(GL_NONE);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * mesh->size(), mesh->data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, GL_NONE);
+        num_vertices = (int) mesh->size();
+    }
+    if (!pixels.empty()) {
+        texture = make_texture(pixels.data(), width, height);
+    }
+    return num_vertices > 0;
+}
+
+auto RemotePreview::render(const Camera &camera, glm::ivec2 viewport_size) -> void {
+    if (num_vertices == 0) {
+        return;
+    }
+    glUseProgram(program);
+    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(camera.model()));
+    glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(camera.view()));
+    glUniformMatrix4fv(glGetUniformLocation(program, "perspective"), 1, GL_FALSE, glm::value_ptr(camera.perspective(viewport_size)));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1i(glGetUniformLocation(program, "use_texture"), texture != GL_NONE);
+    glBindVertexArray(VAO);
+    glDrawArrays(GL_TRIANGLES, 0, num_vertices);
+    glBindVertexArray(GL_NONE);
+}
+
+auto RemotePreview::status() -> std::string {
+    if (!pending) {
+        return "";
+    }
+    std::lock_guard<std::mutex> lock(pending->pending_mutex);
+    if (pending->failed) {
+        return "获取失败";
+    }
+    return std::to_string(pending->received) + " / " + std::to_string(pending->levels) + " 级，" +
+        std::to_string(pending->bytes / 1024) + " KB";
+}
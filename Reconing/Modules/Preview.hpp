@@ -0,0 +1,74 @@
+//
+//  Preview.hpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Preview_hpp
+#define Preview_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <cstdint>
+#include "common.hpp"
+#include "Module.hpp"
+#include "online.pb.h"
+#include "Channel.hpp"
+
+#define PREVIEW "预览"
+
+namespace PreviewNS {
+
+/// Handed from the thread fetching a preview to the one drawing it. Every preview gets its own,
+/// so a fetch still running for an earlier record never touches the current one.
+struct Pending {
+    std::mutex pending_mutex;
+    bool cancelled = false;
+    bool failed = false;
+    int levels = 0; // Announced by the server
+    int received = 0; // Levels decoded so far
+    int64_t bytes = 0; // Received so far, levels and texture
+    float radius = 0.0f; // Of the bounding box, around its center
+    std::optional<std::vector<Vertex>> mesh; // The finest level not drawn yet
+    std::vector<unsigned char> pixels; // RGB, not uploaded yet
+    int width = 0, height = 0;
+};
+
+};
+
+/// Shows a server record before it's downloaded, from its progressive levels: the coarsest
+/// arrives in the first few KB and is drawn straight away, and each finer one replaces it as it
+/// comes in. The texture follows the levels.
+class RemotePreview {
+public:
+    RemotePreview() : VAO(0), VBO(0), program(0), texture(GL_NONE), num_vertices(0) {}
+
+    /// Starts fetching `record` on an exchange of `channel`, dropping whatever was shown before.
+    auto start(Channel &channel, const online::ReconRecord &record) -> void;
+
+    auto stop() -> void;
+
+    /// On the GL thread: uploads whatever arrived since. True while there is something to draw.
+    auto update(Camera &camera) -> bool;
+
+    auto render(const Camera &camera, glm::ivec2 viewport_size) -> void;
+
+    /// E.g. "3 / 5 级，412 KB".
+    auto status() -> std::string;
+
+    std::string name; // Of the record shown
+
+private:
+    std::shared_ptr<PreviewNS::Pending> pending;
+
+    // O P E N G L /////////////////////////////////////////
+    GLuint VAO, VBO, program;
+    GLuint texture;
+    int num_vertices;
+};
+
+#endif /* Preview_hpp */
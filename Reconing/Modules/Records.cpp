@@ -7,9 +7,6 @@
 
 #include "Records.hpp"
 #include <imgui.h>
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <tiny_obj_loader.h>
-#include <stb_image.h>
 
 
 auto RecordsModule::update_ui() -> void {
@@ -50,156 +47,43 @@ auto RecordsModule::update_ui() -> void {
     } else if (records.size() <= 0) {
         ImGui::TextWrapped("现在还没有重建记录。");
     }
+    if (gl_ready) {
+        ImGui::Checkbox("遮挡剔除", &occlusion_culling);
+        ImGui::Text("绘制簇：%d / %d", clusters.drawn, (int) clusters.clusters.size());
+    }
     ImGui::End();
 }
 
 auto RecordsModule::update(float delta_time) -> bool {
-    if (!gl_ready) {
-        return false;
-    }
-    float horizontal_rotation_delta = horizontal_rotation_target - horizontal_rotation;
-    horizontal_rotation += (horizontal_rotation_delta * delta_time) * 10.0f;
-
-    model_mat = glm::mat4(1.0f);
-    model_mat = glm::rotate(model_mat, glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    model_mat = glm::rotate(model_mat, glm::radians(horizontal_rotation * 180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    view_mat = glm::lookAt(glm::vec3(0.0f, 0.0f, radius), center, glm::vec3(0.0f, 1.0f, 0.0f));
-
-    if (glfwGetKey(window, GLFW_KEY_A)) {
-        horizontal_rotation_target -= glm::radians(delta_time * 180.0f);
-    }
-    if (glfwGetKey(window, GLFW_KEY_D)) {
-        horizontal_rotation_target += glm::radians(delta_time * 180.0f);
-    }
-    if (glfwGetKey(window, GLFW_KEY_S)) {
-        radius += delta_time * 5.0f;
-    }
-    if (glfwGetKey(window, GLFW_KEY_W)) {
-        radius -= delta_time * 5.0f;
-    }
-    
-    const auto front = glm::normalize(center - eye);
-    const auto right = glm::cross(front, glm::vec3(0.0f, 1.0f, 0.0f));
-    if (glfwGetKey(window, GLFW_KEY_LEFT)) {
-        center -= right * delta_time;
-    }
-    if (glfwGetKey(window, GLFW_KEY_RIGHT)) {
-        center += right * delta_time;
-    }
-    if (glfwGetKey(window, GLFW_KEY_UP)) {
-        center += glm::vec3(0.0f, 1.0f, 0.0f) * delta_time;
-    }
-    if (glfwGetKey(window, GLFW_KEY_DOWN)) {
-        center -= glm::vec3(0.0f, 1.0f, 0.0f) * delta_time;
-    }
-    return true;
+    return gl_ready;
 }
 
 auto RecordsModule::load_record() -> bool {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn, err;
-    
     if (!gl_ready) {
         // Is this the first time?
-        program = link(compile(GL_VERTEX_SHADER, "shaders/vertex.glsl"),
-                       compile(GL_FRAGMENT_SHADER, "shaders/fragment.glsl"));
-        eye = glm::vec3(0.0f, 0.0f, 5.0f);
-        center = glm::vec3(0.0f);
-        perspective_mat = glm::perspective(glm::radians(45.0f), (float) window_size.x / window_size.y, 0.01f, 200.0f);
-        view_mat = glm::lookAt(glm::vec3(0.0f, 0.0f, 5.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        program = shared_program("shaders/vertex.glsl", "shaders/fragment.glsl");
     }
     
     std::filesystem::path obj_path = std::string("recons/") + records[current_selected_index].obj_file;
-    auto ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
-                                obj_path.c_str(),
-                                obj_path.parent_path().c_str());
-    if (!ret) {
-        RECON_LOG(RECORDS) << "obj 模型加载失败。警告：" << warn << "，错误：" << err;
-        return false;
-    }
-    RECON_LOG(RECORDS) << "加载完毕。面：" << shapes.size();
     std::vector<Vertex> vertices;
-    for (auto i = 0; i < shapes.size(); i++) {
-        for (auto f = 0; f < shapes[i].mesh.indices.size() / 3; f++) {
-            auto idx0 = shapes[i].mesh.indices[3 * f + 0];
-            auto idx1 = shapes[i].mesh.indices[3 * f + 1];
-            auto idx2 = shapes[i].mesh.indices[3 * f + 2];
-            
-            Vertex v0, v1, v2;
-            v0 = Vertex {
-                { attrib.vertices[3 * idx0.vertex_index + 0],
-                    attrib.vertices[3 * idx0.vertex_index + 1] ,
-                    attrib.vertices[3 * idx0.vertex_index + 2] },
-                { 0.0f, 0.0f, 0.0f }, // There aren't normals
-                { attrib.texcoords[2 * idx0.texcoord_index + 0],
-                    attrib.texcoords[2 * idx0.texcoord_index + 1] },
-                { 1.0f, 0.0f, 0.0f }
-            };
-            v1 = Vertex {
-                { attrib.vertices[3 * idx1.vertex_index + 0],
-                    attrib.vertices[3 * idx1.vertex_index + 1],
-                    attrib.vertices[3 * idx1.vertex_index + 2] },
-                { 0.0f, 0.0f, 0.0f }, // There aren't normals
-                { attrib.texcoords[2 * idx1.texcoord_index + 0],
-                    attrib.texcoords[2 * idx1.texcoord_index + 1] },
-                { 1.0f, 0.0f, 0.0f }
-            };
-            v2 = Vertex {
-                { attrib.vertices[3 * idx2.vertex_index + 0],
-                    attrib.vertices[3 * idx2.vertex_index + 1],
-                    attrib.vertices[3 * idx2.vertex_index + 2] },
-                { 0.0f, 0.0f, 0.0f }, // There aren't normals
-                { attrib.texcoords[2 * idx2.texcoord_index + 0],
-                    attrib.texcoords[2 * idx2.texcoord_index + 1] },
-                { 1.0f, 0.0f, 0.0f }
-            };
-            vertices.push_back(v0);
-            vertices.push_back(v1);
-            vertices.push_back(v2);
-        }
-    }
-    glm::vec3 center_of_gravity(0.0f);
-    for (const auto &v : vertices) {
-        center_of_gravity += v.position;
-    }
-    center_of_gravity /= vertices.size();
-    for (auto &v : vertices) {
-        v.position -= center_of_gravity;
-        float len = glm::length(v.position);
-        if (len > radius) {
-            radius = len;
-        }
-    }
-    eye = glm::vec3(0.0f, 0.0f, radius);
-    
-    if (materials.size() != 1) {
-        RECON_LOG(RECORDS) << "材质数量错误。";
+    std::string texture_path;
+    if (!load_obj(obj_path, vertices, texture_path)) {
         return false;
     }
+    RECON_LOG(RECORDS) << "加载完毕。面：" << vertices.size() / 3;
+    camera->radius = std::max(camera->radius, center_vertices(vertices));
+    camera->eye = glm::vec3(0.0f, 0.0f, camera->radius);
     
     if (mesh_texture != GL_NONE) {
         glDeleteTextures(1, &mesh_texture);
     }
-    glGenTextures(1, &mesh_texture);
-    glBindTexture(GL_TEXTURE_2D, mesh_texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    stbi_set_flip_vertically_on_load(true);
-    int width, height, channels;
-    std::string path = (obj_path.parent_path() / materials[0].diffuse_texname).string();
-    auto *data = stbi_load(path.c_str(), &width, &height, &channels, 0);
-    if (!data) {
-        RECON_LOG(RECORDS) << "加载材质失败：" << path << " 未找到或无权限";
+    mesh_texture = load_texture(texture_path);
+    if (mesh_texture == GL_NONE) {
+        RECON_LOG(RECORDS) << "加载材质失败：" << texture_path << " 未找到或无权限";
         return false;
     }
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    stbi_image_free(data);
-    glBindTexture(GL_TEXTURE_2D, GL_NONE);
     
+    clusters.build(vertices);
     setup_render(vertices);
     gl_ready = true;
     return true;
@@ -210,17 +94,15 @@ auto RecordsModule::render() -> void {
         return;
     }
     glUseProgram(program);
-    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(model_mat));
-    glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(view_mat));
-    glUniformMatrix4fv(glGetUniformLocation(program, "perspective"), 1, GL_FALSE, glm::value_ptr(perspective_mat));
-    if (mesh_texture != GL_NONE) {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, mesh_texture);
-        glUniform1i(glGetUniformLocation(program, "tex"), 0);
-        glUniform1i(glGetUniformLocation(program, "use_texture"), 1);
-    }
+    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(camera->model()));
+    glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(camera->view()));
+    glUniformMatrix4fv(glGetUniformLocation(program, "perspective"), 1, GL_FALSE, glm::value_ptr(camera->perspective(viewport_size)));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, mesh_texture);
+    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1i(glGetUniformLocation(program, "use_texture"), mesh_texture != GL_NONE);
     glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, num_vertices);
+    clusters.draw(camera->model(), camera->view(), camera->perspective(viewport_size), occlusion_culling);
     glBindVertexArray(GL_NONE);
 }
 
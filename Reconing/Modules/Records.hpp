@@ -10,6 +10,7 @@
 
 #include "common.hpp"
 #include "Module.hpp"
+#include "Clusters.hpp"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -20,8 +21,7 @@ class RecordsModule : public Module {
 public:
     RecordsModule() : Module(RECORDS), gl_ready(false),
         mesh_texture(GL_NONE),
-        current_selected_index(0),
-        horizontal_rotation_target(0.0f), horizontal_rotation(0.0f) {
+        current_selected_index(0), VAO(0), VBO(0), occlusion_culling(true) {
         mkdir_if_not_exists("recons");
         records = read_recon_records("recons/records.bin");
     }
@@ -43,11 +43,10 @@ private:
     // O P E N G L /////////////////////////////////////////
     bool gl_ready;
     GLuint VAO, VBO, program;
-    glm::vec3 eye, center;
-    glm::mat4 model_mat, view_mat, perspective_mat;
-    float time, radius, horizontal_rotation, horizontal_rotation_target;
     GLuint mesh_texture;
     int num_vertices;
+    ClusteredMesh clusters;
+    bool occlusion_culling;
 };
 
 #endif /* Records_hpp */
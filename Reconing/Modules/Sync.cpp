@@ -0,0 +1,527 @@
+//
+//  Sync.cpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Sync.hpp"
+#include <set>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <functional>
+
+using namespace OnlineNS;
+using namespace SyncNS;
+
+static auto short_hash(const std::string &hash) -> std::string {
+    return hash.substr(0, SYNC_SHORT_HASH);
+}
+
+/// The .obj path under recons/ without its extension.
+static auto local_stem(const ReconRecord &record) -> std::string {
+    return std::filesystem::path(record.obj_file).replace_extension("").generic_string();
+}
+
+SyncEngine::~SyncEngine() {
+    stop();
+}
+
+auto SyncEngine::parse_options(int argc, const char *argv[], SyncOptions &options) -> bool {
+    auto ok = true;
+    for (auto i = 2; i < argc && ok; i++) {
+        std::string arg = argv[i];
+        auto has_value = i + 1 < argc;
+        if (arg == "--user" && has_value) {
+            options.username = argv[++i];
+        } else if (arg == "--password" && has_value) {
+            options.password = argv[++i];
+        } else if (arg == "--remote" && has_value) {
+            options.remote = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--limit" && has_value) {
+            options.limit = std::atoll(argv[++i]) * 1024;
+        } else if (arg == "--interval" && has_value) {
+            options.interval = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--once") {
+            options.once = true;
+        } else {
+            std::cerr << "未知参数：" << arg << std::endl;
+            ok = false;
+        }
+    }
+    if (!ok || options.username.empty() || options.password.empty()) {
+        std::cerr << "用法：Reconing --sync --user <账户名> --password <密码> [--remote 服务器地址] [--port 端口]"
+            " [--limit 限速 KB/s] [--interval 同步间隔秒数] [--once]" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+auto SyncEngine::run() -> int {
+    while (true) {
+        auto result = settle();
+        std::cout << "sync " << result.uploaded << " " << result.downloaded << " " << result.conflicts << " "
+            << result.failed << std::endl;
+        if (options.once) {
+            if (!result.connected || result.failed > 0) {
+                std::cerr << get_log().str() << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+        std::unique_lock<std::mutex> lock(status_mutex);
+        wakeup.wait_for(lock, std::chrono::seconds(options.interval), [this] () { return stopping; });
+        if (stopping) {
+            return 0;
+        }
+    }
+}
+
+auto SyncEngine::start() -> void {
+    if (active) {
+        return;
+    }
+    stopping = false;
+    active = true;
+    thread = std::thread([this] () {
+        while (true) {
+            settle();
+            std::unique_lock<std::mutex> lock(status_mutex);
+            wakeup.wait_for(lock, std::chrono::seconds(options.interval), [this] () { return stopping; });
+            if (stopping) {
+                break;
+            }
+        }
+        active = false;
+    });
+}
+
+auto SyncEngine::stop() -> void {
+    status_mutex.lock();
+    stopping = true;
+    status_mutex.unlock();
+    wakeup.notify_all();
+    // Fails whatever transfer is under way; it resumes from its partial file next time
+    channel.close();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    channel.close();
+}
+
+auto SyncEngine::set_limit(int64_t bytes_per_second) -> void {
+    limiter.set_rate(bytes_per_second);
+}
+
+auto SyncEngine::status(float &progress) -> std::string {
+    std::lock_guard<std::mutex> lock(status_mutex);
+    if (current) {
+        progress = current->progress();
+        return std::string(current->upload ? "正在上传 " : "正在下载 ") + current->name;
+    }
+    progress = -1.0f;
+    return status_line;
+}
+
+auto SyncEngine::report(const std::string &line) -> void {
+    status_mutex.lock();
+    status_line = line;
+    status_mutex.unlock();
+    mutex().lock();
+    RECON_LOG(SYNC) << line;
+    mutex().unlock();
+}
+
+auto SyncEngine::own(const std::string &key) const -> bool {
+    return key.rfind(options.username + "/", 0) == 0;
+}
+
+// P A S S E S ////////////////////////////////////////////////
+
+auto SyncEngine::settle() -> PassResult {
+    PassResult total;
+    // A conflict leaves a copy under a new name behind, which the next pass sends on
+    for (auto i = 0; i < 3; i++) {
+        auto result = pass();
+        total.connected = result.connected;
+        total.uploaded += result.uploaded;
+        total.downloaded += result.downloaded;
+        total.conflicts += result.conflicts;
+        total.failed += result.failed;
+        if (!result.connected || result.conflicts == 0) {
+            break;
+        }
+    }
+    if (total.connected) {
+        report("同步完成：上传 " + std::to_string(total.uploaded) + " 项，下载 " + std::to_string(total.downloaded) +
+               " 项，冲突 " + std::to_string(total.conflicts) + " 项，失败 " + std::to_string(total.failed) + " 项。");
+    }
+    return total;
+}
+
+auto SyncEngine::pass() -> PassResult {
+    PassResult result;
+    if (!connect()) {
+        report("无法连接服务器，稍后重试。");
+        return result;
+    }
+    auto local = scan_local();
+    // The user's own records, and those of anyone whose records are kept here; nobody else's matter
+    std::set<std::string> owners { options.username };
+    for (const auto &[key, copy] : local) {
+        auto slash = key.find('/');
+        if (slash != std::string::npos) {
+            owners.insert(key.substr(0, slash));
+        }
+    }
+    std::map<std::string, online::ReconRecord> remote;
+    std::map<std::string, std::string> remote_hashes;
+    if (!list_remote(owners, remote, remote_hashes)) {
+        channel.close();
+        report("获取服务端记录失败，稍后重试。");
+        return result;
+    }
+    result.connected = true;
+    auto base = read_base();
+
+    std::set<std::string> keys;
+    for (const auto &[key, copy] : local) {
+        keys.insert(key);
+    }
+    for (const auto &[key, hash] : remote_hashes) {
+        keys.insert(key);
+    }
+    for (const auto &key : keys) {
+        status_mutex.lock();
+        auto stopped = stopping;
+        status_mutex.unlock();
+        if (stopped) {
+            break;
+        }
+        auto l = local.find(key);
+        auto r = remote_hashes.find(key);
+        auto b = base.find(key);
+        auto local_hash = l != local.end() ? l->second->plan.hash : "";
+        auto remote_hash = r != remote_hashes.end() ? r->second : "";
+        auto base_hash = b != base.end() ? b->second : "";
+        if (local_hash == remote_hash) {
+            base[key] = local_hash;
+            continue;
+        }
+
+        auto outcome = Transfer::DONE;
+        std::string agreed;
+        if (remote_hash.empty()) {
+            // Only ever here; nobody else's can be published under their name
+            if (!own(key)) {
+                continue;
+            }
+            outcome = upload(key, *l->second);
+            agreed = local_hash;
+            result.uploaded += outcome == Transfer::DONE;
+        } else if (local_hash.empty()) {
+            // Someone else's only comes down once it's listed here, and a deleted one stays deleted
+            if (!own(key) || base_hash == remote_hash) {
+                continue;
+            }
+            outcome = download(remote[key], key);
+            agreed = remote_hash;
+            result.downloaded += outcome == Transfer::DONE;
+        } else if (base_hash == remote_hash) {
+            // Changed here only
+            if (!own(key)) {
+                continue;
+            }
+            outcome = upload(key, *l->second);
+            agreed = local_hash;
+            result.uploaded += outcome == Transfer::DONE;
+        } else if (base_hash == local_hash) {
+            // Changed there only
+            outcome = download(remote[key], local_stem(l->second->record));
+            agreed = remote_hash;
+            result.downloaded += outcome == Transfer::DONE;
+        } else {
+            result.conflicts++;
+            auto stem = local_stem(l->second->record);
+            if (own(key) && local_hash < remote_hash) {
+                // Ours keeps the name; the server's comes down beside it and goes back up as a copy
+                auto aside = stem + "~" + short_hash(remote_hash);
+                outcome = download(remote[key], aside);
+                if (outcome == Transfer::DONE) {
+                    relink_record(std::filesystem::path("recons") / aside, std::filesystem::path(stem).filename().string());
+                    outcome = upload(key, *l->second);
+                }
+                agreed = local_hash;
+            } else {
+                outcome = set_aside(*l->second) ? download(remote[key], stem) : Transfer::REJECTED;
+                agreed = remote_hash;
+            }
+            mutex().lock();
+            RECON_LOG(SYNC) << "同步冲突：" << key << "，保留内容哈希较小的 " << short_hash(agreed) << " 为原名。";
+            mutex().unlock();
+        }
+        if (outcome != Transfer::DONE) {
+            result.failed++;
+            if (outcome == Transfer::DROPPED) {
+                // Everything else waits for the next pass, which resumes this one
+                channel.close();
+                break;
+            }
+            continue;
+        }
+        base[key] = agreed;
+        write_base(base);
+    }
+    write_base(base);
+    return result;
+}
+
+auto SyncEngine::connect() -> bool {
+    if (channel.connected()) {
+        return true;
+    }
+    status_mutex.lock();
+    auto stopped = stopping;
+    status_mutex.unlock();
+    if (stopped || !channel.open(options.remote, options.port)) {
+        return false;
+    }
+    if (!login(channel, options.username, options.password)) {
+        channel.close();
+        mutex().lock();
+        RECON_LOG(SYNC) << "同步登陆失败：" << options.username;
+        mutex().unlock();
+        return false;
+    }
+    return true;
+}
+
+auto SyncEngine::list_remote(const std::set<std::string> &owners, std::map<std::string, online::ReconRecord> &remote,
+                             std::map<std::string, std::string> &hashes) -> bool {
+    std::vector<const online::ReconRecord *> listed;
+    for (const auto &owner : owners) {
+        std::string cursor;
+        do {
+            auto exchange = channel.request();
+            if (!exchange->send(make_request("list", "0", cursor, std::to_string(SYNC_LIST_PAGE), owner, ""))) {
+                return false;
+            }
+            auto page = exchange->receive<online::Request>();
+            auto records = exchange->receive<online::ReconRecords>();
+            if (!page.has_value() || page->arg_size() != 3 || page->arg(0) != "page" || !records.has_value()) {
+                return false;
+            }
+            cursor = page->arg(2);
+            for (const auto &record : records->records()) {
+                remote[record.name()] = record;
+            }
+        } while (!cursor.empty());
+    }
+    for (const auto &[name, record] : remote) {
+        listed.push_back(&record);
+    }
+
+    for (size_t i = 0; i < listed.size(); i += SYNC_HASH_BATCH) {
+        auto count = std::min<size_t>(SYNC_HASH_BATCH, listed.size() - i);
+        online::Request request;
+        request.add_arg("hashes");
+        for (size_t j = 0; j < count; j++) {
+            request.add_arg(std::to_string(listed[i + j]->id()));
+        }
+        auto exchange = channel.request();
+        if (!exchange->send(request)) {
+            return false;
+        }
+        auto response = exchange->receive<online::Request>();
+        if (!response.has_value() || response->arg_size() != 1 + 2 * (int) count || response->arg(0) != "hashes") {
+            mutex().lock();
+            RECON_LOG(SYNC) << "服务端不支持内容哈希查询。";
+            mutex().unlock();
+            return false;
+        }
+        for (size_t j = 0; j < count; j++) {
+            const auto &hash = response->arg(1 + 2 * (int) j);
+            if (!hash.empty()) {
+                hashes[listed[i + j]->name()] = hash;
+            }
+        }
+    }
+    return true;
+}
+
+auto SyncEngine::scan_local() -> std::map<std::string, std::shared_ptr<LocalCopy>> {
+    mkdir_if_not_exists("recons");
+    mutex().lock();
+    auto records = read_recon_records("recons/records.bin");
+    mutex().unlock();
+    std::map<std::string, std::shared_ptr<LocalCopy>> local;
+    std::map<std::string, std::shared_ptr<LocalCopy>> still_hashed;
+    for (const auto &record : records) {
+        auto path = std::filesystem::path("recons") / record.obj_file;
+        std::filesystem::file_time_type modified;
+        auto readable = true;
+        for (auto i = 0; i < TRANSFER_FILES && readable; i++) {
+            std::error_code error;
+            auto time = std::filesystem::last_write_time(path.replace_extension(TRANSFER_EXTENSIONS[i]), error);
+            readable = !error;
+            modified = i == 0 ? time : std::max(modified, time);
+        }
+        path.replace_extension(".obj");
+        if (!readable) {
+            continue;
+        }
+        auto cached = hashed.find(path.string());
+        std::shared_ptr<LocalCopy> copy;
+        if (cached != hashed.end() && cached->second->modified == modified) {
+            copy = cached->second;
+        } else {
+            copy = std::make_shared<LocalCopy>();
+            copy->record = record;
+            copy->modified = modified;
+            if (!plan_upload(record, copy->plan)) {
+                continue;
+            }
+        }
+        copy->record = record;
+        still_hashed[path.string()] = copy;
+        auto stem = local_stem(record);
+        auto key = stem.find('/') == std::string::npos ? options.username + "/" + stem : stem;
+        // The first one listed for a key is the one that's synced
+        local.emplace(key, copy);
+    }
+    hashed = std::move(still_hashed);
+    return local;
+}
+
+// T R A N S F E R S //////////////////////////////////////////
+
+auto SyncEngine::upload(const std::string &key, LocalCopy &copy) -> Transfer {
+    auto item = std::make_shared<TransferItem>(key, true, nullptr);
+    item->limiter = &limiter;
+    item->state = ItemState::RUNNING;
+    item->started = std::chrono::steady_clock::now();
+    status_mutex.lock();
+    current = item;
+    status_mutex.unlock();
+    // The server names it after the .obj, which is the key's stem for the user's own records
+    auto result = upload_chunks(channel, copy.plan, *item, std::filesystem::path(key).filename().string());
+    status_mutex.lock();
+    current.reset();
+    status_mutex.unlock();
+    return result;
+}
+
+auto SyncEngine::download(const online::ReconRecord &record, const std::string &target) -> Transfer {
+    auto item = std::make_shared<TransferItem>(record.name(), false, nullptr);
+    item->limiter = &limiter;
+    item->state = ItemState::RUNNING;
+    item->started = std::chrono::steady_clock::now();
+    status_mutex.lock();
+    current = item;
+    status_mutex.unlock();
+    std::string name;
+    auto result = download_resumable(channel, record, name, *item, target);
+    status_mutex.lock();
+    current.reset();
+    status_mutex.unlock();
+    if (result == Transfer::DONE) {
+        auto file_name = std::filesystem::path(target).filename().string();
+        auto shown = target.find('/') == std::string::npos ? file_name : record.owner() + " 创作的 " + file_name;
+        add_local_record(ReconRecord(shown, target + ".obj"));
+    }
+    return result;
+}
+
+auto SyncEngine::set_aside(LocalCopy &copy) -> bool {
+    auto stem = local_stem(copy.record);
+    auto aside = stem + "~" + short_hash(copy.plan.hash);
+    auto from = std::filesystem::path("recons") / stem;
+    auto to = std::filesystem::path("recons") / aside;
+    std::error_code error;
+    for (auto i = 0; i < TRANSFER_FILES && !error; i++) {
+        std::filesystem::rename(from.string() + TRANSFER_EXTENSIONS[i], to.string() + TRANSFER_EXTENSIONS[i], error);
+    }
+    if (error || !relink_record(to, from.filename().string())) {
+        mutex().lock();
+        RECON_LOG(SYNC) << "无法保留冲突副本：" << stem;
+        mutex().unlock();
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex());
+    auto records = read_recon_records("recons/records.bin");
+    for (auto &record : records) {
+        if (std::string(record.obj_file) == copy.record.obj_file) {
+            record = ReconRecord(std::string(record.name) + "~" + short_hash(copy.plan.hash), aside + ".obj");
+        }
+    }
+    return write_recon_records(records, "recons/records.bin");
+}
+
+// B A S E ////////////////////////////////////////////////////
+
+auto SyncEngine::read_base() -> std::map<std::string, std::string> {
+    // <hash>\t<key> per line; keys are names and may have spaces
+    std::map<std::string, std::string> base;
+    std::ifstream reader(SYNC_BASE_PATH);
+    std::string line;
+    while (std::getline(reader, line)) {
+        auto tab = line.find('\t');
+        if (tab != std::string::npos) {
+            base[line.substr(tab + 1)] = line.substr(0, tab);
+        }
+    }
+    return base;
+}
+
+auto SyncEngine::write_base(const std::map<std::string, std::string> &base) -> void {
+    auto temporary = std::string(SYNC_BASE_PATH) + ".tmp";
+    std::ofstream writer(temporary);
+    for (const auto &[key, hash] : base) {
+        if (!hash.empty()) {
+            writer << hash << "\t" << key << "\n";
+        }
+    }
+    writer.close();
+    std::error_code error;
+    std::filesystem::rename(temporary, SYNC_BASE_PATH, error);
+}
+
+// R E N A M E S //////////////////////////////////////////////
+
+static auto rewrite_lines(const std::string &path, std::function<void(std::string &)> edit) -> bool {
+    auto temporary = path + ".tmp";
+    std::ifstream reader(path);
+    std::ofstream writer(temporary);
+    if (!reader.good() || !writer.good()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(reader, line)) {
+        edit(line);
+        writer << line << "\n";
+    }
+    writer.close();
+    reader.close();
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    return !error && writer.good();
+}
+
+auto relink_record(const std::filesystem::path &base, const std::string &old_stem) -> bool {
+    auto stem = base.filename().string();
+    auto linked = rewrite_lines(base.string() + ".obj", [&] (std::string &line) {
+        if (line.rfind("mtllib ", 0) == 0) {
+            line = "mtllib " + stem + ".mtl";
+        }
+    });
+    return linked && rewrite_lines(base.string() + ".mtl", [&] (std::string &line) {
+        // map_Ka <stem>.png, map_Kd <stem>.png and so on
+        auto space = line.find(' ');
+        if (line.rfind("map_", 0) == 0 && space != std::string::npos && line.substr(space + 1) == old_stem + ".png") {
+            line = line.substr(0, space + 1) + stem + ".png";
+        }
+    });
+}
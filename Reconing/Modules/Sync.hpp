@@ -0,0 +1,157 @@
+//
+//  Sync.hpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Sync_hpp
+#define Sync_hpp
+
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <cstdint>
+#include "common.hpp"
+#include "online.pb.h"
+#include "Channel.hpp"
+#include "Transfers.hpp"
+
+#define SYNC "后台同步"
+#define SYNC_BASE_PATH "recons/.sync"
+#define SYNC_INTERVAL_DEFAULT 60 // Seconds between passes
+#define SYNC_LIST_PAGE 200
+#define SYNC_HASH_BATCH 256 // Record ids per `hashes` request
+#define SYNC_SHORT_HASH 8 // Hex digits naming a conflict copy
+
+struct SyncOptions {
+    std::string username;
+    std::string password;
+    std::string remote = ONLINE_REMOTE;
+    int port = ONLINE_PORT;
+    int64_t limit = 0; // Bytes per second for every transfer together; zero for no limit
+    int interval = SYNC_INTERVAL_DEFAULT;
+    bool once = false;
+};
+
+namespace SyncNS {
+
+/// A record in recons/records.bin, with the content hash of its files as the server would
+/// compute it. Kept between passes, and only cut again when the files change.
+struct LocalCopy {
+    ReconRecord record;
+    OnlineNS::UploadPlan plan;
+    std::filesystem::file_time_type modified;
+};
+
+/// What one pass did.
+struct PassResult {
+    bool connected = false;
+    int uploaded = 0;
+    int downloaded = 0;
+    int conflicts = 0;
+    int failed = 0;
+};
+
+};
+
+/// Keeps recons/ and the user's records on the server the same, without anyone asking.
+///
+/// Records are matched by key, `<owner>/<stem>`: the server's record name, or the local .obj
+/// path without its extension, where the user's own reconstructions sit at the top of recons/.
+/// Both sides are compared by content hash against the last hash they agreed on, kept in
+/// recons/.sync, so each pass knows which side changed:
+///
+/// - changed on one side only: that side's copy wins. Only the user's own records go up;
+///   anyone else's are only ever downloaded, and only once they're in records.bin.
+/// - gone locally but unchanged remotely: left gone, the server has no deletes.
+/// - changed on both sides: a conflict. Of the user's own records, the copy with the smaller
+///   hash keeps the name and the other one is kept beside it as `<stem>~<its first 8 hex digits>`,
+///   so every machine resolves the same conflict the same way. For anyone else's, the server's
+///   copy keeps the name.
+///
+/// Transfers go one at a time on one connection, all under one RateLimiter; a dropped one
+/// resumes on the next pass.
+class SyncEngine {
+public:
+    SyncEngine(SyncOptions options) : options(options), limiter(options.limit), stopping(false), active(false) {}
+
+    ~SyncEngine();
+
+    /// Passes every `interval` seconds until stopped, or just one with `once`. For the CLI;
+    /// prints `sync <uploaded> <downloaded> <conflicts> <failed>` after each pass.
+    auto run() -> int;
+
+    /// Runs passes on a thread of its own, for the online window.
+    auto start() -> void;
+
+    auto stop() -> void;
+
+    auto running() const -> bool {
+        return active;
+    }
+
+    auto set_limit(int64_t bytes_per_second) -> void;
+
+    /// One line about the last pass or the transfer under way, and its progress; negative
+    /// when nothing is moving.
+    auto status(float &progress) -> std::string;
+
+    static auto parse_options(int argc, const char *argv[], SyncOptions &options) -> bool;
+
+private:
+    /// Passes again at once while conflicts leave new copies behind to send.
+    auto settle() -> SyncNS::PassResult;
+
+    auto pass() -> SyncNS::PassResult;
+
+    auto connect() -> bool;
+
+    /// The records of `owners` on the server by name, with their content hashes. Records without
+    /// stored files are left out.
+    auto list_remote(const std::set<std::string> &owners, std::map<std::string, online::ReconRecord> &remote,
+                     std::map<std::string, std::string> &hashes) -> bool;
+
+    /// Re-reads records.bin, re-hashing only what changed since the last pass.
+    auto scan_local() -> std::map<std::string, std::shared_ptr<SyncNS::LocalCopy>>;
+
+    auto upload(const std::string &key, SyncNS::LocalCopy &copy) -> OnlineNS::Transfer;
+
+    /// Fetches a record into recons/<target>, listing it in records.bin if it's new there.
+    auto download(const online::ReconRecord &record, const std::string &target) -> OnlineNS::Transfer;
+
+    /// Moves a local copy to `<stem>~<short hash>`, files and records.bin entry alike.
+    auto set_aside(SyncNS::LocalCopy &copy) -> bool;
+
+    auto own(const std::string &key) const -> bool;
+
+    auto read_base() -> std::map<std::string, std::string>;
+
+    auto write_base(const std::map<std::string, std::string> &base) -> void;
+
+    auto report(const std::string &line) -> void;
+
+    SyncOptions options;
+    OnlineNS::RateLimiter limiter;
+    Channel channel;
+    std::map<std::string, std::shared_ptr<SyncNS::LocalCopy>> hashed; // By .obj path
+    std::thread thread;
+    std::mutex status_mutex; // Guards the status and stopping
+    std::condition_variable wakeup;
+    bool stopping;
+    std::atomic<bool> active;
+    std::string status_line;
+    std::shared_ptr<OnlineNS::TransferItem> current;
+};
+
+/// Points a renamed record's .obj at its .mtl and the .mtl at its texture again, after the
+/// files moved from `<old stem>.*` to `base.*`.
+auto relink_record(const std::filesystem::path &base, const std::string &old_stem) -> bool;
+
+#endif /* Sync_hpp */
@@ -0,0 +1,420 @@
+//
+//  Transfers.cpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Transfers.hpp"
+#include "Hash.hpp"
+#include "Compress.hpp"
+#include <set>
+#include <map>
+#include <memory>
+#include <thread>
+#include <fstream>
+#include <cstring>
+
+using namespace OnlineNS;
+
+// R A T E ////////////////////////////////////////////////////
+
+auto RateLimiter::set_rate(int64_t bytes_per_second) -> void {
+    std::lock_guard<std::mutex> lock(mutex);
+    rate = std::max<int64_t>(bytes_per_second, 0);
+    allowance = 0.0;
+    last = std::chrono::steady_clock::now();
+}
+
+auto RateLimiter::take(int64_t bytes) -> void {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (rate <= 0) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    allowance = std::min<double>(allowance + std::chrono::duration<double>(now - last).count() * rate, rate);
+    last = now;
+    allowance -= bytes;
+    // The debt stays booked, so whoever takes next waits for it too
+    auto wait = allowance < 0.0 ? -allowance / rate : 0.0;
+    lock.unlock();
+    if (wait > 0.0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+auto TransferItem::rate() const -> double {
+    auto until = state == ItemState::RUNNING ? std::chrono::steady_clock::now() : finished.load();
+    auto seconds = std::chrono::duration<double>(until - started.load()).count();
+    return seconds > 0.0 ? moved / seconds : 0.0;
+}
+
+// T R A N S F E R S //////////////////////////////////////////
+
+auto login(Channel &channel, const std::string &username, const std::string &password) -> bool {
+    online::User user;
+    user.set_username(username);
+    user.set_password(password);
+    auto exchange = channel.request();
+    if (!exchange->send(make_request("login")) || !exchange->send(user)) {
+        return false;
+    }
+    auto response = exchange->receive<online::Request>();
+    return response.has_value() && response->arg_size() == 1 && response->arg(0) == "success";
+}
+
+auto plan_upload(const ReconRecord &record, UploadPlan &plan) -> bool {
+    plan.path = std::filesystem::path("recons") / record.obj_file;
+    plan.chunks.clear();
+    // Cut the files the way the server's store does; only chunks it lacks need to travel
+    Sha256 digest;
+    Chunker chunker;
+    int64_t offset = 0;
+    auto cut = [&] (const std::string &bytes) {
+        Sha256 chunk_digest;
+        chunk_digest.update(bytes);
+        plan.chunks.push_back({ chunk_digest.hex(), offset, (int64_t) bytes.size() });
+        offset += bytes.size();
+        return true;
+    };
+    std::vector<char> chunk(TRANSFER_CHUNK);
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        std::error_code error;
+        plan.sizes[i] = (int64_t) std::filesystem::file_size(plan.path.replace_extension(TRANSFER_EXTENSIONS[i]), error);
+        std::ifstream reader(plan.path, std::ios::binary);
+        if (error || !reader.good()) {
+            mutex().lock();
+            RECON_LOG(TRANSFERS) << "无法打开 obj 文件：" << record.name;
+            mutex().unlock();
+            plan.chunks.clear();
+            return false;
+        }
+        while (reader.read(chunk.data(), chunk.size()) || reader.gcount() > 0) {
+            digest.update(chunk.data(), reader.gcount());
+            chunker.feed(chunk.data(), reader.gcount(), cut);
+        }
+    }
+    chunker.finish(cut);
+    plan.hash = digest.hex();
+    return true;
+}
+
+auto upload_chunks(Channel &channel, const UploadPlan &plan, TransferItem &item, const std::string &file_base) -> Transfer {
+    const auto &sizes = plan.sizes;
+    const auto &chunks = plan.chunks;
+    auto path = plan.path;
+    auto base = file_base.empty() ? path.replace_extension("").filename().string() : file_base;
+    auto request = make_request("upload_chunks", base, plan.hash, std::to_string(sizes[0]),
+                                std::to_string(sizes[1]), std::to_string(sizes[2]));
+    for (const auto &chunk : chunks) {
+        request.add_arg(chunk.hash);
+        request.add_arg(std::to_string(chunk.length));
+    }
+    auto exchange = channel.request();
+    if (!exchange->send(request)) {
+        return Transfer::DROPPED;
+    }
+    auto response = exchange->receive<online::Request>();
+    if (!response.has_value()) {
+        return Transfer::DROPPED;
+    }
+    if (response->arg_size() < 1 || response->arg(0) != "missing") {
+        mutex().lock();
+        RECON_LOG(TRANSFERS) << "服务端拒绝了上传。";
+        mutex().unlock();
+        return Transfer::REJECTED;
+    }
+    // The server lists what it lacks in the order it wants it, each hash once
+    std::set<std::string> missing(response->arg().begin() + 1, response->arg().end());
+    int64_t total = 0;
+    for (const auto &chunk : chunks) {
+        total += missing.count(chunk.hash) ? chunk.length : 0;
+    }
+    item.total = total;
+    item.done = 0;
+    mutex().lock();
+    RECON_LOG(TRANSFERS) << item.name << "：需要上传 " << missing.size() << " / " << chunks.size() << " 个分块。";
+    mutex().unlock();
+    std::ifstream readers[TRANSFER_FILES];
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        readers[i].open(path.replace_extension(TRANSFER_EXTENSIONS[i]), std::ios::binary);
+    }
+    std::string bytes;
+    for (const auto &chunk : chunks) {
+        if (missing.erase(chunk.hash) == 0) {
+            continue;
+        }
+        // A chunk may straddle the end of one file and the start of the next
+        bytes.resize(chunk.length);
+        int64_t filled = 0, start = 0;
+        for (auto i = 0; i < TRANSFER_FILES && filled < chunk.length; i++) {
+            auto from = chunk.offset + filled - start;
+            if (from < sizes[i]) {
+                auto take = std::min<int64_t>(sizes[i] - from, chunk.length - filled);
+                readers[i].seekg(from);
+                readers[i].read(&bytes[filled], take);
+                if (readers[i].gcount() != take) {
+                    mutex().lock();
+                    RECON_LOG(TRANSFERS) << "读取文件失败。";
+                    mutex().unlock();
+                    return Transfer::REJECTED;
+                }
+                filled += take;
+            }
+            start += sizes[i];
+        }
+        if (item.limiter != nullptr) {
+            item.limiter->take(chunk.length);
+        }
+        if (!send_checked_chunk(*exchange, bytes.data(), (int) bytes.size())) {
+            return Transfer::DROPPED;
+        }
+        item.done += chunk.length;
+        item.moved += chunk.length;
+    }
+    response = exchange->receive<online::Request>();
+    if (!response.has_value()) {
+        return Transfer::DROPPED;
+    }
+    return response->arg_size() == 1 && response->arg(0) == "success" ? Transfer::DONE : Transfer::REJECTED;
+}
+
+auto download_resumable(Channel &channel, const online::ReconRecord &record, std::string &name,
+                        TransferItem &item, const std::string &target) -> Transfer {
+    // Ask for the header alone first; the content hash says which partial file to resume
+    auto probe = channel.request();
+    if (!probe->send(make_request("download_range", std::to_string(record.id()), "0", "0"))) {
+        return Transfer::DROPPED;
+    }
+    auto header = probe->receive<online::Request>();
+    probe.reset();
+    if (!header.has_value()) {
+        return Transfer::DROPPED;
+    }
+    if (header->arg_size() != 5 + TRANSFER_FILES || header->arg(0) != "range") {
+        mutex().lock();
+        RECON_LOG(TRANSFERS) << "错误！服务端传输信息未齐全。";
+        mutex().unlock();
+        return Transfer::REJECTED;
+    }
+    name = header->arg(1);
+    auto hash = header->arg(2);
+    std::array<int64_t, TRANSFER_FILES> sizes;
+    int64_t total = 0;
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        sizes[i] = std::atoll(header->arg(5 + i).c_str());
+        total += sizes[i];
+    }
+    auto partial = partial_path(hash);
+    auto lock = lock_partial(hash);
+    std::error_code error;
+    auto received = std::filesystem::exists(partial, error) ? (int64_t) std::filesystem::file_size(partial, error) : 0;
+    if (error || received > total) {
+        received = 0;
+        std::filesystem::remove(partial, error);
+    }
+    item.total = total;
+    item.done = received;
+    if (received < total) {
+        auto result = fetch_range(channel, record.id(), hash, received, -1, item);
+        if (result != Transfer::DONE) {
+            return result;
+        }
+    }
+
+    // Check the whole thing before it replaces anything, then split it into the three files
+    Sha256 digest;
+    std::vector<char> buffer(TRANSFER_CHUNK);
+    std::ifstream reader(partial, std::ios::binary);
+    while (reader.read(buffer.data(), buffer.size()) || reader.gcount() > 0) {
+        digest.update(buffer.data(), reader.gcount());
+    }
+    if (digest.hex() != hash) {
+        reader.close();
+        std::filesystem::remove(partial, error);
+        mutex().lock();
+        RECON_LOG(TRANSFERS) << "错误！下载内容校验失败。";
+        mutex().unlock();
+        return Transfer::REJECTED;
+    }
+    reader.clear();
+    reader.seekg(0);
+    auto base = std::filesystem::path("recons") / (target.empty() ? name : target);
+    mkdir_if_not_exists(base.parent_path());
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        std::ofstream writer(base.string() + TRANSFER_EXTENSIONS[i], std::ios::binary);
+        auto left = sizes[i];
+        while (left > 0 && writer.good()) {
+            auto take = (size_t) std::min<int64_t>(left, TRANSFER_CHUNK);
+            reader.read(buffer.data(), take);
+            writer.write(buffer.data(), take);
+            left -= take;
+        }
+        if (!writer.good()) {
+            mutex().lock();
+            RECON_LOG(TRANSFERS) << "尝试文件写入失败。";
+            mutex().unlock();
+            return Transfer::REJECTED;
+        }
+    }
+    reader.close();
+    std::filesystem::remove(partial, error);
+    return Transfer::DONE;
+}
+
+auto partial_path(const std::string &hash) -> std::filesystem::path {
+    mkdir_if_not_exists("recons");
+    mkdir_if_not_exists("recons/.partial");
+    return std::filesystem::path("recons/.partial") / std::filesystem::path(hash).filename();
+}
+
+auto lock_partial(const std::string &hash, bool wait) -> std::unique_lock<std::mutex> {
+    static std::mutex locks_mutex;
+    static std::map<std::string, std::unique_ptr<std::mutex>> locks;
+    locks_mutex.lock();
+    auto &lock = locks[hash];
+    if (!lock) {
+        lock = std::make_unique<std::mutex>();
+    }
+    auto &partial = *lock;
+    locks_mutex.unlock();
+    if (wait) {
+        return std::unique_lock<std::mutex>(partial);
+    }
+    return std::unique_lock<std::mutex>(partial, std::try_to_lock);
+}
+
+auto fetch_range(Channel &channel, int id, const std::string &hash, int64_t offset, int64_t length,
+                 TransferItem &item) -> Transfer {
+    auto exchange = channel.request();
+    if (!exchange->send(make_request("download_range", std::to_string(id), std::to_string(offset), std::to_string(length)))) {
+        return Transfer::DROPPED;
+    }
+    auto header = exchange->receive<online::Request>();
+    if (!header.has_value() || header->arg_size() != 5 + TRANSFER_FILES || header->arg(2) != hash) {
+        // Overwritten in between; start over. Whatever the server still sends for this
+        // exchange is dropped once it's gone
+        return Transfer::DROPPED;
+    }
+    // Only verified chunks reach the file, so its size is always a safe place to resume
+    std::ofstream writer(partial_path(hash), std::ios::binary | std::ios::app);
+    std::string chunk;
+    auto left = std::atoll(header->arg(4).c_str());
+    while (left > 0) {
+        if (!receive_checked_chunk(*exchange, chunk)) {
+            return Transfer::DROPPED;
+        }
+        writer.write(chunk.data(), chunk.size());
+        writer.flush();
+        if (!writer.good()) {
+            mutex().lock();
+            RECON_LOG(TRANSFERS) << "尝试文件写入失败。";
+            mutex().unlock();
+            return Transfer::DROPPED;
+        }
+        left -= chunk.size();
+        item.done += chunk.size();
+        item.moved += chunk.size();
+        // Reading slower lets the channel's window fill, and then the server waits too
+        if (item.limiter != nullptr) {
+            item.limiter->take(chunk.size());
+        }
+    }
+    return Transfer::DONE;
+}
+
+auto fetch_artifact(Channel &channel, int id, const std::string &artifact, std::string &out) -> Transfer {
+    auto exchange = channel.request();
+    if (!exchange->send(make_request("artifacts", std::to_string(id)))) {
+        return Transfer::DROPPED;
+    }
+    auto listing = exchange->receive<online::Request>();
+    if (!listing.has_value()) {
+        return Transfer::DROPPED;
+    }
+    if (listing->arg_size() < 3 || listing->arg(0) != "artifacts" || listing->arg(2) != "ready") {
+        return Transfer::REJECTED;
+    }
+    auto made = false;
+    for (auto i = 3; i + 1 < listing->arg_size(); i += 2) {
+        made = made || listing->arg(i) == artifact;
+    }
+    if (!made) {
+        return Transfer::REJECTED;
+    }
+    exchange = channel.request();
+    if (!exchange->send(make_request("artifact", std::to_string(id), artifact))) {
+        return Transfer::DROPPED;
+    }
+    auto header = exchange->receive<online::Request>();
+    if (!header.has_value()) {
+        return Transfer::DROPPED;
+    }
+    if (header->arg_size() != 3 || header->arg(0) != "artifact") {
+        return Transfer::REJECTED;
+    }
+    auto size = std::atoll(header->arg(2).c_str());
+    out.clear();
+    std::string chunk;
+    while ((int64_t) out.size() < size) {
+        if (!exchange->receive_bytes(chunk)) {
+            return Transfer::DROPPED;
+        }
+        out += chunk;
+    }
+    return Transfer::DONE;
+}
+
+auto add_local_record(const ReconRecord &record) -> void {
+    // Under the global lock, like every other reader of records.bin in the app
+    std::lock_guard<std::mutex> lock(mutex());
+    auto records = read_recon_records("recons/records.bin");
+    auto record_in_db = std::find_if(records.begin(), records.end(), [&] (auto &r) {
+        return std::string(r.name) == record.name || std::string(r.obj_file) == record.obj_file;
+    });
+    if (record_in_db == records.end()) {
+        records.push_back(record);
+        write_recon_records(records, "recons/records.bin");
+    }
+}
+
+auto send_checked_chunk(Exchange &exchange, const char *data, int size) -> bool {
+    if (exchange.codec() != Codec::NONE) {
+        auto packed = pack_chunk(data, size, exchange.codec(), ONLINE_COMPRESS_LEVEL);
+        return exchange.send_bytes(packed.data(), (int) packed.size());
+    }
+    auto crc = crc32(data, size);
+    std::string checked(TRANSFER_CHECKSUM + size, '\0');
+    std::memcpy(&checked[0], &crc, TRANSFER_CHECKSUM);
+    std::memcpy(&checked[TRANSFER_CHECKSUM], data, size);
+    return exchange.send_bytes(checked.data(), (int) checked.size());
+}
+
+auto receive_checked_chunk(Exchange &exchange, std::string &chunk) -> bool {
+    if (exchange.codec() != Codec::NONE) {
+        std::string packed;
+        if (!exchange.receive_bytes(packed)) {
+            return false;
+        }
+        if (!unpack_chunk(packed, chunk, TRANSFER_CHUNK)) {
+            mutex().lock();
+            RECON_LOG(TRANSFERS) << "下载分块校验失败。";
+            mutex().unlock();
+            return false;
+        }
+        return true;
+    }
+    if (!exchange.receive_bytes(chunk) || chunk.size() < TRANSFER_CHECKSUM || chunk.size() > TRANSFER_CHUNK + TRANSFER_CHECKSUM) {
+        return false;
+    }
+    uint32_t crc = 0;
+    std::memcpy(&crc, chunk.data(), TRANSFER_CHECKSUM);
+    chunk.erase(0, TRANSFER_CHECKSUM);
+    if (crc32(chunk.data(), chunk.size()) != crc) {
+        mutex().lock();
+        RECON_LOG(TRANSFERS) << "下载分块校验失败。";
+        mutex().unlock();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,156 @@
+//
+//  Transfers.hpp
+//  Reconing
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Transfers_hpp
+#define Transfers_hpp
+
+#include <array>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <cstdint>
+#include "common.hpp"
+#include "online.pb.h"
+#include "Protocol.hpp"
+#include "Channel.hpp"
+
+#define TRANSFERS "传输"
+#define ONLINE_REMOTE "127.0.0.1"
+#define ONLINE_PORT 17290
+#define ONLINE_COMPRESS_LEVEL 4 // Uploads go out once, so spend a little more on them
+
+// Resumable record transfers on a logged-in Channel, shared by the online window and the sync
+// engine. None of them touch any UI; progress goes into the TransferItem they are given.
+
+namespace OnlineNS {
+
+/// How one attempt at a resumable transfer ended.
+enum class Transfer {
+    DONE = 0,
+    REJECTED = 1, // The server said no; retrying won't help
+    DROPPED = 2 // The connection broke; reconnect and resume
+};
+
+/// A content-defined chunk of the files being uploaded, as the server's store will cut it.
+struct LocalChunk {
+    std::string hash;
+    int64_t offset; // Into the .obj, .mtl & .png back to back
+    int64_t length;
+};
+
+/// A local record cut up for upload; made once and kept across retries.
+struct UploadPlan {
+    std::filesystem::path path; // Of the .obj
+    std::array<int64_t, TRANSFER_FILES> sizes;
+    std::string hash;
+    std::vector<LocalChunk> chunks;
+};
+
+/// Token bucket shared by the transfers it's handed to, allowing a second's worth of burst.
+class RateLimiter {
+public:
+    RateLimiter(int64_t rate = 0) : rate(rate), allowance(0.0), last(std::chrono::steady_clock::now()) {}
+
+    /// Bytes per second; zero lifts the limit.
+    auto set_rate(int64_t bytes_per_second) -> void;
+
+    /// Waits until `bytes` more may move.
+    auto take(int64_t bytes) -> void;
+
+private:
+    std::mutex mutex;
+    int64_t rate;
+    double allowance; // Bytes that may move right now; negative while in debt
+    std::chrono::steady_clock::time_point last;
+};
+
+enum class ItemState {
+    QUEUED = 0,
+    RUNNING = 1,
+    DONE = 2,
+    FAILED = 3
+};
+
+class TransferItem;
+
+/// One attempt at a bulk transfer item, on the connection of the worker running it.
+using TransferWork = std::function<Transfer(Channel &channel, TransferItem &item)>;
+
+/// One record of a bulk upload or download. Workers update the counters as bytes move and the
+/// UI reads them every frame, so each is atomic; together they may be a chunk apart.
+class TransferItem {
+public:
+    TransferItem(std::string name, bool upload, TransferWork work) : name(name), upload(upload), work(work) {}
+
+    auto progress() const -> float {
+        auto total = this->total.load();
+        return total > 0 ? (float) done.load() / total : state == ItemState::DONE ? 1.0f : 0.0f;
+    }
+
+    /// Bytes per second actually sent or received, over the current or last attempt.
+    auto rate() const -> double;
+
+    std::string name;
+    bool upload;
+    TransferWork work;
+    RateLimiter *limiter = nullptr; // Paces the chunks, if set
+    std::atomic<ItemState> state { ItemState::QUEUED };
+    std::atomic<int> attempts { 0 };
+    std::atomic<int64_t> total { 0 }; // Bytes this transfer needs to move, once known
+    std::atomic<int64_t> done { 0 }; // Of total, counting what a resumed attempt skipped
+    std::atomic<int64_t> moved { 0 }; // Over the wire, this attempt
+    std::atomic<std::chrono::steady_clock::time_point> started;
+    std::atomic<std::chrono::steady_clock::time_point> finished;
+};
+
+};
+
+auto login(Channel &channel, const std::string &username, const std::string &password) -> bool;
+
+/// Cuts a local record the way the server's store does, hashing its content on the way.
+auto plan_upload(const ReconRecord &record, OnlineNS::UploadPlan &plan) -> bool;
+
+/// Sends the chunk list, then only the chunks the server doesn't already have. The record is
+/// published as `file_base`, or the .obj's name without its extension.
+auto upload_chunks(Channel &channel, const OnlineNS::UploadPlan &plan, OnlineNS::TransferItem &item,
+                   const std::string &file_base = "") -> OnlineNS::Transfer;
+
+/// Fetches what's missing of a record into recons/.partial/<hash>, then unpacks it into
+/// recons/<name>, or recons/<target> if given. `name` receives the record's file base.
+auto download_resumable(Channel &channel, const online::ReconRecord &record, std::string &name,
+                        OnlineNS::TransferItem &item, const std::string &target = "") -> OnlineNS::Transfer;
+
+/// Where a download collects verified bytes until it has them all.
+auto partial_path(const std::string &hash) -> std::filesystem::path;
+
+/// Held while bytes go into a record's partial file, so a prefetch and a download of the same
+/// record never write it at once. Without `wait`, comes back unlocked if someone else has it.
+auto lock_partial(const std::string &hash, bool wait = true) -> std::unique_lock<std::mutex>;
+
+/// Appends `length` bytes of a record from `offset` to its partial file, or up to the end if
+/// negative; `offset` has to be the file's size. Call with the partial file locked.
+auto fetch_range(Channel &channel, int id, const std::string &hash, int64_t offset, int64_t length,
+                 OnlineNS::TransferItem &item) -> OnlineNS::Transfer;
+
+/// Fetches one of the artifacts the server made of a record, if they're ready and it made that one.
+auto fetch_artifact(Channel &channel, int id, const std::string &artifact, std::string &out) -> OnlineNS::Transfer;
+
+/// Lists a record in recons/records.bin, unless one by that name or file is there already.
+auto add_local_record(const ReconRecord &record) -> void;
+
+/// Chunk frames led by a CRC-32 of the bytes, for resumable transfers; packed with the codec
+/// of the exchange's connection, if any.
+auto send_checked_chunk(Exchange &exchange, const char *data, int size) -> bool;
+
+auto receive_checked_chunk(Exchange &exchange, std::string &chunk) -> bool;
+
+#endif /* Transfers_hpp */
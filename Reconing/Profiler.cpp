@@ -0,0 +1,228 @@
+//
+//  Profiler.cpp
+//  Reconing
+//
+//  Created by apple on 20/04/2021.
+//
+
+#include "Profiler.hpp"
+#include "common.hpp"
+#include <imgui.h>
+#include <fstream>
+#include <algorithm>
+
+Profiler _profiler;
+
+auto profiler() -> Profiler & {
+    return _profiler;
+}
+
+Profiler::Profiler() : enabled(true), head(0), frame_index(0), active_gpu(-1), paused(false) {
+    frame_history.resize(PROFILER_HISTORY, 0.0f);
+}
+
+auto Profiler::section(const std::string &name, bool gpu) -> int {
+    auto key = (gpu ? "gpu:" : "cpu:") + name;
+    auto it = section_lookup.find(key);
+    if (it != section_lookup.end()) {
+        return it->second;
+    }
+    ProfilerSection section;
+    section.name = name;
+    section.gpu = gpu;
+    section.history.resize(PROFILER_HISTORY, 0.0f);
+    section.current = 0.0f;
+    section.last = 0.0f;
+    if (gpu) {
+        glGenQueries(PROFILER_QUERY_LATENCY, section.queries);
+    }
+    sections.push_back(section);
+    section_lookup[key] = (int) sections.size() - 1;
+    return (int) sections.size() - 1;
+}
+
+auto Profiler::begin_frame() -> void {
+    if (!enabled) {
+        return;
+    }
+    collect_gpu();
+}
+
+auto Profiler::end_frame(float delta_time) -> void {
+    if (!enabled || paused) {
+        for (auto &s : sections) {
+            s.current = 0.0f;
+        }
+        return;
+    }
+    for (auto &s : sections) {
+        if (!s.gpu) {
+            commit(s, s.current);
+        }
+        s.current = 0.0f;
+    }
+    frame_history[head] = delta_time * 1000.0f;
+    head = (head + 1) % PROFILER_HISTORY;
+    frame_index++;
+}
+
+auto Profiler::commit(ProfilerSection &section, float value) -> void {
+    section.history[head] = value;
+    section.last = value;
+}
+
+auto Profiler::collect_gpu() -> void {
+    for (auto &s : sections) {
+        if (!s.gpu) {
+            continue;
+        }
+        // Slots are reused round-robin; read back everything that finished since last frame
+        for (auto i = 0; i < PROFILER_QUERY_LATENCY; i++) {
+            if (!s.pending[i]) {
+                continue;
+            }
+            GLint available = 0;
+            glGetQueryObjectiv(s.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) {
+                continue;
+            }
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(s.queries[i], GL_QUERY_RESULT, &elapsed);
+            s.pending[i] = false;
+            if (!paused) {
+                commit(s, (float) elapsed / 1000000.0f);
+            }
+        }
+    }
+}
+
+auto Profiler::begin_cpu(const std::string &name) -> int {
+    if (!enabled) {
+        return -1;
+    }
+    return section(name, false);
+}
+
+auto Profiler::end_cpu(int section, std::chrono::steady_clock::time_point start) -> void {
+    if (section < 0) {
+        return;
+    }
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    sections[section].current += elapsed.count();
+}
+
+auto Profiler::begin_gpu(const std::string &name) -> int {
+    if (!enabled || active_gpu != -1) {
+        return -1;
+    }
+    auto index = section(name, true);
+    auto &s = sections[index];
+    auto slot = frame_index % PROFILER_QUERY_LATENCY;
+    if (s.pending[slot]) {
+        // The GPU is more than PROFILER_QUERY_LATENCY frames behind; skip instead of stalling
+        return -1;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, s.queries[slot]);
+    active_gpu = index;
+    return index;
+}
+
+auto Profiler::end_gpu(int section) -> void {
+    if (section < 0 || section != active_gpu) {
+        return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    sections[section].pending[frame_index % PROFILER_QUERY_LATENCY] = true;
+    active_gpu = -1;
+}
+
+auto Profiler::update_ui(bool *open) -> void {
+    if (!*open) {
+        return;
+    }
+    ImGui::SetNextWindowPos({ 10, 430 }, ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize({ 420, 320 }, ImGuiCond_FirstUseEver);
+    ImGui::Begin("性能分析", open);
+    auto last_frame = frame_history[(head + PROFILER_HISTORY - 1) % PROFILER_HISTORY];
+    auto max_frame = *std::max_element(frame_history.begin(), frame_history.end());
+    ImGui::Text("帧时间：%.2f ms (%.1f FPS)，最近 %d 帧最大：%.2f ms",
+                last_frame, last_frame > 0.0f ? 1000.0f / last_frame : 0.0f,
+                PROFILER_HISTORY, max_frame);
+    ImGui::PlotLines("##frame", frame_history.data(), PROFILER_HISTORY, head,
+                     nullptr, 0.0f, std::max(max_frame, 16.7f), ImVec2 { -FLT_MIN, 60 });
+    ImGui::Checkbox("暂停", &paused);
+    ImGui::SameLine();
+    if (ImGui::Button("导出 CSV")) {
+        mkdir_if_not_exists("profiles");
+        auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        char name[128] = { 0 };
+        auto t_struct = *localtime(&now);
+        strftime(name, sizeof(name), "profiles/profile-at-%Y-%m-%d-%H-%M-%S.csv", &t_struct);
+        if (export_csv(name)) {
+            RECON_LOG(PROFILER) << "性能记录已导出到 " << name;
+        }
+    }
+    if (ImGui::BeginTable("sections", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        ImGui::TableSetupColumn("区段");
+        ImGui::TableSetupColumn("类型");
+        ImGui::TableSetupColumn("当前 (ms)");
+        ImGui::TableSetupColumn("平均 (ms)");
+        ImGui::TableSetupColumn("历史");
+        ImGui::TableHeadersRow();
+        for (const auto &s : sections) {
+            float sum = 0.0f, max = 0.0f;
+            for (auto v : s.history) {
+                sum += v;
+                max = std::max(max, v);
+            }
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", s.name.c_str());
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", s.gpu ? "GPU" : "CPU");
+            ImGui::TableNextColumn();
+            ImGui::Text("%.3f", s.last);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.3f", sum / PROFILER_HISTORY);
+            ImGui::TableNextColumn();
+            ImGui::PlotLines(("##" + s.name + (s.gpu ? "gpu" : "cpu")).c_str(), s.history.data(), PROFILER_HISTORY, head,
+                             nullptr, 0.0f, std::max(max, 0.001f), ImVec2 { 120, 20 });
+        }
+        ImGui::EndTable();
+    }
+    ImGui::End();
+}
+
+auto Profiler::export_csv(std::string path) -> bool {
+    std::ofstream writer(path);
+    if (!writer.good()) {
+        RECON_LOG(PROFILER) << "无法打开性能记录文件：" << path;
+        return false;
+    }
+    writer << "frame,frame_ms";
+    for (const auto &s : sections) {
+        writer << "," << (s.gpu ? "gpu:" : "cpu:") << s.name;
+    }
+    writer << std::endl;
+    // Oldest entry first
+    for (auto i = 0; i < PROFILER_HISTORY; i++) {
+        auto index = (head + i) % PROFILER_HISTORY;
+        writer << i << "," << frame_history[index];
+        for (const auto &s : sections) {
+            writer << "," << s.history[index];
+        }
+        writer << std::endl;
+    }
+    writer.close();
+    return true;
+}
+
+auto Profiler::destroy() -> void {
+    for (auto &s : sections) {
+        if (s.gpu) {
+            glDeleteQueries(PROFILER_QUERY_LATENCY, s.queries);
+        }
+    }
+    sections.clear();
+    section_lookup.clear();
+}
@@ -0,0 +1,115 @@
+//
+//  Profiler.hpp
+//  Reconing
+//
+//  Created by apple on 20/04/2021.
+//
+
+#ifndef Profiler_hpp
+#define Profiler_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <glad/glad.h>
+
+#define PROFILER "性能分析"
+#define PROFILER_HISTORY 240
+#define PROFILER_QUERY_LATENCY 4
+
+/// One named timing section. CPU sections are measured with a steady clock,
+/// GPU sections with GL_TIME_ELAPSED queries which are read back
+/// PROFILER_QUERY_LATENCY frames later so we never stall the pipeline.
+struct ProfilerSection {
+    std::string name;
+    bool gpu;
+    std::vector<float> history; // Milliseconds, ring buffer
+    float current;
+    float last;
+
+    // G P U /////////////////////////////////////////
+    GLuint queries[PROFILER_QUERY_LATENCY] = { GL_NONE };
+    bool pending[PROFILER_QUERY_LATENCY] = { false };
+};
+
+class Profiler {
+public:
+    Profiler();
+
+    auto begin_frame() -> void;
+
+    auto end_frame(float delta_time) -> void;
+
+    auto begin_cpu(const std::string &name) -> int;
+
+    auto end_cpu(int section, std::chrono::steady_clock::time_point start) -> void;
+
+    auto begin_gpu(const std::string &name) -> int;
+
+    auto end_gpu(int section) -> void;
+
+    auto update_ui(bool *open) -> void;
+
+    auto export_csv(std::string path) -> bool;
+
+    auto destroy() -> void;
+
+    bool enabled;
+
+private:
+    auto section(const std::string &name, bool gpu) -> int;
+
+    auto collect_gpu() -> void;
+
+    auto commit(ProfilerSection &section, float value) -> void;
+
+    std::vector<ProfilerSection> sections;
+    std::map<std::string, int> section_lookup;
+    std::vector<float> frame_history;
+    int head;
+    int frame_index;
+    int active_gpu;
+    bool paused;
+};
+
+auto profiler() -> Profiler &;
+
+/// Measures the enclosing scope on the CPU.
+class ProfileScope {
+public:
+    ProfileScope(const std::string &name) : start(std::chrono::steady_clock::now()) {
+        section = profiler().begin_cpu(name);
+    }
+
+    ~ProfileScope() {
+        profiler().end_cpu(section, start);
+    }
+
+private:
+    int section;
+    std::chrono::steady_clock::time_point start;
+};
+
+/// Measures the enclosing scope on the GPU. GL_TIME_ELAPSED queries can't be nested,
+/// so an inner GPU scope is silently ignored.
+class GpuProfileScope {
+public:
+    GpuProfileScope(const std::string &name) {
+        section = profiler().begin_gpu(name);
+    }
+
+    ~GpuProfileScope() {
+        profiler().end_gpu(section);
+    }
+
+private:
+    int section;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define RECON_PROFILE_CPU(NAME) ProfileScope PROFILE_CONCAT(_profile_cpu_, __LINE__)(NAME)
+#define RECON_PROFILE_GPU(NAME) GpuProfileScope PROFILE_CONCAT(_profile_gpu_, __LINE__)(NAME)
+
+#endif /* Profiler_hpp */
@@ -0,0 +1,59 @@
+//
+//  Viewport.cpp
+//  Reconing
+//
+//  Created by apple on 23/04/2021.
+//
+
+#include "Viewport.hpp"
+
+
+auto Viewport::resize(glm::ivec2 size) -> void {
+    if (fbo != GL_NONE && this->size == size) {
+        return;
+    }
+    destroy();
+    this->size = size;
+    glGenFramebuffers(1, &fbo);
+    glGenTextures(1, &color_texture);
+    glGenTextures(1, &depth_texture);
+
+    glBindTexture(GL_TEXTURE_2D, color_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, depth_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, GL_NONE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_texture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, GL_NONE);
+}
+
+auto Viewport::bind() -> void {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, size.x, size.y);
+}
+
+auto Viewport::blit(glm::ivec2 offset) -> void {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, GL_NONE);
+    glBlitFramebuffer(0, 0, size.x, size.y,
+                      offset.x, offset.y, offset.x + size.x, offset.y + size.y,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, GL_NONE);
+}
+
+auto Viewport::destroy() -> void {
+    if (fbo == GL_NONE) {
+        return;
+    }
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &color_texture);
+    glDeleteTextures(1, &depth_texture);
+    fbo = color_texture = depth_texture = GL_NONE;
+}
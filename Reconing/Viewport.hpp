@@ -0,0 +1,33 @@
+//
+//  Viewport.hpp
+//  Reconing
+//
+//  Created by apple on 23/04/2021.
+//
+
+#ifndef Viewport_hpp
+#define Viewport_hpp
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+/// An offscreen render target for one view of the main window.
+class Viewport {
+public:
+    Viewport() : fbo(GL_NONE), color_texture(GL_NONE), depth_texture(GL_NONE), size(0, 0) {}
+
+    /// (Re)allocates the attachments if the size changed.
+    auto resize(glm::ivec2 size) -> void;
+
+    auto bind() -> void;
+
+    /// Copies the color buffer into the given rectangle of the default framebuffer.
+    auto blit(glm::ivec2 offset) -> void;
+
+    auto destroy() -> void;
+
+    GLuint fbo, color_texture, depth_texture;
+    glm::ivec2 size;
+};
+
+#endif /* Viewport_hpp */
@@ -7,8 +7,11 @@
 
 #include "common.hpp"
 #include <fstream>
+#include <map>
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <tiny_obj_loader.h>
 
 std::stringstream log_stream;
 
@@ -62,6 +65,22 @@ auto link(GLuint vertex_shader, GLuint fragment_shader) -> GLuint {
     return program;
 }
 
+auto shared_program(std::string vertex_path, std::string fragment_path) -> GLuint {
+    static std::map<std::pair<std::string, std::string>, GLuint> programs;
+    auto key = std::make_pair(vertex_path, fragment_path);
+    auto it = programs.find(key);
+    if (it != programs.end()) {
+        return it->second;
+    }
+    auto vertex_shader = compile(GL_VERTEX_SHADER, vertex_path);
+    auto fragment_shader = compile(GL_FRAGMENT_SHADER, fragment_path);
+    auto program = link(vertex_shader, fragment_shader);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    programs[key] = program;
+    return program;
+}
+
 auto mkdir_if_not_exists(std::filesystem::path path) -> void {
     if (!std::filesystem::exists(path)) {
         std::filesystem::create_directory(path);
@@ -111,3 +130,171 @@ auto write_recon_records(const std::vector<ReconRecord> &records, std::string pa
     writer.close();
     return true;
 }
+
+auto load_obj(std::filesystem::path obj_path, std::vector<Vertex> &vertices, std::string &texture_path) -> bool {
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string warn, err;
+
+    auto ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                                obj_path.c_str(),
+                                obj_path.parent_path().c_str());
+    if (!ret) {
+        mutex().lock();
+        RECON_LOG(RECON_RECORD) << "obj 模型加载失败。警告：" << warn << "，错误：" << err;
+        mutex().unlock();
+        return false;
+    }
+    if (materials.size() != 1) {
+        mutex().lock();
+        RECON_LOG(RECON_RECORD) << "材质数量错误。";
+        mutex().unlock();
+        return false;
+    }
+    vertices.clear();
+    for (auto i = 0; i < shapes.size(); i++) {
+        for (auto f = 0; f < shapes[i].mesh.indices.size(); f++) {
+            auto idx = shapes[i].mesh.indices[f];
+            vertices.push_back(Vertex {
+                { attrib.vertices[3 * idx.vertex_index + 0],
+                    attrib.vertices[3 * idx.vertex_index + 1],
+                    attrib.vertices[3 * idx.vertex_index + 2] },
+                { 0.0f, 0.0f, 0.0f }, // There aren't normals
+                { attrib.texcoords[2 * idx.texcoord_index + 0],
+                    attrib.texcoords[2 * idx.texcoord_index + 1] },
+                { 1.0f, 0.0f, 0.0f }
+            });
+        }
+    }
+    texture_path = (obj_path.parent_path() / materials[0].diffuse_texname).string();
+    return true;
+}
+
+auto center_vertices(std::vector<Vertex> &vertices) -> float {
+    glm::vec3 center_of_gravity(0.0f);
+    for (const auto &v : vertices) {
+        center_of_gravity += v.position;
+    }
+    center_of_gravity /= vertices.size();
+    float radius = 0.0f;
+    for (auto &v : vertices) {
+        v.position -= center_of_gravity;
+        radius = std::max(radius, glm::length(v.position));
+    }
+    return radius;
+}
+
+auto load_texture(std::string path) -> GLuint {
+    stbi_set_flip_vertically_on_load(true);
+    int width, height, channels;
+    auto *data = stbi_load(path.c_str(), &width, &height, &channels, 3);
+    if (!data) {
+        return GL_NONE;
+    }
+    auto texture = make_texture(data, width, height);
+    stbi_image_free(data);
+    return texture;
+}
+
+auto make_texture(const unsigned char *rgb, int width, int height) -> GLuint {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+    glBindTexture(GL_TEXTURE_2D, GL_NONE);
+    return texture;
+}
+
+// P N G ////////////////////////////////////////////
+auto crc32(const unsigned char *data, size_t length, unsigned int crc = 0) -> unsigned int {
+    static unsigned int table[256] = { 0 };
+    if (table[1] == 0) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i;
+            for (auto k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+auto png_chunk(std::ofstream &writer, const char *type, const std::vector<unsigned char> &data) -> void {
+    unsigned char length[4] = {
+        (unsigned char) (data.size() >> 24), (unsigned char) (data.size() >> 16),
+        (unsigned char) (data.size() >> 8), (unsigned char) data.size()
+    };
+    writer.write((char *) length, 4);
+    std::vector<unsigned char> body(type, type + 4);
+    body.insert(body.end(), data.begin(), data.end());
+    writer.write((char *) body.data(), body.size());
+    auto crc = crc32(body.data(), body.size());
+    unsigned char crc_bytes[4] = {
+        (unsigned char) (crc >> 24), (unsigned char) (crc >> 16),
+        (unsigned char) (crc >> 8), (unsigned char) crc
+    };
+    writer.write((char *) crc_bytes, 4);
+}
+
+/// Writes an 8-bit RGBA PNG. The zlib stream uses stored (uncompressed) blocks,
+/// which keeps this dependency free; thumbnails are small anyway.
+auto write_png(std::string path, int width, int height, const unsigned char *rgba) -> bool {
+    std::ofstream writer(path, std::ios::binary);
+    if (!writer.good()) {
+        return false;
+    }
+    const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    writer.write((char *) signature, sizeof(signature));
+
+    std::vector<unsigned char> header = {
+        (unsigned char) (width >> 24), (unsigned char) (width >> 16), (unsigned char) (width >> 8), (unsigned char) width,
+        (unsigned char) (height >> 24), (unsigned char) (height >> 16), (unsigned char) (height >> 8), (unsigned char) height,
+        8, 6, 0, 0, 0 // 8 bit, RGBA, deflate, no filter, no interlace
+    };
+    png_chunk(writer, "IHDR", header);
+
+    std::vector<unsigned char> raw;
+    raw.reserve((width * 4 + 1) * height);
+    for (auto y = 0; y < height; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgba + y * width * 4, rgba + (y + 1) * width * 4);
+    }
+    std::vector<unsigned char> zlib = { 0x78, 0x01 };
+    unsigned int a = 1, b = 0;
+    for (auto c : raw) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    size_t offset = 0;
+    do {
+        auto block = std::min(raw.size() - offset, (size_t) 65535);
+        auto last = offset + block == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(block & 0xff);
+        zlib.push_back((block >> 8) & 0xff);
+        zlib.push_back(~block & 0xff);
+        zlib.push_back((~block >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + block);
+        offset += block;
+    } while (offset < raw.size());
+    auto adler = (b << 16) | a;
+    zlib.push_back(adler >> 24);
+    zlib.push_back(adler >> 16);
+    zlib.push_back(adler >> 8);
+    zlib.push_back(adler);
+    png_chunk(writer, "IDAT", zlib);
+    png_chunk(writer, "IEND", {});
+    writer.close();
+    return true;
+}
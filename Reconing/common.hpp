@@ -32,6 +32,9 @@ auto compile(GLuint type, std::string path) -> GLuint;
 
 auto link(GLuint vertex_shader, GLuint fragment_shader) -> GLuint;
 
+/// Compiles and links a program once; later calls with the same shaders return the same program.
+auto shared_program(std::string vertex_path, std::string fragment_path) -> GLuint;
+
 // S T O R A G E //////////////////////////////////////////
 struct ReconRecord {
     ReconRecord() {}
@@ -56,6 +59,20 @@ struct Vertex {
     glm::vec3 color;
 };
 
+/// Loads a single-material textured OBJ as a flat triangle list.
+auto load_obj(std::filesystem::path obj_path, std::vector<Vertex> &vertices, std::string &texture_path) -> bool;
+
+/// Moves the vertices so their center of gravity sits at the origin. Returns the bounding radius.
+auto center_vertices(std::vector<Vertex> &vertices) -> float;
+
+auto load_texture(std::string path) -> GLuint;
+
+/// Uploads tightly packed RGB pixels as a texture.
+auto make_texture(const unsigned char *rgb, int width, int height) -> GLuint;
+
+// I M A G E S ////////////////////////////////////////////
+auto write_png(std::string path, int width, int height, const unsigned char *rgba) -> bool;
+
 
 
 
@@ -7,15 +7,42 @@
 
 #include <iostream>
 #include "Engine.hpp"
+#include "Headless.hpp"
+#include "Batch.hpp"
 
 // M O D U L E S /////////////////////////////
 #include "Modules/ImGuiDemoWindow.hpp"
 #include "Modules/Pipeline.hpp"
 #include "Modules/Records.hpp"
 #include "Modules/Online.hpp"
+#include "Modules/Sync.hpp"
 
 
 int main(int argc, const char * argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--headless") {
+        HeadlessOptions options;
+        if (!HeadlessRenderer::parse_options(argc, argv, options)) {
+            return 1;
+        }
+        HeadlessRenderer renderer(options);
+        auto ret = renderer.init() ? renderer.run() : 1;
+        std::cout << get_log().str() << std::endl;
+        return ret;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--reconstruct") {
+        BatchOptions options;
+        if (!BatchReconstruction::parse_options(argc, argv, options)) {
+            return 1;
+        }
+        return BatchReconstruction(options).run();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--sync") {
+        SyncOptions options;
+        if (!SyncEngine::parse_options(argc, argv, options)) {
+            return 1;
+        }
+        return SyncEngine(options).run();
+    }
     Engine engine;
 //    engine.register_module(new ImGuiDemoWindowModule());
     engine.register_module(new PipelineModule());
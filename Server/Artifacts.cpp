@@ -0,0 +1,511 @@
+//
+//  Artifacts.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#include "Artifacts.hpp"
+#include "Mesh.hpp"
+#include "Hash.hpp"
+#include "Log.hpp"
+#include <atomic>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace {
+
+struct Image {
+    int width = 0, height = 0;
+    std::vector<unsigned char> rgb;
+};
+
+};
+
+template<typename T>
+static auto append(std::string &out, T value) -> void {
+    out.append((const char *) &value, sizeof(value));
+}
+
+/// Writes under a temporary name and renames, so a reader never sees half a file.
+static auto write_artifact(const std::string &path, const std::string &bytes) -> bool {
+    static std::atomic<uint64_t> counter { 0 };
+    auto temporary = path + ".tmp." + std::to_string(counter++);
+    std::ofstream writer(temporary, std::ios::binary);
+    writer.write(bytes.data(), bytes.size());
+    writer.close();
+    std::error_code error;
+    if (!writer.good()) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+}
+
+// M E S H E S ////////////////////////////////////////
+
+/// The triangle list as it goes into a vertex buffer, flat shaded.
+static auto encode_mesh(const ObjMesh &mesh) -> std::string {
+    std::string out(ARTIFACT_MESH_MAGIC);
+    out.reserve(out.size() + sizeof(uint32_t) + mesh.triangles.size() * 3 * 8 * sizeof(float));
+    append(out, (uint32_t) (mesh.triangles.size() * 3));
+    for (const auto &triangle : mesh.triangles) {
+        const auto &a = mesh.positions[triangle[0].position];
+        const auto &b = mesh.positions[triangle[1].position];
+        const auto &c = mesh.positions[triangle[2].position];
+        float ab[3], ac[3], normal[3];
+        for (auto axis = 0; axis < 3; axis++) {
+            ab[axis] = b[axis] - a[axis];
+            ac[axis] = c[axis] - a[axis];
+        }
+        normal[0] = ab[1] * ac[2] - ab[2] * ac[1];
+        normal[1] = ab[2] * ac[0] - ab[0] * ac[2];
+        normal[2] = ab[0] * ac[1] - ab[1] * ac[0];
+        auto length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        for (auto &component : normal) {
+            component = length > 0.0f ? component / length : 0.0f;
+        }
+        for (const auto &corner : triangle) {
+            for (auto coordinate : mesh.positions[corner.position]) {
+                append(out, coordinate);
+            }
+            for (auto component : normal) {
+                append(out, component);
+            }
+            append(out, corner.u);
+            append(out, corner.v);
+        }
+    }
+    return out;
+}
+
+// T E X T U R E S ////////////////////////////////////
+
+static auto to_565(const float color[3]) -> uint16_t {
+    auto r = (int) std::lround(std::clamp(color[0], 0.0f, 255.0f) * 31.0f / 255.0f);
+    auto g = (int) std::lround(std::clamp(color[1], 0.0f, 255.0f) * 63.0f / 255.0f);
+    auto b = (int) std::lround(std::clamp(color[2], 0.0f, 255.0f) * 31.0f / 255.0f);
+    return (uint16_t) ((r << 11) | (g << 5) | b);
+}
+
+static auto from_565(uint16_t packed, float color[3]) -> void {
+    color[0] = ((packed >> 11) & 31) * 255.0f / 31.0f;
+    color[1] = ((packed >> 5) & 63) * 255.0f / 63.0f;
+    color[2] = (packed & 31) * 255.0f / 31.0f;
+}
+
+/// One 4 × 4 block: the ends of the colors' bounding box, pulled in a little, and each pixel's
+/// nearest of the four colors between them.
+static auto encode_block(const unsigned char pixels[16][3], std::string &out) -> void {
+    float low[3] = { 255.0f, 255.0f, 255.0f }, high[3] = { 0.0f, 0.0f, 0.0f };
+    for (auto i = 0; i < 16; i++) {
+        for (auto channel = 0; channel < 3; channel++) {
+            low[channel] = std::min(low[channel], (float) pixels[i][channel]);
+            high[channel] = std::max(high[channel], (float) pixels[i][channel]);
+        }
+    }
+    for (auto channel = 0; channel < 3; channel++) {
+        auto inset = (high[channel] - low[channel]) / 16.0f;
+        low[channel] += inset;
+        high[channel] -= inset;
+    }
+    auto color0 = to_565(high), color1 = to_565(low);
+    if (color0 < color1) {
+        std::swap(color0, color1);
+    }
+    uint32_t indices = 0;
+    if (color0 != color1) {
+        // color0 > color1 picks the four-color mode
+        float palette[4][3];
+        from_565(color0, palette[0]);
+        from_565(color1, palette[1]);
+        for (auto channel = 0; channel < 3; channel++) {
+            palette[2][channel] = (2.0f * palette[0][channel] + palette[1][channel]) / 3.0f;
+            palette[3][channel] = (palette[0][channel] + 2.0f * palette[1][channel]) / 3.0f;
+        }
+        for (auto i = 0; i < 16; i++) {
+            auto best = 0;
+            auto best_distance = std::numeric_limits<float>::max();
+            for (auto entry = 0; entry < 4; entry++) {
+                float distance = 0.0f;
+                for (auto channel = 0; channel < 3; channel++) {
+                    auto delta = palette[entry][channel] - pixels[i][channel];
+                    distance += delta * delta;
+                }
+                if (distance < best_distance) {
+                    best = entry;
+                    best_distance = distance;
+                }
+            }
+            indices |= (uint32_t) best << (2 * i);
+        }
+    }
+    append(out, color0);
+    append(out, color1);
+    append(out, indices);
+}
+
+static auto encode_bc1(const Image &image, std::string &out) -> void {
+    unsigned char pixels[16][3];
+    for (auto by = 0; by < image.height; by += 4) {
+        for (auto bx = 0; bx < image.width; bx += 4) {
+            // Blocks past the edge repeat the last row and column
+            for (auto i = 0; i < 16; i++) {
+                auto x = std::min(bx + i % 4, image.width - 1), y = std::min(by + i / 4, image.height - 1);
+                std::memcpy(pixels[i], &image.rgb[((size_t) y * image.width + x) * 3], 3);
+            }
+            encode_block(pixels, out);
+        }
+    }
+}
+
+/// Half the size, each pixel the average of the ones it covers.
+static auto downsample(const Image &image) -> Image {
+    Image half;
+    half.width = std::max(1, image.width / 2);
+    half.height = std::max(1, image.height / 2);
+    half.rgb.resize((size_t) half.width * half.height * 3);
+    for (auto y = 0; y < half.height; y++) {
+        for (auto x = 0; x < half.width; x++) {
+            for (auto channel = 0; channel < 3; channel++) {
+                auto sum = 0;
+                for (auto dy = 0; dy < 2; dy++) {
+                    for (auto dx = 0; dx < 2; dx++) {
+                        auto sx = std::min(x * 2 + dx, image.width - 1), sy = std::min(y * 2 + dy, image.height - 1);
+                        sum += image.rgb[((size_t) sy * image.width + sx) * 3 + channel];
+                    }
+                }
+                half.rgb[((size_t) y * half.width + x) * 3 + channel] = (unsigned char) ((sum + 2) / 4);
+            }
+        }
+    }
+    return half;
+}
+
+static auto encode_texture(const Image &image) -> std::string {
+    std::string out(ARTIFACT_TEXTURE_MAGIC);
+    auto levels = 1;
+    for (auto size = std::max(image.width, image.height); size > 1; size /= 2) {
+        levels++;
+    }
+    append(out, (uint32_t) image.width);
+    append(out, (uint32_t) image.height);
+    append(out, (uint32_t) levels);
+    auto level = image;
+    for (auto i = 0; i < levels; i++) {
+        encode_bc1(level, out);
+        if (i + 1 < levels) {
+            level = downsample(level);
+        }
+    }
+    return out;
+}
+
+// T H U M B N A I L S ////////////////////////////////
+
+/// Draws the model with a z-buffer, textured if there's a texture, lit from the viewer's side.
+/// Whatever isn't covered stays transparent.
+static auto render_thumbnail(const ObjMesh &mesh, const Image &texture) -> std::vector<unsigned char> {
+    const auto size = ARTIFACT_THUMBNAIL;
+    std::vector<unsigned char> rgba((size_t) size * size * 4, 0);
+    std::vector<float> depth((size_t) size * size, -std::numeric_limits<float>::max());
+
+    // A little from above and to the side, fitted to the bounding sphere
+    const float yaw = 0.5f, pitch = 0.35f;
+    float center[3], radius = 0.0f;
+    for (auto axis = 0; axis < 3; axis++) {
+        center[axis] = (mesh.min[axis] + mesh.max[axis]) * 0.5f;
+        radius += (mesh.max[axis] - mesh.min[axis]) * (mesh.max[axis] - mesh.min[axis]);
+    }
+    radius = std::max(std::sqrt(radius) * 0.5f, 1e-6f);
+    auto scale = size * 0.48f / radius;
+    std::vector<std::array<float, 3>> projected(mesh.positions.size());
+    for (size_t i = 0; i < mesh.positions.size(); i++) {
+        auto x = mesh.positions[i][0] - center[0], y = mesh.positions[i][1] - center[1], z = mesh.positions[i][2] - center[2];
+        auto x1 = x * std::cos(yaw) + z * std::sin(yaw), z1 = -x * std::sin(yaw) + z * std::cos(yaw);
+        auto y2 = y * std::cos(pitch) - z1 * std::sin(pitch), z2 = y * std::sin(pitch) + z1 * std::cos(pitch);
+        projected[i] = { size * 0.5f + x1 * scale, size * 0.5f - y2 * scale, z2 };
+    }
+
+    for (const auto &triangle : mesh.triangles) {
+        const auto &a = projected[triangle[0].position];
+        const auto &b = projected[triangle[1].position];
+        const auto &c = projected[triangle[2].position];
+        auto area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+        if (std::fabs(area) < 1e-8f) {
+            continue;
+        }
+        // Facing the viewer or not, both sides are drawn; the light follows the facing side
+        float ab[3], ac[3];
+        for (auto axis = 0; axis < 3; axis++) {
+            ab[axis] = b[axis] - a[axis];
+            ac[axis] = c[axis] - a[axis];
+        }
+        float normal[3] = { ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0] };
+        auto length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        auto shade = 0.35f + 0.65f * (length > 0.0f ? std::fabs(normal[2]) / length : 0.0f);
+
+        auto min_x = std::max(0, (int) std::floor(std::min({ a[0], b[0], c[0] })));
+        auto max_x = std::min(size - 1, (int) std::ceil(std::max({ a[0], b[0], c[0] })));
+        auto min_y = std::max(0, (int) std::floor(std::min({ a[1], b[1], c[1] })));
+        auto max_y = std::min(size - 1, (int) std::ceil(std::max({ a[1], b[1], c[1] })));
+        for (auto y = min_y; y <= max_y; y++) {
+            for (auto x = min_x; x <= max_x; x++) {
+                auto px = x + 0.5f, py = y + 0.5f;
+                auto w0 = ((b[0] - px) * (c[1] - py) - (b[1] - py) * (c[0] - px)) / area;
+                auto w1 = ((c[0] - px) * (a[1] - py) - (c[1] - py) * (a[0] - px)) / area;
+                auto w2 = 1.0f - w0 - w1;
+                if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) {
+                    continue;
+                }
+                auto z = w0 * a[2] + w1 * b[2] + w2 * c[2];
+                auto pixel = (size_t) y * size + x;
+                if (z <= depth[pixel]) {
+                    continue;
+                }
+                depth[pixel] = z;
+                unsigned char color[3] = { 200, 200, 200 };
+                if (!texture.rgb.empty()) {
+                    auto u = w0 * triangle[0].u + w1 * triangle[1].u + w2 * triangle[2].u;
+                    auto v = w0 * triangle[0].v + w1 * triangle[1].v + w2 * triangle[2].v;
+                    u -= std::floor(u);
+                    v -= std::floor(v);
+                    // Rows are stored top down; v runs bottom up
+                    auto tx = std::min((int) (u * texture.width), texture.width - 1);
+                    auto ty = std::min((int) ((1.0f - v) * texture.height), texture.height - 1);
+                    std::memcpy(color, &texture.rgb[((size_t) ty * texture.width + tx) * 3], 3);
+                }
+                for (auto channel = 0; channel < 3; channel++) {
+                    rgba[pixel * 4 + channel] = (unsigned char) std::min(255.0f, color[channel] * shade);
+                }
+                rgba[pixel * 4 + 3] = 255;
+            }
+        }
+    }
+    return rgba;
+}
+
+static auto png_chunk(std::string &out, const char *type, const std::string &data) -> void {
+    auto length = (uint32_t) data.size();
+    unsigned char length_bytes[4] = {
+        (unsigned char) (length >> 24), (unsigned char) (length >> 16), (unsigned char) (length >> 8), (unsigned char) length
+    };
+    out.append((const char *) length_bytes, 4);
+    auto body = std::string(type, 4) + data;
+    out += body;
+    auto crc = crc32(body.data(), body.size());
+    unsigned char crc_bytes[4] = {
+        (unsigned char) (crc >> 24), (unsigned char) (crc >> 16), (unsigned char) (crc >> 8), (unsigned char) crc
+    };
+    out.append((const char *) crc_bytes, 4);
+}
+
+/// An 8-bit RGBA PNG in stored (uncompressed) deflate blocks; a thumbnail is small enough.
+static auto encode_png(int width, int height, const std::vector<unsigned char> &rgba) -> std::string {
+    std::string out("\x89PNG\r\n\x1a\n", 8);
+    std::string header;
+    for (auto value : { width, height }) {
+        header += (char) (value >> 24);
+        header += (char) (value >> 16);
+        header += (char) (value >> 8);
+        header += (char) value;
+    }
+    header += std::string("\x08\x06\x00\x00\x00", 5); // 8 bit, RGBA, deflate, no filter, no interlace
+    png_chunk(out, "IHDR", header);
+
+    std::string raw;
+    raw.reserve((size_t) (width * 4 + 1) * height);
+    for (auto y = 0; y < height; y++) {
+        raw += '\0';
+        raw.append((const char *) &rgba[(size_t) y * width * 4], (size_t) width * 4);
+    }
+    std::string zlib("\x78\x01", 2);
+    uint32_t a = 1, b = 0;
+    for (auto c : raw) {
+        a = (a + (unsigned char) c) % 65521;
+        b = (b + a) % 65521;
+    }
+    size_t offset = 0;
+    do {
+        auto block = std::min(raw.size() - offset, (size_t) 65535);
+        zlib += (char) (offset + block == raw.size() ? 1 : 0);
+        zlib += (char) (block & 0xff);
+        zlib += (char) ((block >> 8) & 0xff);
+        zlib += (char) (~block & 0xff);
+        zlib += (char) ((~block >> 8) & 0xff);
+        zlib.append(raw, offset, block);
+        offset += block;
+    } while (offset < raw.size());
+    auto adler = (b << 16) | a;
+    for (auto shift : { 24, 16, 8, 0 }) {
+        zlib += (char) (adler >> shift);
+    }
+    png_chunk(out, "IDAT", zlib);
+    png_chunk(out, "IEND", "");
+    return out;
+}
+
+// Q U E U E //////////////////////////////////////////
+
+auto Artifacts::init() -> bool {
+    std::error_code error;
+    std::filesystem::create_directories(root, error);
+    return !error;
+}
+
+auto Artifacts::start(int workers, std::function<void(const std::string &name)> runner) -> void {
+    this->runner = runner;
+    for (auto i = 0; i < workers; i++) {
+        threads.emplace_back([this] () {
+            work();
+        });
+    }
+}
+
+auto Artifacts::stop() -> void {
+    queue_mutex.lock();
+    stopping = true;
+    queue_mutex.unlock();
+    condition.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+auto Artifacts::enqueue(const std::string &name) -> void {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (waiting_names.insert(name).second) {
+        queued.push_back(name);
+        condition.notify_one();
+    }
+}
+
+auto Artifacts::waiting() -> int {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return (int) queued.size();
+}
+
+auto Artifacts::work() -> void {
+    while (true) {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        condition.wait(lock, [this] () {
+            return stopping || !queued.empty();
+        });
+        if (stopping) {
+            return;
+        }
+        auto name = queued.front();
+        queued.pop_front();
+        // Published again from here on means it's worth queueing again
+        waiting_names.erase(name);
+        lock.unlock();
+        runner(name);
+    }
+}
+
+auto Artifacts::directory(const std::string &hash) const -> std::string {
+    return root + "/" + hash;
+}
+
+auto Artifacts::build(Store &store, const std::string &base, online::Request &made) -> bool {
+    DownloadStream stream(store, base);
+    if (!stream.open()) {
+        return false;
+    }
+    auto target = directory(stream.hash);
+    std::error_code error;
+    std::filesystem::create_directories(target, error);
+    if (error) {
+        return false;
+    }
+    made.Clear();
+    made.add_arg(stream.hash);
+    auto add = [&] (const std::string &name, const std::string &bytes) {
+        if (write_artifact(target + "/" + name, bytes)) {
+            made.add_arg(name);
+            made.add_arg(std::to_string(bytes.size()));
+        }
+    };
+
+    std::string file;
+    Image texture;
+    if (stream.sizes[2] > 0 && stream.read_file(2, file)) {
+        int channels;
+        auto *data = stbi_load_from_memory((const unsigned char *) file.data(), (int) file.size(),
+                                           &texture.width, &texture.height, &channels, 3);
+        if (data) {
+            texture.rgb.assign(data, data + (size_t) texture.width * texture.height * 3);
+            stbi_image_free(data);
+        }
+    }
+    ObjMesh mesh;
+    auto has_mesh = stream.read_file(0, file) && parse_obj(file, mesh);
+    file.clear();
+    file.shrink_to_fit();
+
+    if (has_mesh) {
+        add(ARTIFACT_NAMES[0], encode_mesh(mesh));
+        for (auto lod = 0; lod < ARTIFACT_LODS; lod++) {
+            add(ARTIFACT_NAMES[1 + lod], encode_mesh(cluster_mesh(mesh, ARTIFACT_LOD_GRIDS[lod])));
+        }
+    }
+    if (!texture.rgb.empty()) {
+        add(ARTIFACT_NAMES[1 + ARTIFACT_LODS], encode_texture(texture));
+    }
+    if (has_mesh) {
+        add(ARTIFACT_NAMES[2 + ARTIFACT_LODS], encode_png(ARTIFACT_THUMBNAIL, ARTIFACT_THUMBNAIL,
+                                                          render_thumbnail(mesh, texture)));
+    }
+    return true;
+}
+
+auto Artifacts::open(const std::string &hash, const std::string &name, int64_t &size) const -> std::shared_ptr<FileHandle> {
+    auto known = std::find_if(std::begin(ARTIFACT_NAMES), std::end(ARTIFACT_NAMES), [&] (const char *artifact) {
+        return name == artifact;
+    });
+    if (known == std::end(ARTIFACT_NAMES)) {
+        return nullptr;
+    }
+    auto fd = ::open((directory(hash) + "/" + name).c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    auto file = std::make_shared<FileHandle>(fd);
+    size = (int64_t) lseek(fd, 0, SEEK_END);
+    return size >= 0 ? file : nullptr;
+}
+
+auto Artifacts::collect(const std::vector<Manifest> &live) -> int {
+    std::set<std::string> referenced;
+    for (const auto &manifest : live) {
+        referenced.insert(directory(manifest.hash));
+    }
+    auto removed = 0;
+    std::error_code error;
+    std::vector<std::filesystem::path> garbage;
+    for (const auto &entry : std::filesystem::directory_iterator(root, error)) {
+        if (referenced.count(entry.path().string()) == 0) {
+            garbage.push_back(entry.path());
+        }
+    }
+    for (const auto &path : garbage) {
+        if (std::filesystem::remove_all(path, error) > 0) {
+            removed++;
+        }
+    }
+    return removed;
+}
+
+Artifacts::~Artifacts() {
+    stop();
+}
@@ -0,0 +1,77 @@
+//
+//  Artifacts.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Artifacts_hpp
+#define Artifacts_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include "Store.hpp"
+#include "Transfer.hpp"
+#include "Protocol.hpp"
+
+#define ARTIFACT_WORKERS 1
+
+/// Files derived from stored records for clients that don't want the whole record: LOD meshes,
+/// a binary mesh ready for the GPU, a mipmapped BC1 texture and a thumbnail. One directory per
+/// content hash at <root>/<hash>; see Protocol.hpp for the formats. Records are queued as they
+/// are published and made by threads of its own, so an upload never waits on them.
+class Artifacts {
+public:
+    Artifacts(std::string root) : root(root), stopping(false) {}
+
+    ~Artifacts();
+
+    auto init() -> bool;
+
+    /// Starts `workers` threads, each taking queued record names through `runner`.
+    auto start(int workers, std::function<void(const std::string &name)> runner) -> void;
+
+    auto stop() -> void;
+
+    /// Queues a record, unless it's waiting already; whatever it holds when its turn comes is
+    /// what gets processed.
+    auto enqueue(const std::string &name) -> void;
+
+    /// Records queued and not yet picked up.
+    auto waiting() -> int;
+
+    auto directory(const std::string &hash) const -> std::string;
+
+    /// Makes the artifacts of the record at `base`. `made` gets its content hash, then the name
+    /// and size of each file made; a texture or mesh it can't read just leaves its files out.
+    auto build(Store &store, const std::string &base, online::Request &made) -> bool;
+
+    /// One of the files made for `hash`, or nullptr if there is none.
+    auto open(const std::string &hash, const std::string &name, int64_t &size) const -> std::shared_ptr<FileHandle>;
+
+    /// Deletes the artifacts of content no record has any more.
+    auto collect(const std::vector<Manifest> &live) -> int;
+
+    std::string root;
+
+private:
+    auto work() -> void;
+
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    std::deque<std::string> queued;
+    std::set<std::string> waiting_names;
+    std::vector<std::thread> threads;
+    std::function<void(const std::string &)> runner;
+    bool stopping;
+};
+
+#endif /* Artifacts_hpp */
@@ -0,0 +1,89 @@
+//
+//  Cache.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Cache.hpp"
+#include <functional>
+
+auto PayloadCache::resize(int64_t capacity) -> void {
+    shard_capacity = capacity / CACHE_SHARDS;
+}
+
+auto PayloadCache::shard(const std::string &key) -> Shard & {
+    return shards[std::hash<std::string>()(key) % CACHE_SHARDS];
+}
+
+auto PayloadCache::get(const std::string &key, CacheTicket &ticket) -> std::shared_ptr<const std::string> {
+    auto &shard = this->shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        hits++;
+        return it->second->payload;
+    }
+    misses++;
+    ticket.epoch = shard.epoch;
+    ticket.admit = shard.seen.erase(key) > 0;
+    if (!ticket.admit) {
+        if (shard.seen.size() >= CACHE_DOORKEEPER) {
+            shard.seen.clear();
+        }
+        shard.seen.insert(key);
+    }
+    return nullptr;
+}
+
+auto PayloadCache::put(const std::string &key, std::shared_ptr<const std::string> payload,
+                       const CacheTicket &ticket) -> void {
+    auto size = (int64_t) payload->size();
+    if (!ticket.admit || size > shard_capacity) {
+        return;
+    }
+    auto &shard = this->shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.epoch != ticket.epoch || shard.index.count(key) > 0) {
+        // Overwritten while we were reading it, or someone else got there first
+        return;
+    }
+    shard.entries.push_front({ key, std::move(payload) });
+    shard.index[key] = shard.entries.begin();
+    shard.bytes += size;
+    while (shard.bytes > shard_capacity) {
+        auto &last = shard.entries.back();
+        shard.bytes -= last.payload->size();
+        shard.index.erase(last.key);
+        shard.entries.pop_back();
+        evictions++;
+    }
+}
+
+auto PayloadCache::fits(int64_t size) const -> bool {
+    return size <= shard_capacity;
+}
+
+auto PayloadCache::invalidate(const std::string &key) -> void {
+    auto &shard = this->shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.epoch++;
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        return;
+    }
+    shard.bytes -= it->second->payload->size();
+    shard.entries.erase(it->second);
+    shard.index.erase(it);
+}
+
+auto PayloadCache::stats() -> CacheStats {
+    CacheStats stats { hits, misses, evictions, 0, 0 };
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        stats.entries += shard.entries.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
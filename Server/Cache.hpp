@@ -0,0 +1,89 @@
+//
+//  Cache.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Cache_hpp
+#define Cache_hpp
+
+#include <string>
+#include <list>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_BYTES (256ll << 20)
+#define CACHE_DOORKEEPER 4096 // Names remembered per shard before the doorkeeper forgets them all
+
+/// Handed out by a miss, and needed to fill it in.
+struct CacheTicket {
+    uint64_t epoch = 0; // Of the shard at the miss; an invalidation since makes the fill stale
+    bool admit = false; // Asked for before; worth the memory
+};
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    int64_t bytes;
+};
+
+/// Size-bounded LRU of ready-to-send download frames: a `download`'s keyed by record name, a
+/// `download_range`'s chunk frames by content hash and codec. Split into shards with a lock each,
+/// so concurrent downloads of different records rarely contend. A key only gets cached the
+/// second time it misses, so one-off downloads don't push popular ones out.
+class PayloadCache {
+public:
+    PayloadCache(int64_t capacity = CACHE_DEFAULT_BYTES) {
+        resize(capacity);
+    }
+
+    /// Only before the server starts taking connections.
+    auto resize(int64_t capacity) -> void;
+
+    auto get(const std::string &key, CacheTicket &ticket) -> std::shared_ptr<const std::string>;
+
+    /// Keeps `payload` unless the ticket says not to, or the key changed since the miss.
+    auto put(const std::string &key, std::shared_ptr<const std::string> payload, const CacheTicket &ticket) -> void;
+
+    /// Whether a payload of `size` bytes could be kept at all, before going to the trouble of making it.
+    auto fits(int64_t size) const -> bool;
+
+    /// Drops the entry, e.g. when an upload overwrites the record.
+    auto invalidate(const std::string &key) -> void;
+
+    auto stats() -> CacheStats;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const std::string> payload;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> entries; // Most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        std::unordered_set<std::string> seen; // Missed once, not cached yet
+        int64_t bytes = 0;
+        uint64_t epoch = 0;
+    };
+
+    auto shard(const std::string &key) -> Shard &;
+
+    std::array<Shard, CACHE_SHARDS> shards;
+    int64_t shard_capacity;
+    std::atomic<uint64_t> hits { 0 };
+    std::atomic<uint64_t> misses { 0 };
+    std::atomic<uint64_t> evictions { 0 };
+};
+
+#endif /* Cache_hpp */
@@ -0,0 +1,513 @@
+//
+//  Catalogue.cpp
+//  Server
+//
+//  Created by apple on 27/04/2021.
+//
+
+#include "Catalogue.hpp"
+#include "Hash.hpp"
+#include "Shards.hpp"
+#include "Log.hpp"
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Log entries are [uint32_t length][uint32_t CRC-32][type][serialized message], the length and
+// CRC covering type and message. Replay stops at the first torn or corrupt entry.
+
+auto Catalogue::open() -> bool {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    online::Users loaded_users;
+    online::ReconRecords loaded_records;
+    std::ifstream users_reader(directory + "/users.bin", std::ios::binary);
+    if (users_reader.good()) {
+        loaded_users.ParseFromIstream(&users_reader);
+    }
+    std::ifstream records_reader(directory + "/records.bin", std::ios::binary);
+    if (records_reader.good()) {
+        loaded_records.ParseFromIstream(&records_reader);
+    }
+    // The counter, then the version each snapshot record last changed at
+    std::unordered_map<int, uint64_t> loaded_versions;
+    std::ifstream version_reader(directory + "/catalogue.version");
+    if (version_reader >> version) {
+        int id;
+        uint64_t at;
+        while (version_reader >> id >> at) {
+            loaded_versions[id] = at;
+        }
+    }
+    std::vector<online::Request> loaded_artifacts;
+    std::ifstream artifacts_reader(directory + "/artifacts.bin", std::ios::binary);
+    uint32_t length;
+    std::string payload;
+    while (artifacts_reader.read((char *) &length, sizeof(length))) {
+        payload.resize(length);
+        online::Request entry;
+        if (!artifacts_reader.read(&payload[0], length) || !entry.ParseFromString(payload)) {
+            break;
+        }
+        loaded_artifacts.push_back(std::move(entry));
+    }
+    for (const auto &user : loaded_users.users()) {
+        apply_user(user);
+    }
+    for (auto record : loaded_records.records()) {
+        // Older servers could hand out the same id twice; give clashes a fresh one
+        auto owner = record_index.find(record.id());
+        if (record.id() <= 0 || (owner != record_index.end() &&
+                                 records_list.records(owner->second).name() != record.name())) {
+            record.set_id(next_record_id);
+            apply_record(record, ++version);
+            continue;
+        }
+        auto at = loaded_versions.find(record.id());
+        apply_record(record, at != loaded_versions.end() ? at->second : 0);
+    }
+    for (const auto &entry : loaded_artifacts) {
+        // Their changes are already counted in the records' versions
+        apply_artifacts(entry, 0);
+    }
+    if (!replay()) {
+        return false;
+    }
+    // Start from a clean log, which also persists any ids reassigned above
+    return compact_locked();
+}
+
+auto Catalogue::replay() -> bool {
+    auto path = directory + "/catalogue.wal";
+    log_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (log_fd == -1) {
+        return false;
+    }
+    std::ifstream reader(path, std::ios::binary);
+    std::string entry;
+    off_t valid = 0;
+    while (true) {
+        uint32_t header[2];
+        if (!reader.read((char *) header, sizeof(header))) {
+            break;
+        }
+        entry.resize(header[0]);
+        if (header[0] == 0 || !reader.read(&entry[0], header[0]) ||
+            crc32(entry.data(), entry.size()) != header[1]) {
+            SERVER_ERROR << "日志尾部已损坏，已丢弃";
+            break;
+        }
+        auto payload = entry.substr(1);
+        if (entry[0] == USER) {
+            online::User user;
+            if (user.ParseFromString(payload)) {
+                apply_user(user);
+            }
+        } else if (entry[0] == RECORD) {
+            online::ReconRecord record;
+            if (record.ParseFromString(payload)) {
+                apply_record(record, ++version);
+            }
+        } else if (entry[0] == ARTIFACTS) {
+            online::Request artifacts;
+            if (artifacts.ParseFromString(payload)) {
+                apply_artifacts(artifacts, ++version);
+            }
+        } else if (entry[0] == DROP) {
+            online::ReconRecord record;
+            if (record.ParseFromString(payload)) {
+                apply_drop(record.id());
+            }
+        }
+        valid += sizeof(header) + header[0];
+        log_entries++;
+    }
+    // Appends go after the last good entry
+    return ftruncate(log_fd, valid) == 0 && lseek(log_fd, valid, SEEK_SET) != -1;
+}
+
+auto Catalogue::apply_user(const online::User &user) -> void {
+    if (user_index.count(user.username()) > 0) {
+        return;
+    }
+    user_index[user.username()] = users.users_size();
+    *users.add_users() = user;
+}
+
+auto Catalogue::apply_record(const online::ReconRecord &record, uint64_t at) -> void {
+    auto named = record_names.find(record.name());
+    if (named != record_names.end() && named->second != record.id()) {
+        // Same record under its old id; renumber it in place
+        auto old_id = named->second;
+        auto position = record_index[old_id];
+        record_index.erase(old_id);
+        record_index[record.id()] = position;
+        changes.erase(record_versions[old_id]);
+        record_versions.erase(old_id);
+        record_ids.erase(old_id);
+        owner_ids[records_list.records(position).owner()].erase(old_id);
+    }
+    auto indexed = record_index.find(record.id());
+    if (indexed == record_index.end()) {
+        record_index[record.id()] = records_list.records_size();
+        *records_list.add_records() = record;
+    } else {
+        auto &previous = *records_list.mutable_records(indexed->second);
+        owner_ids[previous.owner()].erase(record.id());
+        sorted_names.erase(previous.name());
+        previous = record;
+    }
+    auto changed = record_versions.find(record.id());
+    if (changed != record_versions.end()) {
+        changes.erase(changed->second);
+    }
+    record_versions[record.id()] = at;
+    if (at > 0) {
+        changes[at] = record.id();
+    }
+    record_ids.insert(record.id());
+    sorted_names.insert(record.name());
+    owner_ids[record.owner()].insert(record.id());
+    record_names[record.name()] = record.id();
+    next_record_id = std::max(next_record_id, record.id() + 1);
+}
+
+auto Catalogue::apply_artifacts(const online::Request &entry, uint64_t at) -> void {
+    if (entry.arg_size() < 2) {
+        return;
+    }
+    record_artifacts_by_name[entry.arg(0)] = entry;
+    auto named = record_names.find(entry.arg(0));
+    if (named == record_names.end() || at == 0) {
+        return;
+    }
+    changes.erase(record_versions[named->second]);
+    record_versions[named->second] = at;
+    changes[at] = named->second;
+}
+
+auto Catalogue::apply_drop(int id) -> void {
+    auto indexed = record_index.find(id);
+    if (indexed == record_index.end()) {
+        return;
+    }
+    auto position = indexed->second;
+    auto record = records_list.records(position);
+    record_index.erase(indexed);
+    // The last record takes its place, so only that one moves
+    auto last = records_list.records_size() - 1;
+    if (position != last) {
+        records_list.mutable_records()->SwapElements(position, last);
+        record_index[records_list.records(position).id()] = position;
+    }
+    records_list.mutable_records()->RemoveLast();
+    auto changed = record_versions.find(id);
+    if (changed != record_versions.end()) {
+        changes.erase(changed->second);
+        record_versions.erase(changed);
+    }
+    record_ids.erase(id);
+    sorted_names.erase(record.name());
+    owner_ids[record.owner()].erase(id);
+    record_names.erase(record.name());
+    record_artifacts_by_name.erase(record.name());
+}
+
+auto Catalogue::append(Entry type, const std::string &payload) -> bool {
+    std::string entry(sizeof(uint32_t) * 2, '\0');
+    entry.push_back(type);
+    entry += payload;
+    uint32_t header[2] = {
+        (uint32_t) (entry.size() - sizeof(header)),
+        crc32(entry.data() + sizeof(header), entry.size() - sizeof(header))
+    };
+    std::memcpy(&entry[0], header, sizeof(header));
+    size_t written = 0;
+    while (written < entry.size()) {
+        auto result = ::write(log_fd, entry.data() + written, entry.size() - written);
+        if (result <= 0) {
+            return false;
+        }
+        written += result;
+    }
+#ifdef __APPLE__
+    // fsync on macOS only reaches the drive's cache
+    fcntl(log_fd, F_FULLFSYNC);
+#else
+    fdatasync(log_fd);
+#endif
+    if (++log_entries >= CATALOGUE_COMPACT_ENTRIES) {
+        compact_locked();
+    }
+    return true;
+}
+
+auto Catalogue::authenticate(const std::string &username, const std::string &password) -> std::optional<online::User> {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = user_index.find(username);
+    if (it == user_index.end() || users.users(it->second).password() != password) {
+        return {};
+    }
+    return users.users(it->second);
+}
+
+auto Catalogue::add_user(const std::string &username, const std::string &password) -> std::optional<online::User> {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (user_index.count(username) > 0) {
+        return {};
+    }
+    online::User user;
+    user.set_id(users.users_size());
+    user.set_username(username);
+    user.set_password(password);
+    if (!append(USER, user.SerializeAsString())) {
+        return {};
+    }
+    apply_user(user);
+    return user;
+}
+
+auto Catalogue::publish(const std::string &owner, const std::string &name, std::optional<int> id) -> std::optional<online::ReconRecord> {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    online::ReconRecord record;
+    auto named = record_names.find(name);
+    if (named != record_names.end()) {
+        SERVER_ERROR << "用户尝试上传的记录已经存在。正在覆盖...";
+        id = named->second;
+    } else if (!id.has_value() && hashed_ids) {
+        // Another name got there first; the next free one will do, and the router finds it by asking around
+        id = shard_record_id(name);
+        while (record_index.count(*id) > 0) {
+            id = *id < SHARD_ID_MAX ? *id + 1 : 1;
+        }
+    }
+    record.set_id(id.value_or(next_record_id));
+    record.set_owner(owner);
+    record.set_name(name);
+    if (!append(RECORD, record.SerializeAsString())) {
+        SERVER_ERROR << "写入日志失败：" << strerror(errno);
+        return {};
+    }
+    apply_record(record, ++version);
+    return record;
+}
+
+auto Catalogue::find(int id) -> std::optional<online::ReconRecord> {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = record_index.find(id);
+    if (it == record_index.end()) {
+        return {};
+    }
+    return records_list.records(it->second);
+}
+
+auto Catalogue::find_named(const std::string &name) -> std::optional<online::ReconRecord> {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = record_names.find(name);
+    if (it == record_names.end()) {
+        return {};
+    }
+    return records_list.records(record_index.at(it->second));
+}
+
+auto Catalogue::drop(int id) -> std::optional<online::ReconRecord> {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto it = record_index.find(id);
+    if (it == record_index.end()) {
+        return {};
+    }
+    auto record = records_list.records(it->second);
+    if (!append(DROP, record.SerializeAsString())) {
+        SERVER_ERROR << "写入日志失败：" << strerror(errno);
+        return {};
+    }
+    apply_drop(id);
+    return record;
+}
+
+auto Catalogue::record_artifacts(const std::string &name, const online::Request &artifacts) -> bool {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (record_names.count(name) == 0) {
+        return false;
+    }
+    online::Request entry;
+    entry.add_arg(name);
+    for (const auto &arg : artifacts.arg()) {
+        entry.add_arg(arg);
+    }
+    if (!append(ARTIFACTS, entry.SerializeAsString())) {
+        SERVER_ERROR << "写入日志失败：" << strerror(errno);
+        return false;
+    }
+    apply_artifacts(entry, ++version);
+    return true;
+}
+
+auto Catalogue::artifacts(int id) -> std::optional<online::Request> {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = record_index.find(id);
+    if (it == record_index.end()) {
+        return {};
+    }
+    auto found = record_artifacts_by_name.find(records_list.records(it->second).name());
+    if (found == record_artifacts_by_name.end()) {
+        return {};
+    }
+    online::Request artifacts;
+    for (auto i = 1; i < found->second.arg_size(); i++) {
+        artifacts.add_arg(found->second.arg(i));
+    }
+    return artifacts;
+}
+
+auto Catalogue::records() -> online::ReconRecords {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return records_list;
+}
+
+auto Catalogue::matches(const ListingQuery &query, const online::ReconRecord &record) const -> bool {
+    return (query.owner.empty() || record.owner() == query.owner) &&
+           record.name().compare(0, query.prefix.size(), query.prefix) == 0;
+}
+
+auto Catalogue::list(const ListingQuery &query) -> Listing {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    Listing listing;
+    listing.version = version;
+    if (query.since > version) {
+        // Changes after a version this catalogue never reached: it's another or a rebuilt one.
+        // Version 0 and nothing else sends the client back to a full listing
+        listing.version = 0;
+        return listing;
+    }
+    auto limit = std::clamp(query.limit, 1, CATALOGUE_PAGE_MAX);
+    auto full = false;
+    // Each branch walks one ordered index from just past the cursor and stops one record past
+    // a full page, so it knows whether to hand out a cursor
+    auto take = [&] (int id, const std::string &cursor) {
+        const auto &record = records_list.records(record_index.at(id));
+        if (!matches(query, record)) {
+            return true;
+        }
+        if (listing.records.records_size() == limit) {
+            full = true;
+            return false;
+        }
+        *listing.records.add_records() = record;
+        listing.next = cursor;
+        return true;
+    };
+    if (query.since > 0) {
+        auto after = std::max<uint64_t>(query.since, std::strtoull(query.cursor.c_str(), nullptr, 10));
+        for (auto it = changes.upper_bound(after); it != changes.end(); it++) {
+            if (!take(it->second, std::to_string(it->first))) {
+                break;
+            }
+        }
+    } else if (!query.prefix.empty()) {
+        auto it = query.cursor.empty() ? sorted_names.lower_bound(query.prefix) : sorted_names.upper_bound(query.cursor);
+        for (; it != sorted_names.end() && it->compare(0, query.prefix.size(), query.prefix) == 0; it++) {
+            if (!take(record_names.at(*it), *it)) {
+                break;
+            }
+        }
+    } else {
+        static const std::set<int> none;
+        auto owned = owner_ids.find(query.owner);
+        const auto &ids = query.owner.empty() ? record_ids : owned != owner_ids.end() ? owned->second : none;
+        auto it = query.cursor.empty() ? ids.begin() : ids.upper_bound(std::atoi(query.cursor.c_str()));
+        for (; it != ids.end(); it++) {
+            if (!take(*it, std::to_string(*it))) {
+                break;
+            }
+        }
+    }
+    if (!full) {
+        listing.next.clear();
+    }
+    return listing;
+}
+
+auto Catalogue::compact() -> bool {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    return compact_locked();
+}
+
+auto Catalogue::compact_locked() -> bool {
+    // Version and snapshots first; a crash before the log is emptied just replays entries
+    // already in them, which only counts them as changed again
+    std::ofstream version_writer(directory + "/catalogue.version.tmp");
+    version_writer << version << "\n";
+    for (const auto &[id, at] : record_versions) {
+        version_writer << id << " " << at << "\n";
+    }
+    version_writer.close();
+    std::error_code error;
+    std::filesystem::rename(directory + "/catalogue.version.tmp", directory + "/catalogue.version", error);
+    if (!version_writer.good() || error || !write_snapshot(users, directory + "/users.bin") ||
+        !write_snapshot(records_list, directory + "/records.bin") ||
+        !write_artifacts_snapshot(directory + "/artifacts.bin")) {
+        SERVER_ERROR << "写入快照失败";
+        return false;
+    }
+    if (ftruncate(log_fd, 0) != 0 || lseek(log_fd, 0, SEEK_SET) == -1) {
+        return false;
+    }
+    log_entries = 0;
+    return true;
+}
+
+auto Catalogue::write_snapshot(const google::protobuf::Message &message, const std::string &path) -> bool {
+    auto temporary = path + ".tmp";
+    auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    auto written = message.SerializeToFileDescriptor(fd) && fsync(fd) == 0;
+    close(fd);
+    std::error_code error;
+    if (written) {
+        std::filesystem::rename(temporary, path, error);
+    }
+    return written && !error;
+}
+
+auto Catalogue::write_artifacts_snapshot(const std::string &path) -> bool {
+    std::string bytes;
+    for (const auto &[name, entry] : record_artifacts_by_name) {
+        auto payload = entry.SerializeAsString();
+        auto length = (uint32_t) payload.size();
+        bytes.append((const char *) &length, sizeof(length));
+        bytes += payload;
+    }
+    auto temporary = path + ".tmp";
+    auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < bytes.size()) {
+        auto result = ::write(fd, bytes.data() + written, bytes.size() - written);
+        if (result <= 0) {
+            break;
+        }
+        written += result;
+    }
+    auto synced = written == bytes.size() && fsync(fd) == 0;
+    close(fd);
+    std::error_code error;
+    if (synced) {
+        std::filesystem::rename(temporary, path, error);
+    }
+    return synced && !error;
+}
+
+Catalogue::~Catalogue() {
+    if (log_fd != -1) {
+        close(log_fd);
+    }
+}
@@ -0,0 +1,146 @@
+//
+//  Catalogue.hpp
+//  Server
+//
+//  Created by apple on 27/04/2021.
+//
+
+#ifndef Catalogue_hpp
+#define Catalogue_hpp
+
+#include <string>
+#include <optional>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <cstdint>
+#include <shared_mutex>
+#include "online.pb.h"
+
+#define CATALOGUE_COMPACT_ENTRIES 4096 // Log entries before the snapshots are rewritten
+#define CATALOGUE_PAGE_DEFAULT 200
+#define CATALOGUE_PAGE_MAX 1000
+
+/// One page of the record listing. An empty `owner` or `prefix` doesn't filter; `since` > 0
+/// only asks for records changed after that catalogue version; one past this catalogue's gets
+/// an empty page at version 0.
+struct ListingQuery {
+    uint64_t since = 0;
+    std::string cursor; // From the previous page; empty for the first
+    int limit = CATALOGUE_PAGE_DEFAULT;
+    std::string owner;
+    std::string prefix;
+};
+
+struct Listing {
+    online::ReconRecords records;
+    uint64_t version; // Of the catalogue as this page saw it
+    std::string next; // Cursor for the following page; empty once done
+};
+
+/// Users and reconstruction records, indexed in memory and persisted as snapshots
+/// (users.bin, records.bin) plus an append-only log of everything since. A change costs one
+/// small fsync'd append instead of rewriting whole files; every CATALOGUE_COMPACT_ENTRIES the
+/// snapshots are rewritten and the log starts over. Safe to use from any thread.
+class Catalogue {
+public:
+    Catalogue(std::string directory) : hashed_ids(false), directory(directory), log_fd(-1), log_entries(0),
+        next_record_id(1), version(0) {}
+
+    ~Catalogue();
+
+    /// Loads the snapshots and replays the log over them.
+    auto open() -> bool;
+
+    auto authenticate(const std::string &username, const std::string &password) -> std::optional<online::User>;
+
+    /// Registers a new user; empty if the name is taken.
+    auto add_user(const std::string &username, const std::string &password) -> std::optional<online::User>;
+
+    /// Adds the record, or overwrites the one with the same name, keeping its id. A new record
+    /// gets `id` when given. Empty if it couldn't be logged.
+    auto publish(const std::string &owner, const std::string &name, std::optional<int> id = {}) -> std::optional<online::ReconRecord>;
+
+    auto find(int id) -> std::optional<online::ReconRecord>;
+
+    auto find_named(const std::string &name) -> std::optional<online::ReconRecord>;
+
+    /// Forgets a record, as when it moves to another shard; returns what it was.
+    auto drop(int id) -> std::optional<online::ReconRecord>;
+
+    /// Records the derived files made for a record's content: `artifacts` holds its content
+    /// hash, then a name and a byte count for each. Counts as a change to the record, so
+    /// listings of changes bring it up again.
+    auto record_artifacts(const std::string &name, const online::Request &artifacts) -> bool;
+
+    /// The last artifacts recorded for a record, which may be of content it has since replaced.
+    auto artifacts(int id) -> std::optional<online::Request>;
+
+    auto records() -> online::ReconRecords;
+
+    /// A page of records: by version when asking for changes, by name under a prefix, otherwise
+    /// by id. The cursor picks up after the last record of the previous page.
+    auto list(const ListingQuery &query) -> Listing;
+
+    /// Rewrites the snapshots and empties the log.
+    auto compact() -> bool;
+
+    bool hashed_ids; // New records get shard_record_id() of their name rather than the next id
+
+private:
+    enum Entry : char {
+        USER = 'U',
+        RECORD = 'R',
+        ARTIFACTS = 'A', // A Request: record name, then what record_artifacts() was given
+        DROP = 'D' // The ReconRecord dropped
+    };
+
+    auto apply_user(const online::User &user) -> void;
+
+    /// Stores the record as changed at catalogue version `at`.
+    auto apply_record(const online::ReconRecord &record, uint64_t at) -> void;
+
+    /// Stores a record's artifacts from an ARTIFACTS entry, as a change at version `at`.
+    auto apply_artifacts(const online::Request &entry, uint64_t at) -> void;
+
+    auto apply_drop(int id) -> void;
+
+    auto matches(const ListingQuery &query, const online::ReconRecord &record) const -> bool;
+
+    /// Appends and syncs one entry. Callers hold the lock exclusively.
+    auto append(Entry type, const std::string &payload) -> bool;
+
+    auto replay() -> bool;
+
+    auto compact_locked() -> bool;
+
+    auto write_snapshot(const google::protobuf::Message &message, const std::string &path) -> bool;
+
+    /// artifacts.bin holds ARTIFACTS entries back to back, each behind its uint32_t length.
+    auto write_artifacts_snapshot(const std::string &path) -> bool;
+
+    std::string directory;
+    std::shared_mutex mutex;
+    int log_fd;
+    int log_entries;
+
+    online::Users users;
+    online::ReconRecords records_list; // In publishing order but for drops, filled by the last record; the records command lists it
+    std::unordered_map<std::string, int> user_index; // Username → position in users
+    std::unordered_map<int, int> record_index; // Id → position in records_list
+    std::unordered_map<std::string, int> record_names; // Name → id
+    std::unordered_map<std::string, online::Request> record_artifacts_by_name; // As ARTIFACTS entries
+    int next_record_id;
+
+    // L I S T I N G /////////////////////////////////
+    // Ordered views for paging. Versions count changes; compaction saves the counter and each
+    // record's version to catalogue.version so deltas stay exact across restarts.
+    uint64_t version;
+    std::unordered_map<int, uint64_t> record_versions; // Id → version of its last change
+    std::map<uint64_t, int> changes; // Version → id, only each record's latest change
+    std::set<int> record_ids;
+    std::set<std::string> sorted_names;
+    std::unordered_map<std::string, std::set<int>> owner_ids;
+};
+
+#endif /* Catalogue_hpp */
@@ -0,0 +1,225 @@
+//
+//  Compress.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Compress.hpp"
+#include "Hash.hpp"
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // The block always ends with at least this many literals
+#define LZ4_MATCH_LIMIT 12 // No match may start closer than this to the end
+#define LZ4_WINDOW 65535
+#define LZ4_HASH_BITS 16
+
+auto codec_name(Codec codec) -> std::string {
+    return codec == Codec::LZ4 ? "lz4" : "none";
+}
+
+auto parse_codec(const std::string &name) -> Codec {
+    return name == "lz4" ? Codec::LZ4 : Codec::NONE;
+}
+
+// L Z 4 //////////////////////////////////////////////////////
+
+static auto read32(const unsigned char *p) -> uint32_t {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static auto hash4(uint32_t value) -> uint32_t {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static auto write_length(std::string &out, size_t length) -> void {
+    while (length >= 255) {
+        out.push_back((char) 255);
+        length -= 255;
+    }
+    out.push_back((char) length);
+}
+
+static auto emit(std::string &out, const unsigned char *literals, size_t literal_count,
+                 size_t offset, size_t match_length) -> void {
+    auto extra = match_length - LZ4_MIN_MATCH;
+    out.push_back((char) ((std::min<size_t>(literal_count, 15) << 4) | std::min<size_t>(extra, 15)));
+    if (literal_count >= 15) {
+        write_length(out, literal_count - 15);
+    }
+    out.append((const char *) literals, literal_count);
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (extra >= 15) {
+        write_length(out, extra - 15);
+    }
+}
+
+auto lz4_compress(const char *data, size_t size, int level) -> std::string {
+    level = std::clamp(level, 1, COMPRESS_LEVEL_MAX);
+    auto in = (const unsigned char *) data;
+    std::string out;
+    out.reserve(size / 2 + 16);
+    size_t anchor = 0;
+    if (size > LZ4_MATCH_LIMIT) {
+        std::vector<int32_t> head(1 << LZ4_HASH_BITS, -1);
+        std::vector<int32_t> chain(level > 1 ? size : 0, -1);
+        auto attempts = 1 << (level - 1);
+        auto insert = [&] (size_t at) {
+            auto h = hash4(read32(in + at));
+            if (!chain.empty()) {
+                chain[at] = head[h];
+            }
+            head[h] = (int32_t) at;
+        };
+        auto limit = size - LZ4_MATCH_LIMIT; // Last position a match may start at
+        auto match_end = size - LZ4_LAST_LITERALS;
+        size_t at = 0;
+        while (at < limit) {
+            auto value = read32(in + at);
+            auto candidate = head[hash4(value)];
+            size_t best_length = 0, best_at = 0;
+            for (auto tries = attempts; candidate >= 0 && at - candidate <= LZ4_WINDOW && tries > 0; tries--) {
+                if (read32(in + candidate) == value) {
+                    auto length = (size_t) LZ4_MIN_MATCH;
+                    while (at + length < match_end && in[candidate + length] == in[at + length]) {
+                        length++;
+                    }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_at = candidate;
+                    }
+                }
+                candidate = chain.empty() ? -1 : chain[candidate];
+            }
+            insert(at);
+            if (best_length < LZ4_MIN_MATCH) {
+                // The longer nothing matched, the bigger the strides
+                at += level == 1 ? 1 + ((at - anchor) >> 6) : 1;
+                continue;
+            }
+            emit(out, in + anchor, at - anchor, at - best_at, best_length);
+            auto next = at + best_length;
+            for (auto skipped = at + 1; skipped < std::min(next, limit); skipped += level == 1 ? 4 : 1) {
+                insert(skipped);
+            }
+            at = anchor = next;
+        }
+    }
+    auto literal_count = size - anchor;
+    out.push_back((char) (std::min<size_t>(literal_count, 15) << 4));
+    if (literal_count >= 15) {
+        write_length(out, literal_count - 15);
+    }
+    out.append(data + anchor, literal_count);
+    return out;
+}
+
+auto lz4_decompress(const char *data, size_t size, size_t raw_size, std::string &out) -> bool {
+    auto in = (const unsigned char *) data;
+    auto end = in + size;
+    out.resize(raw_size);
+    auto dst = (unsigned char *) &out[0];
+    size_t written = 0;
+    auto read_length = [&] (size_t &length) {
+        unsigned char byte;
+        do {
+            if (in >= end) {
+                return false;
+            }
+            byte = *in++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+    while (in < end) {
+        auto token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(literal_count)) {
+            return false;
+        }
+        if (literal_count > (size_t) (end - in) || literal_count > raw_size - written) {
+            return false;
+        }
+        std::memcpy(dst + written, in, literal_count);
+        in += literal_count;
+        written += literal_count;
+        if (in == end) {
+            // The last sequence has no match
+            break;
+        }
+        if (end - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !read_length(length)) {
+            return false;
+        }
+        length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > written || length > raw_size - written) {
+            return false;
+        }
+        // Overlapping copies repeat the last `offset` bytes, so go one byte at a time
+        auto from = dst + written - offset;
+        for (size_t i = 0; i < length; i++) {
+            dst[written + i] = from[i];
+        }
+        written += length;
+    }
+    return written == raw_size;
+}
+
+// C H U N K S ////////////////////////////////////////////////
+
+auto pack_chunk(const char *data, size_t size, Codec codec, int level) -> std::string {
+    auto crc = crc32(data, size);
+    auto raw_size = (uint32_t) size;
+    std::string compressed;
+    if (codec == Codec::LZ4) {
+        compressed = lz4_compress(data, size, level);
+        if (compressed.size() >= size) {
+            codec = Codec::NONE;
+        }
+    }
+    std::string packed(sizeof(crc) + COMPRESS_HEADER, '\0');
+    std::memcpy(&packed[0], &crc, sizeof(crc));
+    packed[sizeof(crc)] = (char) codec;
+    std::memcpy(&packed[sizeof(crc) + 1], &raw_size, sizeof(raw_size));
+    if (codec == Codec::NONE) {
+        packed.append(data, size);
+    } else {
+        packed += compressed;
+    }
+    return packed;
+}
+
+auto unpack_chunk(const std::string &payload, std::string &chunk, size_t limit) -> bool {
+    uint32_t crc = 0, raw_size = 0;
+    if (payload.size() < sizeof(crc) + COMPRESS_HEADER) {
+        return false;
+    }
+    std::memcpy(&crc, payload.data(), sizeof(crc));
+    auto codec = (Codec) payload[sizeof(crc)];
+    std::memcpy(&raw_size, payload.data() + sizeof(crc) + 1, sizeof(raw_size));
+    auto body = payload.data() + sizeof(crc) + COMPRESS_HEADER;
+    auto body_size = payload.size() - sizeof(crc) - COMPRESS_HEADER;
+    if (raw_size > limit) {
+        return false;
+    }
+    if (codec == Codec::NONE) {
+        if (body_size != raw_size) {
+            return false;
+        }
+        chunk.assign(body, body_size);
+    } else if (codec != Codec::LZ4 || !lz4_decompress(body, body_size, raw_size, chunk)) {
+        return false;
+    }
+    return crc32(chunk.data(), chunk.size()) == crc;
+}
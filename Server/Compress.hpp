@@ -0,0 +1,46 @@
+//
+//  Compress.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Compress_hpp
+#define Compress_hpp
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#define COMPRESS_LEVEL_DEFAULT 1
+#define COMPRESS_LEVEL_MAX 9
+#define COMPRESS_HEADER 5 // Codec byte and uint32_t raw size, after the CRC-32 of a packed chunk
+
+/// Negotiated in `hello server <codec>...`; the server answers `hello <codec>` with the first
+/// one it knows, or a bare `hello` to keep chunks as they were.
+enum class Codec : uint8_t {
+    NONE = 0,
+    LZ4 = 1
+};
+
+auto codec_name(Codec codec) -> std::string;
+
+auto parse_codec(const std::string &name) -> Codec;
+
+/// LZ4 block format. Level 1 is a single hash probe per position, skipping ahead faster through
+/// data that doesn't compress; every level above keeps hash chains and tries twice as many
+/// candidates for a longer match.
+auto lz4_compress(const char *data, size_t size, int level = COMPRESS_LEVEL_DEFAULT) -> std::string;
+
+/// Fails on anything malformed or not exactly `raw_size` bytes once decoded.
+auto lz4_decompress(const char *data, size_t size, size_t raw_size, std::string &out) -> bool;
+
+/// A checked chunk on a connection with a codec: the CRC-32 of the raw bytes, the codec they
+/// are in and their raw size, then the bytes, compressed unless that didn't make them smaller.
+/// Chunks are packed one at a time, so a transfer compresses as it streams.
+auto pack_chunk(const char *data, size_t size, Codec codec, int level) -> std::string;
+
+/// Reverses pack_chunk and checks the CRC-32. Refuses chunks that would decode past `limit`.
+auto unpack_chunk(const std::string &payload, std::string &chunk, size_t limit) -> bool;
+
+#endif /* Compress_hpp */
@@ -0,0 +1,203 @@
+//
+//  Hash.cpp
+//  Server
+//
+//  Created by apple on 26/04/2021.
+//
+
+#include "Hash.hpp"
+#include <cstring>
+#include <algorithm>
+
+// S H A 2 5 6 ////////////////////////////////////////////////
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline auto rotr(uint32_t x, int n) -> uint32_t {
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() : state {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+}, length(0) {}
+
+auto Sha256::transform(const unsigned char *block) -> void {
+    uint32_t w[64];
+    for (auto i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+               (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+    }
+    for (auto i = 16; i < 64; i++) {
+        auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+    for (auto i = 0; i < 64; i++) {
+        auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        auto ch = (e & f) ^ (~e & g);
+        auto t1 = h + s1 + ch + sha256_k[i] + w[i];
+        auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        auto maj = (a & b) ^ (a & c) ^ (b & c);
+        auto t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+auto Sha256::update(const void *data, size_t size) -> void {
+    auto bytes = (const unsigned char *) data;
+    auto used = (size_t) (length % 64);
+    length += size;
+    if (used > 0) {
+        auto take = std::min(size, 64 - used);
+        std::memcpy(buffer + used, bytes, take);
+        bytes += take;
+        size -= take;
+        if (used + take < 64) {
+            return;
+        }
+        transform(buffer);
+    }
+    while (size >= 64) {
+        transform(bytes);
+        bytes += 64;
+        size -= 64;
+    }
+    std::memcpy(buffer, bytes, size);
+}
+
+auto Sha256::hex() const -> std::string {
+    // Pad a copy, so the caller can keep feeding the original
+    auto copy = *this;
+    auto bits = length * 8;
+    unsigned char padding[72] = { 0x80 };
+    auto used = (size_t) (length % 64);
+    auto pad = used < 56 ? 56 - used : 120 - used;
+    for (auto i = 0; i < 8; i++) {
+        padding[pad + i] = (unsigned char) (bits >> (56 - i * 8));
+    }
+    copy.update(padding, pad + 8);
+    const char *digits = "0123456789abcdef";
+    std::string digest;
+    for (auto i = 0; i < 8; i++) {
+        for (auto j = 3; j >= 0; j--) {
+            auto byte = (copy.state[i] >> (j * 8)) & 0xff;
+            digest.push_back(digits[byte >> 4]);
+            digest.push_back(digits[byte & 0xf]);
+        }
+    }
+    return digest;
+}
+
+auto is_hex_digest(const std::string &hash) -> bool {
+    if (hash.size() != 64) {
+        return false;
+    }
+    for (auto c : hash) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// C R C 3 2 //////////////////////////////////////////////////
+
+auto crc32(const void *data, size_t size, uint32_t crc) -> uint32_t {
+    static uint32_t table[256] = { 0 };
+    static bool table_ready = [] () {
+        for (uint32_t i = 0; i < 256; i++) {
+            auto c = i;
+            for (auto k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void) table_ready;
+    auto bytes = (const unsigned char *) data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// C H U N K E R //////////////////////////////////////////////
+
+static auto gear_table() -> const uint64_t * {
+    // splitmix64 from a fixed seed, so every build agrees on the table
+    static uint64_t table[256];
+    static bool ready = [] () {
+        uint64_t seed = 0x5265636f6e696e67;
+        for (auto i = 0; i < 256; i++) {
+            auto z = (seed += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            table[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void) ready;
+    return table;
+}
+
+auto Chunker::feed(const char *data, size_t size, const std::function<bool(const std::string &)> &cut) -> bool {
+    auto gear = gear_table();
+    size_t start = 0;
+    for (size_t i = 0; i < size; i++) {
+        rolling = (rolling << 1) + gear[(unsigned char) data[i]];
+        auto length = pending.size() + (i + 1 - start);
+        if (length < CHUNK_MIN) {
+            continue;
+        }
+        if ((rolling & CHUNK_MASK) == 0 || length >= CHUNK_MAX) {
+            pending.append(data + start, i + 1 - start);
+            start = i + 1;
+            rolling = 0;
+            auto chunk = std::move(pending);
+            pending.clear();
+            if (!cut(chunk)) {
+                return false;
+            }
+        }
+    }
+    pending.append(data + start, size - start);
+    return true;
+}
+
+auto Chunker::finish(const std::function<bool(const std::string &)> &cut) -> bool {
+    rolling = 0;
+    if (pending.empty()) {
+        return true;
+    }
+    auto chunk = std::move(pending);
+    pending.clear();
+    return cut(chunk);
+}
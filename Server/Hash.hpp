@@ -0,0 +1,65 @@
+//
+//  Hash.hpp
+//  Server
+//
+//  Created by apple on 26/04/2021.
+//
+
+#ifndef Hash_hpp
+#define Hash_hpp
+
+#include <string>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#define CHUNK_MIN (16 << 10)
+#define CHUNK_MASK (0xffffull << 48) // 16 high bits, which depend on the last 64 bytes: a cut every 64 KiB on average
+#define CHUNK_MAX (256 << 10)
+
+/// Incremental SHA-256. Transfers are identified by the hash of their content.
+class Sha256 {
+public:
+    Sha256();
+
+    auto update(const void *data, size_t size) -> void;
+
+    auto update(const std::string &data) -> void {
+        update(data.data(), data.size());
+    }
+
+    /// Lowercase hex digest. Doesn't disturb the running state.
+    auto hex() const -> std::string;
+
+private:
+    auto transform(const unsigned char *block) -> void;
+
+    uint32_t state[8];
+    unsigned char buffer[64];
+    uint64_t length; // Bytes so far
+};
+
+/// CRC-32 (the zlib polynomial), guarding each transfer chunk.
+auto crc32(const void *data, size_t size, uint32_t crc = 0) -> uint32_t;
+
+auto is_hex_digest(const std::string &hash) -> bool;
+
+/// Content-defined chunking with a gear rolling hash. Boundaries depend only on the bytes around
+/// them, so an edit only changes the chunks it touches and the rest dedupe against the old
+/// version. The client and server must cut identically.
+class Chunker {
+public:
+    Chunker() : rolling(0) {}
+
+    /// Feeds the next bytes; `cut` gets every completed chunk and may return false to stop.
+    auto feed(const char *data, size_t size, const std::function<bool(const std::string &)> &cut) -> bool;
+
+    /// Hands over whatever is left as the last chunk.
+    auto finish(const std::function<bool(const std::string &)> &cut) -> bool;
+
+private:
+    std::string pending;
+    uint64_t rolling;
+};
+
+#endif /* Hash_hpp */
@@ -0,0 +1,230 @@
+//
+//  Jobs.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Jobs.hpp"
+#include "Log.hpp"
+#include <filesystem>
+
+#define JOB_MAGIC "recon-job 1"
+
+// Q U E U E //////////////////////////////////////////////////
+
+auto JobQueue::open() -> bool {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::error_code error;
+    std::filesystem::create_directories(root, error);
+    if (error) {
+        return false;
+    }
+    for (const auto &entry : std::filesystem::directory_iterator(root, error)) {
+        auto id = std::atoi(entry.path().filename().c_str());
+        auto job = id > 0 ? load(id) : std::nullopt;
+        if (job.has_value()) {
+            jobs[id] = *job;
+            next_id = std::max(next_id, id + 1);
+        }
+    }
+    for (auto &[id, job] : jobs) {
+        if (job.state == JobState::UPLOADING) {
+            // Whoever was uploading the images is gone with the old process
+            job.state = JobState::FAILED;
+            save(job);
+        } else if (job.state == JobState::QUEUED || job.state == JobState::RUNNING) {
+            // Interrupted runs start over; the pipeline clears its own products
+            job.state = JobState::QUEUED;
+            job.stage = 0;
+            job.progress = 0.0f;
+            save(job);
+            queued.push_back(id);
+            SERVER_LOG << "重新排队重建任务 " << id;
+        }
+    }
+    return true;
+}
+
+auto JobQueue::start(int workers, std::function<bool(Job &)> runner) -> void {
+    this->runner = runner;
+    for (auto i = 0; i < workers; i++) {
+        threads.emplace_back([this] () {
+            work();
+        });
+    }
+}
+
+auto JobQueue::stop() -> void {
+    mutex.lock();
+    stopping = true;
+    mutex.unlock();
+    condition.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+auto JobQueue::work() -> void {
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] () {
+            return stopping || !queued.empty();
+        });
+        if (stopping) {
+            return;
+        }
+        auto job = jobs[queued.front()];
+        queued.pop_front();
+        job.state = JobState::RUNNING;
+        change(job);
+        lock.unlock();
+
+        SERVER_LOG << "开始重建任务 " << job.id << "：" << job.owner << "/" << job.name;
+        auto succeeded = runner(job);
+
+        lock.lock();
+        job.state = succeeded ? JobState::DONE : JobState::FAILED;
+        if (succeeded) {
+            job.progress = 1.0f;
+        }
+        change(job);
+        SERVER_LOG << "重建任务 " << job.id << (succeeded ? " 完成" : " 失败");
+    }
+}
+
+auto JobQueue::create(const std::string &owner, const std::string &name) -> std::optional<Job> {
+    std::lock_guard<std::mutex> lock(mutex);
+    Job job;
+    job.id = next_id++;
+    job.owner = owner;
+    job.name = name;
+    std::error_code error;
+    std::filesystem::create_directories(directory(job.id) + "/images", error);
+    if (error || !save(job)) {
+        return {};
+    }
+    jobs[job.id] = job;
+    return job;
+}
+
+auto JobQueue::find(int id) -> std::optional<Job> {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = jobs.find(id);
+    if (it == jobs.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+auto JobQueue::waiting() -> int {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int) queued.size();
+}
+
+auto JobQueue::directory(int id) const -> std::string {
+    return root + "/" + std::to_string(id);
+}
+
+auto JobQueue::enqueue(int id) -> bool {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = jobs.find(id);
+    if (it == jobs.end() || it->second.state != JobState::UPLOADING) {
+        return false;
+    }
+    auto job = it->second;
+    job.state = JobState::QUEUED;
+    change(job);
+    queued.push_back(id);
+    lock.unlock();
+    condition.notify_one();
+    return true;
+}
+
+auto JobQueue::update(const Job &job) -> void {
+    std::lock_guard<std::mutex> lock(mutex);
+    change(job);
+}
+
+auto JobQueue::watch(int id, JobListener listener) -> bool {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = jobs.find(id);
+    if (it == jobs.end()) {
+        return false;
+    }
+    listener(it->second);
+    if (!it->second.finished()) {
+        listeners.emplace(id, listener);
+    }
+    return true;
+}
+
+auto JobQueue::change(const Job &job) -> void {
+    jobs[job.id] = job;
+    if (!save(job)) {
+        SERVER_ERROR << "无法保存重建任务状态：" << job.id;
+    }
+    auto range = listeners.equal_range(job.id);
+    for (auto it = range.first; it != range.second; it++) {
+        it->second(job);
+    }
+    if (job.finished()) {
+        listeners.erase(range.first, range.second);
+    }
+}
+
+auto JobQueue::save(const Job &job) -> bool {
+    auto path = directory(job.id) + "/job";
+    std::ofstream writer(path + ".tmp");
+    writer << JOB_MAGIC << "\n" << job.owner << "\n" << job.name << "\n"
+        << (int) job.state << " " << job.stage << " " << job.progress << " " << job.record << "\n";
+    writer.close();
+    std::error_code error;
+    if (writer.good()) {
+        std::filesystem::rename(path + ".tmp", path, error);
+    }
+    return writer.good() && !error;
+}
+
+auto JobQueue::load(int id) -> std::optional<Job> {
+    std::ifstream reader(directory(id) + "/job");
+    std::string magic;
+    Job job;
+    job.id = id;
+    auto state = 0;
+    if (!std::getline(reader, magic) || magic != JOB_MAGIC ||
+        !std::getline(reader, job.owner) || !std::getline(reader, job.name) ||
+        !(reader >> state >> job.stage >> job.progress >> job.record) ||
+        state < (int) JobState::UPLOADING || state > (int) JobState::FAILED) {
+        return {};
+    }
+    job.state = (JobState) state;
+    return job;
+}
+
+JobQueue::~JobQueue() {
+    stop();
+}
+
+// I M A G E S ////////////////////////////////////////////////
+
+auto JobImageUpload::write(const std::string &chunk) -> bool {
+    if ((int64_t) chunk.size() > remaining) {
+        return false;
+    }
+    writer.write(chunk.data(), chunk.size());
+    remaining -= chunk.size();
+    return writer.good();
+}
+
+auto JobImageUpload::commit() -> bool {
+    writer.close();
+    std::error_code error;
+    if (writer.good()) {
+        std::filesystem::rename(path + ".tmp", path, error);
+    } else {
+        std::filesystem::remove(path + ".tmp", error);
+    }
+    return writer.good() && !error;
+}
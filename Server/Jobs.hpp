@@ -0,0 +1,125 @@
+//
+//  Jobs.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Jobs_hpp
+#define Jobs_hpp
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <optional>
+#include <fstream>
+#include <cstdint>
+#include "Protocol.hpp"
+
+struct Job {
+    auto finished() const -> bool {
+        return state == JobState::DONE || state == JobState::FAILED;
+    }
+
+    int id = 0;
+    std::string owner;
+    std::string name; // Of the record it publishes
+    JobState state = JobState::UPLOADING;
+    int stage = 0; // PipelineNS::PipelineState while running
+    float progress = 0.0f;
+    int record = -1; // Published record, once done
+};
+
+/// Called with a job every time it changes. Runs with the queue locked, so it must not call
+/// back into the queue.
+using JobListener = std::function<void(const Job &)>;
+
+/// Reconstruction jobs, one directory each under `root` holding the uploaded images, the
+/// pipeline's scratch files and a small `job` file with the state. Jobs queued or running when
+/// the server stopped are queued again on open(), so nothing submitted is lost.
+class JobQueue {
+public:
+    JobQueue(std::string root) : root(root), next_id(1), stopping(false) {}
+
+    ~JobQueue();
+
+    auto open() -> bool;
+
+    /// Starts `workers` threads, each running one job at a time through `runner`. The runner
+    /// reports progress with update() and returns whether the job succeeded.
+    auto start(int workers, std::function<bool(Job &)> runner) -> void;
+
+    auto stop() -> void;
+
+    auto create(const std::string &owner, const std::string &name) -> std::optional<Job>;
+
+    auto find(int id) -> std::optional<Job>;
+
+    /// Jobs queued and not yet picked up by a worker.
+    auto waiting() -> int;
+
+    auto directory(int id) const -> std::string;
+
+    /// Hands a job whose images are all uploaded to the workers.
+    auto enqueue(int id) -> bool;
+
+    /// Saves a running job's progress and tells its watchers.
+    auto update(const Job &job) -> void;
+
+    /// Calls `listener` with the job right away and then on every change until it finishes.
+    auto watch(int id, JobListener listener) -> bool;
+
+private:
+    auto work() -> void;
+
+    /// Saves the job and notifies its watchers. Callers hold the lock.
+    auto change(const Job &job) -> void;
+
+    auto save(const Job &job) -> bool;
+
+    auto load(int id) -> std::optional<Job>;
+
+    std::string root;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::map<int, Job> jobs;
+    std::deque<int> queued;
+    std::multimap<int, JobListener> listeners; // Job id → watcher
+    std::vector<std::thread> threads;
+    std::function<bool(Job &)> runner;
+    int next_id;
+    bool stopping;
+};
+
+/// One image of a job's image set, arriving as raw chunk frames. Written under a temporary
+/// name and renamed once complete.
+class JobImageUpload {
+public:
+    JobImageUpload(std::string path, int64_t size) : path(path), remaining(size),
+        writer(path + ".tmp", std::ios::binary) {}
+
+    auto good() -> bool {
+        return writer.good();
+    }
+
+    auto write(const std::string &chunk) -> bool;
+
+    auto finished() const -> bool {
+        return remaining == 0;
+    }
+
+    auto commit() -> bool;
+
+    std::string path;
+
+private:
+    int64_t remaining;
+    std::ofstream writer;
+};
+
+#endif /* Jobs_hpp */
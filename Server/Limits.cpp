@@ -0,0 +1,112 @@
+//
+//  Limits.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Limits.hpp"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+auto TokenBucket::configure(double rate, double burst) -> void {
+    this->rate = std::max(0.0, rate);
+    this->burst = std::max(0.0, burst);
+    tokens = this->burst;
+    refilled = std::chrono::steady_clock::now();
+}
+
+auto TokenBucket::unlimited() const -> bool {
+    return rate <= 0;
+}
+
+auto TokenBucket::refill(std::chrono::steady_clock::time_point now) -> void {
+    if (now > refilled) {
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - refilled).count() * rate);
+        refilled = now;
+    }
+}
+
+auto TokenBucket::available(std::chrono::steady_clock::time_point now) -> int64_t {
+    if (unlimited()) {
+        return std::numeric_limits<int64_t>::max();
+    }
+    refill(now);
+    return std::max<int64_t>(0, (int64_t) std::floor(tokens));
+}
+
+auto TokenBucket::take(double amount, std::chrono::steady_clock::time_point now) -> bool {
+    if (unlimited()) {
+        return true;
+    }
+    refill(now);
+    if (tokens < amount) {
+        return false;
+    }
+    tokens -= amount;
+    return true;
+}
+
+auto TokenBucket::spend(double amount) -> void {
+    if (!unlimited()) {
+        tokens -= amount;
+    }
+}
+
+auto FairShare::configure(double rate) -> void {
+    this->rate = std::max(0.0, rate);
+    burst = std::max<double>(FAIR_GRANT_MIN, this->rate * FAIR_BURST_SECONDS);
+    refilled = std::chrono::steady_clock::now();
+    flows.clear();
+}
+
+auto FairShare::unlimited() const -> bool {
+    return rate <= 0;
+}
+
+auto FairShare::refill(std::chrono::steady_clock::time_point now) -> void {
+    if (now <= refilled) {
+        return;
+    }
+    for (auto it = flows.begin(); it != flows.end();) {
+        if (now - it->second.asked > std::chrono::milliseconds(FAIR_IDLE_MS)) {
+            it = flows.erase(it);
+        } else {
+            it++;
+        }
+    }
+    if (!flows.empty()) {
+        auto quantum = std::chrono::duration<double>(now - refilled).count() * rate / flows.size();
+        for (auto &[name, flow] : flows) {
+            flow.deficit = std::min(burst, flow.deficit + quantum);
+        }
+    }
+    refilled = now;
+}
+
+auto FairShare::grant(const std::string &flow, size_t wanted, std::chrono::steady_clock::time_point now) -> size_t {
+    if (unlimited()) {
+        return wanted;
+    }
+    refill(now);
+    auto &share = flows[flow];
+    share.asked = now;
+    auto granted = std::min<size_t>(wanted, (size_t) std::max(0.0, share.deficit));
+    if (granted < std::min<size_t>(wanted, FAIR_GRANT_STEP)) {
+        // Slivers only cost the loop a send each
+        return 0;
+    }
+    share.deficit -= granted;
+    return granted;
+}
+
+auto FairShare::refund(const std::string &flow, size_t unused) -> void {
+    if (unlimited() || unused == 0) {
+        return;
+    }
+    auto it = flows.find(flow);
+    if (it != flows.end()) {
+        it->second.deficit += unused;
+    }
+}
@@ -0,0 +1,95 @@
+//
+//  Limits.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Limits_hpp
+#define Limits_hpp
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+#define LIMIT_REQUEST_BYTES (2 << 20) // A request or credentials frame
+#define LIMIT_MESSAGE_BYTES (256 << 20) // Any other frame; a whole `upload` ReconBuffer is the biggest
+#define LIMIT_CONNECTION_BYTES (4 << 20) // Received and parked bytes of a connection before it stops being read
+#define LIMIT_GLOBAL_BYTES (1ll << 30) // Frames bigger than LIMIT_CONNECTION_BYTES being received, together
+#define LIMIT_PENDING_REQUESTS 64 // Tagged requests parked on a connection while a transfer goes
+#define LIMIT_TICK_MS 5 // How often connections held back by a rate are looked at again
+#define FAIR_BURST_SECONDS 0.05 // Of a bandwidth, saved up by a flow or connection that isn't using it
+#define FAIR_GRANT_MIN (64 << 10) // Bytes a flow starts with, so small replies never wait for a tick
+#define FAIR_IDLE_MS 50 // A flow that hasn't asked for this long gives up its share
+#define FAIR_GRANT_STEP (16 << 10) // Fewer bytes than this, unless that's all it wants, wait for a tick
+
+/// What one connection, and all of them together, may ask of the server. Rates of 0 are unlimited.
+struct ServerLimits {
+    size_t request_bytes = LIMIT_REQUEST_BYTES;
+    size_t message_bytes = LIMIT_MESSAGE_BYTES;
+    size_t connection_bytes = LIMIT_CONNECTION_BYTES;
+    size_t global_bytes = LIMIT_GLOBAL_BYTES;
+    size_t pending_requests = LIMIT_PENDING_REQUESTS;
+    double request_rate = 0; // A connection's requests a second
+    double global_request_rate = 0;
+    double bandwidth = 0; // A connection's bytes a second, each way
+    double global_bandwidth = 0; // Bytes a second each way, shared evenly by whoever is moving any
+};
+
+/// `rate` tokens a second, up to `burst` saved up. Unconfigured, it lets everything through.
+class TokenBucket {
+public:
+    auto configure(double rate, double burst) -> void;
+
+    auto unlimited() const -> bool;
+
+    /// Whole tokens there are now; INT64_MAX when unlimited.
+    auto available(std::chrono::steady_clock::time_point now) -> int64_t;
+
+    /// Takes `amount` if it's all there.
+    auto take(double amount, std::chrono::steady_clock::time_point now) -> bool;
+
+    auto spend(double amount) -> void;
+
+private:
+    auto refill(std::chrono::steady_clock::time_point now) -> void;
+
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point refilled;
+};
+
+/// Splits a bandwidth evenly between the flows using it, deficit round robin style: each refill
+/// hands every flow that asked lately an equal quantum, capped at a burst, and a flow can only
+/// move what it has been handed. One moving a lot gets its turn like everyone else, and no more;
+/// one wanting less leaves the rest to the others. Loop thread only.
+class FairShare {
+public:
+    auto configure(double rate) -> void;
+
+    auto unlimited() const -> bool;
+
+    /// Bytes `flow` may move now, at most `wanted`; 0 means wait for the next refill.
+    auto grant(const std::string &flow, size_t wanted, std::chrono::steady_clock::time_point now) -> size_t;
+
+    /// Gives back what a grant didn't use.
+    auto refund(const std::string &flow, size_t unused) -> void;
+
+private:
+    struct Flow {
+        double deficit = FAIR_GRANT_MIN;
+        std::chrono::steady_clock::time_point asked;
+    };
+
+    auto refill(std::chrono::steady_clock::time_point now) -> void;
+
+    double rate = 0;
+    double burst = 0;
+    std::chrono::steady_clock::time_point refilled;
+    std::map<std::string, Flow> flows;
+};
+
+#endif /* Limits_hpp */
@@ -0,0 +1,513 @@
+//
+//  Load.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Load.hpp"
+#include "Reactor.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+using Clock = std::chrono::steady_clock;
+
+// B L O C K I N G   H E L P E R S ////////////////////////////
+// Only for setting up; the measured part is all non-blocking.
+
+static auto encode(const google::protobuf::Message &message) -> std::string {
+    int size = (int) message.ByteSizeLong();
+    std::string packet(sizeof(size) + size, '\0');
+    std::memcpy(&packet[0], &size, sizeof(size));
+    message.SerializeToArray(&packet[sizeof(size)], size);
+    return packet;
+}
+
+static auto user_frame(int index) -> std::string {
+    online::User user;
+    user.set_username("load-user-" + std::to_string(index));
+    user.set_password("load");
+    return encode(user);
+}
+
+static auto upload_frames(const std::string &name, int payload) -> std::string {
+    online::ReconBuffer buffer;
+    buffer.set_file_base(name);
+    buffer.set_obj_content(std::string(payload, 'v'));
+    buffer.set_mtl_content("newmtl Material\n");
+    buffer.set_texture_content(std::string(1024, 't'));
+    return encode(make_request("upload")) + encode(buffer);
+}
+
+static auto connect_to(const LoadOptions &options) -> int {
+    auto sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin;
+    std::memset(&sin, 0, sizeof(sin));
+    inet_pton(AF_INET, options.host.c_str(), &sin.sin_addr.s_addr);
+    sin.sin_port = htons(options.port);
+    sin.sin_family = AF_INET;
+    if (sock == -1 || ::connect(sock, (sockaddr *) &sin, sizeof(sin)) == -1) {
+        if (sock != -1) {
+            close(sock);
+        }
+        return -1;
+    }
+    return sock;
+}
+
+static auto write_all(int sock, const std::string &bytes) -> bool {
+    size_t offset = 0;
+    while (offset < bytes.size()) {
+        auto sent = ::send(sock, bytes.data() + offset, bytes.size() - offset, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        offset += sent;
+    }
+    return true;
+}
+
+static auto read_frame(int sock, std::string &payload) -> bool {
+    int size = 0;
+    if (recv(sock, &size, sizeof(size), MSG_WAITALL) != sizeof(size) || size < 0) {
+        return false;
+    }
+    payload.resize(size);
+    return size == 0 || recv(sock, &payload[0], size, MSG_WAITALL) == size;
+}
+
+/// Sends `frames` and waits for the one reply frame.
+static auto call(int sock, const std::string &frames) -> std::optional<std::string> {
+    std::string reply;
+    if (!write_all(sock, frames) || !read_frame(sock, reply)) {
+        return {};
+    }
+    return reply;
+}
+
+/// Every reply that isn't `error ...` counts as a success; other replies either aren't a
+/// Request at all, or don't start with that word.
+static auto is_error(const std::string &reply) -> bool {
+    online::Request request;
+    return request.ParseFromString(reply) && request.arg_size() > 0 && request.arg(0) == "error";
+}
+
+// O P T I O N S //////////////////////////////////////////////
+
+auto LoadGenerator::parse_options(int argc, const char *argv[], LoadOptions &options) -> bool {
+    for (auto i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        auto has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--clients" && has_value) {
+            options.clients = std::atoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--users" && has_value) {
+            options.users = std::atoi(argv[++i]);
+        } else if (arg == "--duration" && has_value) {
+            options.duration = std::atof(argv[++i]);
+        } else if (arg == "--rate" && has_value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--payload" && has_value) {
+            options.payload = std::atoi(argv[++i]);
+        } else if (arg == "--server-pid" && has_value) {
+            options.server_pid = std::atoi(argv[++i]);
+        } else if (arg == "--mix" && has_value) {
+            // e.g. hello=1,download=4; commands left out get no weight
+            options.mix.fill(0);
+            std::string mix = argv[++i];
+            size_t start = 0;
+            while (start < mix.size()) {
+                auto end = std::min(mix.find(',', start), mix.size());
+                auto item = mix.substr(start, end - start);
+                auto equals = item.find('=');
+                auto name = item.substr(0, equals);
+                auto found = std::find_if(std::begin(LOAD_COMMAND_NAMES), std::end(LOAD_COMMAND_NAMES),
+                                          [&] (const char *command) { return name == command; });
+                if (equals == std::string::npos || found == std::end(LOAD_COMMAND_NAMES)) {
+                    std::cerr << "未知命令：" << name << std::endl;
+                    return false;
+                }
+                options.mix[found - std::begin(LOAD_COMMAND_NAMES)] = std::atoi(item.c_str() + equals + 1);
+                start = end + 1;
+            }
+        } else {
+            std::cerr << "未知参数：" << arg << std::endl;
+            std::cerr << "用法：Server --load [--host 127.0.0.1] [--port 17290] [--clients N] [--threads N] "
+                "[--users N] [--duration 秒] [--rate 每客户端每秒请求数] [--payload 字节] "
+                "[--mix hello=30,login=5,records=25,upload=5,download=35] [--server-pid PID]" << std::endl;
+            return false;
+        }
+    }
+    auto weights = 0;
+    for (auto weight : options.mix) {
+        weights += std::max(weight, 0);
+    }
+    return options.clients > 0 && options.threads > 0 && options.users > 0 && options.duration > 0 &&
+           options.payload >= 0 && weights > 0;
+}
+
+// R U N //////////////////////////////////////////////////////
+
+auto LoadGenerator::prepare() -> bool {
+    auto sock = connect_to(options);
+    if (sock == -1) {
+        std::cerr << "无法连接服务器：" << options.host << ":" << options.port << std::endl;
+        return false;
+    }
+    auto ok = call(sock, encode(make_request("hello", "server"))).has_value();
+    // Accounts left over from an earlier run answer "user exist", which is fine
+    for (auto i = 0; i < options.users && ok; i++) {
+        ok = call(sock, encode(make_request("register")) + user_frame(i)).has_value();
+    }
+    // A few records of our own for the downloads
+    auto seeds = std::min(options.users, 8);
+    for (auto i = 0; i < seeds && ok; i++) {
+        auto logged_in = call(sock, encode(make_request("login")) + user_frame(i));
+        auto uploaded = logged_in.has_value() && !is_error(*logged_in) ?
+            call(sock, upload_frames("load-seed", options.payload)) : std::nullopt;
+        ok = uploaded.has_value() && !is_error(*uploaded);
+    }
+    auto reply = ok ? call(sock, encode(make_request("records"))) : std::nullopt;
+    close(sock);
+    online::ReconRecords records;
+    if (!reply.has_value() || !records.ParseFromString(*reply)) {
+        std::cerr << "准备压测数据失败。" << std::endl;
+        return false;
+    }
+    for (const auto &record : records.records()) {
+        if (record.name().find("/load-") != std::string::npos) {
+            record_ids.push_back(record.id());
+        }
+    }
+    return !record_ids.empty();
+}
+
+auto LoadGenerator::run() -> int {
+    // One descriptor per client, and then some
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+#ifdef __APPLE__
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, OPEN_MAX);
+#endif
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (!prepare()) {
+        return 1;
+    }
+    std::cout << "已准备 " << options.users << " 个账户与 " << record_ids.size() << " 条记录，正在连接 "
+        << options.clients << " 个客户端..." << std::endl;
+
+    auto threads = std::min(options.threads, options.clients);
+    std::vector<std::array<LoadSamples, LOAD_COMMANDS>> samples(threads);
+    std::vector<std::thread> workers;
+    auto first = 0;
+    for (auto i = 0; i < threads; i++) {
+        auto count = options.clients / threads + (i < options.clients % threads ? 1 : 0);
+        workers.emplace_back([this, i, first, count, &samples] () {
+            drive(i, first, count, samples[i]);
+        });
+        first += count;
+    }
+    // Everyone connects and logs in before the clock starts
+    while (connected < threads) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto start = Clock::now();
+    deadline = start + std::chrono::microseconds((int64_t) (options.duration * 1e6));
+    started = true;
+    std::cout << "开始压测，持续 " << options.duration << " 秒。" << std::endl;
+    while (Clock::now() < deadline) {
+        if (options.server_pid > 0) {
+            auto command = "ps -o rss= -p " + std::to_string(options.server_pid);
+            auto pipe = popen(command.c_str(), "r");
+            long long kib = 0;
+            if (pipe != nullptr) {
+                if (fscanf(pipe, "%lld", &kib) == 1) {
+                    rss.push_back(kib);
+                }
+                pclose(pipe);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::array<LoadSamples, LOAD_COMMANDS> merged;
+    for (auto &thread_samples : samples) {
+        for (auto c = 0; c < LOAD_COMMANDS; c++) {
+            auto &into = merged[c].latencies;
+            into.insert(into.end(), thread_samples[c].latencies.begin(), thread_samples[c].latencies.end());
+            merged[c].errors += thread_samples[c].errors;
+        }
+    }
+    report(merged, elapsed);
+    return 0;
+}
+
+// C L I E N T S //////////////////////////////////////////////
+
+namespace {
+
+struct LoadClient {
+    int sock = -1;
+    int user = 0;
+    std::string out;
+    size_t out_offset = 0;
+    std::string in;
+    bool waiting = false; // For the reply to `command`
+    int64_t pieces = 0; // Chunk frames of a download still to come
+    LoadCommand command = LoadCommand::HELLO;
+    Clock::time_point sent;
+    Clock::time_point next; // When to send the next request
+};
+
+}
+
+auto LoadGenerator::drive(int thread, int first, int count, std::array<LoadSamples, LOAD_COMMANDS> &samples) -> void {
+    Reactor reactor;
+    std::vector<LoadClient> clients(count);
+    std::unordered_map<int, int> by_sock;
+    auto usable = reactor.init();
+    for (auto i = 0; i < count && usable; i++) {
+        auto &client = clients[i];
+        client.user = (first + i) % options.users;
+        client.sock = connect_to(options);
+        auto hello = client.sock == -1 ? std::nullopt : call(client.sock, encode(make_request("hello", "server")));
+        auto login = hello.has_value() ? call(client.sock, encode(make_request("login")) + user_frame(client.user)) :
+            std::nullopt;
+        if (!login.has_value() || is_error(*login) || !set_nonblocking(client.sock) || !reactor.add(client.sock)) {
+            std::cerr << "客户端 " << first + i << " 无法登陆。" << std::endl;
+            if (client.sock != -1) {
+                close(client.sock);
+                client.sock = -1;
+            }
+            continue;
+        }
+        by_sock[client.sock] = i;
+    }
+    connected++;
+    while (!started) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Everything a client might send, built once; uploads overwrite a handful of records
+    std::mt19937 random(thread + 1);
+    std::discrete_distribution<int> pick(options.mix.begin(), options.mix.end());
+    std::uniform_int_distribution<size_t> pick_record(0, record_ids.size() - 1);
+    const auto hello_frame = encode(make_request("hello", "server"));
+    const auto records_frame = encode(make_request("records"));
+    std::vector<std::string> login_frames;
+    for (auto i = 0; i < options.users; i++) {
+        login_frames.push_back(encode(make_request("login")) + user_frame(i));
+    }
+    const auto upload_frame = upload_frames("load-" + std::to_string(thread), options.payload);
+    auto interval = options.rate > 0 ? std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / options.rate)) : Clock::duration::zero();
+    auto now = Clock::now();
+    for (auto &client : clients) {
+        // Spread rate-limited clients over the first interval instead of firing all at once
+        client.next = now + std::chrono::duration_cast<Clock::duration>(interval * std::generate_canonical<double, 32>(random));
+    }
+
+    auto flush = [&] (LoadClient &client) {
+        while (client.sock != -1 && client.out_offset < client.out.size()) {
+            auto sent = ::send(client.sock, client.out.data() + client.out_offset,
+                               client.out.size() - client.out_offset, 0);
+            if (sent > 0) {
+                client.out_offset += sent;
+            } else if (sent == -1 && errno == EINTR) {
+                continue;
+            } else {
+                return sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+        }
+        return true;
+    };
+    auto drop = [&] (LoadClient &client) {
+        samples[(int) client.command].errors++;
+        by_sock.erase(client.sock);
+        close(client.sock);
+        client.sock = -1;
+    };
+    auto begin = [&] (LoadClient &client) {
+        client.command = (LoadCommand) pick(random);
+        switch (client.command) {
+            case LoadCommand::HELLO:
+                client.out = hello_frame;
+                break;
+
+            case LoadCommand::LOGIN:
+                client.out = login_frames[client.user];
+                break;
+
+            case LoadCommand::RECORDS:
+                client.out = records_frame;
+                break;
+
+            case LoadCommand::UPLOAD:
+                client.out = upload_frame;
+                break;
+
+            case LoadCommand::DOWNLOAD:
+                // The whole record the way the app fetches it, so the range path and its cache are measured
+                client.out = encode(make_request("download_range", std::to_string(record_ids[pick_record(random)]),
+                                                 "0", "-1"));
+                break;
+        }
+        client.out_offset = 0;
+        client.waiting = true;
+        client.sent = Clock::now();
+        if (!flush(client)) {
+            drop(client);
+        }
+    };
+    auto receive = [&] (LoadClient &client) {
+        char buffer[65536];
+        while (client.sock != -1) {
+            auto received = recv(client.sock, buffer, sizeof(buffer), 0);
+            if (received > 0) {
+                client.in.append(buffer, received);
+                continue;
+            }
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            drop(client);
+            return;
+        }
+        int size = 0;
+        while (client.waiting && client.in.size() >= sizeof(size)) {
+            std::memcpy(&size, client.in.data(), sizeof(size));
+            if (client.in.size() < sizeof(size) + size) {
+                break;
+            }
+            auto failed = false;
+            if (client.pieces > 0) {
+                // A chunk frame of the download; the sample ends with the last
+                client.in.erase(0, sizeof(size) + size);
+                if (--client.pieces > 0) {
+                    continue;
+                }
+            } else {
+                auto reply = client.in.substr(sizeof(size), size);
+                client.in.erase(0, sizeof(size) + size);
+                failed = is_error(reply);
+                online::Request header;
+                if (!failed && client.command == LoadCommand::DOWNLOAD && header.ParseFromString(reply) &&
+                    header.arg_size() >= 5) {
+                    // `range <name> <hash> <offset> <length> ...`, then the length in chunk frames
+                    client.pieces = (std::atoll(header.arg(4).c_str()) + TRANSFER_CHUNK - 1) / TRANSFER_CHUNK;
+                    if (client.pieces > 0) {
+                        continue;
+                    }
+                }
+            }
+            auto finished = Clock::now();
+            auto &into = samples[(int) client.command];
+            if (failed) {
+                into.errors++;
+            } else {
+                auto micros = std::chrono::duration_cast<std::chrono::microseconds>(finished - client.sent).count();
+                into.latencies.push_back((uint32_t) std::min<int64_t>(micros, UINT32_MAX));
+            }
+            client.waiting = false;
+            // A client that fell far behind its rate starts over instead of bursting to catch up
+            client.next = std::max(client.next + interval, finished - std::chrono::seconds(1));
+        }
+    };
+
+    std::vector<ReactorEvent> events;
+    while ((now = Clock::now()) < deadline) {
+        auto wake = deadline;
+        for (auto &client : clients) {
+            if (client.sock == -1 || client.waiting) {
+                continue;
+            }
+            if (client.next <= now) {
+                begin(client);
+            } else {
+                wake = std::min(wake, client.next);
+            }
+        }
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+        if (reactor.wait(events, (int) std::clamp<int64_t>(timeout, 0, 100)) < 0) {
+            break;
+        }
+        for (const auto &event : events) {
+            auto it = by_sock.find(event.fd);
+            if (it == by_sock.end()) {
+                continue;
+            }
+            auto &client = clients[it->second];
+            if (event.error) {
+                drop(client);
+                continue;
+            }
+            if (event.writable && !flush(client)) {
+                drop(client);
+                continue;
+            }
+            if (event.readable) {
+                receive(client);
+            }
+        }
+    }
+    for (auto &client : clients) {
+        if (client.sock != -1) {
+            close(client.sock);
+        }
+    }
+}
+
+auto LoadGenerator::report(std::array<LoadSamples, LOAD_COMMANDS> &samples, double elapsed) -> void {
+    auto percentile = [] (const std::vector<uint32_t> &sorted, double q) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        return sorted[std::min(sorted.size() - 1, (size_t) (q * sorted.size()))] / 1000.0;
+    };
+    uint64_t total = 0, errors = 0;
+    printf("\n%-10s %10s %12s %10s %10s %10s %8s\n", "命令", "次数", "吞吐 (次/秒)", "p50 毫秒", "p99 毫秒", "p999 毫秒", "错误");
+    for (auto c = 0; c < LOAD_COMMANDS; c++) {
+        auto &latencies = samples[c].latencies;
+        if (latencies.empty() && samples[c].errors == 0) {
+            continue;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("%-10s %10zu %12.1f %10.2f %10.2f %10.2f %8llu\n", LOAD_COMMAND_NAMES[c], latencies.size(),
+               latencies.size() / elapsed, percentile(latencies, 0.5), percentile(latencies, 0.99),
+               percentile(latencies, 0.999), (unsigned long long) samples[c].errors);
+        total += latencies.size();
+        errors += samples[c].errors;
+    }
+    printf("%-10s %10llu %12.1f %43llu\n", "合计", (unsigned long long) total, total / elapsed,
+           (unsigned long long) errors);
+    if (!rss.empty()) {
+        printf("服务器 RSS：开始 %.1f MB，峰值 %.1f MB，结束 %.1f MB\n", rss.front() / 1024.0,
+               *std::max_element(rss.begin(), rss.end()) / 1024.0, rss.back() / 1024.0);
+    }
+}
@@ -0,0 +1,79 @@
+//
+//  Load.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Load_hpp
+#define Load_hpp
+
+#include <string>
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <unordered_map>
+#include "Protocol.hpp"
+
+#define LOAD_COMMANDS 5
+
+enum class LoadCommand {
+    HELLO = 0,
+    LOGIN = 1,
+    RECORDS = 2,
+    UPLOAD = 3,
+    DOWNLOAD = 4 // A whole record by download_range, as the app fetches it
+};
+
+inline const char *LOAD_COMMAND_NAMES[LOAD_COMMANDS] = { "hello", "login", "records", "upload", "download" };
+
+struct LoadOptions {
+    std::string host = "127.0.0.1";
+    int port = 17290;
+    int clients = 1000;
+    int threads = 4;
+    int users = 100; // Clients share this many accounts
+    double duration = 30.0; // Seconds
+    double rate = 0.0; // Requests per second per client; 0 sends the next as soon as one is answered
+    int payload = 64 << 10; // Bytes of .obj per upload
+    std::array<int, LOAD_COMMANDS> mix { 30, 5, 25, 5, 35 }; // Relative weights, in LoadCommand order
+    int server_pid = 0; // Sampled for RSS when set
+};
+
+/// Latencies of one command, in microseconds.
+struct LoadSamples {
+    std::vector<uint32_t> latencies;
+    uint64_t errors = 0;
+};
+
+/// A fleet of synthetic clients against a running server, speaking the same protocol as the
+/// app: `Server --load [options]`. Clients are spread over a few threads, each driving its
+/// sockets from one Reactor, so thousands of them don't need thousands of threads.
+class LoadGenerator {
+public:
+    LoadGenerator(LoadOptions options) : options(options) {}
+
+    auto run() -> int;
+
+    static auto parse_options(int argc, const char *argv[], LoadOptions &options) -> bool;
+
+private:
+    /// Registers the accounts and uploads a few records for the downloads to fetch.
+    auto prepare() -> bool;
+
+    auto drive(int thread, int first, int count, std::array<LoadSamples, LOAD_COMMANDS> &samples) -> void;
+
+    auto report(std::array<LoadSamples, LOAD_COMMANDS> &samples, double elapsed) -> void;
+
+    LoadOptions options;
+    std::vector<int> record_ids;
+    std::vector<int64_t> rss; // KiB, sampled once a second
+    std::atomic<int> connected { 0 }; // Threads done connecting their clients
+    std::atomic<bool> started { false };
+    std::chrono::steady_clock::time_point deadline; // Set before `started`
+};
+
+#endif /* Load_hpp */
@@ -0,0 +1,89 @@
+//
+//  Log.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Log.hpp"
+#include <iostream>
+#include <algorithm>
+
+Logger::Logger() : tokens(LOG_RATE), refilled(std::chrono::steady_clock::now()), dropped_lines(0),
+    dropped_total(0), stopping(false) {
+    writer = std::thread([this] () {
+        work();
+    });
+}
+
+auto Logger::shared() -> Logger & {
+    static Logger logger;
+    return logger;
+}
+
+auto Logger::write(LogLevel level, std::string line) -> void {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (level == LogLevel::INFO) {
+        auto now = std::chrono::steady_clock::now();
+        tokens = std::min<double>(LOG_RATE, tokens + std::chrono::duration<double>(now - refilled).count() * LOG_RATE);
+        refilled = now;
+    }
+    if (stopping || lines.size() >= LOG_QUEUE_CAPACITY || (level == LogLevel::INFO && tokens < 1.0)) {
+        dropped_lines++;
+        dropped_total++;
+        return;
+    }
+    if (level == LogLevel::INFO) {
+        tokens -= 1.0;
+    }
+    lines.emplace_back(level, std::move(line));
+    lock.unlock();
+    condition.notify_one();
+}
+
+auto Logger::work() -> void {
+    std::deque<std::pair<LogLevel, std::string>> batch;
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] () {
+            return stopping || !lines.empty();
+        });
+        batch.swap(lines);
+        auto dropped = dropped_lines;
+        dropped_lines = 0;
+        auto done = stopping;
+        lock.unlock();
+
+        for (const auto &[level, line] : batch) {
+            (level == LogLevel::ERROR ? std::cerr : std::cout) << line << '\n';
+        }
+        if (dropped > 0) {
+            std::cerr << "日志过多，已丢弃 " << dropped << " 行\n";
+        }
+        std::cout.flush();
+        std::cerr.flush();
+        batch.clear();
+        if (done) {
+            return;
+        }
+    }
+}
+
+auto Logger::stop() -> void {
+    mutex.lock();
+    stopping = true;
+    mutex.unlock();
+    condition.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+auto Logger::dropped() -> uint64_t {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped_total;
+}
+
+Logger::~Logger() {
+    stop();
+}
@@ -0,0 +1,83 @@
+//
+//  Log.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Log_hpp
+#define Log_hpp
+
+#include <string>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+#define LOG_QUEUE_CAPACITY 8192 // Lines waiting for the writer before new ones are dropped
+#define LOG_RATE 2000 // Informational lines per second, with a burst of as many
+
+enum class LogLevel {
+    INFO = 0,
+    ERROR = 1
+};
+
+/// Hands lines to one writer thread, so the event loop never blocks on the terminal. Under a
+/// flood, informational lines beyond LOG_RATE are counted and dropped instead of queued; errors
+/// are only dropped once the queue is full.
+class Logger {
+public:
+    static auto shared() -> Logger &;
+
+    auto write(LogLevel level, std::string line) -> void;
+
+    /// Writes out what is queued and stops the writer.
+    auto stop() -> void;
+
+    auto dropped() -> uint64_t;
+
+    ~Logger();
+
+private:
+    Logger();
+
+    auto work() -> void;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::pair<LogLevel, std::string>> lines;
+    std::thread writer;
+    double tokens;
+    std::chrono::steady_clock::time_point refilled;
+    uint64_t dropped_lines; // Since the writer last reported them
+    uint64_t dropped_total;
+    bool stopping;
+};
+
+/// One line, handed to the logger when it goes out of scope.
+class LogLine {
+public:
+    LogLine(LogLevel level) : level(level) {}
+
+    ~LogLine() {
+        Logger::shared().write(level, stream.str());
+    }
+
+    template<typename T>
+    auto operator<<(const T &what) -> LogLine & {
+        stream << what;
+        return *this;
+    }
+
+private:
+    LogLevel level;
+    std::ostringstream stream;
+};
+
+#define SERVER_LOG LogLine(LogLevel::INFO)
+#define SERVER_ERROR LogLine(LogLevel::ERROR)
+
+#endif /* Log_hpp */
@@ -0,0 +1,157 @@
+//
+//  Mesh.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Mesh.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+struct TriangleHash {
+    auto operator()(const std::array<uint32_t, 3> &t) const -> size_t {
+        return ((size_t) t[0] * 73856093) ^ ((size_t) t[1] * 19349663) ^ ((size_t) t[2] * 83492791);
+    }
+};
+
+};
+
+auto parse_obj(const std::string &text, ObjMesh &mesh) -> bool {
+    std::vector<std::array<float, 2>> texcoords;
+    std::vector<MeshCorner> face;
+    size_t at = 0;
+    while (at < text.size()) {
+        auto end = text.find('\n', at);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string line(text, at, end - at);
+        at = end + 1;
+        const char *cursor = line.c_str();
+        if (line.rfind("v ", 0) == 0) {
+            std::array<float, 3> position;
+            cursor += 2;
+            for (auto &coordinate : position) {
+                char *next;
+                coordinate = std::strtof(cursor, &next);
+                cursor = next;
+            }
+            mesh.positions.push_back(position);
+        } else if (line.rfind("vt ", 0) == 0) {
+            std::array<float, 2> texcoord;
+            cursor += 3;
+            for (auto &coordinate : texcoord) {
+                char *next;
+                coordinate = std::strtof(cursor, &next);
+                cursor = next;
+            }
+            texcoords.push_back(texcoord);
+        } else if (line.rfind("f ", 0) == 0) {
+            // v, v/vt, v//vn or v/vt/vn; negative indices count back from the latest
+            face.clear();
+            cursor += 2;
+            while (true) {
+                char *next;
+                auto position = std::strtol(cursor, &next, 10);
+                if (next == cursor) {
+                    break;
+                }
+                cursor = next;
+                long texcoord = 0;
+                if (*cursor == '/') {
+                    cursor++;
+                    texcoord = std::strtol(cursor, &next, 10);
+                    cursor = next;
+                    if (*cursor == '/') {
+                        cursor++;
+                        std::strtol(cursor, &next, 10);
+                        cursor = next;
+                    }
+                }
+                position = position < 0 ? (long) mesh.positions.size() + position : position - 1;
+                texcoord = texcoord < 0 ? (long) texcoords.size() + texcoord : texcoord - 1;
+                if (position < 0 || position >= (long) mesh.positions.size()) {
+                    return false;
+                }
+                auto has_texcoord = texcoord >= 0 && texcoord < (long) texcoords.size();
+                face.push_back({ (uint32_t) position, has_texcoord ? texcoords[texcoord][0] : 0.0f,
+                    has_texcoord ? texcoords[texcoord][1] : 0.0f });
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                mesh.triangles.push_back({ face[0], face[i - 1], face[i] });
+            }
+        }
+    }
+    if (mesh.triangles.empty()) {
+        return false;
+    }
+    mesh.min = mesh.max = mesh.positions[mesh.triangles[0][0].position];
+    for (const auto &position : mesh.positions) {
+        for (auto axis = 0; axis < 3; axis++) {
+            mesh.min[axis] = std::min(mesh.min[axis], position[axis]);
+            mesh.max[axis] = std::max(mesh.max[axis], position[axis]);
+        }
+    }
+    return true;
+}
+
+auto cluster_mesh(const ObjMesh &mesh, int grid) -> ObjMesh {
+    ObjMesh clustered;
+    clustered.min = mesh.min;
+    clustered.max = mesh.max;
+
+    // Each cell's vertex sits at the average of the ones it replaces
+    std::vector<uint32_t> remap(mesh.positions.size());
+    std::unordered_map<uint64_t, uint32_t> cells;
+    std::vector<std::array<double, 3>> sums;
+    std::vector<uint32_t> counts;
+    for (size_t i = 0; i < mesh.positions.size(); i++) {
+        uint64_t key = 0;
+        for (auto axis = 0; axis < 3; axis++) {
+            auto extent = mesh.max[axis] - mesh.min[axis];
+            auto t = extent > 0.0f ? (mesh.positions[i][axis] - mesh.min[axis]) / extent : 0.0f;
+            key = key * grid + (uint64_t) std::min(std::max((int) (t * grid), 0), grid - 1);
+        }
+        auto cell = cells.emplace(key, (uint32_t) sums.size());
+        if (cell.second) {
+            sums.push_back({ 0.0, 0.0, 0.0 });
+            counts.push_back(0);
+        }
+        auto index = cell.first->second;
+        for (auto axis = 0; axis < 3; axis++) {
+            sums[index][axis] += mesh.positions[i][axis];
+        }
+        counts[index]++;
+        remap[i] = index;
+    }
+    clustered.positions.resize(sums.size());
+    for (size_t i = 0; i < sums.size(); i++) {
+        for (auto axis = 0; axis < 3; axis++) {
+            clustered.positions[i][axis] = (float) (sums[i][axis] / counts[i]);
+        }
+    }
+
+    // Triangles whose corners fell into fewer than three cells are gone; so are repeats
+    std::unordered_set<std::array<uint32_t, 3>, TriangleHash> seen;
+    for (const auto &triangle : mesh.triangles) {
+        auto kept = triangle;
+        std::array<uint32_t, 3> corners;
+        for (auto corner = 0; corner < 3; corner++) {
+            kept[corner].position = corners[corner] = remap[triangle[corner].position];
+        }
+        if (corners[0] == corners[1] || corners[1] == corners[2] || corners[0] == corners[2]) {
+            continue;
+        }
+        std::sort(corners.begin(), corners.end());
+        if (!seen.insert(corners).second) {
+            continue;
+        }
+        clustered.triangles.push_back(kept);
+    }
+    return clustered;
+}
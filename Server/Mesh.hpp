@@ -0,0 +1,37 @@
+//
+//  Mesh.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Mesh_hpp
+#define Mesh_hpp
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+struct MeshCorner {
+    uint32_t position;
+    float u, v;
+};
+
+/// Positions and triangles of an .obj, every corner with texture coordinates of its own.
+struct ObjMesh {
+    std::vector<std::array<float, 3>> positions;
+    std::vector<std::array<MeshCorner, 3>> triangles;
+    std::array<float, 3> min { 0.0f, 0.0f, 0.0f }; // Bounding box of the positions
+    std::array<float, 3> max { 0.0f, 0.0f, 0.0f };
+};
+
+/// Reads `v`, `vt` and `f` lines; polygons become fans of triangles. False if there are no
+/// triangles or a face points at a vertex that isn't there.
+auto parse_obj(const std::string &text, ObjMesh &mesh) -> bool;
+
+/// Merges the vertices sharing a cell of a grid `grid` cells a side into one at their average,
+/// dropping the triangles that collapse or repeat. The bounding box stays the original's.
+auto cluster_mesh(const ObjMesh &mesh, int grid) -> ObjMesh;
+
+#endif /* Mesh_hpp */
@@ -0,0 +1,252 @@
+//
+//  Metrics.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Metrics.hpp"
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define METRICS_REQUEST_LIMIT 8192 // Bytes of an HTTP request head we bother reading
+
+// H I S T O G R A M S ////////////////////////////////////////
+
+auto LatencyHistogram::bucket(uint64_t value) -> int {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int) value;
+    }
+    auto exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    auto shift = exponent - HISTOGRAM_SUB_BITS;
+    return HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS + (int) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+auto LatencyHistogram::upper_bound(int bucket) -> uint64_t {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    auto shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    auto sub = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    return ((uint64_t) (HISTOGRAM_SUB_BUCKETS + sub) << shift) + (1ull << shift) - 1;
+}
+
+auto LatencyHistogram::record(uint64_t micros) -> void {
+    counts[bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(micros, std::memory_order_relaxed);
+    auto seen = max.load(std::memory_order_relaxed);
+    while (micros > seen && !max.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {}
+}
+
+auto LatencyHistogram::snapshot() const -> HistogramSnapshot {
+    // Not one atomic picture, but close enough: count is recomputed from the buckets read
+    HistogramSnapshot snapshot;
+    for (auto i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot.counts[i] = counts[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.counts[i];
+    }
+    snapshot.sum = sum.load(std::memory_order_relaxed);
+    snapshot.max = max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+auto HistogramSnapshot::percentile(double q) const -> uint64_t {
+    if (count == 0) {
+        return 0;
+    }
+    auto rank = std::max<uint64_t>(1, (uint64_t) std::ceil(q * count));
+    uint64_t seen = 0;
+    for (auto i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::min(LatencyHistogram::upper_bound(i), max);
+        }
+    }
+    return max;
+}
+
+// M E T R I C S //////////////////////////////////////////////
+
+auto Metrics::request(MetricCommand command, uint64_t micros, bool failed) -> void {
+    latencies[(int) command].record(micros);
+    if (failed) {
+        failures[(int) command].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+auto Metrics::stats(const MetricsGauges &gauges) const -> std::vector<std::string> {
+    std::vector<std::string> stats;
+    auto add = [&stats] (std::string name, auto value) {
+        stats.push_back(name);
+        stats.push_back(std::to_string(value));
+    };
+    auto uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - started);
+    add("uptime_seconds", uptime.count());
+    add("connections_active", active.load(std::memory_order_relaxed));
+    add("connections_accepted", accepted.load(std::memory_order_relaxed));
+    add("bytes_in", bytes_in.load(std::memory_order_relaxed));
+    add("bytes_out", bytes_out.load(std::memory_order_relaxed));
+    add("errors", errors.load(std::memory_order_relaxed));
+    add("throttled", throttled.load(std::memory_order_relaxed));
+    add("rejected", rejected.load(std::memory_order_relaxed));
+    add("worker_queue", gauges.worker_queue);
+    add("job_queue", gauges.job_queue);
+    add("artifact_queue", gauges.artifact_queue);
+    add("cache_bytes", gauges.cache_bytes);
+    add("log_dropped", gauges.log_dropped);
+    for (auto c = 0; c < METRICS_COMMANDS; c++) {
+        auto snapshot = latencies[c].snapshot();
+        std::string name = METRIC_COMMAND_NAMES[c];
+        add(name + "_count", snapshot.count);
+        add(name + "_failed", failures[c].load(std::memory_order_relaxed));
+        add(name + "_p50_us", snapshot.percentile(0.5));
+        add(name + "_p99_us", snapshot.percentile(0.99));
+        add(name + "_p999_us", snapshot.percentile(0.999));
+        add(name + "_max_us", snapshot.max);
+    }
+    return stats;
+}
+
+auto Metrics::prometheus(const MetricsGauges &gauges) const -> std::string {
+    std::ostringstream out;
+    auto metric = [&out] (const char *name, const char *type, const char *help, auto value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n"
+            << name << " " << value << "\n";
+    };
+    auto uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    metric("recon_uptime_seconds", "gauge", "Seconds since the server started.", uptime);
+    metric("recon_connections_active", "gauge", "Open client connections.", active.load(std::memory_order_relaxed));
+    metric("recon_connections_accepted_total", "counter", "Client connections accepted.",
+           accepted.load(std::memory_order_relaxed));
+    metric("recon_received_bytes_total", "counter", "Bytes read from clients.", bytes_in.load(std::memory_order_relaxed));
+    metric("recon_sent_bytes_total", "counter", "Bytes written to clients.", bytes_out.load(std::memory_order_relaxed));
+    metric("recon_errors_total", "counter", "Error replies sent.", errors.load(std::memory_order_relaxed));
+    metric("recon_throttled_total", "counter", "Times a connection waited for a rate limit or buffer room.",
+           throttled.load(std::memory_order_relaxed));
+    metric("recon_rejected_total", "counter", "Connections closed for going over a size or request limit.",
+           rejected.load(std::memory_order_relaxed));
+    metric("recon_worker_queue_depth", "gauge", "Jobs waiting for the worker pool.", gauges.worker_queue);
+    metric("recon_job_queue_depth", "gauge", "Reconstruction jobs waiting to run.", gauges.job_queue);
+    metric("recon_artifact_queue_depth", "gauge", "Published records waiting for their artifacts.", gauges.artifact_queue);
+    metric("recon_cache_bytes", "gauge", "Bytes held by the download cache.", gauges.cache_bytes);
+    metric("recon_cache_hits_total", "counter", "Downloads answered from the cache.", gauges.cache_hits);
+    metric("recon_cache_misses_total", "counter", "Downloads read from the store.", gauges.cache_misses);
+    metric("recon_log_dropped_total", "counter", "Log lines dropped by the rate limit.", gauges.log_dropped);
+
+    out << "# HELP recon_request_duration_seconds Time from a request to its last reply frame.\n"
+        << "# TYPE recon_request_duration_seconds summary\n";
+    for (auto c = 0; c < METRICS_COMMANDS; c++) {
+        auto snapshot = latencies[c].snapshot();
+        std::string label = std::string("command=\"") + METRIC_COMMAND_NAMES[c] + "\"";
+        for (auto q : { 0.5, 0.9, 0.99, 0.999 }) {
+            out << "recon_request_duration_seconds{" << label << ",quantile=\"" << q << "\"} "
+                << snapshot.percentile(q) / 1e6 << "\n";
+        }
+        out << "recon_request_duration_seconds_sum{" << label << "} " << snapshot.sum / 1e6 << "\n"
+            << "recon_request_duration_seconds_count{" << label << "} " << snapshot.count << "\n";
+    }
+    out << "# HELP recon_request_failures_total Requests answered with an error.\n"
+        << "# TYPE recon_request_failures_total counter\n";
+    for (auto c = 0; c < METRICS_COMMANDS; c++) {
+        out << "recon_request_failures_total{command=\"" << METRIC_COMMAND_NAMES[c] << "\"} "
+            << failures[c].load(std::memory_order_relaxed) << "\n";
+    }
+    return out.str();
+}
+
+// E N D P O I N T ////////////////////////////////////////////
+
+auto MetricsEndpoint::start(int port, std::function<std::string()> render) -> bool {
+    this->render = render;
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in sin;
+    std::memset(&sin, 0, sizeof(sin));
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    sin.sin_family = AF_INET;
+    if (bind(sock, (sockaddr *) &sin, sizeof(sin)) == -1 || listen(sock, 16) == -1) {
+        close(sock);
+        sock = -1;
+        return false;
+    }
+    stopping = false;
+    thread = std::thread([this] () {
+        serve();
+    });
+    return true;
+}
+
+auto MetricsEndpoint::serve() -> void {
+    while (!stopping) {
+        // Poll rather than block in accept() so stop() needn't rely on closing a socket under it
+        pollfd listening { sock, POLLIN, 0 };
+        if (poll(&listening, 1, 200) <= 0) {
+            continue;
+        }
+        auto client = accept(sock, nullptr, nullptr);
+        if (client == -1) {
+            continue;
+        }
+        timeval timeout { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string head;
+        char buffer[1024];
+        while (head.find("\r\n\r\n") == std::string::npos && head.size() < METRICS_REQUEST_LIMIT) {
+            auto received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                break;
+            }
+            head.append(buffer, received);
+        }
+        std::string status = "200 OK", body;
+        if (head.rfind("GET /metrics ", 0) == 0 || head.rfind("GET / ", 0) == 0) {
+            body = render();
+        } else {
+            status = "404 Not Found";
+            body = "try /metrics\n";
+        }
+        auto response = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+            std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t offset = 0;
+        while (offset < response.size()) {
+            auto sent = ::send(client, response.data() + offset, response.size() - offset, 0);
+            if (sent <= 0) {
+                break;
+            }
+            offset += sent;
+        }
+        close(client);
+    }
+}
+
+auto MetricsEndpoint::stop() -> void {
+    stopping = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (sock != -1) {
+        close(sock);
+        sock = -1;
+    }
+}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    stop();
+}
@@ -0,0 +1,128 @@
+//
+//  Metrics.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Metrics_hpp
+#define Metrics_hpp
+
+#include <string>
+#include <array>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS) // Per power of two, so a bucket is within ~6% of its values
+#define HISTOGRAM_MAX_EXPONENT 40 // Microseconds; anything slower lands in the last bucket
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1))
+#define METRICS_COMMANDS 5
+
+/// Requests timed from the command frame to the last reply frame.
+enum class MetricCommand {
+    LOGIN = 0,
+    RECORDS = 1,
+    UPLOAD = 2,
+    DOWNLOAD = 3,
+    OTHER = 4
+};
+
+inline const char *METRIC_COMMAND_NAMES[METRICS_COMMANDS] = { "login", "records", "upload", "download", "other" };
+
+struct HistogramSnapshot {
+    /// The highest value the bucket holding the q-th quantile can hold.
+    auto percentile(double q) const -> uint64_t;
+
+    std::array<uint64_t, HISTOGRAM_BUCKETS> counts {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+/// HDR-style log-linear histogram of latencies in microseconds: exact below
+/// HISTOGRAM_SUB_BUCKETS, then HISTOGRAM_SUB_BUCKETS buckets per power of two. Recording is a
+/// few relaxed atomic adds, so any thread can record without a lock.
+class LatencyHistogram {
+public:
+    auto record(uint64_t micros) -> void;
+
+    auto snapshot() const -> HistogramSnapshot;
+
+    static auto bucket(uint64_t value) -> int;
+
+    /// Highest value that falls in `bucket`.
+    static auto upper_bound(int bucket) -> uint64_t;
+
+private:
+    std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> counts {};
+    std::atomic<uint64_t> count { 0 };
+    std::atomic<uint64_t> sum { 0 };
+    std::atomic<uint64_t> max { 0 };
+};
+
+/// Gauges that live elsewhere, read whenever the metrics are rendered.
+struct MetricsGauges {
+    int64_t worker_queue = 0; // Jobs waiting for the worker pool
+    int64_t job_queue = 0; // Reconstruction jobs waiting for a job worker
+    int64_t artifact_queue = 0; // Published records waiting for their artifacts
+    int64_t cache_bytes = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t log_dropped = 0;
+};
+
+/// Counters of the whole server. Everything is a relaxed atomic: exact enough for monitoring,
+/// and free of locks for the event loop and workers that bump them.
+class Metrics {
+public:
+    Metrics() : started(std::chrono::steady_clock::now()) {}
+
+    auto request(MetricCommand command, uint64_t micros, bool failed) -> void;
+
+    /// `stats <name> <value>...`, for the protocol command.
+    auto stats(const MetricsGauges &gauges) const -> std::vector<std::string>;
+
+    /// Prometheus text exposition format, version 0.0.4.
+    auto prometheus(const MetricsGauges &gauges) const -> std::string;
+
+    std::atomic<uint64_t> bytes_in { 0 };
+    std::atomic<uint64_t> bytes_out { 0 };
+    std::atomic<uint64_t> accepted { 0 }; // Connections, ever
+    std::atomic<int64_t> active { 0 }; // Connections, now
+    std::atomic<uint64_t> errors { 0 }; // `error` replies of any request
+    std::atomic<uint64_t> throttled { 0 }; // Times a connection was held back by a rate or the buffer budget
+    std::atomic<uint64_t> rejected { 0 }; // Connections closed over a frame too big or too many parked requests
+
+private:
+    std::chrono::steady_clock::time_point started;
+    std::array<LatencyHistogram, METRICS_COMMANDS> latencies;
+    std::array<std::atomic<uint64_t>, METRICS_COMMANDS> failures {};
+};
+
+/// Answers `GET /metrics` on 127.0.0.1 from a thread of its own, one connection at a time.
+/// Scrapes are rare and tiny, so this stays out of the event loop entirely.
+class MetricsEndpoint {
+public:
+    MetricsEndpoint() : sock(-1), stopping(false) {}
+
+    ~MetricsEndpoint();
+
+    auto start(int port, std::function<std::string()> render) -> bool;
+
+    auto stop() -> void;
+
+private:
+    auto serve() -> void;
+
+    int sock;
+    std::atomic<bool> stopping;
+    std::thread thread;
+    std::function<std::string()> render;
+};
+
+#endif /* Metrics_hpp */
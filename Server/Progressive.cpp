@@ -0,0 +1,152 @@
+//
+//  Progressive.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Progressive.hpp"
+#include "Mesh.hpp"
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+
+template<typename T>
+static auto append(std::string &out, T value) -> void {
+    out.append((const char *) &value, sizeof(value));
+}
+
+static auto quantize(float value, float min, float max) -> uint16_t {
+    auto extent = max - min;
+    auto t = extent > 0.0f ? (value - min) / extent : 0.0f;
+    return (uint16_t) std::lround(std::min(std::max(t, 0.0f), 1.0f) * PROGRESSIVE_QUANTA);
+}
+
+/// One level, vertices quantized across the bounding box of the whole mesh.
+static auto encode_level(const ObjMesh &level) -> std::string {
+    std::string out;
+    out.reserve(8 + level.positions.size() * 6 + level.triangles.size() * 24);
+    append(out, (uint32_t) level.positions.size());
+    append(out, (uint32_t) level.triangles.size());
+    for (const auto &position : level.positions) {
+        for (auto axis = 0; axis < 3; axis++) {
+            append(out, quantize(position[axis], level.min[axis], level.max[axis]));
+        }
+    }
+    for (const auto &triangle : level.triangles) {
+        for (const auto &corner : triangle) {
+            append(out, corner.position);
+        }
+        for (const auto &corner : triangle) {
+            append(out, quantize(corner.u, 0.0f, 1.0f));
+            append(out, quantize(corner.v, 0.0f, 1.0f));
+        }
+    }
+    return out;
+}
+
+auto ProgressiveMeshes::init() -> bool {
+    std::error_code error;
+    std::filesystem::create_directories(root, error);
+    return !error;
+}
+
+auto ProgressiveMeshes::path(const std::string &hash) const -> std::string {
+    return root + "/" + hash + ".pm";
+}
+
+auto ProgressiveMeshes::build(Store &store, const std::string &base) -> bool {
+    DownloadStream stream(store, base);
+    if (!stream.open()) {
+        return false;
+    }
+    auto target = path(stream.hash);
+    std::error_code error;
+    if (std::filesystem::exists(target, error)) {
+        return true;
+    }
+    std::string obj;
+    ObjMesh mesh;
+    if (!stream.read_file(0, obj) || !parse_obj(obj, mesh)) {
+        return false;
+    }
+    obj.clear();
+    obj.shrink_to_fit();
+
+    ProgressiveIndex index;
+    index.min = mesh.min;
+    index.max = mesh.max;
+    auto header = (int64_t) (sizeof(PROGRESSIVE_MAGIC) - 1 + sizeof(float) * 6 + (PROGRESSIVE_LEVELS + 1) * sizeof(int64_t));
+    index.offsets.push_back(header);
+
+    // Workers racing to build the same levels write the same bytes; the last rename wins
+    static std::atomic<uint64_t> counter { 0 };
+    auto temporary = target + ".tmp." + std::to_string(counter++);
+    std::ofstream writer(temporary, std::ios::binary);
+    writer.seekp(header);
+    for (auto level = 0; level < PROGRESSIVE_LEVELS && writer.good(); level++) {
+        auto bytes = PROGRESSIVE_GRIDS[level] == 0 ? encode_level(mesh) :
+            encode_level(cluster_mesh(mesh, PROGRESSIVE_GRIDS[level]));
+        writer.write(bytes.data(), bytes.size());
+        index.offsets.push_back(index.offsets.back() + (int64_t) bytes.size());
+    }
+    writer.seekp(0);
+    writer.write(PROGRESSIVE_MAGIC, sizeof(PROGRESSIVE_MAGIC) - 1);
+    writer.write((const char *) index.min.data(), sizeof(float) * 3);
+    writer.write((const char *) index.max.data(), sizeof(float) * 3);
+    writer.write((const char *) index.offsets.data(), index.offsets.size() * sizeof(int64_t));
+    writer.close();
+    if (!writer.good() || index.offsets.size() != PROGRESSIVE_LEVELS + 1) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    std::filesystem::rename(temporary, target, error);
+    return !error;
+}
+
+auto ProgressiveMeshes::open(const std::string &hash, ProgressiveIndex &index) const -> std::shared_ptr<FileHandle> {
+    auto fd = ::open(path(hash).c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    auto file = std::make_shared<FileHandle>(fd);
+    char magic[sizeof(PROGRESSIVE_MAGIC) - 1];
+    index.offsets.resize(PROGRESSIVE_LEVELS + 1);
+    auto bytes = (ssize_t) (index.offsets.size() * sizeof(int64_t));
+    auto at = (off_t) sizeof(magic);
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || std::memcmp(magic, PROGRESSIVE_MAGIC, sizeof(magic)) != 0 ||
+        pread(fd, index.min.data(), sizeof(float) * 3, at) != sizeof(float) * 3 ||
+        pread(fd, index.max.data(), sizeof(float) * 3, at + sizeof(float) * 3) != sizeof(float) * 3 ||
+        pread(fd, index.offsets.data(), bytes, at + sizeof(float) * 6) != bytes) {
+        return nullptr;
+    }
+    return file;
+}
+
+auto ProgressiveMeshes::collect(const std::vector<Manifest> &live) -> int {
+    std::set<std::string> referenced;
+    for (const auto &manifest : live) {
+        referenced.insert(path(manifest.hash));
+    }
+    auto removed = 0;
+    std::error_code error;
+    std::vector<std::filesystem::path> garbage;
+    for (const auto &entry : std::filesystem::directory_iterator(root, error)) {
+        if (referenced.count(entry.path().string()) == 0) {
+            garbage.push_back(entry.path());
+        }
+    }
+    for (const auto &path : garbage) {
+        if (std::filesystem::remove(path, error)) {
+            removed++;
+        }
+    }
+    return removed;
+}
@@ -0,0 +1,53 @@
+//
+//  Progressive.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Progressive_hpp
+#define Progressive_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <array>
+#include <cstdint>
+#include "Store.hpp"
+#include "Transfer.hpp"
+#include "Protocol.hpp"
+
+#define PROGRESSIVE_MAGIC "RPM1"
+
+/// Where a record's progressive levels sit in its file, and what the client needs to place them.
+struct ProgressiveIndex {
+    std::array<float, 3> min { 0.0f, 0.0f, 0.0f };
+    std::array<float, 3> max { 0.0f, 0.0f, 0.0f };
+    std::vector<int64_t> offsets; // PROGRESSIVE_LEVELS + 1, the last one the end of the file
+};
+
+/// Progressive meshes of stored records, one file per content hash at <root>/<hash>.pm, built
+/// from the .obj on upload; see Protocol.hpp for the levels. A file is "RPM1", the bounding box
+/// as six floats, PROGRESSIVE_LEVELS + 1 int64_t file offsets of the levels, then the levels,
+/// so they go out with sendfile as they are.
+class ProgressiveMeshes {
+public:
+    ProgressiveMeshes(std::string root) : root(root) {}
+
+    auto init() -> bool;
+
+    auto path(const std::string &hash) const -> std::string;
+
+    /// Builds the levels of the record at `base`, unless its content already has them.
+    auto build(Store &store, const std::string &base) -> bool;
+
+    /// The file for `hash` and where its levels are, or nullptr if there is none.
+    auto open(const std::string &hash, ProgressiveIndex &index) const -> std::shared_ptr<FileHandle>;
+
+    /// Deletes levels of content no record has any more.
+    auto collect(const std::vector<Manifest> &live) -> int;
+
+    std::string root;
+};
+
+#endif /* Progressive_hpp */
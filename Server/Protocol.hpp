@@ -0,0 +1,126 @@
+//
+//  Protocol.hpp
+//  Server
+//
+//  Created by apple on 25/04/2021.
+//
+
+#ifndef Protocol_hpp
+#define Protocol_hpp
+
+#include <string>
+#include "online.pb.h"
+
+// Shared by the server and the client. Every frame on the wire is an `int` byte count followed
+// by that many bytes: usually a serialized protobuf message, or raw file bytes during a
+// chunked transfer.
+
+#define TRANSFER_CHUNK (1 << 20) // Max payload of one chunk frame
+#define TRANSFER_FILES 3
+#define TRANSFER_CHECKSUM 4 // Resumable transfers prefix each chunk with its uint32_t CRC-32
+#define TRANSFER_RETRIES 3 // Times a client reconnects to resume a dropped transfer
+
+// T A G S ////////////////////////////////////////
+// A client offering `tags` in its hello, and answered with `tags` in the server's, puts a uint32_t
+// request tag in front of every later payload, counted in the frame's byte count, and gets the
+// server's frames tagged the same way. Requests are still served in the order they arrive, and
+// a request's transfer keeps the connection to itself, but replies carry the tag of the request
+// they answer, so a client can have many in flight and match them up as they come.
+
+#define TRANSFER_TAG 4
+#define TRANSFER_TAGS "tags"
+
+/// A stored reconstruction travels as its .obj, .mtl and .png, back to back, in this order.
+inline const char *TRANSFER_EXTENSIONS[TRANSFER_FILES] = { ".obj", ".mtl", ".png" };
+
+// J O B S ////////////////////////////////////////
+// Reconstructions run on the server: job_submit <name> → `job <id>`; job_image <id> <file> <bytes>
+// → "ready" → raw chunk frames → "success", once per image; job_start <id>; then job_watch <id>
+// streams `job <id> <state> <stage> <progress> <record id>` until the job is done or failed.
+
+#define JOB_IMAGES_MAX 4096
+
+enum class JobState {
+    UPLOADING = 0,
+    QUEUED = 1,
+    RUNNING = 2,
+    DONE = 3,
+    FAILED = 4
+};
+
+// P R O G R E S S I V E //////////////////////////
+// progressive <id> → `progressive <hash> <levels> <min x> <min y> <min z> <max x> <max y> <max z>
+// <png offset> <png bytes>`, then one raw frame per level, coarsest first. Each level is a whole
+// mesh: a uint32_t vertex count and triangle count, the vertices as three uint16_t each across
+// the bounding box, then per triangle three uint32_t vertex indices and three uint16_t (u, v)
+// pairs across [0, 1]. Coarser levels merge the vertices sharing a cell of a grid of
+// PROGRESSIVE_GRIDS[level] cells a side; the finest keeps every vertex. The texture is the
+// record's .png, fetched as a download_range from <png offset>.
+
+#define PROGRESSIVE_LEVELS 5
+#define PROGRESSIVE_QUANTA 65535.0f // Steps of a uint16_t coordinate
+
+inline const int PROGRESSIVE_GRIDS[PROGRESSIVE_LEVELS] = { 8, 24, 64, 160, 0 }; // 0: every vertex
+
+// A R T I F A C T S //////////////////////////////
+// Made by the server in the background once a record is published: artifacts <id> →
+// `artifacts <hash> <state> <name> <bytes>...` for the record's current content, the state
+// "ready" or "pending", and no names until they're ready; artifact <id> <name> → `artifact <hash>
+// <bytes>`, then the file as raw frames of up to TRANSFER_CHUNK bytes.
+// mesh.bin and the lod<n>.bin: ARTIFACT_MESH_MAGIC, a uint32_t vertex count, then a triangle list,
+// each vertex eight floats: position, face normal and texture coordinates.
+// texture.bc1: ARTIFACT_TEXTURE_MAGIC, uint32_t width, height and level count, then the mip
+// levels, largest first, as BC1 (DXT1) blocks of 8 bytes per 4 × 4 pixels, rows of blocks top down.
+// thumbnail.png: the model from the front and a little above, ARTIFACT_THUMBNAIL pixels square.
+
+#define ARTIFACT_LODS 2
+#define ARTIFACT_THUMBNAIL 128
+#define ARTIFACT_MESH_MAGIC "RMB1"
+#define ARTIFACT_TEXTURE_MAGIC "RTB1"
+
+inline const int ARTIFACT_LOD_GRIDS[ARTIFACT_LODS] = { 64, 24 }; // Cells a side, as for progressive levels
+inline const char *ARTIFACT_NAMES[] = { "mesh.bin", "lod1.bin", "lod2.bin", "texture.bc1", "thumbnail.png" };
+
+// S H A R D S ////////////////////////////////////
+// Records spread over several servers (`Server --shard <key>`) behind a router (`Server --router`)
+// that clients talk to as if it were one. A sharded server gives a new record the id
+// shard_record_id(<owner>/<name>), so the router can send an upload to the node that owns
+// that id on its ring before the record exists.
+// The router's own links offer `routed` in their hello; on those the server follows the last
+// frame of every request with a bare ROUTE_DONE in place of a byte count, so the router knows
+// where an exchange ends without understanding it.
+// After `shard <key>`, a link may also move records: shard_records → every record;
+// shard_export <id> → `manifest <owner> <name> <sha256> <obj bytes> <mtl bytes> <png bytes>` and a
+// <chunk hash> <length> pair per chunk; shard_chunk <hash> → that chunk as a checked frame;
+// shard_import <id> <owner> <name> and the rest of a manifest → as upload_chunks, publishing
+// the record under that id and owner unless either is taken; shard_drop <id> → "success".
+
+#define ROUTE_HELLO "routed"
+#define ROUTE_DONE -1
+
+// L I M I T S ////////////////////////////////////
+// A frame bigger than the server takes at that point, a request or credentials frame or any other
+// (`Server --request-kb`, `--message-mb`; a router takes the same flags), is answered with
+// `error message too large` and the connection closed, since the rest of it is never read.
+// Request rates and bandwidth only ever slow a connection down: it stops being read, or written
+// to, until its turn comes again.
+
+template<typename T>
+auto request_append(online::Request &request, T last) -> void {
+    request.add_arg(std::string(last));
+}
+
+template<typename T, typename ...Ar>
+auto request_append(online::Request &request, T first, Ar... args) -> void {
+    request.add_arg(std::string(first));
+    request_append(request, args...);
+}
+
+template<typename ...Ar>
+auto make_request(Ar... args) -> online::Request {
+    online::Request request;
+    request_append(request, args...);
+    return request;
+}
+
+#endif /* Protocol_hpp */
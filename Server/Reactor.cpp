@@ -0,0 +1,116 @@
+//
+//  Reactor.cpp
+//  Server
+//
+//  Created by apple on 24/04/2021.
+//
+
+#include "Reactor.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+auto set_nonblocking(int fd) -> bool {
+    auto flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return false;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+auto Reactor::init() -> bool {
+    if (pipe(wake_pipe) == -1) {
+        return false;
+    }
+    set_nonblocking(wake_pipe[0]);
+    set_nonblocking(wake_pipe[1]);
+#ifdef RECON_REACTOR_EPOLL
+    poll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    poll_fd = kqueue();
+#endif
+    if (poll_fd == -1) {
+        return false;
+    }
+    return add(wake_pipe[0]);
+}
+
+auto Reactor::add(int fd) -> bool {
+#ifdef RECON_REACTOR_EPOLL
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    return epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event) != -1;
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    return kevent(poll_fd, changes, 2, nullptr, 0, nullptr) != -1;
+#endif
+}
+
+auto Reactor::remove(int fd) -> void {
+    // Closing a descriptor drops it from both epoll and kqueue; this is for sockets we keep open
+#ifdef RECON_REACTOR_EPOLL
+    epoll_ctl(poll_fd, EPOLL_CTL_DEL, fd, nullptr);
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    kevent(poll_fd, changes, 2, nullptr, 0, nullptr);
+#endif
+}
+
+auto Reactor::wait(std::vector<ReactorEvent> &events, int timeout_ms) -> int {
+    events.clear();
+#ifdef RECON_REACTOR_EPOLL
+    epoll_event ready[REACTOR_MAX_EVENTS];
+    auto count = epoll_wait(poll_fd, ready, REACTOR_MAX_EVENTS, timeout_ms);
+#else
+    struct kevent ready[REACTOR_MAX_EVENTS];
+    timespec timeout { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+    auto count = kevent(poll_fd, nullptr, 0, ready, REACTOR_MAX_EVENTS, timeout_ms < 0 ? nullptr : &timeout);
+#endif
+    if (count == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (auto i = 0; i < count; i++) {
+        ReactorEvent event;
+#ifdef RECON_REACTOR_EPOLL
+        event.fd = ready[i].data.fd;
+        // Hang ups are reported as readable, so the next read sees EOF and cleans up
+        event.readable = ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP);
+        event.writable = ready[i].events & EPOLLOUT;
+        event.error = ready[i].events & EPOLLERR;
+#else
+        event.fd = (int) ready[i].ident;
+        event.readable = ready[i].filter == EVFILT_READ || (ready[i].flags & EV_EOF);
+        event.writable = ready[i].filter == EVFILT_WRITE;
+        event.error = ready[i].flags & EV_ERROR;
+#endif
+        if (event.fd == wake_pipe[0]) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+            continue;
+        }
+        events.push_back(event);
+    }
+    return (int) events.size();
+}
+
+auto Reactor::wake() -> void {
+    char byte = 0;
+    // A full pipe already guarantees a wake up, so EAGAIN is fine
+    auto written = write(wake_pipe[1], &byte, 1);
+    (void) written;
+}
+
+Reactor::~Reactor() {
+    if (poll_fd != -1) {
+        close(poll_fd);
+    }
+    if (wake_pipe[0] != -1) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+    }
+}
@@ -0,0 +1,58 @@
+//
+//  Reactor.hpp
+//  Server
+//
+//  Created by apple on 24/04/2021.
+//
+
+#ifndef Reactor_hpp
+#define Reactor_hpp
+
+#include <vector>
+
+#if defined(__linux__)
+#define RECON_REACTOR_EPOLL
+#include <sys/epoll.h>
+#else
+#define RECON_REACTOR_KQUEUE
+#include <sys/event.h>
+#endif
+
+#define REACTOR_MAX_EVENTS 1024
+
+struct ReactorEvent {
+    int fd;
+    bool readable;
+    bool writable;
+    bool error;
+};
+
+/// Edge-triggered readiness notification for many non-blocking sockets: epoll on Linux,
+/// kqueue on macOS. Sockets are always watched for both directions, so callers must
+/// read / write until EAGAIN every time they are told a socket is ready.
+class Reactor {
+public:
+    Reactor() : poll_fd(-1), wake_pipe { -1, -1 } {}
+
+    ~Reactor();
+
+    auto init() -> bool;
+
+    auto add(int fd) -> bool;
+
+    auto remove(int fd) -> void;
+
+    /// Blocks until something is ready or wake() is called. Returns the number of events.
+    auto wait(std::vector<ReactorEvent> &events, int timeout_ms = -1) -> int;
+
+    /// Interrupts wait() from any thread.
+    auto wake() -> void;
+
+private:
+    int poll_fd;
+    int wake_pipe[2];
+};
+
+auto set_nonblocking(int fd) -> bool;
+
+#endif /* Reactor_hpp */
@@ -0,0 +1,1061 @@
+//
+//  Router.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Router.hpp"
+#include "Log.hpp"
+#include <google/protobuf/io/coded_stream.h>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <set>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <filesystem>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+using namespace RouterNS;
+
+// B L O C K I N G   H E L P E R S ////////////////////////////
+// Every session has a thread of its own, so plain blocking sockets do.
+
+static auto encode(const google::protobuf::Message &message) -> std::string {
+    return message.SerializeAsString();
+}
+
+static auto connect_to(const ShardNode &node) -> int {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found = nullptr;
+    if (getaddrinfo(node.host.c_str(), std::to_string(node.port).c_str(), &hints, &found) != 0) {
+        return -1;
+    }
+    auto sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock != -1 && ::connect(sock, found->ai_addr, found->ai_addrlen) == -1) {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(found);
+    if (sock != -1) {
+        int no_delay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    }
+    return sock;
+}
+
+static auto write_all(int sock, const char *data, size_t size) -> bool {
+    size_t offset = 0;
+    while (offset < size) {
+        auto sent = ::send(sock, data + offset, size - offset, 0);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        offset += sent;
+    }
+    return true;
+}
+
+static auto write_frame(int sock, const std::string &payload) -> bool {
+    int size = (int) payload.size();
+    return write_all(sock, (const char *) &size, sizeof(size)) && write_all(sock, payload.data(), payload.size());
+}
+
+static auto read_all(int sock, char *data, size_t size) -> bool {
+    size_t offset = 0;
+    while (offset < size) {
+        auto received = recv(sock, data + offset, size - offset, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        offset += received;
+    }
+    return true;
+}
+
+/// A node's next frame. `size` comes back as ROUTE_DONE, with nothing read, once it's done.
+static auto read_node(int sock, int &size, std::string &payload) -> bool {
+    if (!read_all(sock, (char *) &size, sizeof(size)) || (size < 0 && size != ROUTE_DONE)) {
+        return false;
+    }
+    if (size == ROUTE_DONE) {
+        return true;
+    }
+    payload.resize(size);
+    return read_all(sock, &payload[0], size);
+}
+
+/// Sends `payloads` and collects the replies up to ROUTE_DONE.
+static auto call(int sock, const std::vector<std::string> &payloads, std::vector<std::string> &replies) -> bool {
+    for (const auto &payload : payloads) {
+        if (!write_frame(sock, payload)) {
+            return false;
+        }
+    }
+    replies.clear();
+    while (true) {
+        int size = 0;
+        std::string reply;
+        if (!read_node(sock, size, reply)) {
+            return false;
+        }
+        if (size == ROUTE_DONE) {
+            return true;
+        }
+        replies.push_back(std::move(reply));
+    }
+}
+
+/// Whether a reply is `<word> ...`, read off its first bytes like the server does, since it may
+/// just as well be a chunk.
+static auto is_reply(const std::string &reply, const std::string &word) -> bool {
+    auto prefix = std::string("\x0a") + (char) word.size() + word;
+    return reply.compare(0, prefix.size(), prefix) == 0;
+}
+
+static auto is_error(const std::string &reply) -> bool {
+    return is_reply(reply, "error");
+}
+
+static auto is_success(const std::vector<std::string> &replies) -> bool {
+    online::Request answer;
+    return !replies.empty() && answer.ParseFromString(replies[0]) && answer.arg_size() > 0 && answer.arg(0) == "success";
+}
+
+/// Logs a node link in as the client, making the account first on a node that joined after
+/// it was registered; the first node has already taken these credentials.
+static auto log_in(int sock, const online::User &user) -> bool {
+    std::vector<std::string> replies;
+    auto credentials = encode(user);
+    if (!call(sock, { encode(make_request("login")), credentials }, replies)) {
+        return false;
+    }
+    if (is_success(replies)) {
+        return true;
+    }
+    if (!call(sock, { encode(make_request("register")), credentials }, replies) ||
+        !call(sock, { encode(make_request("login")), credentials }, replies)) {
+        return false;
+    }
+    return is_success(replies);
+}
+
+/// One cursor per node: `-` once it's done, otherwise its length, a colon and the cursor.
+static auto join_cursors(const std::vector<std::optional<std::string>> &cursors) -> std::string {
+    std::string joined;
+    auto going = false;
+    for (const auto &cursor : cursors) {
+        if (!cursor.has_value()) {
+            joined += "-";
+            continue;
+        }
+        joined += std::to_string(cursor->size()) + ":" + *cursor;
+        going = true;
+    }
+    return going ? joined : "";
+}
+
+/// One catalogue version per node, by commas. A single server's version reads as the first
+/// node's.
+static auto join_versions(const std::vector<uint64_t> &versions) -> std::string {
+    std::string joined;
+    for (auto version : versions) {
+        joined += (joined.empty() ? "" : ",") + std::to_string(version);
+    }
+    return joined;
+}
+
+/// Nodes past the end of `joined` list everything, as from version 0.
+static auto split_versions(const std::string &joined, std::vector<uint64_t> &versions) -> bool {
+    size_t node = 0;
+    for (size_t at = 0; at < joined.size(); node++) {
+        auto comma = std::min(joined.find(',', at), joined.size());
+        if (node >= versions.size() || comma == at) {
+            return false;
+        }
+        char *end = nullptr;
+        versions[node] = std::strtoull(joined.c_str() + at, &end, 10);
+        if (end != joined.c_str() + comma) {
+            return false;
+        }
+        at = comma + 1;
+    }
+    return true;
+}
+
+/// Nodes past the end of `joined` start from their first page; that's all of them for "".
+static auto split_cursors(const std::string &joined, std::vector<std::optional<std::string>> &cursors) -> bool {
+    size_t at = 0;
+    for (size_t node = 0; at < joined.size(); node++) {
+        if (node >= cursors.size()) {
+            return false;
+        }
+        if (joined[at] == '-') {
+            cursors[node].reset();
+            at++;
+            continue;
+        }
+        auto colon = joined.find(':', at);
+        if (colon == std::string::npos) {
+            return false;
+        }
+        auto length = std::strtoull(joined.c_str() + at, nullptr, 10);
+        if (length > joined.size() - colon - 1) {
+            return false;
+        }
+        cursors[node] = joined.substr(colon + 1, length);
+        at = colon + 1 + length;
+    }
+    return true;
+}
+
+// O P T I O N S //////////////////////////////////////////////
+
+auto Router::parse_options(int argc, const char *argv[], RouterOptions &options) -> bool {
+    for (auto i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        auto has_value = i + 1 < argc;
+        if (arg == "--nodes" && has_value) {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start < list.size()) {
+                auto end = std::min(list.find(',', start), list.size());
+                ShardNode node;
+                if (!parse_shard_node(list.substr(start, end - start), node)) {
+                    std::cerr << "无法识别的节点：" << list.substr(start, end - start) << std::endl;
+                    return false;
+                }
+                options.nodes.push_back(node);
+                start = end + 1;
+            }
+        } else if (arg == "--port" && has_value) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--shard" && has_value) {
+            options.key = argv[++i];
+        } else if (arg == "--state" && has_value) {
+            options.state = argv[++i];
+        } else if (arg == "--request-kb" && has_value) {
+            options.limits.request_bytes = std::max(1ll, std::atoll(argv[++i])) << 10;
+        } else if (arg == "--message-mb" && has_value) {
+            options.limits.message_bytes = std::max(1ll, std::atoll(argv[++i])) << 20;
+        } else if (arg == "--max-sessions" && has_value) {
+            options.max_sessions = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::cerr << "未知参数：" << arg << std::endl;
+            std::cerr << "用法：Server --router --nodes host:port,... [--port 17290] [--shard key] "
+                         "[--state router.nodes] [--request-kb 2048] [--message-mb 256] [--max-sessions 1024]"
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// R U N //////////////////////////////////////////////////////
+
+auto Router::run() -> int {
+    signal(SIGPIPE, SIG_IGN);
+    for (const auto &node : options.nodes) {
+        ring.add(node);
+    }
+    std::ifstream reader(options.state);
+    std::string line;
+    while (std::getline(reader, line)) {
+        ShardNode node;
+        if (parse_shard_node(line, node)) {
+            ring.add(node);
+        }
+    }
+    if (ring.nodes().empty()) {
+        std::cerr << "没有存储节点；请用 --nodes 指定。" << std::endl;
+        return 1;
+    }
+
+    auto server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in sin;
+    std::memset(&sin, 0, sizeof(sin));
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(options.port);
+    sin.sin_family = AF_INET;
+    if (bind(server_sock, (sockaddr *) &sin, sizeof(sin)) == -1 || listen(server_sock, SOMAXCONN) == -1) {
+        SERVER_ERROR << "路由启动错误！无法监听端口：" << options.port;
+        return 1;
+    }
+    SERVER_LOG << "Recon 路由启动完毕，共 " << ring.nodes().size() << " 个存储节点，正在监听";
+    if (!options.key.empty()) {
+        // Picks up nodes given since the last run, and moves left over by an interrupted one
+        std::thread([this] () { rebalance(); }).detach();
+    }
+    while (true) {
+        auto client = accept(server_sock, nullptr, nullptr);
+        if (client == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                SERVER_ERROR << "接受新连接失败：" << strerror(errno);
+            }
+            continue;
+        }
+        if (sessions >= options.max_sessions) {
+            // Refused before its hello, so the reply goes untagged
+            write_frame(client, encode(make_request("error", "too many connections")));
+            close(client);
+            continue;
+        }
+        int no_delay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        sessions++;
+        std::thread([this, client] () {
+            serve(client);
+            sessions--;
+        }).detach();
+    }
+    return 0;
+}
+
+auto Router::serve(int client) -> void {
+    Session session;
+    session.client = client;
+    std::string payload;
+    while (next_request(session, payload)) {
+        online::Request request;
+        if (!request.ParseFromString(payload) || !handle(session, request, payload)) {
+            break;
+        }
+    }
+    if (session.oversized) {
+        // The rest of it is never read, so there's no carrying on after it
+        reply(session, encode(make_request("error", "message too large")));
+    }
+    for (const auto &[node, backend] : session.backends) {
+        close(backend.sock);
+    }
+    close(client);
+}
+
+auto Router::handle(Session &session, const online::Request &request, const std::string &payload) -> bool {
+    if (request.arg_size() == 0) {
+        return relay_any(session, { 0 }, { payload });
+    }
+    const auto &cmd = request.arg(0);
+    if (cmd == "hello") {
+        return greet(session, request);
+    } else if (request.arg_size() == 1 && (cmd == "login" || cmd == "register")) {
+        return authenticate(session, payload, cmd == "register");
+    } else if (request.arg_size() == 1 && cmd == "shard_nodes") {
+        // shard_nodes → `shard_nodes <host:port>...`, in the order they joined
+        auto listed = make_request("shard_nodes");
+        for (const auto &node : nodes()) {
+            listed.add_arg(node.name());
+        }
+        return reply(session, encode(listed));
+    } else if (request.arg_size() == 3 && cmd == "shard_add") {
+        return add_node(session, request);
+    }
+    if (!session.user.has_value()) {
+        // Whatever the first node tells anyone who hasn't logged in
+        return relay_any(session, { 0 }, { payload });
+    }
+
+    if (request.arg_size() == 1 && cmd == "records") {
+        return gather_records(session, payload);
+    } else if (request.arg_size() == 6 && cmd == "list") {
+        return gather_page(session, request);
+    } else if (cmd == "hashes") {
+        return gather_hashes(session, payload);
+    }
+    auto by_id = (request.arg_size() == 2 && (cmd == "download" || cmd == "download_stream" ||
+                                              cmd == "progressive" || cmd == "artifacts")) ||
+                 (request.arg_size() == 3 && cmd == "artifact") ||
+                 (request.arg_size() == 4 && cmd == "download_range");
+    if (by_id) {
+        auto id = std::atoi(request.arg(1).c_str());
+        std::shared_lock<std::shared_mutex> lock(ring_mutex);
+        auto owners = ring.owners(shard_record_key(id));
+        lock.unlock();
+        return relay_any(session, owners, { payload });
+    }
+    // Uploads go where the id their name is about to get belongs
+    if (request.arg_size() == 1 && cmd == "upload") {
+        return relay_upload(session, payload);
+    }
+    int node = 0;
+    if (request.arg_size() >= 2 && (cmd == "upload_stream" || cmd == "upload_resume" || cmd == "upload_chunks") &&
+        !request.arg(1).empty()) {
+        node = upload_node(session, request.arg(1));
+    } else if (cmd.rfind("job_", 0) == 0) {
+        // Job ids are a node's own, so all of a user's jobs stay on one
+        std::shared_lock<std::shared_mutex> lock(ring_mutex);
+        node = ring.owner(shard_hash("jobs:" + session.user->username()));
+    }
+    return relay_any(session, { node }, { payload });
+}
+
+auto Router::upload_node(Session &session, const std::string &file_base) -> int {
+    auto name = session.user->username() + "/" + std::filesystem::path(file_base).filename().string();
+    std::shared_lock<std::shared_mutex> lock(ring_mutex);
+    return ring.owner(shard_record_key(shard_record_id(name)));
+}
+
+// C L I E N T ////////////////////////////////////////////////
+
+/// A client frame's byte count, without its tag, and the tag; the bytes are left to be read.
+/// A frame over `limit` marks the session oversized.
+static auto read_client_header(Session &session, size_t limit, int &size, uint32_t &tag) -> bool {
+    if (!read_all(session.client, (char *) &size, sizeof(size)) || size < 0 ||
+        (session.tagged && size < TRANSFER_TAG)) {
+        return false;
+    }
+    if ((size_t) size > limit) {
+        SERVER_ERROR << "数据包过大：" << size << " 字节，正在关闭连接。";
+        session.oversized = true;
+        return false;
+    }
+    tag = 0;
+    if (session.tagged) {
+        if (!read_all(session.client, (char *) &tag, TRANSFER_TAG)) {
+            return false;
+        }
+        size -= TRANSFER_TAG;
+    }
+    return true;
+}
+
+/// A client frame, without its tag.
+static auto read_client(Session &session, size_t limit, std::string &payload, uint32_t &tag) -> bool {
+    int size = 0;
+    if (!read_client_header(session, limit, size, tag)) {
+        return false;
+    }
+    payload.resize(size);
+    return read_all(session.client, &payload[0], size);
+}
+
+static auto park(Session &session, uint32_t tag, std::string payload) -> bool {
+    session.parked_bytes += payload.size();
+    session.parked.emplace_back(tag, std::move(payload));
+    return session.parked_bytes <= ROUTER_PARKED_LIMIT;
+}
+
+/// A frame of the request being served that was parked right behind it, as a parked request's are.
+static auto unpark(Session &session, std::string &payload) -> bool {
+    for (auto it = session.parked.begin(); it != session.parked.end(); it++) {
+        if (it->first == session.tag) {
+            payload = std::move(it->second);
+            session.parked_bytes -= payload.size();
+            session.parked.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+/// The file base of a serialized ReconBuffer's first bytes. Fields are written in field order,
+/// so a set one leads; empty if it isn't there.
+static auto peek_file_base(const std::string &head) -> std::string {
+    google::protobuf::io::CodedInputStream input((const uint8_t *) head.data(), (int) head.size());
+    uint32_t length = 0;
+    std::string file_base;
+    if (input.ReadTag() != (1 << 3 | 2) || !input.ReadVarint32(&length) || !input.ReadString(&file_base, (int) length)) {
+        return "";
+    }
+    return file_base;
+}
+
+auto Router::next_request(Session &session, std::string &payload) -> bool {
+    if (!session.parked.empty()) {
+        session.tag = session.parked.front().first;
+        payload = std::move(session.parked.front().second);
+        session.parked_bytes -= payload.size();
+        session.parked.pop_front();
+        // Parked before anyone knew it was a request
+        session.oversized = payload.size() > options.limits.request_bytes;
+        return !session.oversized;
+    }
+    return read_client(session, options.limits.request_bytes, payload, session.tag);
+}
+
+auto Router::next_frame(Session &session, std::string &payload) -> bool {
+    if (unpark(session, payload)) {
+        session.oversized = payload.size() > options.limits.request_bytes;
+        return !session.oversized;
+    }
+    while (true) {
+        // Others' frames may be anything
+        uint32_t tag = 0;
+        if (!read_client(session, session.tagged ? options.limits.message_bytes : options.limits.request_bytes,
+                         payload, tag)) {
+            return false;
+        }
+        if (!session.tagged || tag == session.tag) {
+            session.oversized = payload.size() > options.limits.request_bytes;
+            return !session.oversized;
+        }
+        if (!park(session, tag, std::move(payload))) {
+            return false;
+        }
+    }
+}
+
+auto Router::reply(Session &session, const std::string &payload) -> bool {
+    int size = (int) payload.size() + (session.tagged ? TRANSFER_TAG : 0);
+    std::string header((const char *) &size, sizeof(size));
+    if (session.tagged) {
+        header.append((const char *) &session.tag, TRANSFER_TAG);
+    }
+    return write_all(session.client, header.data(), header.size()) &&
+           write_all(session.client, payload.data(), payload.size());
+}
+
+auto Router::relay_upload(Session &session, const std::string &payload) -> bool {
+    std::string head;
+    int size = 0;
+    if (unpark(session, head)) {
+        // Parked whole, so it's small anyway
+        size = (int) head.size();
+    } else {
+        while (true) {
+            uint32_t tag = 0;
+            if (!read_client_header(session, options.limits.message_bytes, size, tag)) {
+                return false;
+            }
+            if (!session.tagged || tag == session.tag) {
+                break;
+            }
+            std::string other(size, '\0');
+            if (!read_all(session.client, &other[0], size) || !park(session, tag, std::move(other))) {
+                return false;
+            }
+        }
+        head.resize(std::min(size, ROUTER_UPLOAD_PEEK));
+        if (!read_all(session.client, &head[0], head.size())) {
+            return false;
+        }
+    }
+    auto node = upload_node(session, peek_file_base(head));
+    auto sock = link(session, node);
+    auto passing = sock != -1 && write_frame(sock, payload) && write_all(sock, (const char *) &size, sizeof(size)) &&
+                   write_all(sock, head.data(), head.size());
+    std::vector<char> piece(std::min(size - (int) head.size(), TRANSFER_CHUNK));
+    for (auto left = size - (int) head.size(); left > 0;) {
+        auto count = std::min(left, (int) piece.size());
+        if (!read_all(session.client, piece.data(), count)) {
+            return false;
+        }
+        passing = passing && write_all(sock, piece.data(), count);
+        left -= count;
+    }
+    if (passing) {
+        switch (relay(session, node, {}, false)) {
+            case Relayed::DONE:
+                return true;
+            case Relayed::LOST:
+                return false;
+            case Relayed::REFUSED:
+            case Relayed::FAILED:
+                break;
+        }
+    } else if (sock != -1) {
+        unlink(session, node);
+    }
+    // All of the buffer was read regardless, so the client's next frame is where it should be
+    return reply(session, encode(make_request("error", "node unavailable")));
+}
+
+// N O D E S //////////////////////////////////////////////////
+
+auto Router::nodes() -> std::vector<ShardNode> {
+    std::shared_lock<std::shared_mutex> lock(ring_mutex);
+    return ring.nodes();
+}
+
+auto Router::link(Session &session, int node) -> int {
+    auto &backend = session.backends[node];
+    if (backend.sock == -1) {
+        auto all = nodes();
+        if (node >= (int) all.size() || (backend.sock = connect_to(all[node])) == -1) {
+            SERVER_ERROR << "无法连接存储节点：" << (node < (int) all.size() ? all[node].name() : std::to_string(node));
+            session.backends.erase(node);
+            return -1;
+        }
+        auto hello = make_request("hello", "server");
+        if (session.codec != Codec::NONE) {
+            hello.add_arg(codec_name(session.codec));
+        }
+        hello.add_arg(ROUTE_HELLO);
+        std::vector<std::string> replies;
+        if (!call(backend.sock, { encode(hello) }, replies) || replies.empty()) {
+            unlink(session, node);
+            return -1;
+        }
+    }
+    if (session.user.has_value() && !backend.logged_in) {
+        if (!log_in(backend.sock, *session.user)) {
+            SERVER_ERROR << "无法在存储节点上登陆：" << session.user->username();
+            unlink(session, node);
+            return -1;
+        }
+        backend.logged_in = true;
+    }
+    return backend.sock;
+}
+
+auto Router::unlink(Session &session, int node) -> void {
+    auto it = session.backends.find(node);
+    if (it == session.backends.end()) {
+        return;
+    }
+    if (it->second.sock != -1) {
+        close(it->second.sock);
+    }
+    session.backends.erase(it);
+}
+
+auto Router::relay(Session &session, int node, const std::vector<std::string> &payloads, bool refusable) -> Relayed {
+    auto sock = link(session, node);
+    if (sock == -1) {
+        return Relayed::FAILED;
+    }
+    for (const auto &payload : payloads) {
+        if (!write_frame(sock, payload)) {
+            unlink(session, node);
+            return Relayed::FAILED;
+        }
+    }
+    auto relayed = false;
+    // Whether the node is waiting on the client. Only then are the client's frames part of this
+    // exchange: the next request may well come before ROUTE_DONE does, and has to wait for it
+    auto inviting = false;
+    while (true) {
+        pollfd fds[2] = { { sock, POLLIN, 0 }, { session.client, POLLIN, 0 } };
+        if (poll(fds, inviting ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Relayed::LOST;
+        }
+        if (fds[0].revents != 0) {
+            int size = 0;
+            std::string reply_payload;
+            if (!read_node(sock, size, reply_payload)) {
+                unlink(session, node);
+                return relayed ? Relayed::LOST : Relayed::FAILED;
+            }
+            if (size == ROUTE_DONE) {
+                return Relayed::DONE;
+            }
+            if (!relayed && refusable && is_error(reply_payload)) {
+                std::vector<std::string> rest;
+                if (!call(sock, {}, rest)) {
+                    unlink(session, node);
+                }
+                return Relayed::REFUSED;
+            }
+            if (!reply(session, reply_payload)) {
+                return Relayed::LOST;
+            }
+            relayed = true;
+            // Transfers start with "ready" or "missing" and end with "success" or an error
+            if (is_reply(reply_payload, "ready") || is_reply(reply_payload, "missing")) {
+                inviting = true;
+            } else if (is_reply(reply_payload, "success") || is_error(reply_payload)) {
+                inviting = false;
+            }
+        }
+        if (inviting && fds[1].revents != 0) {
+            // The rest of this request, such as an upload's chunks
+            std::string frame;
+            uint32_t tag = 0;
+            if (!read_client(session, options.limits.message_bytes, frame, tag)) {
+                return Relayed::LOST;
+            }
+            if (session.tagged && tag != session.tag) {
+                if (!park(session, tag, std::move(frame))) {
+                    return Relayed::LOST;
+                }
+            } else if (!write_frame(sock, frame)) {
+                unlink(session, node);
+                return Relayed::LOST;
+            }
+        }
+    }
+}
+
+auto Router::relay_any(Session &session, const std::vector<int> &nodes, const std::vector<std::string> &payloads) -> bool {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        switch (relay(session, nodes[i], payloads, i + 1 < nodes.size())) {
+            case Relayed::DONE:
+                return true;
+            case Relayed::LOST:
+                return false;
+            case Relayed::REFUSED:
+            case Relayed::FAILED:
+                break;
+        }
+    }
+    return reply(session, encode(make_request("error", "node unavailable")));
+}
+
+// S E R V E D   H E R E //////////////////////////////////////
+
+auto Router::greet(Session &session, const online::Request &request) -> bool {
+    if (request.arg_size() < 2 || request.arg(1) != "server") {
+        reply(session, encode(make_request("error", "fuck off")));
+        return false;
+    }
+    auto codec = Codec::NONE;
+    auto tagged = false;
+    for (auto i = 2; i < request.arg_size(); i++) {
+        if (request.arg(i) == TRANSFER_TAGS) {
+            tagged = true;
+        } else if (codec == Codec::NONE) {
+            codec = parse_codec(request.arg(i));
+        }
+    }
+    if (codec != session.codec) {
+        // The node links were greeted with the old one
+        for (const auto &[node, backend] : session.backends) {
+            close(backend.sock);
+        }
+        session.backends.clear();
+        session.codec = codec;
+    }
+    auto hello = make_request("hello");
+    if (codec != Codec::NONE) {
+        hello.add_arg(codec_name(codec));
+    }
+    if (tagged) {
+        hello.add_arg(TRANSFER_TAGS);
+    }
+    auto greeted = reply(session, encode(hello));
+    session.tagged = tagged || session.tagged;
+    return greeted;
+}
+
+auto Router::authenticate(Session &session, const std::string &payload, bool registering) -> bool {
+    std::string credentials;
+    online::User user;
+    if (!next_frame(session, credentials) || !user.ParseFromString(credentials)) {
+        return false;
+    }
+    std::vector<std::string> replies;
+    auto sock = link(session, 0);
+    if (sock == -1 || !call(sock, { payload, credentials }, replies)) {
+        unlink(session, 0);
+        return reply(session, encode(make_request("error", "node unavailable")));
+    }
+    for (const auto &answer : replies) {
+        if (!reply(session, answer)) {
+            return false;
+        }
+    }
+    if (!is_success(replies)) {
+        return true;
+    }
+    if (registering) {
+        // Every node knows every account, so any of them can take the user's requests
+        auto count = (int) nodes().size();
+        for (auto node = 1; node < count; node++) {
+            auto peer = link(session, node);
+            if (peer == -1 || !call(peer, { payload, credentials }, replies)) {
+                unlink(session, node);
+            }
+        }
+        return true;
+    }
+    session.user = user;
+    for (auto &[node, backend] : session.backends) {
+        backend.logged_in = node == 0;
+    }
+    return true;
+}
+
+auto Router::gather_records(Session &session, const std::string &payload) -> bool {
+    online::ReconRecords merged;
+    std::set<int> seen;
+    auto count = (int) nodes().size();
+    for (auto node = 0; node < count; node++) {
+        std::vector<std::string> replies;
+        online::ReconRecords records;
+        auto sock = link(session, node);
+        if (sock == -1 || !call(sock, { payload }, replies) || replies.size() != 1 ||
+            !records.ParseFromString(replies[0])) {
+            unlink(session, node);
+            return reply(session, encode(make_request("error", "node unavailable")));
+        }
+        for (const auto &record : records.records()) {
+            // Mid-move, a record can be on two nodes at once
+            if (seen.insert(record.id()).second) {
+                *merged.add_records() = record;
+            }
+        }
+    }
+    return reply(session, encode(merged));
+}
+
+auto Router::gather_page(Session &session, const online::Request &request) -> bool {
+    auto count = (int) nodes().size();
+    std::vector<std::optional<std::string>> cursors(count, std::string());
+    std::vector<uint64_t> versions(count, 0);
+    if (!split_cursors(request.arg(2), cursors)) {
+        return reply(session, encode(make_request("error", "bad cursor")));
+    }
+    if (!split_versions(request.arg(1), versions)) {
+        return reply(session, encode(make_request("error", "bad version")));
+    }
+    online::ReconRecords merged;
+    std::set<int> seen;
+    for (auto node = 0; node < count; node++) {
+        if (!cursors[node].has_value()) {
+            continue;
+        }
+        auto query = request;
+        query.set_arg(1, std::to_string(versions[node]));
+        query.set_arg(2, *cursors[node]);
+        std::vector<std::string> replies;
+        online::Request page;
+        online::ReconRecords records;
+        auto sock = link(session, node);
+        if (sock == -1 || !call(sock, { encode(query) }, replies) || replies.size() != 2 ||
+            !page.ParseFromString(replies[0]) || page.arg_size() != 3 || page.arg(0) != "page" ||
+            !records.ParseFromString(replies[1])) {
+            unlink(session, node);
+            return reply(session, encode(make_request("error", "node unavailable")));
+        }
+        auto version = std::strtoull(page.arg(1).c_str(), nullptr, 10);
+        if (version < versions[node]) {
+            // That node's catalogue was rebuilt; the client starts over as from a single server
+            online::ReconRecords none;
+            return reply(session, encode(make_request("page", "0", ""))) && reply(session, encode(none));
+        }
+        versions[node] = version;
+        if (page.arg(2).empty()) {
+            cursors[node].reset();
+        } else {
+            cursors[node] = page.arg(2);
+        }
+        for (const auto &record : records.records()) {
+            if (seen.insert(record.id()).second) {
+                *merged.add_records() = record;
+            }
+        }
+    }
+    return reply(session, encode(make_request("page", join_versions(versions), join_cursors(cursors)))) &&
+           reply(session, encode(merged));
+}
+
+auto Router::gather_hashes(Session &session, const std::string &payload) -> bool {
+    online::Request merged;
+    auto count = (int) nodes().size();
+    for (auto node = 0; node < count; node++) {
+        std::vector<std::string> replies;
+        online::Request answer;
+        auto sock = link(session, node);
+        if (sock == -1 || !call(sock, { payload }, replies) || replies.size() != 1 ||
+            !answer.ParseFromString(replies[0]) || answer.arg_size() == 0 || answer.arg(0) != "hashes") {
+            unlink(session, node);
+            return reply(session, encode(make_request("error", "node unavailable")));
+        }
+        if (merged.arg_size() == 0) {
+            merged = answer;
+            continue;
+        }
+        // Each id is answered by whichever node has it
+        for (auto i = 1; i + 1 < answer.arg_size() && i + 1 < merged.arg_size(); i += 2) {
+            if (merged.arg(i).empty() && !answer.arg(i).empty()) {
+                merged.set_arg(i, answer.arg(i));
+                merged.set_arg(i + 1, answer.arg(i + 1));
+            }
+        }
+    }
+    return reply(session, encode(merged));
+}
+
+auto Router::add_node(Session &session, const online::Request &request) -> bool {
+    // shard_add <key> <host:port>
+    ShardNode node;
+    if (options.key.empty() || request.arg(1) != options.key) {
+        return reply(session, encode(make_request("error", "wrong key")));
+    }
+    if (!parse_shard_node(request.arg(2), node)) {
+        return reply(session, encode(make_request("error", "bad node")));
+    }
+    std::unique_lock<std::shared_mutex> lock(ring_mutex);
+    auto added = ring.add(node);
+    lock.unlock();
+    if (!added) {
+        return reply(session, encode(make_request("error", "node exists")));
+    }
+    save_nodes();
+    SERVER_LOG << "已加入存储节点：" << node.name() << "，正在重新平衡";
+    std::thread([this] () { rebalance(); }).detach();
+    return reply(session, encode(make_request("success")));
+}
+
+// R E B A L A N C I N G //////////////////////////////////////
+
+auto Router::save_nodes() -> void {
+    std::ofstream writer(options.state + ".tmp");
+    for (const auto &node : nodes()) {
+        writer << node.name() << "\n";
+    }
+    writer.close();
+    std::error_code error;
+    std::filesystem::rename(options.state + ".tmp", options.state, error);
+    if (!writer.good() || error) {
+        SERVER_ERROR << "无法保存节点列表：" << options.state;
+    }
+}
+
+auto Router::open_peer(const ShardNode &node) -> int {
+    auto sock = connect_to(node);
+    if (sock == -1) {
+        SERVER_ERROR << "无法连接存储节点：" << node.name();
+        return -1;
+    }
+    std::vector<std::string> replies;
+    if (!call(sock, { encode(make_request("hello", "server", ROUTE_HELLO)) }, replies) ||
+        !call(sock, { encode(make_request("shard", options.key)) }, replies) || !is_success(replies)) {
+        SERVER_ERROR << "存储节点不接受分片密钥：" << node.name();
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+auto Router::rebalance() -> void {
+    if (options.key.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(rebalance_mutex);
+    ShardRing snapshot;
+    {
+        std::shared_lock<std::shared_mutex> ring_lock(ring_mutex);
+        snapshot = ring;
+    }
+    const auto &members = snapshot.nodes();
+    std::vector<int> peers(members.size(), -1);
+    auto moved = 0, failed = 0;
+    for (size_t from = 0; from < members.size(); from++) {
+        if (peers[from] == -1) {
+            peers[from] = open_peer(members[from]);
+        }
+        std::vector<std::string> replies;
+        online::ReconRecords records;
+        if (peers[from] == -1 || !call(peers[from], { encode(make_request("shard_records")) }, replies) ||
+            replies.size() != 1 || !records.ParseFromString(replies[0])) {
+            SERVER_ERROR << "无法列出存储节点上的记录：" << members[from].name();
+            continue;
+        }
+        for (const auto &record : records.records()) {
+            auto to = snapshot.owner(shard_record_key(record.id()));
+            if (to == (int) from) {
+                continue;
+            }
+            if (peers[to] == -1) {
+                peers[to] = open_peer(members[to]);
+            }
+            if (peers[from] != -1 && peers[to] != -1 && move(record, peers[from], peers[to])) {
+                moved++;
+            } else {
+                failed++;
+            }
+        }
+    }
+    for (auto peer : peers) {
+        if (peer != -1) {
+            close(peer);
+        }
+    }
+    SERVER_LOG << "重新平衡完毕：迁移 " << moved << " 条记录，失败 " << failed << " 条";
+}
+
+auto Router::move(const online::ReconRecord &record, int &from, int &to) -> bool {
+    auto id = std::to_string(record.id());
+    auto drop = [&] () {
+        std::vector<std::string> replies;
+        if (!call(from, { encode(make_request("shard_drop", id)) }, replies)) {
+            close(from);
+            from = -1;
+            return false;
+        }
+        return is_success(replies);
+    };
+    auto broken = [] (int &sock) {
+        close(sock);
+        sock = -1;
+        return false;
+    };
+
+    std::vector<std::string> replies;
+    online::Request manifest;
+    if (!call(from, { encode(make_request("shard_export", id)) }, replies)) {
+        return broken(from);
+    }
+    if (replies.size() != 1 || !manifest.ParseFromString(replies[0]) || manifest.arg_size() < 4 + TRANSFER_FILES ||
+        manifest.arg(0) != "manifest") {
+        return false;
+    }
+    auto adopt = make_request("shard_import", id);
+    for (auto i = 1; i < manifest.arg_size(); i++) {
+        adopt.add_arg(manifest.arg(i));
+    }
+    // The node asks for the chunks it lacks before it's done, so this isn't a call()
+    int size = 0;
+    std::string first;
+    online::Request missing;
+    if (!write_frame(to, encode(adopt)) || !read_node(to, size, first) || size == ROUTE_DONE) {
+        return broken(to);
+    }
+    if (!missing.ParseFromString(first) || missing.arg_size() == 0) {
+        return broken(to);
+    }
+    if (missing.arg(0) == "error") {
+        if (!call(to, {}, replies)) {
+            broken(to);
+        }
+        // The owner has a newer one, uploaded since the ring changed; this copy is stale
+        return missing.arg_size() > 1 && missing.arg(1) == "record exists" && drop();
+    }
+    for (auto i = 1; i < missing.arg_size(); i++) {
+        if (!call(from, { encode(make_request("shard_chunk", missing.arg(i))) }, replies)) {
+            broken(from);
+            return broken(to);
+        }
+        if (replies.size() != 1 || is_error(replies[0])) {
+            // It's waiting for a chunk that isn't coming
+            return broken(to);
+        }
+        if (!write_frame(to, replies[0])) {
+            return broken(to);
+        }
+    }
+    if (!call(to, {}, replies)) {
+        return broken(to);
+    }
+    if (!is_success(replies) || !drop()) {
+        SERVER_ERROR << "迁移记录失败：" << record.name();
+        return false;
+    }
+    SERVER_LOG << "已迁移记录：" << record.name() << "（" << id << "）";
+    return true;
+}
@@ -0,0 +1,161 @@
+//
+//  Router.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Router_hpp
+#define Router_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <cstdint>
+#include "online.pb.h"
+#include "Protocol.hpp"
+#include "Compress.hpp"
+#include "Shards.hpp"
+#include "Limits.hpp"
+
+#define ROUTER_STATE "router.nodes" // Nodes added while running, one host:port a line
+#define ROUTER_PARKED_LIMIT (4 << 20) // Bytes of a tagged client's later requests held back
+#define ROUTER_UPLOAD_PEEK (64 << 10) // Of a legacy upload's buffer, read before picking its node
+#define ROUTER_SESSIONS_MAX 1024 // Clients served at once; each is a thread and a link per node
+
+struct RouterOptions {
+    int port = 17290;
+    std::vector<ShardNode> nodes; // The first one holds the accounts everyone logs in against
+    std::string key; // The nodes' --shard key; without it records are never moved
+    std::string state = ROUTER_STATE;
+    ServerLimits limits; // Only the frame sizes apply here
+    int max_sessions = ROUTER_SESSIONS_MAX;
+};
+
+namespace RouterNS {
+
+/// A client's link to one node, logged in as the client once it has logged in.
+struct Backend {
+    int sock = -1;
+    bool logged_in = false;
+};
+
+struct Session {
+    int client = -1;
+    bool tagged = false;
+    Codec codec = Codec::NONE; // Passed on to the nodes, so checked chunks go through untouched
+    std::optional<online::User> user; // Credentials the first node took
+    std::map<int, Backend> backends; // Node index → link, opened on first use
+    uint32_t tag = 0; // Of the request being served
+    std::deque<std::pair<uint32_t, std::string>> parked; // Tagged requests that came in meanwhile
+    size_t parked_bytes = 0;
+    bool oversized = false; // Sent a frame over the limits; told so, then let go
+};
+
+enum class Relayed {
+    DONE = 0,
+    REFUSED = 1, // The first reply was an error and, as asked, went nowhere
+    FAILED = 2, // The node couldn't be reached; nothing went to the client
+    LOST = 3 // Either side dropped mid-exchange
+};
+
+};
+
+/// The front of a sharded deployment: `Server --router --nodes host:port,... [--shard key]`.
+/// Clients talk to it as to one server. Records live on the node owning their id on a
+/// consistent hash ring; downloads go there, falling back to the other nodes while a record
+/// is on its way, uploads go to the owner of the id their name will get, and listings are
+/// gathered from every node. Each client gets a thread and its own links to the nodes, and
+/// requests are relayed frame by frame, a node's ROUTE_DONE marking where each one ends. Past
+/// `max_sessions` clients at once, newcomers are told `error too many connections` and let go.
+/// Nodes added with `shard_add <key> <host:port>` join the ring at once, and a rebalance moves
+/// whatever records they now own over to them.
+class Router {
+public:
+    Router(RouterOptions options) : options(options) {}
+
+    auto run() -> int;
+
+    static auto parse_options(int argc, const char *argv[], RouterOptions &options) -> bool;
+
+private:
+    auto serve(int client) -> void;
+
+    /// False once the client has to be let go.
+    auto handle(RouterNS::Session &session, const online::Request &request, const std::string &payload) -> bool;
+
+    // C L I E N T ///////////////////////////////////
+    /// The next request, parked or fresh; sets the session's tag.
+    auto next_request(RouterNS::Session &session, std::string &payload) -> bool;
+
+    /// The next frame of the request being served, no bigger than a request, parking other
+    /// tagged requests.
+    auto next_frame(RouterNS::Session &session, std::string &payload) -> bool;
+
+    auto reply(RouterNS::Session &session, const std::string &payload) -> bool;
+
+    /// A legacy `upload`: the ReconBuffer goes on to the node owning its name as it comes in,
+    /// only its first bytes held here to read the file base off.
+    auto relay_upload(RouterNS::Session &session, const std::string &payload) -> bool;
+
+    /// The node owning the id the user's record named `file_base` gets.
+    auto upload_node(RouterNS::Session &session, const std::string &file_base) -> int;
+
+    // N O D E S /////////////////////////////////////
+    /// The session's link to a node, greeted and logged in; -1 if it can't be had.
+    auto link(RouterNS::Session &session, int node) -> int;
+
+    auto unlink(RouterNS::Session &session, int node) -> void;
+
+    /// Sends `payloads` to the node and passes its replies back to the client, and the client's
+    /// frames on to the node, until the node is done.
+    auto relay(RouterNS::Session &session, int node, const std::vector<std::string> &payloads,
+               bool refusable) -> RouterNS::Relayed;
+
+    /// Relays to the first of `nodes` that has an answer; the last one answers whatever it says.
+    auto relay_any(RouterNS::Session &session, const std::vector<int> &nodes,
+                   const std::vector<std::string> &payloads) -> bool;
+
+    // S E R V E D   H E R E /////////////////////////
+    auto greet(RouterNS::Session &session, const online::Request &request) -> bool;
+
+    /// login and register go to the first node; a new account is then made on the others too.
+    auto authenticate(RouterNS::Session &session, const std::string &payload, bool registering) -> bool;
+
+    auto gather_records(RouterNS::Session &session, const std::string &payload) -> bool;
+
+    /// `list` across the nodes: the cursor and the version hold one per node, so each node is
+    /// asked only for its own changes since its own version.
+    auto gather_page(RouterNS::Session &session, const online::Request &request) -> bool;
+
+    auto gather_hashes(RouterNS::Session &session, const std::string &payload) -> bool;
+
+    auto add_node(RouterNS::Session &session, const online::Request &request) -> bool;
+
+    // R E B A L A N C I N G /////////////////////////
+    /// Moves every record not on the node owning it. One at a time; a second call waits.
+    auto rebalance() -> void;
+
+    /// A link for moving records: routed, with the shard key given.
+    auto open_peer(const ShardNode &node) -> int;
+
+    /// Copies one record over and drops it where it was; a link left out of step is closed, as -1.
+    auto move(const online::ReconRecord &record, int &from, int &to) -> bool;
+
+    auto nodes() -> std::vector<ShardNode>;
+
+    auto save_nodes() -> void;
+
+    RouterOptions options;
+    std::shared_mutex ring_mutex;
+    ShardRing ring;
+    std::mutex rebalance_mutex;
+    std::atomic<int> sessions { 0 }; // Clients being served
+};
+
+#endif /* Router_hpp */
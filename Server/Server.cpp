@@ -9,346 +9,2154 @@
 #include <unistd.h>
 #include <thread>
 #include <fstream>
-#include <mutex>
-#include <sstream>
-#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <climits>
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
 
 template<typename T>
-auto request_append(online::Request &request, T last) -> void {
-    request.add_arg(std::string(last));
+auto Server::frame(const T &what) -> std::string {
+    int size = (int) what.ByteSizeLong();
+    std::string packet(sizeof(size) + size, '\0');
+    std::memcpy(&packet[0], &size, sizeof(size));
+    what.SerializeToArray(&packet[sizeof(size)], size);
+    return packet;
+}
+
+auto Server::frame_header(int size) -> std::string {
+    std::string header(sizeof(size), '\0');
+    std::memcpy(&header[0], &size, sizeof(size));
+    return header;
 }
 
-template<typename T, typename ...Ar>
-auto request_append(online::Request &request, T first, Ar... args) -> void {
-    request.add_arg(std::string(first));
-    request_append(request, args...);
+auto Server::frame_chunk(const std::string &bytes) -> std::string {
+    return frame_header((int) bytes.size()) + bytes;
 }
 
-template<typename ...Ar>
-auto make_request(Ar... args) -> online::Request {
-    online::Request request;
-    request_append(request, args...);
-    return request;
+auto Server::frame_checked(const std::string &bytes) -> std::string {
+    auto crc = crc32(bytes.data(), bytes.size());
+    std::string checksum(TRANSFER_CHECKSUM, '\0');
+    std::memcpy(&checksum[0], &crc, TRANSFER_CHECKSUM);
+    return frame_header((int) (TRANSFER_CHECKSUM + bytes.size())) + checksum + bytes;
+}
+
+template<typename T>
+auto Server::parse(const std::string &payload) -> std::optional<T> {
+    T t;
+    if (!t.ParseFromString(payload)) {
+        return {};
+    }
+    return t;
 }
 
 auto Server::init() -> bool {
     ready = false;
+    // Peers vanishing mid-write should be an error code, not a dead server
+    signal(SIGPIPE, SIG_IGN);
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+#ifdef __APPLE__
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, OPEN_MAX);
+#endif
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     sockaddr_in sin;
     sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_port = htons(RECON_PORT);
+    sin.sin_port = htons(port);
     sin.sin_family = AF_INET;
     if (bind(server_sock, (sockaddr *) &sin, sizeof(sin)) == -1) {
-        std::cerr << "服务器启动错误！无法监听端口：" << RECON_PORT << std::endl;
+        SERVER_ERROR << "服务器启动错误！无法监听端口：" << port;
+        return false;
+    }
+    listen(server_sock, SOMAXCONN);
+    if (!set_nonblocking(server_sock) || !reactor.init() || !reactor.add(server_sock)) {
+        SERVER_ERROR << "服务器启动错误！无法初始化事件循环：" << strerror(errno);
         return false;
     }
-    listen(server_sock, 5);
-    std::cout << "Recon 服务器启动完毕，正在监听" << std::endl;
+    pool.start(std::max(2, (int) std::thread::hardware_concurrency()), SERVER_QUEUE_CAPACITY);
+    // The biggest frame allowed has to fit in the budget on its own, or it would never come in
+    limits.global_bytes = std::max(limits.global_bytes, limits.message_bytes + sizeof(int));
+    requests.configure(limits.global_request_rate, std::max(1.0, limits.global_request_rate));
+    shares_in.configure(limits.global_bandwidth);
+    shares_out.configure(limits.global_bandwidth);
+    SERVER_LOG << "Recon 服务器启动完毕，正在监听";
     ready = true;
-    
+
     mkdir_if_not_exists("uploads");
-    std::ifstream records_reader("uploads/records.bin");
-    if (records_reader.good()) {
-        records.ParseFromIstream(&records_reader);
-        records_reader.close();
+    catalogue.hashed_ids = !shard_key.empty();
+    if (!catalogue.open()) {
+        SERVER_ERROR << "无法读取用户与记录：" << strerror(errno);
+        return false;
+    }
+    if (!store.init() || !variants.init() || !progressive.init() || !artifacts.init()) {
+        SERVER_ERROR << "无法初始化存储目录：" << store.root;
+        return false;
     }
-    std::ifstream users_reader("uploads/users.bin");
-    if (users_reader.good()) {
-        users.ParseFromIstream(&users_reader);
-        users_reader.close();
+    migrate_store();
+    artifacts.start(ARTIFACT_WORKERS, [this] (const std::string &name) {
+        make_artifacts(name);
+    });
+    if (!jobs.open()) {
+        SERVER_ERROR << "无法读取重建任务队列";
+        return false;
+    }
+    jobs.start(std::max(1, job_workers), [this] (Job &job) {
+        return run_job(job);
+    });
+    if (metrics_port > 0) {
+        if (!metrics_endpoint.start(metrics_port, [this] () { return metrics.prometheus(gauges()); })) {
+            SERVER_ERROR << "无法监听指标端口：" << metrics_port;
+            return false;
+        }
+        SERVER_LOG << "指标地址：http://127.0.0.1:" << metrics_port << "/metrics";
     }
     return true;
 }
 
-#define BAIL(why) mutex.lock(); \
-    sockets.erase(client_sock); \
-    close(client_sock); \
-    std::cerr << why << std::endl; \
-    mutex.unlock(); \
-    return;
+auto Server::migrate_store() -> void {
+    std::vector<Manifest> live;
+    auto records = catalogue.records();
+    for (const auto &record : records.records()) {
+        auto base = "uploads/" + record.name();
+        auto manifest = store.read_manifest(base);
+        if (!manifest.has_value()) {
+            if (!ingest(base, base)) {
+                SERVER_ERROR << "无法迁移记录：" << base;
+                continue;
+            }
+            std::error_code error;
+            for (auto i = 0; i < TRANSFER_FILES; i++) {
+                std::filesystem::remove(base + TRANSFER_EXTENSIONS[i], error);
+            }
+            SERVER_LOG << "已迁移记录到分块存储：" << base;
+            manifest = store.read_manifest(base);
+        }
+        if (manifest.has_value()) {
+            live.push_back(*manifest);
+            // Published before artifacts, or the server stopped before they were made
+            auto made = catalogue.artifacts(record.id());
+            if (!made.has_value() || made->arg_size() == 0 || made->arg(0) != manifest->hash) {
+                artifacts.enqueue(record.name());
+            }
+        }
+    }
+    // Versions that were overwritten leave chunks behind; nothing is uploading yet, so sweep them
+    auto removed = store.collect(live);
+    if (removed > 0) {
+        SERVER_LOG << "已清理 " << removed << " 个无用分块";
+    }
+    removed = variants.collect(live);
+    if (removed > 0) {
+        SERVER_LOG << "已清理 " << removed << " 个过期压缩副本";
+    }
+    removed = progressive.collect(live);
+    if (removed > 0) {
+        SERVER_LOG << "已清理 " << removed << " 个过期渐进网格";
+    }
+    removed = artifacts.collect(live);
+    if (removed > 0) {
+        SERVER_LOG << "已清理 " << removed << " 组过期派生文件";
+    }
+}
+
+auto Server::ingest(const std::string &source, const std::string &base) -> bool {
+    std::array<int64_t, TRANSFER_FILES> sizes;
+    std::error_code error;
+    for (auto i = 0; i < TRANSFER_FILES && !error; i++) {
+        sizes[i] = (int64_t) std::filesystem::file_size(source + TRANSFER_EXTENSIONS[i], error);
+    }
+    if (error) {
+        return false;
+    }
+    UploadStream stream(store, base, sizes);
+    std::string chunk;
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        std::ifstream reader(source + TRANSFER_EXTENSIONS[i], std::ios::binary);
+        for (int64_t left = sizes[i]; left > 0; left -= chunk.size()) {
+            chunk.resize((size_t) std::min<int64_t>(left, TRANSFER_CHUNK));
+            reader.read(&chunk[0], chunk.size());
+            stream.write(chunk);
+        }
+    }
+    return stream.commit();
+}
 
 auto Server::run() -> bool {
-    std::mutex mutex;
     if (!ready) {
-        std::cerr << "服务器尚未准备完毕" << std::endl;
+        SERVER_ERROR << "服务器尚未准备完毕";
         return false;
     }
+    std::vector<ReactorEvent> events;
+    while (ready) {
+        if (reactor.wait(events, waiting.empty() ? -1 : LIMIT_TICK_MS) < 0) {
+            SERVER_ERROR << "事件循环异常：" << strerror(errno);
+            return false;
+        }
+        for (const auto &event : events) {
+            if (event.fd == server_sock) {
+                accept_all();
+                continue;
+            }
+            auto it = connections.find(event.fd);
+            if (it == connections.end()) {
+                continue;
+            }
+            auto connection = it->second;
+            if (event.error) {
+                close_connection(connection, "连接出现错误，正在关闭连接。");
+                continue;
+            }
+            if (event.writable) {
+                flush(connection);
+                process(connection);
+            }
+            if (event.readable && connection->sock != -1) {
+                receive_all(connection);
+            }
+        }
+        apply_completions();
+        resume_waiting();
+    }
+    return true;
+}
+
+// E V E N T   L O O P ////////////////////////////////////////
+
+auto Server::accept_all() -> void {
     while (true) {
-        int client_sock;
         sockaddr_in client_sockaddr;
         socklen_t slen = sizeof(client_sockaddr);
-        client_sock = accept(server_sock, (sockaddr *) &client_sock, &slen);
-
-        std::cout << "有新连接：" << client_sockaddr.sin_addr.s_addr << std::endl;
-        sockets.insert(client_sock);
-        std::thread thread([&, client_sock] () {
-            online::User user;
-            bool logged_in = false;
-
-            while (true) {
-                auto req_opt = receive<online::Request>(client_sock);
-                if (!req_opt.has_value()) {
-                    BAIL("数据接收异常，正在关闭连接。");
-                }
-                const auto request = *req_opt;
-                for (auto i = 0; i < request.arg_size(); i++) {
-                    std::cout << request.arg(i) << " ";
-                }
-                std::cout << std::endl;
-                if (request.arg_size() == 0) {
-                    send(client_sock, make_request("error", "no args"));
-                } else if (request.arg_size() == 1) {
-                    const auto &cmd = request.arg(0);
-                    
-                    if (cmd == "login") {
-                        std::cout << "用户正在尝试登陆..." << std::endl;
-                        auto credentials = receive<online::User>(client_sock);
-                        if (!credentials.has_value()) {
-                            BAIL("用户信息接收异常，正在关闭连接。");
-                        }
-                        auto located = -1;
-                        for (auto i = 0; i < users.users_size(); i++) {
-                            if (users.users(i).username() == credentials->username() &&
-                                users.users(i).password() == credentials->password()) {
-                                located = true;
-                                break;
-                            }
-                        }
-                        if (located != -1) {
-                            user = users.users(located);
-                            logged_in = true;
-                            std::cout << "用户成功证明自己是 " << user.username() << std::endl;
-                            send(client_sock, make_request("success"));
-                            continue;
-                        }
-                        send(client_sock, make_request("error", "wrong credentials"));
-                    } else if (cmd == "register") {
-                        std::cout << "用户正在尝试注册..." << std::endl;
-                        auto user = receive<online::User>(client_sock);
-                        if (!user.has_value()) {
-                            BAIL("用户信息接收异常，正在关闭连接。");
-                        }
-                        if (!user->has_username() || !user->has_password()) {
-                            send(client_sock, make_request("error", "not enough credentials"));
-                            continue;
-                        }
-                        bool found = false;
-                        for (auto i = 0; i < users.users_size(); i++) {
-                            if (users.users(i).username() == user->username()) {
-                                found = true;
-                                break;
-                            }
-                        }
-                        if (found) {
-                            send(client_sock, make_request("error", "user exist"));
-                            continue;
-                        }
-                        auto *new_user = users.add_users();
-                        new_user->set_id((int) users.users_size() - 1);
-                        new_user->set_username(user->username());
-                        new_user->set_password(user->password());
-                        
-                        send(client_sock, make_request("success"));
-                        std::ofstream users_writer("uploads/users.bin");
-                        if (users_writer.good()) {
-                            users.SerializeToOstream(&users_writer);
-                            users_writer.close();
-                        }
-                    } else if (logged_in && cmd == "records") {
-                        std::cout << user.username() << " 正在访问重建记录" << std::endl;
-                        send(client_sock, records);
-                    } else if (logged_in && cmd == "upload") {
-                        std::cout << "用户正在尝试上传" << std::endl;
-                        auto buffer = receive<online::ReconBuffer>(client_sock);
-                        if (!buffer.has_value()) {
-                            BAIL("用户上传数据失败，正在关闭连接。");
-                        }
-                        if (buffer->has_file_base() && buffer->has_obj_content() &&
-                            buffer->has_mtl_content() && buffer->has_texture_content()) {
-                            auto base = user.username() + "/" + std::filesystem::path(buffer->file_base()).filename().string();
-                            online::ReconRecord * record = nullptr;
-                            for (auto i = 0; i < records.records_size(); i++) {
-                                if (records.records(i).name() == base) {
-                                    std::cerr << "用户尝试上传的记录已经存在。正在覆盖..." << std::endl;
-                                    record = records.mutable_records(i);
-                                }
-                            }
-                            if (record == nullptr) {
-                                record = records.add_records();
-                            }
-                            mkdir_if_not_exists("uploads");
-                            mkdir_if_not_exists(std::string("uploads/") + user.username());
-                            std::ofstream obj_writer(std::string("uploads/") + base + ".obj");
-                            std::ofstream mtl_writer(std::string("uploads/") + base + ".mtl");
-                            std::ofstream tex_writer(std::string("uploads/") + base + ".png");
-                            if (!obj_writer.good() || !mtl_writer.good() || !tex_writer.good()) {
-                                std::cerr << "尝试写入文件失败：" << base << std::endl;
-                                if (obj_writer.good()) {
-                                    obj_writer.close();
-                                }
-                                if (mtl_writer.good()) {
-                                    mtl_writer.close();
-                                }
-                                if (tex_writer.good()) {
-                                    tex_writer.close();
-                                }
-                                send(client_sock, make_request("error", "failed to open file"));
-                                continue;
-                            }
-                            obj_writer << buffer->obj_content();
-                            mtl_writer << buffer->mtl_content();
-                            tex_writer << buffer->texture_content();
-                            obj_writer.close();
-                            mtl_writer.close();
-                            tex_writer.close();
-                            send(client_sock, make_request("success"));
-                            std::cout << "文件上传成功。正在保存记录..." << std::endl;
-
-                            record->set_id(records.records_size());
-                            record->set_name(base);
-                            record->set_owner(user.username());
-                            
-                            std::ofstream records_writer("uploads/records.bin");
-                            if (records_writer.good()) {
-                                records.SerializeToOstream(&records_writer);
-                                records_writer.close();
-                            }
-                        } else {
-                            std::cerr << "上传数据未齐全。";
-                            send(client_sock, make_request("error", "buffer not complete"));
-                        }
-                    }
-                } else if (request.arg_size() == 2) {
-                    const auto &cmd = request.arg(0);
-                    
-                    if (cmd == "hello") {
-                        if (request.arg(1) != "server") {
-                            send(client_sock, make_request("error", "fuck off"));
-                            BAIL("客户端未能正确指代服务器。正在断开连接...");
-                        } else {
-                            send(client_sock, make_request("hello"));
-                            std::cout << "与新连接成功互相打招呼。连接已经稳定。" << std::endl;
-                        }
-                    } else if (logged_in && cmd == "download") {
-                        std::cout << "用户正在尝试下载数据" << std::endl;
-                        auto id = std::stoi(request.arg(1));
-                        const online::ReconRecord *record = nullptr;
-                        for (auto i = 0; i < records.records_size(); i++) {
-                            if (records.records(i).id() == id) {
-                                record = &records.records(i);
-                                break;
-                            }
-                        }
-                        if (record == nullptr) {
-                            std::cerr << "记录条未找到：" << id << std::endl;
-                            send(client_sock, make_request("error", "record not found"));
-                            continue;
-                        }
-                        // U P L O A D ////////////////////////////////////////
-                        std::stringstream obj_stream, mtl_stream, tex_stream;
-                        std::string base = "uploads/" + record->name();
-                        std::ifstream obj_reader(base + ".obj"), mtl_reader(base + ".mtl"), tex_reader(base + ".png");
-                        if (!obj_reader.good() || !mtl_reader.good() || !tex_reader.good()) {
-                            if (obj_reader.good()) {
-                                obj_reader.close();
-                            }
-                            if (mtl_reader.good()) {
-                                mtl_reader.close();
-                            }
-                            if (tex_reader.good()) {
-                                tex_reader.close();
-                            }
-                            std::cerr << "文件未找到：" << base << std::endl;
-                            send(client_sock, make_request("error", "file not found"));
-                            continue;
-                        }
-                        obj_stream << obj_reader.rdbuf();
-                        mtl_stream << mtl_reader.rdbuf();
-                        tex_stream << tex_reader.rdbuf();
-                        obj_reader.close();
-                        mtl_reader.close();
-                        tex_reader.close();
-                        online::ReconBuffer buffer;
-                        buffer.set_file_base(record->name());
-                        buffer.set_obj_content(obj_stream.str());
-                        buffer.set_mtl_content(mtl_stream.str());
-                        buffer.set_texture_content(tex_stream.str());
-                        if (!send(client_sock, buffer)) {
-                            BAIL("发送重建包给客户端失败。");
-                        }
-                        std::cout << "文件发送成功。" << std::endl;
-                    }
-                } else {
-                    send(client_sock, make_request("error", "unknown request"));
-                }
+        auto client_sock = accept(server_sock, (sockaddr *) &client_sockaddr, &slen);
+        if (client_sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
-        });
-        thread.detach();
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                SERVER_ERROR << "接受新连接失败：" << strerror(errno);
+            }
+            return;
+        }
+        if (!set_nonblocking(client_sock) || !reactor.add(client_sock)) {
+            close(client_sock);
+            continue;
+        }
+        // Pipelined requests get their replies back to back; don't hold one for the last one's ACK
+        int no_delay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        auto connection = std::make_shared<Connection>();
+        connection->sock = client_sock;
+        connection->address = inet_ntoa(client_sockaddr.sin_addr);
+        connection->flow = connection->address;
+        connection->requests.configure(limits.request_rate, std::max(1.0, limits.request_rate));
+        connection->bytes_in.configure(limits.bandwidth, std::max<double>(FAIR_GRANT_MIN, limits.bandwidth * FAIR_BURST_SECONDS));
+        connection->bytes_out.configure(limits.bandwidth, std::max<double>(FAIR_GRANT_MIN, limits.bandwidth * FAIR_BURST_SECONDS));
+        connections[client_sock] = connection;
+        metrics.accepted.fetch_add(1, std::memory_order_relaxed);
+        metrics.active.fetch_add(1, std::memory_order_relaxed);
+        SERVER_LOG << "有新连接：" << connection->address;
+    }
+}
+
+auto Server::receive_all(std::shared_ptr<Connection> connection) -> void {
+    char buffer[65536];
+    while (receivable(connection)) {
+        auto allowed = allow(connection, Wait::RECEIVE, sizeof(buffer));
+        if (allowed == 0) {
+            break;
+        }
+        auto recv_len = recv(connection->sock, buffer, allowed, 0);
+        moved(connection, Wait::RECEIVE, allowed, std::max<ssize_t>(recv_len, 0));
+        if (recv_len > 0) {
+            connection->in.append(buffer, recv_len);
+            metrics.bytes_in.fetch_add(recv_len, std::memory_order_relaxed);
+            continue;
+        }
+        if (recv_len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (recv_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        close_connection(connection, "数据接收异常，正在关闭连接。");
+        return;
+    }
+    process(connection);
+}
+
+auto Server::receivable(std::shared_ptr<Connection> connection) -> bool {
+    int size = 0;
+    if (connection->in.size() < sizeof(size)) {
+        return true;
+    }
+    std::memcpy(&size, connection->in.data(), sizeof(size));
+    auto frame = sizeof(size) + (size_t) std::max(size, 0);
+    if (connection->in.size() >= frame) {
+        // Leave the rest in the kernel so TCP pushes back on the peer
+        if (connection->in.size() >= limits.connection_bytes) {
+            connection->reading_paused = true;
+            return false;
+        }
+        return true;
+    }
+    if ((size_t) std::max(size, 0) > frame_limit(connection)) {
+        // Turned away by process(), unless what the connection is busy with changes its mind
+        connection->reading_paused = true;
+        return false;
+    }
+    if (frame > limits.connection_bytes && connection->reserved < frame) {
+        // Never stop short of the frame we're waiting for, once it fits in the global budget
+        if (reserved_bytes + frame > limits.global_bytes) {
+            metrics.throttled.fetch_add(1, std::memory_order_relaxed);
+            hold(connection, Wait::RECEIVE);
+            return false;
+        }
+        reserved_bytes += frame;
+        connection->reserved = frame;
     }
     return true;
 }
 
-template<typename T>
-auto Server::receive(int sock) -> std::optional<T> {
-    int request_size;
-    
-    auto recv_len = recv(sock, &request_size, sizeof(request_size), 0);
-    if (recv_len != sizeof(request_size)) {
-        return {};
+auto Server::frame_limit(std::shared_ptr<Connection> connection) -> size_t {
+    switch (connection->expect) {
+        case Expect::REQUEST:
+        case Expect::LOGIN_CREDENTIALS:
+        case Expect::REGISTER_CREDENTIALS:
+            return limits.request_bytes;
+        default:
+            return limits.message_bytes;
     }
-    
-    char *packet = new char[request_size];
-    auto left_to_receive = request_size;
-    auto offset = 0;
-    while (left_to_receive != 0) {
-        recv_len = recv(sock, packet + offset, left_to_receive, 0);
-        if (recv_len <= 0) {
-            delete[] packet;
-            return {};
+}
+
+auto Server::process(std::shared_ptr<Connection> connection) -> void {
+    // Frames are handled strictly in order; a busy connection resumes once its job completes
+    while (connection->sock != -1 && !connection->busy && !connection->closing) {
+        if (connection->expect == Expect::REQUEST && !connection->parked.empty()) {
+            if (!admit(connection)) {
+                break;
+            }
+            auto parked = std::move(connection->parked.front());
+            connection->parked.pop_front();
+            connection->parked_bytes -= parked.second.size();
+            connection->tag = parked.first;
+            handle(connection, std::move(parked.second));
+            continue;
+        }
+        int size;
+        if (connection->in.size() < sizeof(size)) {
+            break;
+        }
+        std::memcpy(&size, connection->in.data(), sizeof(size));
+        if (size < 0 || (connection->tagged && size < TRANSFER_TAG)) {
+            close_connection(connection, "数据包长度异常，正在关闭连接。");
+            return;
+        }
+        if ((size_t) size > frame_limit(connection)) {
+            // The rest of it is never read, so there's no carrying on after it
+            metrics.rejected.fetch_add(1, std::memory_order_relaxed);
+            SERVER_ERROR << "数据包过大：" << size << " 字节，正在关闭连接。";
+            send(connection, make_request("error", "message too large"));
+            connection->closing = true;
+            flush(connection);
+            return;
+        }
+        if (connection->in.size() < sizeof(size) + size) {
+            break;
+        }
+        if (connection->expect == Expect::REQUEST && !admit(connection)) {
+            break;
+        }
+        auto payload = connection->in.substr(sizeof(size), size);
+        connection->in.erase(0, sizeof(size) + size);
+        unreserve(connection);
+        if (connection->tagged) {
+            uint32_t tag = 0;
+            std::memcpy(&tag, payload.data(), TRANSFER_TAG);
+            payload.erase(0, TRANSFER_TAG);
+            if (connection->expect != Expect::REQUEST && tag != connection->tag) {
+                // Another request, sent while this one's transfer is going; it waits its turn
+                connection->parked_bytes += payload.size();
+                connection->parked.emplace_back(tag, std::move(payload));
+                if (connection->parked.size() > limits.pending_requests ||
+                    connection->parked_bytes > limits.connection_bytes) {
+                    metrics.rejected.fetch_add(1, std::memory_order_relaxed);
+                    close_connection(connection, "等待中的请求过多，正在关闭连接。");
+                    return;
+                }
+                continue;
+            }
+            connection->tag = tag;
+        }
+        handle(connection, std::move(payload));
+    }
+    if (connection->sock != -1 && connection->reading_paused && connection->in.size() < limits.connection_bytes) {
+        connection->reading_paused = false;
+        receive_all(connection);
+    }
+}
+
+auto Server::flush(std::shared_ptr<Connection> connection) -> void {
+    while (connection->sock != -1 && !connection->out.empty()) {
+        const auto &packet = connection->out.front();
+        auto allowed = allow(connection, Wait::SEND, packet.size() - connection->out_offset);
+        if (allowed == 0) {
+            return;
+        }
+        ssize_t sent;
+        if (packet.fd != -1) {
+            sent = send_file(connection->sock, packet.fd, packet.offset + connection->out_offset, allowed);
+        } else {
+            sent = ::send(connection->sock, packet.data() + connection->out_offset, allowed, 0);
+        }
+        moved(connection, Wait::SEND, allowed, std::max<ssize_t>(sent, 0));
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The reactor tells us when there is room again
+                return;
+            }
+            close_connection(connection, "发送数据失败，正在关闭连接。");
+            return;
+        }
+        if (sent == 0 && packet.fd != -1) {
+            // The file ended early, a damaged store; it would never send the rest
+            close_connection(connection, "读取下载文件失败，正在关闭连接。");
+            return;
+        }
+        connection->out_offset += sent;
+        metrics.bytes_out.fetch_add(sent, std::memory_order_relaxed);
+        if (connection->out_offset == packet.size()) {
+            connection->out_bytes -= packet.size();
+            connection->out.pop_front();
+            connection->out_offset = 0;
+            // Top up a streaming download before the queue runs dry
+            pump(connection);
+        }
+    }
+    if (connection->sock != -1 && connection->closing && connection->out.empty()) {
+        close_connection(connection, "连接已关闭。");
+        return;
+    }
+    pump(connection);
+}
+
+/// Whether a framed reply is `error ...`. Such a Request always starts with the field holding
+/// those five bytes, so there is no need to parse it.
+static auto is_error_frame(const Outgoing &packet) -> bool {
+    static const char prefix[] = "\x0a\x05" "error";
+    auto length = sizeof(prefix) - 1;
+    return packet.fd == -1 && packet.size() >= sizeof(int) + length &&
+           std::memcmp(packet.data() + sizeof(int), prefix, length) == 0;
+}
+
+auto Server::queue(std::shared_ptr<Connection> connection, Outgoing packet, std::optional<uint32_t> tag) -> void {
+    if (is_error_frame(packet)) {
+        metrics.errors.fetch_add(1, std::memory_order_relaxed);
+        connection->timing_failed = true;
+    }
+    if (!connection->tagged) {
+        connection->out_bytes += packet.size();
+        connection->out.push_back(std::move(packet));
+        return;
+    }
+    if (connection->frame_left == 0) {
+        // Every frame starts in memory with its length; put the tag after it and count it in
+        int size = 0;
+        std::memcpy(&size, packet.data(), sizeof(size));
+        auto value = tag.value_or(connection->tag);
+        auto header = frame_header(size + TRANSFER_TAG) + std::string(TRANSFER_TAG, '\0');
+        std::memcpy(&header[sizeof(size)], &value, TRANSFER_TAG);
+        connection->frame_left = size;
+        if (!packet.shared) {
+            // Spliced in, so small replies still leave in a single send
+            packet.bytes.replace(0, sizeof(size), header);
+            connection->frame_left += header.size();
+        } else {
+            connection->out_bytes += header.size();
+            connection->out.push_back(std::move(header));
+            packet.offset += sizeof(size);
+        }
+    }
+    connection->frame_left -= packet.size();
+    connection->out_bytes += packet.size();
+    connection->out.push_back(std::move(packet));
+    if (connection->frame_left == 0 && !connection->held.empty()) {
+        std::deque<std::pair<uint32_t, Outgoing>> held;
+        held.swap(connection->held);
+        for (auto &[held_tag, held_packet] : held) {
+            queue(connection, std::move(held_packet), held_tag);
         }
-        offset += recv_len;
-        left_to_receive -= recv_len;
     }
-    
-    T t;
-    t.ParseFromArray(packet, request_size);
-    
-    delete[] packet;
-    return t;
 }
 
 template<typename T>
-auto Server::send(int sock, T what) -> bool {
-    int size = (int) what.ByteSizeLong();
-    char *packet = new char[size];
-    what.SerializeToArray(packet, size);
+auto Server::send(std::shared_ptr<Connection> connection, const T &what) -> void {
+    queue(connection, frame(what));
+    flush(connection);
+}
+
+auto Server::close_connection(std::shared_ptr<Connection> connection, std::string why) -> void {
+    if (connection->sock == -1) {
+        return;
+    }
+    connections.erase(connection->sock);
+    close(connection->sock);
+    connection->sock = -1;
+    unreserve(connection);
+    connection->timing.reset();
+    metrics.active.fetch_sub(1, std::memory_order_relaxed);
+    SERVER_ERROR << why;
+    if (!connection->busy && !connection->pumping) {
+        release(connection);
+    }
+}
+
+auto Server::release(std::shared_ptr<Connection> connection) -> void {
+    // Chunks already stored stay behind for a retry; the next startup sweeps the rest
+    connection->upload.reset();
+    connection->chunked.reset();
+    if (connection->resumable) {
+        // Keep the partial file; the client will be back for it
+        std::lock_guard<std::mutex> lock(data_mutex);
+        partials.erase(connection->resumable->partial);
+        connection->resumable.reset();
+    }
+    connection->download.reset();
+    connection->image.reset();
+}
 
-    if (::send(sock, (char *) &size, sizeof(size), 0) != sizeof(size)) {
-        delete[] packet;
+// L I M I T S ////////////////////////////////////////////////
+
+auto Server::allow(std::shared_ptr<Connection> connection, Wait way, size_t wanted) -> size_t {
+    auto &own = way == Wait::SEND ? connection->bytes_out : connection->bytes_in;
+    auto &shares = way == Wait::SEND ? shares_out : shares_in;
+    if (own.unlimited() && shares.unlimited()) {
+        return wanted;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto allowed = (size_t) std::min<int64_t>(wanted, own.available(now));
+    if (allowed < std::min<size_t>(wanted, FAIR_GRANT_STEP)) {
+        allowed = 0;
+    } else {
+        allowed = shares.grant(connection->flow, allowed, now);
+    }
+    if (allowed == 0) {
+        metrics.throttled.fetch_add(1, std::memory_order_relaxed);
+        hold(connection, way);
+    }
+    return allowed;
+}
+
+auto Server::moved(std::shared_ptr<Connection> connection, Wait way, size_t allowed, size_t used) -> void {
+    auto &own = way == Wait::SEND ? connection->bytes_out : connection->bytes_in;
+    auto &shares = way == Wait::SEND ? shares_out : shares_in;
+    own.spend(used);
+    shares.refund(connection->flow, allowed - std::min(allowed, used));
+}
+
+auto Server::admit(std::shared_ptr<Connection> connection) -> bool {
+    auto now = std::chrono::steady_clock::now();
+    if (!connection->requests.take(1, now)) {
+        metrics.throttled.fetch_add(1, std::memory_order_relaxed);
+        hold(connection, Wait::REQUEST);
         return false;
     }
-    if (::send(sock, packet, size, 0) != size) {
-        delete[] packet;
+    if (!requests.take(1, now)) {
+        // Its own turn is kept for when everyone's rate lets it through
+        connection->requests.spend(-1);
+        metrics.throttled.fetch_add(1, std::memory_order_relaxed);
+        hold(connection, Wait::REQUEST);
         return false;
     }
-    
-    delete[] packet;
     return true;
 }
 
-Server::~Server() { 
+auto Server::hold(std::shared_ptr<Connection> connection, Wait way) -> void {
+    switch (way) {
+        case Wait::SEND:
+            connection->wait_send = true;
+            break;
+        case Wait::RECEIVE:
+            connection->wait_receive = true;
+            break;
+        case Wait::REQUEST:
+            connection->wait_request = true;
+            break;
+    }
+    if (!connection->waiting) {
+        connection->waiting = true;
+        waiting.push_back(connection);
+    }
+}
+
+auto Server::unreserve(std::shared_ptr<Connection> connection) -> void {
+    reserved_bytes -= connection->reserved;
+    connection->reserved = 0;
+}
+
+auto Server::resume_waiting() -> void {
+    std::deque<std::shared_ptr<Connection>> due;
+    due.swap(waiting);
+    for (auto &connection : due) {
+        connection->waiting = false;
+        auto sending = connection->wait_send, receiving = connection->wait_receive;
+        auto requesting = connection->wait_request;
+        connection->wait_send = connection->wait_receive = connection->wait_request = false;
+        if (connection->sock == -1) {
+            continue;
+        }
+        // Edge-triggered: the socket won't say again that it's ready, so it's tried here
+        if (sending) {
+            flush(connection);
+        }
+        if (receiving) {
+            receive_all(connection);
+        } else if (requesting) {
+            process(connection);
+        }
+    }
+}
+
+auto Server::offload(std::shared_ptr<Connection> connection, std::function<Completion()> job,
+                     bool continuation) -> void {
+    connection->busy = true;
+    auto accepted = pool.submit([this, connection, job] () {
+        auto completion = job();
+        completion.connection = connection;
+        complete(std::move(completion));
+    }, !continuation);
+    if (!accepted) {
+        connection->busy = false;
+        SERVER_ERROR << "工作队列已满，拒绝请求。";
+        send(connection, make_request("error", "server busy"));
+    }
+}
+
+auto Server::complete(Completion completion) -> void {
+    completions_mutex.lock();
+    completions.push_back(std::move(completion));
+    completions_mutex.unlock();
+    reactor.wake();
+}
+
+auto Server::apply_completions() -> void {
+    std::vector<Completion> finished;
+    completions_mutex.lock();
+    finished.swap(completions);
+    completions_mutex.unlock();
+    for (auto &completion : finished) {
+        auto connection = completion.connection;
+        if (completion.tag.has_value()) {
+            // Leaves whatever the connection is busy with alone; only waits for a frame boundary
+            if (connection->sock == -1) {
+                continue;
+            }
+            for (auto &packet : completion.frames) {
+                if (connection->frame_left > 0) {
+                    connection->held.emplace_back(*completion.tag, std::move(packet));
+                } else {
+                    queue(connection, std::move(packet), completion.tag);
+                }
+            }
+            flush(connection);
+            continue;
+        }
+        if (completion.chunk) {
+            connection->pumping = false;
+        } else {
+            connection->busy = completion.keep_busy;
+        }
+        if (connection->sock == -1) {
+            // Nobody is left to continue a transfer
+            connection->busy = false;
+            if (!connection->pumping) {
+                release(connection);
+            }
+            continue;
+        }
+        if (completion.expect.has_value()) {
+            connection->expect = *completion.expect;
+        }
+        for (auto &packet : completion.frames) {
+            queue(connection, std::move(packet));
+        }
+        if (!completion.bail.empty()) {
+            SERVER_ERROR << completion.bail;
+            connection->closing = true;
+        }
+        flush(connection);
+        settle(connection);
+        // Frames that arrived while the worker was busy
+        process(connection);
+    }
+}
+
+auto Server::pump(std::shared_ptr<Connection> connection) -> void {
+    if (connection->sock == -1 || !connection->download || connection->pumping ||
+        connection->out_bytes >= SERVER_WRITE_WINDOW) {
+        return;
+    }
+    if (connection->download->finished()) {
+        if (connection->out_bytes > 0) {
+            // Queued file ranges still need the stream's descriptors
+            return;
+        }
+        // Everything is sent; the connection takes requests again
+        connection->download.reset();
+        connection->busy = false;
+        SERVER_LOG << "文件发送成功。";
+        settle(connection);
+        return;
+    }
+    if (zero_copy && !connection->download->checked) {
+        // Nothing to read; queue the next chunks as file ranges and let flush() sendfile them
+        while (!connection->download->finished() && connection->out_bytes < SERVER_WRITE_WINDOW) {
+            std::vector<Outgoing> ranges;
+            auto size = connection->download->ranges(TRANSFER_CHUNK, ranges);
+            if (size < 0) {
+                close_connection(connection, "读取下载文件失败，正在关闭连接。");
+                return;
+            }
+            queue(connection, frame_header((int) size));
+            for (auto &range : ranges) {
+                queue(connection, std::move(range));
+            }
+        }
+        return;
+    }
+    connection->pumping = true;
+    pool.submit([this, connection] () {
+        auto completion = read_chunk(connection);
+        completion.connection = connection;
+        completion.chunk = true;
+        complete(std::move(completion));
+    }, false);
+}
+
+// H A N D L E R S ////////////////////////////////////////////
+
+#define BAIL(why) close_connection(connection, why); \
+    return;
+
+auto Server::handle(std::shared_ptr<Connection> connection, std::string payload) -> void {
+    auto expect = connection->expect;
+    connection->expect = Expect::REQUEST;
+    switch (expect) {
+        case Expect::REQUEST: {
+            auto request = parse<online::Request>(payload);
+            if (!request.has_value()) {
+                BAIL("数据接收异常，正在关闭连接。");
+            }
+            handle_request(connection, *request);
+            break;
+        }
+
+        case Expect::LOGIN_CREDENTIALS: {
+            auto credentials = parse<online::User>(payload);
+            if (!credentials.has_value()) {
+                BAIL("用户信息接收异常，正在关闭连接。");
+            }
+            login(connection, *credentials);
+            break;
+        }
+
+        case Expect::REGISTER_CREDENTIALS: {
+            auto user = parse<online::User>(payload);
+            if (!user.has_value()) {
+                BAIL("用户信息接收异常，正在关闭连接。");
+            }
+            if (!user->has_username() || !user->has_password()) {
+                send(connection, make_request("error", "not enough credentials"));
+                break;
+            }
+            auto new_user = *user;
+            offload(connection, [this, new_user] () {
+                return register_user(new_user);
+            });
+            break;
+        }
+
+        case Expect::UPLOAD_BUFFER:
+            offload(connection, [this, connection, payload = std::move(payload)] () {
+                return upload(connection, payload);
+            });
+            break;
+
+        case Expect::UPLOAD_CHUNK:
+            connection->expect = Expect::UPLOAD_CHUNK;
+            offload(connection, [this, connection, payload = std::move(payload)] () {
+                return upload_chunk(connection, payload);
+            }, true);
+            break;
+
+        case Expect::UPLOAD_CHECKED_CHUNK:
+            connection->expect = Expect::UPLOAD_CHECKED_CHUNK;
+            offload(connection, [this, connection, payload = std::move(payload)] () {
+                return checked_chunk(connection, payload);
+            }, true);
+            break;
+
+        case Expect::UPLOAD_BLOB:
+            connection->expect = Expect::UPLOAD_BLOB;
+            offload(connection, [this, connection, payload = std::move(payload)] () {
+                return blob_chunk(connection, payload);
+            }, true);
+            break;
+
+        case Expect::JOB_IMAGE_CHUNK:
+            connection->expect = Expect::JOB_IMAGE_CHUNK;
+            offload(connection, [this, connection, payload = std::move(payload)] () {
+                return job_image_chunk(connection, payload);
+            }, true);
+            break;
+    }
+    settle(connection);
+}
+
+auto Server::settle(std::shared_ptr<Connection> connection) -> void {
+    if (connection->busy || connection->expect != Expect::REQUEST) {
+        return;
+    }
+    if (connection->timing.has_value()) {
+        auto elapsed = std::chrono::steady_clock::now() - connection->timing_since;
+        metrics.request(*connection->timing, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(),
+                        connection->timing_failed);
+        connection->timing.reset();
+    }
+    if (connection->serving) {
+        connection->serving = false;
+        if (connection->routed) {
+            queue(connection, frame_header(ROUTE_DONE));
+            flush(connection);
+        }
+    }
+}
+
+auto Server::gauges() -> MetricsGauges {
+    MetricsGauges gauges;
+    gauges.worker_queue = pool.queued();
+    gauges.job_queue = jobs.waiting();
+    gauges.artifact_queue = artifacts.waiting();
+    auto cache_stats = cache.stats();
+    gauges.cache_bytes = cache_stats.bytes;
+    gauges.cache_hits = cache_stats.hits;
+    gauges.cache_misses = cache_stats.misses;
+    gauges.log_dropped = Logger::shared().dropped();
+    return gauges;
+}
+
+/// Which latency histogram a request counts towards; nullopt for the ones left untimed.
+static auto metric_command(const std::string &cmd) -> std::optional<MetricCommand> {
+    if (cmd == "login") {
+        return MetricCommand::LOGIN;
+    } else if (cmd == "records" || cmd == "list" || cmd == "hashes" || cmd == "artifacts") {
+        return MetricCommand::RECORDS;
+    } else if (cmd == "upload" || cmd == "upload_stream" || cmd == "upload_resume" || cmd == "upload_chunks") {
+        return MetricCommand::UPLOAD;
+    } else if (cmd == "download" || cmd == "download_stream" || cmd == "download_range" || cmd == "progressive" ||
+               cmd == "artifact") {
+        return MetricCommand::DOWNLOAD;
+    } else if (cmd == "job_watch") {
+        // Lasts as long as the reconstruction
+        return {};
+    }
+    return MetricCommand::OTHER;
+}
+
+auto Server::handle_request(std::shared_ptr<Connection> connection, const online::Request &request) -> void {
+    {
+        auto line = SERVER_LOG;
+        for (auto i = 0; i < std::min(request.arg_size(), 2 + TRANSFER_FILES); i++) {
+            line << request.arg(i) << " ";
+        }
+    }
+    connection->serving = true;
+    connection->timing = metric_command(request.arg_size() > 0 ? request.arg(0) : "");
+    connection->timing_since = std::chrono::steady_clock::now();
+    connection->timing_failed = false;
+    if (request.arg_size() == 0) {
+        send(connection, make_request("error", "no args"));
+    } else if (request.arg(0) == "hashes") {
+        // hashes <id>...; any number of ids, so it comes before the commands sorted by size
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        std::vector<int> ids;
+        for (auto i = 1; i < request.arg_size(); i++) {
+            ids.push_back(std::atoi(request.arg(i).c_str()));
+        }
+        offload(connection, [this, ids = std::move(ids)] () {
+            return record_hashes(ids);
+        });
+    } else if (request.arg_size() == 1) {
+        const auto &cmd = request.arg(0);
+
+        if (cmd == "login") {
+            SERVER_LOG << "用户正在尝试登陆...";
+            connection->expect = Expect::LOGIN_CREDENTIALS;
+        } else if (cmd == "register") {
+            SERVER_LOG << "用户正在尝试注册...";
+            connection->expect = Expect::REGISTER_CREDENTIALS;
+        } else if (connection->logged_in && cmd == "records") {
+            SERVER_LOG << connection->user.username() << " 正在访问重建记录";
+            offload(connection, [this] () {
+                Completion completion;
+                completion.frames.push_back(frame(catalogue.records()));
+                return completion;
+            });
+        } else if (connection->logged_in && cmd == "cache") {
+            // cache → `cache <hits> <misses> <hit rate> <entries> <bytes> <evictions>`
+            auto stats = cache.stats();
+            auto lookups = stats.hits + stats.misses;
+            send(connection, make_request("cache", std::to_string(stats.hits), std::to_string(stats.misses),
+                                          std::to_string(lookups > 0 ? (double) stats.hits / lookups : 0.0),
+                                          std::to_string(stats.entries), std::to_string(stats.bytes),
+                                          std::to_string(stats.evictions)));
+        } else if (connection->logged_in && cmd == "stats") {
+            // stats → `stats <name> <value>...`; see Metrics::stats() for the names
+            online::Request reply;
+            reply.add_arg("stats");
+            for (const auto &field : metrics.stats(gauges())) {
+                reply.add_arg(field);
+            }
+            send(connection, reply);
+        } else if (connection->logged_in && cmd == "upload") {
+            SERVER_LOG << "用户正在尝试上传";
+            connection->expect = Expect::UPLOAD_BUFFER;
+        } else if (connection->shard_peer && cmd == "shard_records") {
+            send(connection, catalogue.records());
+        }
+    } else if (request.arg_size() == 2) {
+        const auto &cmd = request.arg(0);
+
+        if (cmd == "hello") {
+            greet(connection, request);
+        } else if (connection->logged_in && cmd == "download") {
+            SERVER_LOG << "用户正在尝试下载数据";
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, connection, id] () {
+                return download(connection, id);
+            });
+        } else if (connection->logged_in && cmd == "download_stream") {
+            SERVER_LOG << "用户正在尝试分块下载数据";
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, connection, id] () {
+                return begin_download_stream(connection, id);
+            });
+        } else if (connection->logged_in && cmd == "progressive") {
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, id] () {
+                return begin_progressive(id);
+            });
+        } else if (connection->logged_in && cmd == "artifacts") {
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, id] () {
+                return list_artifacts(id);
+            });
+        } else if (connection->logged_in && cmd == "job_submit") {
+            SERVER_LOG << "用户正在提交重建任务";
+            auto name = request.arg(1);
+            offload(connection, [this, connection, name] () {
+                return begin_job(connection, name);
+            });
+        } else if (connection->logged_in && cmd == "job_start") {
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, connection, id] () {
+                return start_job(connection, id);
+            });
+        } else if (connection->logged_in && cmd == "job_watch") {
+            watch_job(connection, std::atoi(request.arg(1).c_str()));
+        } else if (cmd == "shard") {
+            connection->shard_peer = !shard_key.empty() && request.arg(1) == shard_key;
+            send(connection, connection->shard_peer ? make_request("success") : make_request("error", "wrong key"));
+        } else if (connection->shard_peer && cmd == "shard_export") {
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, id] () {
+                return shard_export(id);
+            });
+        } else if (connection->shard_peer && cmd == "shard_chunk") {
+            auto hash = request.arg(1);
+            offload(connection, [this, hash] () {
+                return shard_chunk(hash);
+            });
+        } else if (connection->shard_peer && cmd == "shard_drop") {
+            auto id = std::atoi(request.arg(1).c_str());
+            offload(connection, [this, id] () {
+                return shard_drop(id);
+            });
+        }
+    } else if (request.arg(0) == "hello") {
+        greet(connection, request);
+    } else if (request.arg_size() == 4 && request.arg(0) == "download_range") {
+        // download_range <id> <offset> <length>; a negative length runs to the end, zero only
+        // fetches the header
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        auto id = std::atoi(request.arg(1).c_str());
+        auto offset = std::atoll(request.arg(2).c_str());
+        auto length = std::atoll(request.arg(3).c_str());
+        offload(connection, [this, connection, id, offset, length] () {
+            return begin_download_range(connection, id, offset, length);
+        });
+    } else if (request.arg_size() == 3 && request.arg(0) == "artifact") {
+        // artifact <id> <name>
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        auto id = std::atoi(request.arg(1).c_str());
+        auto artifact = request.arg(2);
+        offload(connection, [this, id, artifact] () {
+            return begin_artifact(id, artifact);
+        });
+    } else if (request.arg_size() == 4 && request.arg(0) == "job_image") {
+        // job_image <job id> <file name> <bytes>
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        auto id = std::atoi(request.arg(1).c_str());
+        auto file = request.arg(2);
+        auto size = std::atoll(request.arg(3).c_str());
+        offload(connection, [this, connection, id, file, size] () {
+            return begin_job_image(connection, id, file, size);
+        });
+    } else if (request.arg_size() == 6 && request.arg(0) == "list") {
+        // list <since version> <cursor> <limit> <owner> <name prefix>; empty or zero where unused.
+        // Answers with `page <version> <next cursor>` and then the records; version 0 to a later
+        // `since` means start over
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        ListingQuery query;
+        query.since = std::strtoull(request.arg(1).c_str(), nullptr, 10);
+        query.cursor = request.arg(2);
+        query.limit = request.arg(3).empty() ? CATALOGUE_PAGE_DEFAULT : std::atoi(request.arg(3).c_str());
+        query.owner = request.arg(4);
+        query.prefix = request.arg(5);
+        offload(connection, [this, query] () {
+            Completion completion;
+            auto listing = catalogue.list(query);
+            completion.frames.push_back(frame(make_request("page", std::to_string(listing.version), listing.next)));
+            completion.frames.push_back(frame(listing.records));
+            return completion;
+        });
+    } else if (request.arg_size() == 3 + TRANSFER_FILES && request.arg(0) == "upload_resume") {
+        // upload_resume <file base> <sha256> <obj bytes> <mtl bytes> <png bytes>
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        SERVER_LOG << "用户正在尝试续传";
+        std::array<int64_t, TRANSFER_FILES> sizes;
+        for (auto i = 0; i < TRANSFER_FILES; i++) {
+            sizes[i] = std::atoll(request.arg(3 + i).c_str());
+            if (sizes[i] < 0) {
+                send(connection, make_request("error", "bad size"));
+                return;
+            }
+        }
+        auto file_base = request.arg(1);
+        auto hash = request.arg(2);
+        offload(connection, [this, connection, file_base, hash, sizes] () {
+            return begin_resumable_upload(connection, file_base, hash, sizes);
+        });
+    } else if (request.arg_size() >= 3 + TRANSFER_FILES && request.arg(0) == "upload_chunks") {
+        // upload_chunks <file base> <sha256> <obj bytes> <mtl bytes> <png bytes>, then a
+        // <chunk hash> <length> pair for every chunk
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        SERVER_LOG << "用户正在尝试去重上传";
+        Manifest manifest;
+        manifest.hash = request.arg(2);
+        for (auto i = 0; i < TRANSFER_FILES; i++) {
+            manifest.sizes[i] = std::atoll(request.arg(3 + i).c_str());
+        }
+        for (auto i = 3 + TRANSFER_FILES; i + 1 < request.arg_size(); i += 2) {
+            manifest.chunks.push_back({ request.arg(i), std::atoll(request.arg(i + 1).c_str()) });
+        }
+        auto file_base = request.arg(1);
+        offload(connection, [this, connection, file_base, manifest = std::move(manifest)] () {
+            return begin_chunked_upload(connection, file_base, manifest);
+        });
+    } else if (request.arg_size() >= 5 + TRANSFER_FILES && request.arg(0) == "shard_import") {
+        // shard_import <id> <owner> <name> <sha256> <obj bytes> <mtl bytes> <png bytes>, then the
+        // <chunk hash> <length> pairs
+        if (!connection->shard_peer) {
+            send(connection, make_request("error", "not a shard peer"));
+            return;
+        }
+        online::ReconRecord record;
+        record.set_id(std::atoi(request.arg(1).c_str()));
+        record.set_owner(request.arg(2));
+        record.set_name(request.arg(3));
+        Manifest manifest;
+        manifest.hash = request.arg(4);
+        for (auto i = 0; i < TRANSFER_FILES; i++) {
+            manifest.sizes[i] = std::atoll(request.arg(5 + i).c_str());
+        }
+        for (auto i = 5 + TRANSFER_FILES; i + 1 < request.arg_size(); i += 2) {
+            manifest.chunks.push_back({ request.arg(i), std::atoll(request.arg(i + 1).c_str()) });
+        }
+        offload(connection, [this, connection, record, manifest = std::move(manifest)] () {
+            return begin_shard_import(connection, record, manifest);
+        });
+    } else if (request.arg_size() == 2 + TRANSFER_FILES && request.arg(0) == "upload_stream") {
+        // upload_stream <file base> <obj bytes> <mtl bytes> <png bytes>
+        if (!connection->logged_in) {
+            send(connection, make_request("error", "not logged in"));
+            return;
+        }
+        SERVER_LOG << "用户正在尝试分块上传";
+        std::array<int64_t, TRANSFER_FILES> sizes;
+        for (auto i = 0; i < TRANSFER_FILES; i++) {
+            sizes[i] = std::atoll(request.arg(2 + i).c_str());
+            if (sizes[i] < 0) {
+                send(connection, make_request("error", "bad size"));
+                return;
+            }
+        }
+        auto file_base = request.arg(1);
+        offload(connection, [this, connection, file_base, sizes] () {
+            return begin_upload_stream(connection, file_base, sizes);
+        });
+    } else {
+        send(connection, make_request("error", "unknown request"));
+    }
+}
+
+auto Server::greet(std::shared_ptr<Connection> connection, const online::Request &request) -> void {
+    if (request.arg(1) != "server") {
+        send(connection, make_request("error", "fuck off"));
+        connection->closing = true;
+        SERVER_ERROR << "客户端未能正确指代服务器。正在断开连接...";
+        flush(connection);
+        return;
+    }
+    // Older clients offer nothing and get a bare hello, keeping chunks and frames as they were
+    connection->codec = Codec::NONE;
+    auto tagged = false;
+    auto routed = false;
+    for (auto i = 2; i < request.arg_size(); i++) {
+        if (request.arg(i) == TRANSFER_TAGS) {
+            tagged = true;
+        } else if (request.arg(i) == ROUTE_HELLO) {
+            routed = true;
+        } else if (connection->codec == Codec::NONE) {
+            connection->codec = parse_codec(request.arg(i));
+        }
+    }
+    auto reply = make_request("hello");
+    if (connection->codec != Codec::NONE) {
+        reply.add_arg(codec_name(connection->codec));
+    }
+    if (tagged) {
+        reply.add_arg(TRANSFER_TAGS);
+    }
+    // The first hello goes out untagged, since the client can't know how until it reads it
+    tagged = tagged || connection->tagged;
+    send(connection, reply);
+    connection->tagged = tagged;
+    // A router serves one request at a time and has no use for tags; ROUTE_DONE can't be tagged
+    connection->routed = routed && !tagged;
+    SERVER_LOG << "与新连接成功互相打招呼。连接已经稳定。";
+}
+
+auto Server::open_checked(std::shared_ptr<Connection> connection, std::string &payload) -> bool {
+    if (connection->codec != Codec::NONE) {
+        std::string chunk;
+        if (!unpack_chunk(payload, chunk, TRANSFER_CHUNK)) {
+            return false;
+        }
+        payload.swap(chunk);
+        return true;
+    }
+    uint32_t crc = 0;
+    if (payload.size() < TRANSFER_CHECKSUM) {
+        return false;
+    }
+    std::memcpy(&crc, payload.data(), TRANSFER_CHECKSUM);
+    payload.erase(0, TRANSFER_CHECKSUM);
+    return crc32(payload.data(), payload.size()) == crc;
+}
+
+auto Server::login(std::shared_ptr<Connection> connection, const online::User &credentials) -> void {
+    auto user = catalogue.authenticate(credentials.username(), credentials.password());
+    if (user.has_value()) {
+        connection->user = *user;
+        connection->logged_in = true;
+        // However many connections a user opens, they share one turn of the bandwidth
+        connection->flow = "user:" + connection->user.username();
+        SERVER_LOG << "用户成功证明自己是 " << connection->user.username();
+        send(connection, make_request("success"));
+        return;
+    }
+    send(connection, make_request("error", "wrong credentials"));
+}
+
+// W O R K E R S //////////////////////////////////////////////
+// Everything below runs on the worker pool. Replies go into the returned Completion.
+
+auto Server::register_user(online::User user) -> Completion {
+    Completion completion;
+    if (!catalogue.add_user(user.username(), user.password()).has_value()) {
+        completion.frames.push_back(frame(make_request("error", "user exist")));
+        return completion;
+    }
+    completion.frames.push_back(frame(make_request("success")));
+    return completion;
+}
+
+auto Server::upload(std::shared_ptr<Connection> connection, std::string payload) -> Completion {
+    Completion completion;
+    auto buffer = parse<online::ReconBuffer>(payload);
+    if (!buffer.has_value()) {
+        completion.bail = "用户上传数据失败，正在关闭连接。";
+        return completion;
+    }
+    if (!buffer->has_file_base() || !buffer->has_obj_content() ||
+        !buffer->has_mtl_content() || !buffer->has_texture_content()) {
+        SERVER_ERROR << "上传数据未齐全。";
+        completion.frames.push_back(frame(make_request("error", "buffer not complete")));
+        return completion;
+    }
+    const auto &username = connection->user.username();
+    auto base = username + "/" + std::filesystem::path(buffer->file_base()).filename().string();
+    mkdir_if_not_exists("uploads");
+    mkdir_if_not_exists(std::string("uploads/") + username);
+    UploadStream stream(store, std::string("uploads/") + base, {
+        (int64_t) buffer->obj_content().size(),
+        (int64_t) buffer->mtl_content().size(),
+        (int64_t) buffer->texture_content().size()
+    });
+    if (!stream.write(buffer->obj_content()) || !stream.write(buffer->mtl_content()) ||
+        !stream.write(buffer->texture_content()) || !stream.commit()) {
+        SERVER_ERROR << "尝试写入文件失败：" << base;
+        completion.frames.push_back(frame(make_request("error", "failed to open file")));
+        return completion;
+    }
+    SERVER_LOG << "文件上传成功。正在保存记录...";
+    if (!publish_record(username, base).has_value()) {
+        completion.frames.push_back(frame(make_request("error", "failed to save record")));
+        return completion;
+    }
+    completion.frames.push_back(frame(make_request("success")));
+    return completion;
+}
+
+auto Server::publish_record(const std::string &username, const std::string &base,
+                            std::optional<int> id) -> std::optional<online::ReconRecord> {
+    // The manifest is already swapped; whoever downloads next should get the new version
+    cache.invalidate(base);
+    if (!variants.build(store, "uploads/" + base, compress_level)) {
+        SERVER_ERROR << "无法生成压缩副本：" << base;
+    }
+    auto record = catalogue.publish(username, base, id);
+    if (!record.has_value()) {
+        return {};
+    }
+    // Progressive levels and artifacts take a while; the upload doesn't wait for them
+    artifacts.enqueue(base);
+    return record;
+}
+
+auto Server::make_artifacts(const std::string &name) -> void {
+    auto base = "uploads/" + name;
+    if (!progressive.build(store, base)) {
+        SERVER_ERROR << "无法生成渐进网格：" << name;
+    }
+    online::Request made;
+    if (!artifacts.build(store, base, made)) {
+        SERVER_ERROR << "无法生成派生文件：" << name;
+        return;
+    }
+    catalogue.record_artifacts(name, made);
+    SERVER_LOG << "已生成派生文件：" << name << "，共 " << (made.arg_size() - 1) / 2 << " 个";
+}
+
+auto Server::find_record_name(int id) -> std::string {
+    auto record = catalogue.find(id);
+    return record.has_value() ? record->name() : "";
+}
+
+auto Server::record_hashes(std::vector<int> ids) -> Completion {
+    Completion completion;
+    online::Request reply;
+    reply.add_arg("hashes");
+    for (auto id : ids) {
+        auto name = find_record_name(id);
+        auto manifest = name.empty() ? std::nullopt : store.read_manifest("uploads/" + name);
+        reply.add_arg(manifest.has_value() ? manifest->hash : "");
+        reply.add_arg(std::to_string(manifest.has_value() ? manifest->total() : 0));
+    }
+    completion.frames.push_back(frame(reply));
+    return completion;
+}
+
+auto Server::download(std::shared_ptr<Connection> connection, int id) -> Completion {
+    Completion completion;
+    auto name = find_record_name(id);
+    if (name.empty()) {
+        SERVER_ERROR << "记录条未找到：" << id;
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    CacheTicket ticket;
+    auto cached = cache.get(name, ticket);
+    if (cached) {
+        completion.frames.push_back(Outgoing(std::move(cached)));
+        SERVER_LOG << "文件从缓存发送。";
+        return completion;
+    }
+    if (zero_copy && !ticket.admit) {
+        // Not popular yet; sendfile beats copying it into memory
+        return download_zero_copy(connection, name);
+    }
+    DownloadStream stream(store, "uploads/" + name);
+    if (!stream.open()) {
+        SERVER_ERROR << "文件未找到：" << stream.base;
+        completion.frames.push_back(frame(make_request("error", "file not found")));
+        return completion;
+    }
+    std::string contents[TRANSFER_FILES], chunk;
+    int64_t offset = 0;
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        stream.seek(offset, stream.sizes[i]);
+        offset += stream.sizes[i];
+        while (!stream.finished()) {
+            if (!stream.read(chunk)) {
+                completion.frames.push_back(frame(make_request("error", "file not found")));
+                return completion;
+            }
+            contents[i] += chunk;
+        }
+    }
+    online::ReconBuffer buffer;
+    buffer.set_file_base(name);
+    buffer.set_obj_content(std::move(contents[0]));
+    buffer.set_mtl_content(std::move(contents[1]));
+    buffer.set_texture_content(std::move(contents[2]));
+    auto payload = std::make_shared<const std::string>(frame(buffer));
+    cache.put(name, payload, ticket);
+    completion.frames.push_back(Outgoing(std::move(payload)));
+    SERVER_LOG << "文件发送成功。";
+    return completion;
+}
+
+auto Server::download_zero_copy(std::shared_ptr<Connection> connection, std::string name) -> Completion {
+    Completion completion;
+    auto stream = std::make_unique<DownloadStream>(store, "uploads/" + name);
+    if (!stream->open()) {
+        SERVER_ERROR << "文件未找到：" << stream->base;
+        completion.frames.push_back(frame(make_request("error", "file not found")));
+        return completion;
+    }
+    // Write out the ReconBuffer encoding by hand, so the file contents can go out with
+    // sendfile instead of passing through protobuf. Fields go in field number order, the
+    // same as SerializeToArray would produce.
+    std::string fields[TRANSFER_FILES];
+    auto head = std::string(1, (char) 0x0a) + encode_varint(name.size()) + name;
+    int64_t size = head.size();
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        fields[i] = std::string(1, (char) (((i + 2) << 3) | 2)) + encode_varint(stream->sizes[i]);
+        size += fields[i].size() + stream->sizes[i];
+    }
+    if (size > INT_MAX) {
+        completion.frames.push_back(frame(make_request("error", "record too large")));
+        return completion;
+    }
+    completion.frames.push_back(frame_header((int) size) + head);
+    for (auto i = 0; i < TRANSFER_FILES; i++) {
+        completion.frames.push_back(fields[i]);
+        if (stream->ranges(stream->sizes[i], completion.frames) < 0) {
+            // The header is already on its way; the only way out is to hang up
+            completion.bail = "读取下载文件失败，正在关闭连接。";
+            return completion;
+        }
+    }
+    connection->download = std::move(stream);
+    completion.keep_busy = true;
+    return completion;
+}
+
+// S T R E A M I N G //////////////////////////////////////////
+// upload_stream: header → "ready" → raw chunk frames → "success".
+// download_stream: → "stream" header with the file sizes → raw chunk frames.
+
+auto Server::begin_upload_stream(std::shared_ptr<Connection> connection, std::string file_base,
+                                 std::array<int64_t, TRANSFER_FILES> sizes) -> Completion {
+    Completion completion;
+    const auto &username = connection->user.username();
+    auto name = std::filesystem::path(file_base).filename().string();
+    if (name.empty() || sizes[0] + sizes[1] + sizes[2] == 0) {
+        completion.frames.push_back(frame(make_request("error", "empty upload")));
+        return completion;
+    }
+    mkdir_if_not_exists("uploads");
+    mkdir_if_not_exists(std::string("uploads/") + username);
+    connection->upload = std::make_unique<UploadStream>(store, "uploads/" + username + "/" + name, sizes);
+    completion.expect = Expect::UPLOAD_CHUNK;
+    completion.frames.push_back(frame(make_request("ready")));
+    return completion;
+}
+
+auto Server::upload_chunk(std::shared_ptr<Connection> connection, std::string chunk) -> Completion {
+    Completion completion;
+    auto &stream = connection->upload;
+    if (!stream->write(chunk)) {
+        // The peer is still streaming chunks we can't take; there's no way to resync
+        stream.reset();
+        completion.bail = "写入上传分块失败，正在关闭连接。";
+        return completion;
+    }
+    if (!stream->finished()) {
+        return completion;
+    }
+    completion.expect = Expect::REQUEST;
+    if (!stream->commit()) {
+        SERVER_ERROR << "保存上传文件失败：" << stream->base;
+        stream.reset();
+        completion.frames.push_back(frame(make_request("error", "failed to save file")));
+        return completion;
+    }
+    const auto &username = connection->user.username();
+    auto base = username + "/" + std::filesystem::path(stream->base).filename().string();
+    stream.reset();
+    SERVER_LOG << "文件上传成功。正在保存记录...";
+    if (!publish_record(username, base).has_value()) {
+        completion.frames.push_back(frame(make_request("error", "failed to save record")));
+        return completion;
+    }
+    completion.frames.push_back(frame(make_request("success")));
+    return completion;
+}
+
+auto Server::begin_download_stream(std::shared_ptr<Connection> connection, int id) -> Completion {
+    Completion completion;
+    auto name = find_record_name(id);
+    if (name.empty()) {
+        SERVER_ERROR << "记录条未找到：" << id;
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    auto stream = std::make_unique<DownloadStream>(store, "uploads/" + name);
+    if (!stream->open()) {
+        SERVER_ERROR << "文件未找到：" << stream->base;
+        completion.frames.push_back(frame(make_request("error", "file not found")));
+        return completion;
+    }
+    completion.frames.push_back(frame(make_request("stream", name,
+                                                   std::to_string(stream->sizes[0]),
+                                                   std::to_string(stream->sizes[1]),
+                                                   std::to_string(stream->sizes[2]))));
+    connection->download = std::move(stream);
+    completion.keep_busy = true;
+    return completion;
+}
+
+auto Server::read_chunk(std::shared_ptr<Connection> connection) -> Completion {
+    Completion completion;
+    std::string chunk;
+    if (!connection->download->read(chunk)) {
+        completion.bail = "读取下载文件失败，正在关闭连接。";
+        return completion;
+    }
+    if (!connection->download->checked) {
+        completion.frames.push_back(frame_chunk(chunk));
+    } else if (connection->codec != Codec::NONE) {
+        completion.frames.push_back(frame_chunk(pack_chunk(chunk.data(), chunk.size(), connection->codec,
+                                                           compress_level)));
+    } else {
+        completion.frames.push_back(frame_checked(chunk));
+    }
+    return completion;
+}
+
+// R E S U M A B L E //////////////////////////////////////////
+// upload_resume: header with the content hash → "ready <offset>" → checked chunks from there
+// → "success". Verified bytes wait in uploads/.partial/<user>/<hash> across connections.
+// download_range: → "range" header with name, hash, range & file sizes → checked chunks.
+
+auto Server::begin_resumable_upload(std::shared_ptr<Connection> connection, std::string file_base,
+                                    std::string hash, std::array<int64_t, TRANSFER_FILES> sizes) -> Completion {
+    Completion completion;
+    const auto &username = connection->user.username();
+    auto name = std::filesystem::path(file_base).filename().string();
+    if (name.empty() || sizes[0] + sizes[1] + sizes[2] == 0) {
+        completion.frames.push_back(frame(make_request("error", "empty upload")));
+        return completion;
+    }
+    if (!is_hex_digest(hash)) {
+        completion.frames.push_back(frame(make_request("error", "bad hash")));
+        return completion;
+    }
+    mkdir_if_not_exists("uploads");
+    mkdir_if_not_exists(std::string("uploads/") + username);
+    mkdir_if_not_exists("uploads/.partial");
+    mkdir_if_not_exists(std::string("uploads/.partial/") + username);
+    auto partial = "uploads/.partial/" + username + "/" + hash;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        if (!partials.insert(partial).second) {
+            completion.frames.push_back(frame(make_request("error", "upload in progress")));
+            return completion;
+        }
+    }
+    connection->resumable = std::make_unique<ResumableUpload>(store, "uploads/" + username + "/" + name,
+                                                              partial, hash, sizes);
+    if (!connection->resumable->open()) {
+        SERVER_ERROR << "尝试写入文件失败：" << partial;
+        std::lock_guard<std::mutex> lock(data_mutex);
+        partials.erase(partial);
+        connection->resumable.reset();
+        completion.frames.push_back(frame(make_request("error", "failed to open file")));
+        return completion;
+    }
+    auto offset = connection->resumable->offset;
+    if (offset > 0) {
+        SERVER_LOG << "从 " << offset << " 字节处继续上传";
+    }
+    completion.frames.push_back(frame(make_request("ready", std::to_string(offset))));
+    if (connection->resumable->finished()) {
+        // Every byte made it last time; only the reply got lost
+        finish_resumable_upload(connection, completion);
+        return completion;
+    }
+    completion.expect = Expect::UPLOAD_CHECKED_CHUNK;
+    return completion;
+}
+
+auto Server::checked_chunk(std::shared_ptr<Connection> connection, std::string payload) -> Completion {
+    Completion completion;
+    // Either way the chunks already in flight can't be taken; drop the connection and let the
+    // client resume from the last verified byte
+    if (!open_checked(connection, payload)) {
+        completion.bail = "上传分块校验失败，正在关闭连接。";
+        return completion;
+    }
+    if (!connection->resumable->write(payload)) {
+        completion.bail = "写入上传分块失败，正在关闭连接。";
+        return completion;
+    }
+    if (!connection->resumable->finished()) {
+        return completion;
+    }
+    completion.expect = Expect::REQUEST;
+    finish_resumable_upload(connection, completion);
+    return completion;
+}
+
+auto Server::finish_resumable_upload(std::shared_ptr<Connection> connection, Completion &completion) -> void {
+    auto upload = std::move(connection->resumable);
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        partials.erase(upload->partial);
+    }
+    if (!upload->verified()) {
+        SERVER_ERROR << "上传内容与哈希不符：" << upload->base;
+        upload->discard();
+        completion.frames.push_back(frame(make_request("error", "hash mismatch")));
+        return;
+    }
+    if (!upload->commit()) {
+        SERVER_ERROR << "保存上传文件失败：" << upload->base;
+        completion.frames.push_back(frame(make_request("error", "failed to save file")));
+        return;
+    }
+    const auto &username = connection->user.username();
+    auto base = username + "/" + std::filesystem::path(upload->base).filename().string();
+    SERVER_LOG << "文件上传成功。正在保存记录...";
+    if (!publish_record(username, base).has_value()) {
+        completion.frames.push_back(frame(make_request("error", "failed to save record")));
+        return;
+    }
+    completion.frames.push_back(frame(make_request("success")));
+}
+
+auto Server::begin_download_range(std::shared_ptr<Connection> connection, int id,
+                                  int64_t offset, int64_t length) -> Completion {
+    Completion completion;
+    auto name = find_record_name(id);
+    if (name.empty()) {
+        SERVER_ERROR << "记录条未找到：" << id;
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    auto stream = std::make_unique<DownloadStream>(store, "uploads/" + name);
+    if (!stream->open()) {
+        SERVER_ERROR << "文件未找到：" << stream->base;
+        completion.frames.push_back(frame(make_request("error", "file not found")));
+        return completion;
+    }
+    auto hash = stream->hash;
+    auto total = stream->total();
+    if (offset < 0 || offset > total) {
+        completion.frames.push_back(frame(make_request("error", "bad range")));
+        return completion;
+    }
+    if (length < 0 || length > total - offset) {
+        length = total - offset;
+    }
+    completion.frames.push_back(frame(make_request("range", name, hash,
+                                                   std::to_string(offset), std::to_string(length),
+                                                   std::to_string(stream->sizes[0]),
+                                                   std::to_string(stream->sizes[1]),
+                                                   std::to_string(stream->sizes[2]))));
+    if (length == 0) {
+        return completion;
+    }
+    if (offset % TRANSFER_CHUNK == 0 && ((offset + length) % TRANSFER_CHUNK == 0 || offset + length == total)) {
+        // Whole pieces, as fresh, resumed and prefetching downloads ask for: a popular record's go
+        // out of memory. Keyed by content, so an overwrite never finds the old one
+        auto key = hash + "/" + codec_name(connection->codec);
+        CacheTicket ticket;
+        auto framed = cache.get(key, ticket);
+        if (!framed && ticket.admit && cache.fits(total)) {
+            framed = frame_pieces(*stream, connection->codec);
+            if (framed) {
+                cache.put(key, framed, ticket);
+            }
+        }
+        if (framed) {
+            // A slice a frame, so a tagged connection can put the tag in front of each
+            int64_t position = 0;
+            for (int64_t piece = 0; position < (int64_t) framed->size() && piece * TRANSFER_CHUNK < offset + length; piece++) {
+                int size = 0;
+                std::memcpy(&size, framed->data() + position, sizeof(size));
+                auto next = position + (int64_t) sizeof(size) + size;
+                if (piece * TRANSFER_CHUNK >= offset) {
+                    completion.frames.push_back(Outgoing(framed, position, next - position));
+                }
+                position = next;
+            }
+            return completion;
+        }
+    }
+    if (zero_copy && connection->codec == Codec::LZ4 && offset % TRANSFER_CHUNK == 0 && offset + length == total) {
+        // Whole pieces through to the end, as a fresh or resumed download asks for: send them
+        // straight out of the packed variant
+        std::vector<int64_t> offsets;
+        auto variant = variants.open(hash, offsets);
+        if (!variant && variants.build(store, stream->base, compress_level)) {
+            variant = variants.open(hash, offsets);
+        }
+        if (variant && (int64_t) offsets.size() == (total + TRANSFER_CHUNK - 1) / TRANSFER_CHUNK + 1) {
+            for (auto piece = offset / TRANSFER_CHUNK; piece + 1 < (int64_t) offsets.size(); piece++) {
+                auto size = offsets[piece + 1] - offsets[piece];
+                completion.frames.push_back(frame_header((int) size));
+                completion.frames.push_back(Outgoing(variant, offsets[piece], size));
+            }
+            return completion;
+        }
+    }
+    stream->seek(offset, length);
+    stream->checked = true;
+    connection->download = std::move(stream);
+    completion.keep_busy = true;
+    return completion;
+}
+
+auto Server::frame_pieces(DownloadStream &stream, Codec codec) -> std::shared_ptr<const std::string> {
+    auto framed = std::make_shared<std::string>();
+    std::string piece;
+    stream.seek(0, stream.total());
+    while (!stream.finished()) {
+        if (!stream.read(piece) || piece.empty()) {
+            return nullptr;
+        }
+        // The same frames read_chunk() makes
+        *framed += codec != Codec::NONE ? frame_chunk(pack_chunk(piece.data(), piece.size(), codec, compress_level)) :
+                                          frame_checked(piece);
+    }
+    return framed;
+}
+
+auto Server::begin_progressive(int id) -> Completion {
+    Completion completion;
+    auto name = find_record_name(id);
+    if (name.empty()) {
+        SERVER_ERROR << "记录条未找到：" << id;
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    DownloadStream stream(store, "uploads/" + name);
+    if (!stream.open()) {
+        SERVER_ERROR << "文件未找到：" << stream.base;
+        completion.frames.push_back(frame(make_request("error", "file not found")));
+        return completion;
+    }
+    // Records from before progressive meshes get theirs the first time someone asks
+    ProgressiveIndex index;
+    auto file = progressive.open(stream.hash, index);
+    if (!file && progressive.build(store, stream.base)) {
+        file = progressive.open(stream.hash, index);
+    }
+    if (!file) {
+        completion.frames.push_back(frame(make_request("error", "no progressive mesh")));
+        return completion;
+    }
+    completion.frames.push_back(frame(make_request("progressive", stream.hash, std::to_string(PROGRESSIVE_LEVELS),
+                                                   std::to_string(index.min[0]), std::to_string(index.min[1]),
+                                                   std::to_string(index.min[2]), std::to_string(index.max[0]),
+                                                   std::to_string(index.max[1]), std::to_string(index.max[2]),
+                                                   std::to_string(stream.sizes[0] + stream.sizes[1]),
+                                                   std::to_string(stream.sizes[2]))));
+    for (auto level = 0; level < PROGRESSIVE_LEVELS; level++) {
+        auto size = index.offsets[level + 1] - index.offsets[level];
+        completion.frames.push_back(frame_header((int) size));
+        completion.frames.push_back(Outgoing(file, index.offsets[level], size));
+    }
+    return completion;
+}
+
+// A R T I F A C T S ////////////////////////////////////////
+
+auto Server::list_artifacts(int id) -> Completion {
+    Completion completion;
+    auto name = find_record_name(id);
+    if (name.empty()) {
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    auto manifest = store.read_manifest("uploads/" + name);
+    if (!manifest.has_value()) {
+        completion.frames.push_back(frame(make_request("error", "file not found")));
+        return completion;
+    }
+    online::Request reply;
+    reply.add_arg("artifacts");
+    reply.add_arg(manifest->hash);
+    // What the catalogue has may be of the content this upload replaced
+    auto made = catalogue.artifacts(id);
+    if (made.has_value() && made->arg_size() > 0 && made->arg(0) == manifest->hash) {
+        reply.add_arg("ready");
+        for (auto i = 1; i < made->arg_size(); i++) {
+            reply.add_arg(made->arg(i));
+        }
+    } else {
+        reply.add_arg("pending");
+    }
+    completion.frames.push_back(frame(reply));
+    return completion;
+}
+
+auto Server::begin_artifact(int id, std::string artifact) -> Completion {
+    Completion completion;
+    auto name = find_record_name(id);
+    auto manifest = name.empty() ? std::nullopt : store.read_manifest("uploads/" + name);
+    if (!manifest.has_value()) {
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    int64_t size = 0;
+    auto file = artifacts.open(manifest->hash, artifact, size);
+    if (!file) {
+        completion.frames.push_back(frame(make_request("error", "artifact not found")));
+        return completion;
+    }
+    completion.frames.push_back(frame(make_request("artifact", manifest->hash, std::to_string(size))));
+    for (int64_t offset = 0; offset < size; offset += TRANSFER_CHUNK) {
+        auto length = std::min<int64_t>(TRANSFER_CHUNK, size - offset);
+        completion.frames.push_back(frame_header((int) length));
+        completion.frames.push_back(Outgoing(file, offset, length));
+    }
+    return completion;
+}
+
+// D E D U P L I C A T E D ////////////////////////////////////
+// upload_chunks: header with the manifest → "missing" with the hashes the store lacks → those
+// chunks, checked, in that order → "success". Chunks survive a dropped connection, so a retry
+// only sends what's still missing.
+
+auto Server::begin_chunked_upload(std::shared_ptr<Connection> connection, std::string file_base,
+                                  Manifest manifest) -> Completion {
+    Completion completion;
+    // A shard_import stores the record under its owner, not the router's user
+    auto username = connection->adopting.has_value() ? connection->adopting->owner() : connection->user.username();
+    auto name = std::filesystem::path(file_base).filename().string();
+    int64_t chunked = 0;
+    auto valid = is_hex_digest(manifest.hash);
+    for (const auto &entry : manifest.chunks) {
+        valid = valid && is_hex_digest(entry.hash) && entry.length > 0 && entry.length <= CHUNK_MAX;
+        chunked += entry.length;
+    }
+    for (auto size : manifest.sizes) {
+        valid = valid && size >= 0;
+    }
+    if (name.empty() || manifest.total() == 0) {
+        completion.frames.push_back(frame(make_request("error", "empty upload")));
+        return completion;
+    }
+    if (!valid || chunked != manifest.total()) {
+        completion.frames.push_back(frame(make_request("error", "bad manifest")));
+        return completion;
+    }
+    mkdir_if_not_exists("uploads");
+    mkdir_if_not_exists(std::string("uploads/") + username);
+    connection->chunked = std::make_unique<ChunkedUpload>(store, "uploads/" + username + "/" + name,
+                                                          std::move(manifest));
+    online::Request missing;
+    missing.add_arg("missing");
+    for (auto &hash : connection->chunked->missing()) {
+        missing.add_arg(hash);
+    }
+    SERVER_LOG << "需要上传 " << missing.arg_size() - 1 << " / "
+               << connection->chunked->manifest.chunks.size() << " 个分块";
+    completion.frames.push_back(frame(missing));
+    if (connection->chunked->finished()) {
+        finish_chunked_upload(connection, completion);
+        return completion;
+    }
+    completion.expect = Expect::UPLOAD_BLOB;
+    return completion;
+}
+
+auto Server::blob_chunk(std::shared_ptr<Connection> connection, std::string payload) -> Completion {
+    Completion completion;
+    if (!open_checked(connection, payload) || !connection->chunked->write(payload)) {
+        connection->chunked.reset();
+        completion.bail = "上传分块校验失败，正在关闭连接。";
+        return completion;
+    }
+    if (!connection->chunked->finished()) {
+        return completion;
+    }
+    completion.expect = Expect::REQUEST;
+    finish_chunked_upload(connection, completion);
+    return completion;
+}
+
+auto Server::finish_chunked_upload(std::shared_ptr<Connection> connection, Completion &completion) -> void {
+    auto upload = std::move(connection->chunked);
+    auto adopting = std::move(connection->adopting);
+    connection->adopting.reset();
+    if (!upload->verified()) {
+        SERVER_ERROR << "上传内容与哈希不符：" << upload->base;
+        completion.frames.push_back(frame(make_request("error", "hash mismatch")));
+        return;
+    }
+    if (!upload->commit()) {
+        SERVER_ERROR << "保存上传文件失败：" << upload->base;
+        completion.frames.push_back(frame(make_request("error", "failed to save file")));
+        return;
+    }
+    if (adopting.has_value()) {
+        if (!publish_record(adopting->owner(), adopting->name(), adopting->id()).has_value()) {
+            completion.frames.push_back(frame(make_request("error", "failed to save record")));
+            return;
+        }
+        completion.frames.push_back(frame(make_request("success")));
+        SERVER_LOG << "已迁入记录：" << adopting->name() << "（" << adopting->id() << "）";
+        return;
+    }
+    const auto &username = connection->user.username();
+    auto base = username + "/" + std::filesystem::path(upload->base).filename().string();
+    SERVER_LOG << "文件上传成功。正在保存记录...";
+    if (!publish_record(username, base).has_value()) {
+        completion.frames.push_back(frame(make_request("error", "failed to save record")));
+        return;
+    }
+    completion.frames.push_back(frame(make_request("success")));
+}
+
+Server::~Server() {
+    metrics_endpoint.stop();
+    pool.stop();
     if (ready) {
         ready = false;
         close(server_sock);
-        for (auto sock : sockets) {
-            close(sock);
+        for (auto &connection : connections) {
+            close(connection.first);
+        }
+    }
+}
+
+// S H A R D S ////////////////////////////////////////////////
+// A router moving a record: shard_export here, shard_import and shard_chunk fetches there, then
+// shard_drop here. See Protocol.hpp.
+
+auto Server::shard_export(int id) -> Completion {
+    Completion completion;
+    auto record = catalogue.find(id);
+    auto manifest = record.has_value() ? store.read_manifest("uploads/" + record->name()) : std::nullopt;
+    if (!manifest.has_value()) {
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    auto reply = make_request("manifest", record->owner(), record->name(), manifest->hash);
+    for (auto size : manifest->sizes) {
+        reply.add_arg(std::to_string(size));
+    }
+    for (const auto &entry : manifest->chunks) {
+        reply.add_arg(entry.hash);
+        reply.add_arg(std::to_string(entry.length));
+    }
+    completion.frames.push_back(frame(reply));
+    return completion;
+}
+
+auto Server::shard_chunk(std::string hash) -> Completion {
+    Completion completion;
+    std::ifstream reader(is_hex_digest(hash) ? store.chunk_path(hash) : "", std::ios::binary);
+    if (!reader.is_open()) {
+        completion.frames.push_back(frame(make_request("error", "chunk not found")));
+        return completion;
+    }
+    std::string bytes((std::istreambuf_iterator<char>(reader)), std::istreambuf_iterator<char>());
+    completion.frames.push_back(frame_checked(bytes));
+    return completion;
+}
+
+auto Server::begin_shard_import(std::shared_ptr<Connection> connection, online::ReconRecord record,
+                                Manifest manifest) -> Completion {
+    Completion completion;
+    auto file = std::filesystem::path(record.name()).filename().string();
+    if (record.id() <= 0 || record.owner().empty() || record.name() != record.owner() + "/" + file) {
+        completion.frames.push_back(frame(make_request("error", "bad record")));
+        return completion;
+    }
+    // Whatever is here already is newer: uploads go to the owner as soon as the ring changes
+    auto taken = catalogue.find(record.id());
+    if (taken.has_value() && taken->name() != record.name()) {
+        completion.frames.push_back(frame(make_request("error", "id taken")));
+        return completion;
+    }
+    if (taken.has_value() || catalogue.find_named(record.name()).has_value()) {
+        completion.frames.push_back(frame(make_request("error", "record exists")));
+        return completion;
+    }
+    connection->adopting = record;
+    completion = begin_chunked_upload(connection, file, std::move(manifest));
+    if (!connection->chunked) {
+        // Refused, or already finished with every chunk on hand
+        connection->adopting.reset();
+    }
+    return completion;
+}
+
+auto Server::shard_drop(int id) -> Completion {
+    Completion completion;
+    auto record = catalogue.drop(id);
+    if (!record.has_value()) {
+        completion.frames.push_back(frame(make_request("error", "record not found")));
+        return completion;
+    }
+    // Its chunks and derived files go with the next startup's sweep
+    cache.invalidate(record->name());
+    store.remove_manifest("uploads/" + record->name());
+    SERVER_LOG << "已迁出记录：" << record->name() << "（" << id << "）";
+    completion.frames.push_back(frame(make_request("success")));
+    return completion;
+}
+
+// J O B S ////////////////////////////////////////////////////
+// job_submit → job_image per image → job_start; job_watch from then on. See Protocol.hpp.
+
+auto Server::begin_job(std::shared_ptr<Connection> connection, std::string name) -> Completion {
+    Completion completion;
+    name = std::filesystem::path(name).filename().string();
+    auto job = name.empty() ? std::nullopt : jobs.create(connection->user.username(), name);
+    if (!job.has_value()) {
+        completion.frames.push_back(frame(make_request("error", "cannot create job")));
+        return completion;
+    }
+    SERVER_LOG << "已创建重建任务 " << job->id << "：" << job->owner << "/" << job->name;
+    completion.frames.push_back(frame(make_request("job", std::to_string(job->id))));
+    return completion;
+}
+
+auto Server::begin_job_image(std::shared_ptr<Connection> connection, int id, std::string file,
+                             int64_t size) -> Completion {
+    Completion completion;
+    auto job = jobs.find(id);
+    if (!job.has_value() || job->owner != connection->user.username() || job->state != JobState::UPLOADING) {
+        completion.frames.push_back(frame(make_request("error", "no such job")));
+        return completion;
+    }
+    auto path = std::filesystem::path(file).filename();
+    auto extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == ".jpeg") {
+        // The pipeline only looks for .jpg
+        extension = ".jpg";
+    }
+    if (size <= 0 || (extension != ".jpg" && extension != ".png" && extension != ".bmp")) {
+        completion.frames.push_back(frame(make_request("error", "not an image")));
+        return completion;
+    }
+    auto images = jobs.directory(id) + "/images";
+    std::error_code error;
+    auto count = std::distance(std::filesystem::directory_iterator(images, error), {});
+    if (count >= JOB_IMAGES_MAX) {
+        completion.frames.push_back(frame(make_request("error", "too many images")));
+        return completion;
+    }
+    path.replace_extension(extension);
+    connection->image = std::make_unique<JobImageUpload>(images + "/" + path.string(), size);
+    if (!connection->image->good()) {
+        connection->image.reset();
+        completion.frames.push_back(frame(make_request("error", "failed to open file")));
+        return completion;
+    }
+    completion.expect = Expect::JOB_IMAGE_CHUNK;
+    completion.frames.push_back(frame(make_request("ready")));
+    return completion;
+}
+
+auto Server::job_image_chunk(std::shared_ptr<Connection> connection, std::string chunk) -> Completion {
+    Completion completion;
+    auto &image = connection->image;
+    if (!image->write(chunk)) {
+        image.reset();
+        completion.bail = "写入任务图片失败，正在关闭连接。";
+        return completion;
+    }
+    if (!image->finished()) {
+        return completion;
+    }
+    completion.expect = Expect::REQUEST;
+    auto committed = image->commit();
+    image.reset();
+    completion.frames.push_back(frame(committed ? make_request("success") : make_request("error", "failed to save file")));
+    return completion;
+}
+
+auto Server::start_job(std::shared_ptr<Connection> connection, int id) -> Completion {
+    Completion completion;
+    auto job = jobs.find(id);
+    std::error_code error;
+    auto count = std::distance(std::filesystem::directory_iterator(jobs.directory(id) + "/images", error), {});
+    // Structure from motion needs at least a pair of views
+    if (!job.has_value() || job->owner != connection->user.username() || count < 2 || !jobs.enqueue(id)) {
+        completion.frames.push_back(frame(make_request("error", "cannot start job")));
+        return completion;
+    }
+    SERVER_LOG << "重建任务 " << id << " 已排队，共 " << count << " 张图片";
+    completion.frames.push_back(frame(make_request("queued", std::to_string(id))));
+    return completion;
+}
+
+auto Server::watch_job(std::shared_ptr<Connection> connection, int id) -> void {
+    auto job = jobs.find(id);
+    if (!job.has_value() || job->owner != connection->user.username()) {
+        send(connection, make_request("error", "no such job"));
+        return;
+    }
+    // Updates come from the job workers; each one is applied on the loop like any completion.
+    // A tagged connection goes on taking requests, and the updates carry this one's tag
+    std::optional<uint32_t> tag;
+    if (connection->tagged) {
+        tag = connection->tag;
+    } else {
+        connection->busy = true;
+    }
+    jobs.watch(id, [this, connection, tag] (const Job &job) {
+        Completion completion;
+        completion.connection = connection;
+        completion.tag = tag;
+        completion.frames.push_back(frame(make_request("job", std::to_string(job.id),
+                                                       std::to_string((int) job.state),
+                                                       std::to_string(job.stage),
+                                                       std::to_string(job.progress),
+                                                       std::to_string(job.record))));
+        completion.keep_busy = !job.finished();
+        complete(std::move(completion));
+    });
+}
+
+auto Server::run_job(Job &job) -> bool {
+    auto directory = jobs.directory(job.id);
+    // Resolved now, since the child runs from the job's directory
+    auto executable = reconstructor.find('/') == std::string::npos ? reconstructor :
+        std::filesystem::absolute(reconstructor).string();
+    std::vector<std::string> args = { executable, "--reconstruct", "images", job.name };
+    args.insert(args.end(), reconstructor_args.begin(), reconstructor_args.end());
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+    auto descriptors = (int) sysconf(_SC_OPEN_MAX);
+
+    int output[2];
+    if (pipe(output) == -1) {
+        return false;
+    }
+    auto pid = fork();
+    if (pid == 0) {
+        // Only what's async-signal-safe until exec; don't leak client sockets into the child
+        dup2(output[1], STDOUT_FILENO);
+        for (auto fd = STDERR_FILENO + 1; fd < descriptors; fd++) {
+            close(fd);
+        }
+        if (chdir(directory.c_str()) == 0) {
+            execvp(argv[0], argv.data());
+        }
+        _exit(127);
+    }
+    close(output[1]);
+    if (pid == -1) {
+        close(output[0]);
+        SERVER_ERROR << "无法启动重建进程：" << strerror(errno);
+        return false;
+    }
+    // The reconstructor prints `stage <PipelineState> <progress>` whenever the stage changes
+    auto reader = fdopen(output[0], "r");
+    char line[512];
+    while (fgets(line, sizeof(line), reader)) {
+        int stage;
+        float progress;
+        if (sscanf(line, "stage %d %f", &stage, &progress) == 2) {
+            job.stage = stage;
+            job.progress = progress;
+            jobs.update(job);
+        }
+    }
+    fclose(reader);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    auto succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (succeeded) {
+        auto base = job.owner + "/" + job.name;
+        mkdir_if_not_exists("uploads/" + job.owner);
+        succeeded = ingest(directory + "/recons/" + job.name, "uploads/" + base);
+        auto record = succeeded ? publish_record(job.owner, base) : std::nullopt;
+        succeeded = record.has_value();
+        if (succeeded) {
+            job.record = record->id();
+            SERVER_LOG << "重建结果已发布为记录 " << job.record;
         }
+    } else {
+        SERVER_ERROR << "重建进程异常退出：" << status;
     }
+    // Images and pipeline products are large; only the job file is worth keeping
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(directory, error)) {
+        if (entry.path().filename() != "job") {
+            std::filesystem::remove_all(entry.path(), error);
+        }
+    }
+    return succeeded;
 }
 
-auto Server::mkdir_if_not_exists(std::filesystem::path path) -> void { 
+auto Server::mkdir_if_not_exists(std::filesystem::path path) -> void {
     if (!std::filesystem::exists(path)) {
         std::filesystem::create_directory(path);
     }
 }
-
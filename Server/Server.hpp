@@ -9,41 +9,380 @@
 #define Server_hpp
 
 #include <iostream>
+#include <map>
 #include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <chrono>
 #include <vector>
 #include <filesystem>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include "online.pb.h"
+#include "Protocol.hpp"
+#include "Reactor.hpp"
+#include "WorkerPool.hpp"
+#include "Transfer.hpp"
+#include "Catalogue.hpp"
+#include "Jobs.hpp"
+#include "Cache.hpp"
+#include "Compress.hpp"
+#include "Variants.hpp"
+#include "Progressive.hpp"
+#include "Artifacts.hpp"
+#include "Shards.hpp"
+#include "Limits.hpp"
+#include "Metrics.hpp"
+#include "Log.hpp"
 
 #define RECON_PORT 17290
+#define SERVER_QUEUE_CAPACITY 256
+#define SERVER_WRITE_WINDOW (2 * TRANSFER_CHUNK) // Queued bytes before a download stops reading ahead
+
+/// What the next complete frame on a connection is going to be.
+enum class Expect {
+    REQUEST = 0,
+    LOGIN_CREDENTIALS = 1,
+    REGISTER_CREDENTIALS = 2,
+    UPLOAD_BUFFER = 3,
+    UPLOAD_CHUNK = 4,
+    UPLOAD_CHECKED_CHUNK = 5,
+    UPLOAD_BLOB = 6,
+    JOB_IMAGE_CHUNK = 7
+};
+
+/// Which way a connection waits out a rate until the next tick.
+enum class Wait {
+    SEND = 0,
+    RECEIVE = 1,
+    REQUEST = 2
+};
+
+/// Per-socket state for the event loop. Frames are `int` length prefixed protobuf messages.
+/// While `busy`, a worker owns the session fields and the loop only buffers incoming bytes;
+/// `expect` stays the loop's, a worker's change to it coming back in its Completion.
+struct Connection {
+    int sock;
+    std::string address;
+
+    // F R A M I N G /////////////////////////////////
+    std::string in; // Received, not yet parsed
+    std::deque<Outgoing> out; // Framed, waiting for the socket
+    size_t out_offset = 0; // Into out.front()
+    size_t out_bytes = 0;
+    bool reading_paused = false; // `in` is full; resume once frames are consumed
+
+    // T A G S ///////////////////////////////////////
+    bool tagged = false; // Frames carry request tags, from the hello
+    uint32_t tag = 0; // Of the request being served
+    int64_t frame_left = 0; // Bytes of the outgoing frame not queued yet
+    std::deque<std::pair<uint32_t, std::string>> parked; // Other requests, waiting out a transfer
+    size_t parked_bytes = 0;
+    std::deque<std::pair<uint32_t, Outgoing>> held; // Frames of watches, waiting for frame_left to run out
+
+    // S E S S I O N /////////////////////////////////
+    Expect expect = Expect::REQUEST;
+    online::User user;
+    bool logged_in = false;
+    Codec codec = Codec::NONE; // Of checked chunks, from the hello
+    bool routed = false; // A shard router's link, wanting ROUTE_DONE after every request
+    bool serving = false; // A request came in and isn't done yet
+    bool shard_peer = false; // Gave the shard key, so may move records
+    bool busy = false;
+    bool closing = false; // Close once `out` drains
+
+    // T R A N S F E R S /////////////////////////////
+    std::unique_ptr<UploadStream> upload;
+    std::unique_ptr<ResumableUpload> resumable;
+    std::unique_ptr<ChunkedUpload> chunked;
+    std::optional<online::ReconRecord> adopting; // What the chunked upload is published as, for shard_import
+    std::unique_ptr<DownloadStream> download;
+    bool pumping = false; // A worker is reading the next download chunk
+
+    std::unique_ptr<JobImageUpload> image; // Of a reconstruction job's image set
+
+    // L I M I T S ///////////////////////////////////
+    std::string flow; // Whose share of the bandwidth it takes: its address, then its user
+    TokenBucket requests; // This connection's request rate
+    TokenBucket bytes_in;
+    TokenBucket bytes_out;
+    size_t reserved = 0; // Of the global budget, for the big frame coming in
+    bool waiting = false; // Queued for the next tick
+    bool wait_send = false;
+    bool wait_receive = false;
+    bool wait_request = false;
+
+    // M E T R I C S /////////////////////////////////
+    std::optional<MetricCommand> timing; // Request being timed, until the connection is idle again
+    std::chrono::steady_clock::time_point timing_since;
+    bool timing_failed = false; // An error reply went out
+};
+
+/// Result of a job run on the worker pool, handed back to the event loop.
+struct Completion {
+    std::shared_ptr<Connection> connection;
+    std::vector<Outgoing> frames;
+    std::string bail; // Non-empty: close the connection with this message
+    bool keep_busy = false; // A transfer carries on after this
+    bool chunk = false; // One download chunk from pump()
+    std::optional<uint32_t> tag; // Whole frames for a request left open beside the current one
+    std::optional<Expect> expect; // What the connection takes next; set on the loop, which reads it while busy
+};
 
 class Server {
 public:
-    Server() {}
-    
+    Server() : port(RECON_PORT), zero_copy(true), reconstructor("Reconing"), job_workers(1), metrics_port(0), compress_level(COMPRESS_LEVEL_DEFAULT),
+        ready(false), server_sock(-1), catalogue("uploads"), store("uploads/.store"), variants("uploads/.variants"),
+        progressive("uploads/.progressive"), artifacts("uploads/.artifacts"), jobs("uploads/.jobs") {}
+
     ~Server();
-    
+
     auto init() -> bool;
-    
+
     auto run() -> bool;
-    
+
     template<typename T>
-    auto receive(int sock) -> std::optional<T>;
-    
+    static auto frame(const T &what) -> std::string;
+
+    static auto frame_header(int size) -> std::string;
+
+    static auto frame_chunk(const std::string &bytes) -> std::string;
+
+    /// A chunk frame led by the CRC-32 of its bytes, for resumable transfers.
+    static auto frame_checked(const std::string &bytes) -> std::string;
+
+    int port;
+
+    // Non-empty: one shard of a routed deployment. New records get ids from their names, and
+    // links presenting this key may move records in and out; see Protocol.hpp
+    std::string shard_key;
+
+    bool zero_copy; // Send stored files with sendfile(2) rather than copying them through memory
+
+    // Jobs run `<reconstructor> --reconstruct images <name> <reconstructor_args>...` in their
+    // own directory, job_workers at a time
+    std::string reconstructor;
+    std::vector<std::string> reconstructor_args;
+    int job_workers;
+
+    PayloadCache cache; // Serialized `download` replies of popular records
+
+    int metrics_port; // Serves Prometheus text on 127.0.0.1 when non-zero
+
+    int compress_level; // Of compressed chunks and stored variants, 1 to COMPRESS_LEVEL_MAX
+
+    ServerLimits limits; // Frame sizes, buffered bytes, request rates and bandwidth
+
     template<typename T>
-    auto send(int sock, T what) -> bool;
-    
+    static auto parse(const std::string &payload) -> std::optional<T>;
+
 private:
     auto mkdir_if_not_exists(std::filesystem::path path) -> void;
 
-    std::set<int> sockets;
+    // E V E N T   L O O P ///////////////////////////
+    auto accept_all() -> void;
+
+    auto receive_all(std::shared_ptr<Connection> connection) -> void;
+
+    /// Whether more may be read off the socket now. Not once `in` holds whole frames up to the
+    /// connection's limit, nor while the frame coming in is bigger than it may be yet or waits
+    /// for room in the global budget.
+    auto receivable(std::shared_ptr<Connection> connection) -> bool;
+
+    /// The biggest frame the connection may send next, given what it's in the middle of.
+    auto frame_limit(std::shared_ptr<Connection> connection) -> size_t;
+
+    auto flush(std::shared_ptr<Connection> connection) -> void;
+
+    auto process(std::shared_ptr<Connection> connection) -> void;
+
+    auto close_connection(std::shared_ptr<Connection> connection, std::string why) -> void;
+
+    // L I M I T S ///////////////////////////////////
+    /// Bytes the connection may move now, at most `wanted`, under its own bandwidth and its flow's
+    /// fair share of the global one. 0 holds it until the next tick.
+    auto allow(std::shared_ptr<Connection> connection, Wait way, size_t wanted) -> size_t;
+
+    /// Charges what was moved of an allow(), and hands back the rest.
+    auto moved(std::shared_ptr<Connection> connection, Wait way, size_t allowed, size_t used) -> void;
+
+    /// Takes one from the connection's and the global request rate, or holds the connection.
+    auto admit(std::shared_ptr<Connection> connection) -> bool;
+
+    auto hold(std::shared_ptr<Connection> connection, Wait way) -> void;
+
+    /// Gives the frame's room in the global budget back once it's been taken off `in`.
+    auto unreserve(std::shared_ptr<Connection> connection) -> void;
+
+    /// Carries on whatever the connections held back were doing, once a tick has passed.
+    auto resume_waiting() -> void;
+
+    /// Once the connection is ready for the next request: records the timed one's latency, and
+    /// tells a router it's done.
+    auto settle(std::shared_ptr<Connection> connection) -> void;
+
+    auto gauges() -> MetricsGauges;
+
+    /// On a tagged connection, tags each frame as it starts with `tag`, or the current request's.
+    auto queue(std::shared_ptr<Connection> connection, Outgoing packet, std::optional<uint32_t> tag = {}) -> void;
+
+    /// Abandons unfinished transfers of a closed connection.
+    auto release(std::shared_ptr<Connection> connection) -> void;
+
+    template<typename T>
+    auto send(std::shared_ptr<Connection> connection, const T &what) -> void;
+
+    /// Runs `job` on the worker pool; its completion is applied on the loop thread.
+    /// Continuations of an accepted transfer bypass the queue bound.
+    auto offload(std::shared_ptr<Connection> connection, std::function<Completion()> job,
+                 bool continuation = false) -> void;
+
+    /// Keeps a streaming download fed while its queued bytes are under the write window.
+    auto pump(std::shared_ptr<Connection> connection) -> void;
+
+    auto complete(Completion completion) -> void;
+
+    auto apply_completions() -> void;
+
+    // H A N D L E R S ///////////////////////////////
+    auto handle(std::shared_ptr<Connection> connection, std::string payload) -> void;
+
+    auto handle_request(std::shared_ptr<Connection> connection, const online::Request &request) -> void;
+
+    /// `hello server [codec]... [tags]`: picks the first codec we know for the connection's chunks,
+    /// and tags frames from then on if asked to.
+    auto greet(std::shared_ptr<Connection> connection, const online::Request &request) -> void;
+
+    /// Checks and strips the CRC-32 of a checked chunk, unpacking it on a connection with a codec.
+    auto open_checked(std::shared_ptr<Connection> connection, std::string &payload) -> bool;
+
+    auto login(std::shared_ptr<Connection> connection, const online::User &credentials) -> void;
+
+    auto register_user(online::User user) -> Completion;
+
+    auto upload(std::shared_ptr<Connection> connection, std::string payload) -> Completion;
+
+    auto download(std::shared_ptr<Connection> connection, int id) -> Completion;
+
+    auto download_zero_copy(std::shared_ptr<Connection> connection, std::string name) -> Completion;
+
+    auto begin_upload_stream(std::shared_ptr<Connection> connection, std::string file_base,
+                             std::array<int64_t, TRANSFER_FILES> sizes) -> Completion;
+
+    auto upload_chunk(std::shared_ptr<Connection> connection, std::string chunk) -> Completion;
+
+    auto begin_download_stream(std::shared_ptr<Connection> connection, int id) -> Completion;
+
+    auto read_chunk(std::shared_ptr<Connection> connection) -> Completion;
+
+    auto begin_resumable_upload(std::shared_ptr<Connection> connection, std::string file_base,
+                                std::string hash, std::array<int64_t, TRANSFER_FILES> sizes) -> Completion;
+
+    auto checked_chunk(std::shared_ptr<Connection> connection, std::string payload) -> Completion;
+
+    auto finish_resumable_upload(std::shared_ptr<Connection> connection, Completion &completion) -> void;
+
+    auto begin_download_range(std::shared_ptr<Connection> connection, int id,
+                              int64_t offset, int64_t length) -> Completion;
+
+    /// The whole content of `stream` as download_range chunk frames in `codec`, for the cache;
+    /// null if the store can't be read.
+    auto frame_pieces(DownloadStream &stream, Codec codec) -> std::shared_ptr<const std::string>;
+
+    /// Sends a record's progressive levels; see Protocol.hpp.
+    auto begin_progressive(int id) -> Completion;
+
+    /// Lists the artifacts made for a record's current content.
+    auto list_artifacts(int id) -> Completion;
+
+    /// Sends one of a record's artifacts.
+    auto begin_artifact(int id, std::string artifact) -> Completion;
+
+    /// Makes a published record's progressive levels and artifacts, on an artifact worker.
+    auto make_artifacts(const std::string &name) -> void;
+
+    auto begin_chunked_upload(std::shared_ptr<Connection> connection, std::string file_base,
+                              Manifest manifest) -> Completion;
+
+    auto blob_chunk(std::shared_ptr<Connection> connection, std::string payload) -> Completion;
+
+    auto finish_chunked_upload(std::shared_ptr<Connection> connection, Completion &completion) -> void;
+
+    auto begin_job(std::shared_ptr<Connection> connection, std::string name) -> Completion;
+
+    auto begin_job_image(std::shared_ptr<Connection> connection, int id, std::string file, int64_t size) -> Completion;
+
+    auto job_image_chunk(std::shared_ptr<Connection> connection, std::string chunk) -> Completion;
+
+    auto start_job(std::shared_ptr<Connection> connection, int id) -> Completion;
+
+    /// A record's manifest, for the router to move it elsewhere.
+    auto shard_export(int id) -> Completion;
+
+    /// One stored chunk, checked, for a shard_import somewhere else.
+    auto shard_chunk(std::string hash) -> Completion;
+
+    /// Takes in a record moving here, keeping its id and owner, the way upload_chunks would.
+    auto begin_shard_import(std::shared_ptr<Connection> connection, online::ReconRecord record,
+                            Manifest manifest) -> Completion;
+
+    /// Lets go of a record that now lives on another shard.
+    auto shard_drop(int id) -> Completion;
+
+    /// Streams the job's progress until it finishes. The connection stays busy meanwhile, unless
+    /// it is tagged and the updates can go out beside other replies.
+    auto watch_job(std::shared_ptr<Connection> connection, int id) -> void;
+
+    /// Runs on a job worker: reconstructs in a child process, then stores and publishes the result.
+    auto run_job(Job &job) -> bool;
+
+    auto find_record_name(int id) -> std::string;
+
+    /// `hashes <id>...` → `hashes <sha256> <bytes>...` in the same order; empty and zero for ids
+    /// that have no record. Lets a client compare its copies without downloading anything.
+    auto record_hashes(std::vector<int> ids) -> Completion;
+
+    /// Adds or overwrites the record for a finished upload, dropping any cached copy. A new
+    /// record gets `id` when given. Empty if the catalogue couldn't log it.
+    auto publish_record(const std::string &username, const std::string &base,
+                        std::optional<int> id = {}) -> std::optional<online::ReconRecord>;
+
+    /// Moves records still stored as plain .obj/.mtl/.png files into the chunk store, then drops
+    /// chunks no record refers to any more.
+    auto migrate_store() -> void;
+
+    /// Cuts the .obj/.mtl/.png at `source` into the store as the record files at `base`.
+    auto ingest(const std::string &source, const std::string &base) -> bool;
+
     bool ready;
     int server_sock;
-    online::Users users;
-    online::ReconRecords records;
+    Reactor reactor;
+    WorkerPool pool;
+    std::map<int, std::shared_ptr<Connection>> connections;
+    std::mutex completions_mutex;
+    std::vector<Completion> completions;
+    Metrics metrics;
+    MetricsEndpoint metrics_endpoint;
+
+    // L I M I T S ///////////////////////////////////
+    TokenBucket requests; // Of all connections together
+    FairShare shares_in;
+    FairShare shares_out;
+    size_t reserved_bytes = 0; // Of big frames being received
+    std::deque<std::shared_ptr<Connection>> waiting; // Held by a rate, in the order they were
+
+    // D A T A ///////////////////////////////////////
+    std::mutex data_mutex; // Guards partials, shared by the loop and workers
+    Catalogue catalogue; // Users & records; locks internally
+    std::set<std::string> partials; // Resumable uploads some connection is appending to
+    Store store;
+    Variants variants; // Compressed copies of stored records, ready to send
+    ProgressiveMeshes progressive; // Coarse-to-fine levels of stored records' meshes
+    Artifacts artifacts; // LODs, textures and thumbnails of stored records, made in the background
+    JobQueue jobs;
 };
 
 #endif /* Server_hpp */
@@ -0,0 +1,89 @@
+//
+//  Shards.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Shards.hpp"
+#include <cstdlib>
+
+auto shard_hash(const std::string &key) -> uint64_t {
+    uint64_t hash = 14695981039346656037ull;
+    for (auto c : key) {
+        hash ^= (uint8_t) c;
+        hash *= 1099511628211ull;
+    }
+    // FNV alone leaves short keys clustered; one round of splitmix spreads them
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+auto shard_record_id(const std::string &name) -> int {
+    return (int) (shard_hash(name) % SHARD_ID_MAX) + 1;
+}
+
+auto shard_record_key(int id) -> uint64_t {
+    return shard_hash("record:" + std::to_string(id));
+}
+
+auto ShardNode::name() const -> std::string {
+    return host + ":" + std::to_string(port);
+}
+
+auto parse_shard_node(const std::string &text, ShardNode &node) -> bool {
+    auto colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    node.host = text.substr(0, colon);
+    node.port = std::atoi(text.c_str() + colon + 1);
+    return node.port > 0 && node.port < 65536;
+}
+
+auto ShardRing::add(const ShardNode &node) -> bool {
+    for (const auto &member : members) {
+        if (member.name() == node.name()) {
+            return false;
+        }
+    }
+    auto index = (int) members.size();
+    members.push_back(node);
+    for (auto i = 0; i < SHARD_VNODES; i++) {
+        // A collision keeps the earlier node's point; the ring just has one fewer
+        points.emplace(shard_hash(node.name() + "#" + std::to_string(i)), index);
+    }
+    return true;
+}
+
+auto ShardRing::nodes() const -> const std::vector<ShardNode> & {
+    return members;
+}
+
+auto ShardRing::owners(uint64_t key) const -> std::vector<int> {
+    std::vector<int> order;
+    std::vector<bool> seen(members.size(), false);
+    auto it = points.lower_bound(key);
+    for (size_t walked = 0; walked < points.size() && order.size() < members.size(); walked++, it++) {
+        if (it == points.end()) {
+            it = points.begin();
+        }
+        if (!seen[it->second]) {
+            seen[it->second] = true;
+            order.push_back(it->second);
+        }
+    }
+    return order;
+}
+
+auto ShardRing::owner(uint64_t key) const -> int {
+    auto it = points.lower_bound(key);
+    if (it == points.end()) {
+        it = points.begin();
+    }
+    return it == points.end() ? -1 : it->second;
+}
@@ -0,0 +1,58 @@
+//
+//  Shards.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Shards_hpp
+#define Shards_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#define SHARD_VNODES 64 // Points each node gets on the ring, so a new one takes a little from everyone
+#define SHARD_ID_MAX 0x7ffffffe // Ids stay in [1, SHARD_ID_MAX], clear of INT_MAX
+
+/// 64-bit FNV-1a, mixed so that keys differing in a digit land far apart on the ring.
+auto shard_hash(const std::string &key) -> uint64_t;
+
+/// The id a sharded catalogue gives a new record: a hash of `<owner>/<name>`, so whoever routes
+/// an upload knows where the record will live before it exists.
+auto shard_record_id(const std::string &name) -> int;
+
+/// Where a record with this id belongs on the ring.
+auto shard_record_key(int id) -> uint64_t;
+
+struct ShardNode {
+    auto name() const -> std::string;
+
+    std::string host;
+    int port = 0;
+};
+
+/// `host:port`.
+auto parse_shard_node(const std::string &text, ShardNode &node) -> bool;
+
+/// Consistent hashing of keys to storage nodes. Nodes are only ever added, so an index into
+/// nodes() stays valid, and adding one only moves the keys that now fall into its arcs.
+class ShardRing {
+public:
+    /// False if it's there already.
+    auto add(const ShardNode &node) -> bool;
+
+    auto nodes() const -> const std::vector<ShardNode> &;
+
+    /// Every node, in the order the key's successors on the ring meet them; the owner first.
+    auto owners(uint64_t key) const -> std::vector<int>;
+
+    auto owner(uint64_t key) const -> int;
+
+private:
+    std::vector<ShardNode> members;
+    std::map<uint64_t, int> points; // Ring position → index into members
+};
+
+#endif /* Shards_hpp */
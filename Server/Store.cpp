@@ -0,0 +1,186 @@
+//
+//  Store.cpp
+//  Server
+//
+//  Created by apple on 26/04/2021.
+//
+
+#include "Store.hpp"
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <filesystem>
+
+#define MANIFEST_MAGIC "recon-manifest 1"
+
+// S T O R E //////////////////////////////////////////////////
+
+auto Store::init() -> bool {
+    std::error_code error;
+    std::filesystem::create_directories(root, error);
+    return !error;
+}
+
+auto Store::chunk_path(const std::string &hash) const -> std::string {
+    return root + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+auto Store::has(const std::string &hash, int64_t length) const -> bool {
+    std::error_code error;
+    auto size = std::filesystem::file_size(chunk_path(hash), error);
+    return !error && (int64_t) size == length;
+}
+
+auto Store::temporary_path(const std::string &path) -> std::string {
+    static std::atomic<uint64_t> counter { 0 };
+    return path + ".tmp." + std::to_string(counter++);
+}
+
+auto Store::put(const std::string &hash, const std::string &bytes) -> bool {
+    if (has(hash, (int64_t) bytes.size())) {
+        return true;
+    }
+    auto path = chunk_path(hash);
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    // Racing writers of the same chunk write the same bytes; whichever rename lands last is fine
+    auto temporary = temporary_path(path);
+    std::ofstream writer(temporary, std::ios::binary);
+    writer.write(bytes.data(), bytes.size());
+    writer.close();
+    if (!writer.good()) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+}
+
+auto Store::content_hash(const Manifest &manifest) const -> std::string {
+    Sha256 digest;
+    std::string buffer;
+    for (const auto &entry : manifest.chunks) {
+        std::ifstream reader(chunk_path(entry.hash), std::ios::binary);
+        buffer.resize(entry.length);
+        reader.read(&buffer[0], entry.length);
+        if (reader.gcount() != entry.length) {
+            return "";
+        }
+        digest.update(buffer);
+    }
+    return digest.hex();
+}
+
+auto Store::read_manifest(const std::string &base) const -> std::optional<Manifest> {
+    std::ifstream reader(base + ".manifest");
+    std::string magic;
+    if (!reader.good() || !std::getline(reader, magic) || magic != MANIFEST_MAGIC) {
+        return {};
+    }
+    Manifest manifest;
+    reader >> manifest.hash;
+    for (auto &size : manifest.sizes) {
+        reader >> size;
+    }
+    if (!reader.good() || !is_hex_digest(manifest.hash)) {
+        return {};
+    }
+    int64_t total = 0;
+    ManifestEntry entry;
+    while (reader >> entry.hash >> entry.length) {
+        if (!is_hex_digest(entry.hash) || entry.length <= 0) {
+            return {};
+        }
+        total += entry.length;
+        manifest.chunks.push_back(entry);
+    }
+    if (total != manifest.total()) {
+        return {};
+    }
+    return manifest;
+}
+
+auto Store::write_manifest(const std::string &base, const Manifest &manifest) -> bool {
+    auto path = base + ".manifest";
+    auto temporary = temporary_path(path);
+    std::ofstream writer(temporary);
+    writer << MANIFEST_MAGIC << "\n" << manifest.hash << "\n";
+    writer << manifest.sizes[0] << " " << manifest.sizes[1] << " " << manifest.sizes[2] << "\n";
+    for (const auto &entry : manifest.chunks) {
+        writer << entry.hash << " " << entry.length << "\n";
+    }
+    writer.close();
+    std::error_code error;
+    if (!writer.good()) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    // Overwrites swap the whole record at once; downloads already running keep their chunks
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+}
+
+auto Store::remove_manifest(const std::string &base) -> bool {
+    std::error_code error;
+    return std::filesystem::remove(base + ".manifest", error) && !error;
+}
+
+auto Store::collect(const std::vector<Manifest> &live) -> int {
+    std::set<std::string> referenced;
+    for (const auto &manifest : live) {
+        for (const auto &entry : manifest.chunks) {
+            referenced.insert(entry.hash);
+        }
+    }
+    auto removed = 0;
+    std::error_code error;
+    std::vector<std::filesystem::path> garbage;
+    for (auto it = std::filesystem::recursive_directory_iterator(root, error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        if (it->is_regular_file() && referenced.count(it->path().filename().string()) == 0) {
+            // Unreferenced chunks, and temporaries from writes that never finished
+            garbage.push_back(it->path());
+        }
+    }
+    for (const auto &path : garbage) {
+        if (std::filesystem::remove(path, error)) {
+            removed++;
+        }
+    }
+    return removed;
+}
+
+// W R I T E R ////////////////////////////////////////////////
+
+auto StoreWriter::cut(const std::string &chunk) -> bool {
+    Sha256 chunk_digest;
+    chunk_digest.update(chunk);
+    auto hash = chunk_digest.hex();
+    if (!store.put(hash, chunk)) {
+        failed = true;
+        return false;
+    }
+    manifest.chunks.push_back({ hash, (int64_t) chunk.size() });
+    return true;
+}
+
+auto StoreWriter::write(const char *data, size_t size) -> bool {
+    if (failed) {
+        return false;
+    }
+    digest.update(data, size);
+    return chunker.feed(data, size, [this] (const std::string &chunk) {
+        return cut(chunk);
+    });
+}
+
+auto StoreWriter::finish() -> std::optional<Manifest> {
+    auto finished = !failed && chunker.finish([this] (const std::string &chunk) {
+        return cut(chunk);
+    });
+    if (!finished) {
+        return {};
+    }
+    manifest.hash = digest.hex();
+    return manifest;
+}
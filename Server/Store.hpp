@@ -0,0 +1,97 @@
+//
+//  Store.hpp
+//  Server
+//
+//  Created by apple on 26/04/2021.
+//
+
+#ifndef Store_hpp
+#define Store_hpp
+
+#include <string>
+#include <array>
+#include <vector>
+#include <optional>
+#include <cstdint>
+#include "Protocol.hpp"
+#include "Hash.hpp"
+
+struct ManifestEntry {
+    std::string hash;
+    int64_t length;
+};
+
+/// What a stored reconstruction is made of: its content hash, the sizes of the .obj/.mtl/.png
+/// and the chunks holding them back to back.
+struct Manifest {
+    auto total() const -> int64_t {
+        return sizes[0] + sizes[1] + sizes[2];
+    }
+
+    std::string hash;
+    std::array<int64_t, TRANSFER_FILES> sizes { 0 };
+    std::vector<ManifestEntry> chunks;
+};
+
+/// Content-addressed chunk store. Every unique chunk lives once, at <root>/<first two hex
+/// digits>/<sha256>, and a record is a manifest file next to where its files used to be. Both
+/// chunks and manifests are written to a temporary name and renamed into place, so readers see
+/// either the old version or the new one.
+class Store {
+public:
+    Store(std::string root) : root(root) {}
+
+    auto init() -> bool;
+
+    auto chunk_path(const std::string &hash) const -> std::string;
+
+    /// Whether the chunk is stored, with the right length.
+    auto has(const std::string &hash, int64_t length) const -> bool;
+
+    /// Stores a chunk under its hash, unless an identical one is already there.
+    auto put(const std::string &hash, const std::string &bytes) -> bool;
+
+    /// Re-hashes the content a manifest points at.
+    auto content_hash(const Manifest &manifest) const -> std::string;
+
+    /// `base` is the record path without extension, e.g. uploads/bob/model.
+    auto read_manifest(const std::string &base) const -> std::optional<Manifest>;
+
+    auto write_manifest(const std::string &base, const Manifest &manifest) -> bool;
+
+    /// Takes the record away; its chunks stay until the next collect().
+    auto remove_manifest(const std::string &base) -> bool;
+
+    /// Deletes chunks none of the manifests refer to. Only safe while nothing is uploading.
+    auto collect(const std::vector<Manifest> &live) -> int;
+
+    std::string root;
+
+private:
+    auto temporary_path(const std::string &path) -> std::string;
+};
+
+/// Cuts bytes into the store as they arrive, so memory stays at one chunk, and builds up the
+/// manifest for them.
+class StoreWriter {
+public:
+    StoreWriter(Store &store, std::array<int64_t, TRANSFER_FILES> sizes) : store(store), failed(false) {
+        manifest.sizes = sizes;
+    }
+
+    auto write(const char *data, size_t size) -> bool;
+
+    /// Stores the last chunk and seals the manifest with the content hash.
+    auto finish() -> std::optional<Manifest>;
+
+private:
+    auto cut(const std::string &chunk) -> bool;
+
+    Store &store;
+    Chunker chunker;
+    Sha256 digest;
+    Manifest manifest;
+    bool failed;
+};
+
+#endif /* Store_hpp */
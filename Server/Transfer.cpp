@@ -0,0 +1,322 @@
+//
+//  Transfer.cpp
+//  Server
+//
+//  Created by apple on 25/04/2021.
+//
+
+#include "Transfer.hpp"
+#include <filesystem>
+#include <algorithm>
+#include <set>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+// U P L O A D ////////////////////////////////////////////////
+
+auto UploadStream::write(const std::string &chunk) -> bool {
+    if (received + (int64_t) chunk.size() > total) {
+        return false;
+    }
+    received += chunk.size();
+    return writer.write(chunk.data(), chunk.size());
+}
+
+auto UploadStream::finished() const -> bool {
+    return received == total;
+}
+
+auto UploadStream::commit() -> bool {
+    if (!finished()) {
+        return false;
+    }
+    auto manifest = writer.finish();
+    return manifest.has_value() && store.write_manifest(base, *manifest);
+}
+
+// R E S U M A B L E //////////////////////////////////////////
+
+auto ResumableUpload::open() -> bool {
+    std::error_code error;
+    auto existing = std::filesystem::exists(partial, error) ? (int64_t) std::filesystem::file_size(partial, error) : 0;
+    if (error || existing > total()) {
+        existing = 0;
+    }
+    // Whatever is there was checked chunk by chunk on the way in; feed it back to the digest
+    std::ifstream reader(partial, std::ios::binary);
+    std::vector<char> buffer(TRANSFER_CHUNK);
+    offset = 0;
+    while (offset < existing && reader.good()) {
+        auto take = (size_t) std::min<int64_t>(existing - offset, TRANSFER_CHUNK);
+        reader.read(buffer.data(), take);
+        if (reader.gcount() != (std::streamsize) take) {
+            break;
+        }
+        digest.update(buffer.data(), take);
+        offset += take;
+    }
+    reader.close();
+    // Drop a torn tail, if any, so the file ends exactly at `offset`
+    std::filesystem::resize_file(partial, offset, error);
+    writer.open(partial, std::ios::binary | std::ios::app);
+    return writer.good();
+}
+
+auto ResumableUpload::write(const std::string &chunk) -> bool {
+    if (offset + (int64_t) chunk.size() > total()) {
+        return false;
+    }
+    writer.write(chunk.data(), chunk.size());
+    writer.flush();
+    if (!writer.good()) {
+        return false;
+    }
+    digest.update(chunk);
+    offset += chunk.size();
+    return true;
+}
+
+auto ResumableUpload::finished() const -> bool {
+    return offset == total();
+}
+
+auto ResumableUpload::verified() const -> bool {
+    return finished() && digest.hex() == hash;
+}
+
+auto ResumableUpload::commit() -> bool {
+    if (!verified()) {
+        return false;
+    }
+    writer.close();
+    UploadStream stream(store, base, sizes);
+    std::ifstream reader(partial, std::ios::binary);
+    if (!reader.good()) {
+        return false;
+    }
+    std::string chunk;
+    int64_t copied = 0;
+    while (copied < total()) {
+        auto take = (size_t) std::min<int64_t>(total() - copied, TRANSFER_CHUNK);
+        chunk.resize(take);
+        reader.read(&chunk[0], take);
+        if (reader.gcount() != (std::streamsize) take || !stream.write(chunk)) {
+            return false;
+        }
+        copied += take;
+    }
+    if (!stream.commit()) {
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::remove(partial, error);
+    return true;
+}
+
+auto ResumableUpload::discard() -> void {
+    if (writer.is_open()) {
+        writer.close();
+    }
+    std::error_code error;
+    std::filesystem::remove(partial, error);
+}
+
+auto ResumableUpload::total() const -> int64_t {
+    return sizes[0] + sizes[1] + sizes[2];
+}
+
+// D E D U P L I C A T E D ////////////////////////////////////
+
+auto ChunkedUpload::missing() -> std::vector<std::string> {
+    std::vector<std::string> hashes;
+    std::set<std::string> seen;
+    wanted.clear();
+    for (const auto &entry : manifest.chunks) {
+        if (seen.insert(entry.hash).second && !store.has(entry.hash, entry.length)) {
+            wanted.push_back(entry);
+            hashes.push_back(entry.hash);
+        }
+    }
+    return hashes;
+}
+
+auto ChunkedUpload::write(const std::string &chunk) -> bool {
+    if (wanted.empty() || (int64_t) chunk.size() != wanted.front().length) {
+        return false;
+    }
+    Sha256 digest;
+    digest.update(chunk);
+    if (digest.hex() != wanted.front().hash || !store.put(wanted.front().hash, chunk)) {
+        return false;
+    }
+    wanted.pop_front();
+    return true;
+}
+
+auto ChunkedUpload::finished() const -> bool {
+    return wanted.empty();
+}
+
+auto ChunkedUpload::verified() const -> bool {
+    return finished() && store.content_hash(manifest) == manifest.hash;
+}
+
+auto ChunkedUpload::commit() -> bool {
+    return store.write_manifest(base, manifest);
+}
+
+// D O W N L O A D ////////////////////////////////////////////
+
+FileHandle::~FileHandle() {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+auto DownloadStream::open() -> bool {
+    auto manifest = store.read_manifest(base);
+    if (!manifest.has_value()) {
+        return false;
+    }
+    hash = manifest->hash;
+    sizes = manifest->sizes;
+    chunks = std::move(manifest->chunks);
+    seek(0, total());
+    return true;
+}
+
+auto DownloadStream::seek(int64_t offset, int64_t length) -> void {
+    current = 0;
+    sent = offset;
+    remaining = length;
+    current_file.reset();
+    while (current < chunks.size() && sent >= chunks[current].length) {
+        sent -= chunks[current].length;
+        current++;
+    }
+}
+
+auto DownloadStream::file() -> std::shared_ptr<FileHandle> {
+    if (!current_file) {
+        auto fd = ::open(store.chunk_path(chunks[current].hash).c_str(), O_RDONLY);
+        if (fd == -1) {
+            return nullptr;
+        }
+        current_file = std::make_shared<FileHandle>(fd);
+    }
+    return current_file;
+}
+
+auto DownloadStream::advance(int64_t bytes) -> void {
+    sent += bytes;
+    remaining -= bytes;
+    if (sent == chunks[current].length) {
+        // Queued ranges hold their own reference; the descriptor closes once they're sent
+        current++;
+        sent = 0;
+        current_file.reset();
+    }
+}
+
+auto DownloadStream::read(std::string &chunk) -> bool {
+    auto size = (size_t) std::min<int64_t>(remaining, TRANSFER_CHUNK);
+    chunk.resize(size);
+    size_t filled = 0;
+    while (filled < size && current < chunks.size()) {
+        auto handle = file();
+        if (!handle) {
+            return false;
+        }
+        auto take = (size_t) std::min<int64_t>(chunks[current].length - sent, size - filled);
+        auto got = pread(handle->fd, &chunk[filled], take, sent);
+        if (got <= 0) {
+            // A damaged store; the sizes we announced are wrong now
+            return false;
+        }
+        filled += got;
+        advance(got);
+    }
+    chunk.resize(filled);
+    return true;
+}
+
+auto DownloadStream::read_file(int file, std::string &out) -> bool {
+    int64_t offset = 0;
+    for (auto i = 0; i < file; i++) {
+        offset += sizes[i];
+    }
+    seek(offset, sizes[file]);
+    out.clear();
+    out.reserve(sizes[file]);
+    std::string chunk;
+    while (!finished()) {
+        if (!read(chunk) || chunk.empty()) {
+            return false;
+        }
+        out += chunk;
+    }
+    return true;
+}
+
+auto DownloadStream::ranges(int64_t max, std::vector<Outgoing> &items) -> int64_t {
+    int64_t total = 0;
+    max = std::min(max, remaining);
+    while (total < max && current < chunks.size()) {
+        auto handle = file();
+        if (!handle) {
+            return -1;
+        }
+        struct stat info;
+        if (fstat(handle->fd, &info) == -1 || info.st_size < chunks[current].length) {
+            // A damaged store; sendfile would stop short of the frame we announce
+            return -1;
+        }
+        auto take = std::min<int64_t>(chunks[current].length - sent, max - total);
+        items.emplace_back(handle, sent, take);
+        total += take;
+        advance(take);
+    }
+    return total;
+}
+
+auto DownloadStream::finished() const -> bool {
+    return current >= chunks.size() || remaining <= 0;
+}
+
+auto DownloadStream::total() const -> int64_t {
+    return sizes[0] + sizes[1] + sizes[2];
+}
+
+// Z E R O   C O P Y //////////////////////////////////////////
+
+auto send_file(int sock, int fd, int64_t offset, size_t count) -> ssize_t {
+#if defined(__linux__)
+    off_t position = (off_t) offset;
+    return sendfile(sock, fd, &position, count);
+#else
+    // macOS reports partial progress through `length`, even when failing with EAGAIN
+    off_t length = (off_t) count;
+    auto result = sendfile(fd, sock, (off_t) offset, &length, nullptr, 0);
+    if (result == -1 && length == 0) {
+        return -1;
+    }
+    return (ssize_t) length;
+#endif
+}
+
+auto encode_varint(uint64_t value) -> std::string {
+    std::string bytes;
+    while (value >= 0x80) {
+        bytes.push_back((char) ((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back((char) value);
+    return bytes;
+}
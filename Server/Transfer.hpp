@@ -0,0 +1,216 @@
+//
+//  Transfer.hpp
+//  Server
+//
+//  Created by apple on 25/04/2021.
+//
+
+#ifndef Transfer_hpp
+#define Transfer_hpp
+
+#include <string>
+#include <array>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <sys/types.h>
+#include "Protocol.hpp"
+#include "Hash.hpp"
+#include "Store.hpp"
+
+/// Owns a descriptor, so queued file ranges keep it open after the stream has moved on.
+struct FileHandle {
+    FileHandle(int fd) : fd(fd) {}
+
+    FileHandle(const FileHandle &) = delete;
+
+    ~FileHandle();
+
+    int fd;
+};
+
+/// Bytes waiting for a socket: either in memory, possibly shared with the download cache, or a
+/// range of an open file which goes out with sendfile(2) straight from the page cache. In memory,
+/// the first `offset` bytes are skipped.
+struct Outgoing {
+    Outgoing(std::string bytes) : bytes(std::move(bytes)) {}
+
+    Outgoing(std::shared_ptr<const std::string> shared) : shared(std::move(shared)) {}
+
+    /// `length` bytes of `shared` from `offset`, such as one frame of a cached download.
+    Outgoing(std::shared_ptr<const std::string> shared, int64_t offset, int64_t length) :
+        shared(std::move(shared)), offset(offset), end(offset + length) {}
+
+    Outgoing(std::shared_ptr<FileHandle> file, int64_t offset, int64_t length) :
+        fd(file->fd), offset(offset), length(length), file(std::move(file)) {}
+
+    auto size() const -> size_t {
+        if (fd != -1) {
+            return (size_t) length;
+        }
+        return (end >= 0 ? (size_t) end : shared ? shared->size() : bytes.size()) - (size_t) offset;
+    }
+
+    /// In-memory bytes only.
+    auto data() const -> const char * {
+        return (shared ? shared->data() : bytes.data()) + offset;
+    }
+
+    std::string bytes;
+    std::shared_ptr<const std::string> shared;
+    int fd = -1;
+    int64_t offset = 0;
+    int64_t length = 0;
+    int64_t end = -1; // Of a slice of `shared`; otherwise it goes to the end
+    std::shared_ptr<FileHandle> file;
+};
+
+/// Non-blocking sendfile(2), papering over the Linux / macOS signatures. Returns the bytes
+/// sent, or -1 with errno set.
+auto send_file(int sock, int fd, int64_t offset, size_t count) -> ssize_t;
+
+auto encode_varint(uint64_t value) -> std::string;
+
+/// Receives an upload chunk by chunk straight into the store, so memory stays at one chunk and
+/// an interrupted upload never clobbers the previous version.
+class UploadStream {
+public:
+    UploadStream(Store &store, std::string base, std::array<int64_t, TRANSFER_FILES> sizes) :
+        base(base), store(store), writer(store, sizes), received(0),
+        total(sizes[0] + sizes[1] + sizes[2]) {}
+
+    /// Appends the next bytes of the concatenated files. Fails on I/O errors or overflow.
+    auto write(const std::string &chunk) -> bool;
+
+    auto finished() const -> bool;
+
+    /// Swaps in the manifest of what arrived.
+    auto commit() -> bool;
+
+    std::string base; // Path without extension
+
+private:
+    Store &store;
+    StoreWriter writer;
+    int64_t received;
+    int64_t total;
+};
+
+/// An upload keyed by the SHA-256 of its content. Verified chunks are appended to a partial
+/// file that outlives the connection, so a client that drops can carry on from `offset`.
+class ResumableUpload {
+public:
+    ResumableUpload(Store &store, std::string base, std::string partial, std::string hash,
+                    std::array<int64_t, TRANSFER_FILES> sizes) :
+        base(base), partial(partial), hash(hash), offset(0), store(store), sizes(sizes) {}
+
+    /// Picks up whatever an earlier connection left in the partial file, rehashing it.
+    auto open() -> bool;
+
+    /// Appends the next verified bytes. Fails on I/O errors or overflow.
+    auto write(const std::string &chunk) -> bool;
+
+    auto finished() const -> bool;
+
+    /// Whether what arrived hashes to what the client promised.
+    auto verified() const -> bool;
+
+    /// Moves the partial file into the store, then removes it.
+    auto commit() -> bool;
+
+    /// Throws away the partial file, e.g. once it turned out not to match its hash.
+    auto discard() -> void;
+
+    auto total() const -> int64_t;
+
+    std::string base; // Path without extension
+    std::string partial;
+    std::string hash;
+    int64_t offset; // Bytes safely in the partial file
+
+private:
+    Store &store;
+    std::array<int64_t, TRANSFER_FILES> sizes;
+    Sha256 digest;
+    std::ofstream writer;
+};
+
+/// An upload that only carries the chunks the store lacks. The client cuts its files the same
+/// way the store does and sends the manifest first; only the missing chunks follow.
+class ChunkedUpload {
+public:
+    ChunkedUpload(Store &store, std::string base, Manifest manifest) :
+        base(base), manifest(std::move(manifest)), store(store) {}
+
+    /// Hashes the store doesn't have yet, each once, in the order they have to arrive.
+    auto missing() -> std::vector<std::string>;
+
+    /// Takes the next missing chunk, checking it against its hash.
+    auto write(const std::string &chunk) -> bool;
+
+    auto finished() const -> bool;
+
+    /// Re-hashes the assembled content, so a record never points at something else than
+    /// the client meant.
+    auto verified() const -> bool;
+
+    auto commit() -> bool;
+
+    std::string base; // Path without extension
+    Manifest manifest;
+
+private:
+    Store &store;
+    std::deque<ManifestEntry> wanted;
+};
+
+/// Reads a stored reconstruction back out of the chunk store, either copied one chunk at a time
+/// or as file ranges for sendfile. The manifest is read once at open and chunks never change,
+/// so a concurrent overwrite can't change what we send.
+class DownloadStream {
+public:
+    DownloadStream(Store &store, std::string base) : base(base), sizes { 0 }, checked(false),
+        store(store), current(0), sent(0), remaining(0) {}
+
+    /// Reads the manifest.
+    auto open() -> bool;
+
+    /// Limits the stream to `length` bytes of the concatenated files, starting at `offset`.
+    auto seek(int64_t offset, int64_t length) -> void;
+
+    /// Copies the next chunk into memory.
+    auto read(std::string &chunk) -> bool;
+
+    /// Reads all of one of the files into memory, by its place in TRANSFER_EXTENSIONS.
+    auto read_file(int file, std::string &out) -> bool;
+
+    /// Appends ranges covering the next `max` bytes (or whatever is left). Returns their total,
+    /// or -1 when a chunk can't be opened or is shorter than the manifest says.
+    auto ranges(int64_t max, std::vector<Outgoing> &items) -> int64_t;
+
+    auto finished() const -> bool;
+
+    auto total() const -> int64_t;
+
+    std::string base;
+    std::string hash; // Of the whole content
+    std::array<int64_t, TRANSFER_FILES> sizes;
+    bool checked; // Chunks carry a CRC-32, so they are always copied, never sendfile'd
+
+private:
+    /// The current chunk's descriptor, opened on first use.
+    auto file() -> std::shared_ptr<FileHandle>;
+
+    auto advance(int64_t bytes) -> void;
+
+    Store &store;
+    std::vector<ManifestEntry> chunks;
+    std::shared_ptr<FileHandle> current_file;
+    size_t current;
+    int64_t sent; // Of the current chunk
+    int64_t remaining; // Until the end of the requested range
+};
+
+#endif /* Transfer_hpp */
@@ -0,0 +1,112 @@
+//
+//  Variants.cpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#include "Variants.hpp"
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+
+auto Variants::init() -> bool {
+    std::error_code error;
+    std::filesystem::create_directories(root, error);
+    return !error;
+}
+
+auto Variants::path(const std::string &hash) const -> std::string {
+    return root + "/" + hash + ".lz4";
+}
+
+auto Variants::build(Store &store, const std::string &base, int level) -> bool {
+    DownloadStream stream(store, base);
+    if (!stream.open()) {
+        return false;
+    }
+    auto target = path(stream.hash);
+    std::error_code error;
+    if (std::filesystem::exists(target, error)) {
+        return true;
+    }
+    auto total = stream.total();
+    auto count = (uint32_t) ((total + TRANSFER_CHUNK - 1) / TRANSFER_CHUNK);
+    std::vector<int64_t> offsets;
+    auto header = (int64_t) (sizeof(VARIANT_MAGIC) - 1 + sizeof(count) + (count + 1) * sizeof(int64_t));
+    offsets.push_back(header);
+
+    // Workers racing to build the same variant write the same bytes; the last rename wins
+    static std::atomic<uint64_t> counter { 0 };
+    auto temporary = target + ".tmp." + std::to_string(counter++);
+    std::ofstream writer(temporary, std::ios::binary);
+    writer.seekp(header);
+    stream.seek(0, total);
+    std::string chunk;
+    while (!stream.finished() && writer.good()) {
+        if (!stream.read(chunk)) {
+            writer.setstate(std::ios::failbit);
+            break;
+        }
+        auto packed = pack_chunk(chunk.data(), chunk.size(), Codec::LZ4, level);
+        writer.write(packed.data(), packed.size());
+        offsets.push_back(offsets.back() + (int64_t) packed.size());
+    }
+    writer.seekp(0);
+    writer.write(VARIANT_MAGIC, sizeof(VARIANT_MAGIC) - 1);
+    writer.write((const char *) &count, sizeof(count));
+    writer.write((const char *) offsets.data(), offsets.size() * sizeof(int64_t));
+    writer.close();
+    if (!writer.good() || offsets.size() != count + 1) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    std::filesystem::rename(temporary, target, error);
+    return !error;
+}
+
+auto Variants::open(const std::string &hash, std::vector<int64_t> &offsets) const -> std::shared_ptr<FileHandle> {
+    auto fd = ::open(path(hash).c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    auto file = std::make_shared<FileHandle>(fd);
+    char magic[sizeof(VARIANT_MAGIC) - 1];
+    uint32_t count = 0;
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || std::memcmp(magic, VARIANT_MAGIC, sizeof(magic)) != 0 ||
+        pread(fd, &count, sizeof(count), sizeof(magic)) != sizeof(count)) {
+        return nullptr;
+    }
+    offsets.resize(count + 1);
+    auto bytes = (ssize_t) (offsets.size() * sizeof(int64_t));
+    if (pread(fd, offsets.data(), bytes, sizeof(magic) + sizeof(count)) != bytes) {
+        return nullptr;
+    }
+    return file;
+}
+
+auto Variants::collect(const std::vector<Manifest> &live) -> int {
+    std::set<std::string> referenced;
+    for (const auto &manifest : live) {
+        referenced.insert(path(manifest.hash));
+    }
+    auto removed = 0;
+    std::error_code error;
+    std::vector<std::filesystem::path> garbage;
+    for (const auto &entry : std::filesystem::directory_iterator(root, error)) {
+        if (referenced.count(entry.path().string()) == 0) {
+            // Overwritten content, and temporaries of builds that never finished
+            garbage.push_back(entry.path());
+        }
+    }
+    for (const auto &path : garbage) {
+        if (std::filesystem::remove(path, error)) {
+            removed++;
+        }
+    }
+    return removed;
+}
@@ -0,0 +1,46 @@
+//
+//  Variants.hpp
+//  Server
+//
+//  Created by apple on 28/04/2021.
+//
+
+#ifndef Variants_hpp
+#define Variants_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "Store.hpp"
+#include "Transfer.hpp"
+#include "Compress.hpp"
+
+#define VARIANT_MAGIC "RLZ4"
+
+/// Pre-compressed copies of stored records, one file per content hash at <root>/<hash>.lz4.
+/// The content is cut every TRANSFER_CHUNK bytes and each piece is packed exactly the way a
+/// compressed download sends it, so those downloads go out with sendfile and no compression
+/// work at all. A file is "RLZ4", a uint32_t piece count, count + 1 int64_t file offsets of
+/// the pieces, then the pieces.
+class Variants {
+public:
+    Variants(std::string root) : root(root) {}
+
+    auto init() -> bool;
+
+    auto path(const std::string &hash) const -> std::string;
+
+    /// Packs the record at `base` at `level`, unless its content already has a variant.
+    auto build(Store &store, const std::string &base, int level) -> bool;
+
+    /// The variant of `hash` with the offsets of its pieces, or nullptr if there is none.
+    auto open(const std::string &hash, std::vector<int64_t> &offsets) const -> std::shared_ptr<FileHandle>;
+
+    /// Deletes variants of content no record has any more.
+    auto collect(const std::vector<Manifest> &live) -> int;
+
+    std::string root;
+};
+
+#endif /* Variants_hpp */
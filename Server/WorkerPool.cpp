@@ -0,0 +1,71 @@
+//
+//  WorkerPool.cpp
+//  Server
+//
+//  Created by apple on 24/04/2021.
+//
+
+#include "WorkerPool.hpp"
+
+auto WorkerPool::start(int threads, size_t capacity) -> void {
+    this->capacity = capacity;
+    stopping = false;
+    for (auto i = 0; i < threads; i++) {
+        this->threads.emplace_back([this] () {
+            work();
+        });
+    }
+}
+
+auto WorkerPool::submit(std::function<void()> job, bool bounded) -> bool {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || (bounded && jobs.size() >= capacity)) {
+            return false;
+        }
+        jobs.push_back(std::move(job));
+    }
+    condition.notify_one();
+    return true;
+}
+
+auto WorkerPool::queued() -> int {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int) jobs.size();
+}
+
+auto WorkerPool::work() -> void {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] () {
+                return stopping || !jobs.empty();
+            });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+auto WorkerPool::stop() -> void {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+WorkerPool::~WorkerPool() {
+    if (!threads.empty()) {
+        stop();
+    }
+}
@@ -0,0 +1,47 @@
+//
+//  WorkerPool.hpp
+//  Server
+//
+//  Created by apple on 24/04/2021.
+//
+
+#ifndef WorkerPool_hpp
+#define WorkerPool_hpp
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/// A fixed number of threads draining a bounded job queue. The event loop hands disk-heavy
+/// requests over here so it never blocks on them.
+class WorkerPool {
+public:
+    WorkerPool() : capacity(0), stopping(false) {}
+
+    ~WorkerPool();
+
+    auto start(int threads, size_t capacity) -> void;
+
+    /// Returns false without queueing if the queue is full; the caller should push back.
+    /// Unbounded jobs are always queued.
+    auto submit(std::function<void()> job, bool bounded = true) -> bool;
+
+    auto queued() -> int;
+
+    auto stop() -> void;
+
+private:
+    auto work() -> void;
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t capacity;
+    bool stopping;
+};
+
+#endif /* WorkerPool_hpp */
@@ -6,11 +6,83 @@
 //
 
 #include <iostream>
+#include <algorithm>
+#include <filesystem>
 #include "Server.hpp"
+#include "Load.hpp"
+#include "Router.hpp"
 
 
 int main(int argc, const char * argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--load") {
+        LoadOptions options;
+        if (!LoadGenerator::parse_options(argc, argv, options)) {
+            return 1;
+        }
+        return LoadGenerator(options).run();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--router") {
+        RouterOptions options;
+        if (!Router::parse_options(argc, argv, options)) {
+            return 1;
+        }
+        return Router(options).run();
+    }
     Server server;
+    for (auto i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto has_value = i + 1 < argc;
+        if (arg == "--port" && has_value) {
+            server.port = std::atoi(argv[++i]);
+        } else if (arg == "--data" && has_value) {
+            // Everything lives under the working directory, so several servers can share a host
+            std::error_code error;
+            std::filesystem::create_directories(argv[++i], error);
+            std::filesystem::current_path(argv[i], error);
+            if (error) {
+                std::cerr << "无法进入数据目录：" << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--shard" && has_value) {
+            server.shard_key = argv[++i];
+        } else if (arg == "--no-sendfile") {
+            server.zero_copy = false;
+        } else if (arg == "--reconstructor" && has_value) {
+            server.reconstructor = argv[++i];
+        } else if (arg == "--cache-mb" && has_value) {
+            server.cache.resize(std::atoll(argv[++i]) << 20);
+        } else if (arg == "--compress-level" && has_value) {
+            server.compress_level = std::clamp(std::atoi(argv[++i]), 1, COMPRESS_LEVEL_MAX);
+        } else if (arg == "--request-kb" && has_value) {
+            server.limits.request_bytes = std::max(1ll, std::atoll(argv[++i])) << 10;
+        } else if (arg == "--message-mb" && has_value) {
+            server.limits.message_bytes = std::max(1ll, std::atoll(argv[++i])) << 20;
+        } else if (arg == "--connection-buffer-mb" && has_value) {
+            server.limits.connection_bytes = std::max(1ll, std::atoll(argv[++i])) << 20;
+        } else if (arg == "--global-buffer-mb" && has_value) {
+            server.limits.global_bytes = std::max(1ll, std::atoll(argv[++i])) << 20;
+        } else if (arg == "--pending-requests" && has_value) {
+            server.limits.pending_requests = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--request-rate" && has_value) {
+            // Requests a second; 0, the default, for no limit
+            server.limits.request_rate = std::atof(argv[++i]);
+        } else if (arg == "--global-request-rate" && has_value) {
+            server.limits.global_request_rate = std::atof(argv[++i]);
+        } else if (arg == "--bandwidth-mb" && has_value) {
+            // MB a second each way; the global one is shared evenly by the users moving bytes
+            server.limits.bandwidth = std::atof(argv[++i]) * (1 << 20);
+        } else if (arg == "--global-bandwidth-mb" && has_value) {
+            server.limits.global_bandwidth = std::atof(argv[++i]) * (1 << 20);
+        } else if (arg == "--metrics-port" && has_value) {
+            server.metrics_port = std::atoi(argv[++i]);
+        } else if (arg == "--job-workers" && has_value) {
+            server.job_workers = std::atoi(argv[++i]);
+        } else if ((arg == "--mvg" || arg == "--mvs") && has_value) {
+            // Handed through to the reconstructor
+            server.reconstructor_args.push_back(arg);
+            server.reconstructor_args.push_back(argv[++i]);
+        }
+    }
     server.init();
     server.run();
     return 0;
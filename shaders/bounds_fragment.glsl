@@ -0,0 +1,8 @@
+#version 330 core
+
+out vec4 color;
+
+void main() {
+    // Only the depth test matters; color writes are masked off
+    color = vec4(1.0);
+}
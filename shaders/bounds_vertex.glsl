@@ -0,0 +1,11 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 mvp;
+uniform vec3 box_min;
+uniform vec3 box_max;
+
+void main() {
+    gl_Position = mvp * vec4(mix(box_min, box_max, aPos), 1.0);
+}
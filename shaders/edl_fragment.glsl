@@ -0,0 +1,41 @@
+#version 330 core
+
+uniform sampler2D color_tex;
+uniform sampler2D depth_tex;
+uniform vec2 screen_size;
+uniform float strength;
+uniform float radius;
+uniform float near;
+uniform float far;
+
+out vec4 color;
+
+float log_depth(float depth) {
+    float z = depth * 2.0 - 1.0;
+    return log2((2.0 * near * far) / (far + near - z * (far - near)));
+}
+
+void main() {
+    vec2 uv = gl_FragCoord.xy / screen_size;
+    float depth = texture(depth_tex, uv).r;
+    if (depth >= 1.0) {
+        discard;
+    }
+    float center = log_depth(depth);
+    
+    // Eye-dome lighting: darken pixels which are further away than their neighbours
+    vec2 offsets[8] = vec2[](vec2(1.0, 0.0), vec2(0.7071, 0.7071), vec2(0.0, 1.0), vec2(-0.7071, 0.7071),
+                             vec2(-1.0, 0.0), vec2(-0.7071, -0.7071), vec2(0.0, -1.0), vec2(0.7071, -0.7071));
+    float response = 0.0;
+    for (int i = 0; i < 8; i++) {
+        float neighbour = texture(depth_tex, uv + offsets[i] * radius / screen_size).r;
+        if (neighbour < 1.0) {
+            response += max(0.0, center - log_depth(neighbour));
+        }
+    }
+    response /= 8.0;
+    float shade = exp(-response * 300.0 * strength);
+    
+    color = vec4(texture(color_tex, uv).rgb * shade, 1.0);
+    gl_FragDepth = depth;
+}
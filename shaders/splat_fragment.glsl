@@ -0,0 +1,13 @@
+#version 330 core
+
+in vec3 point_color;
+
+out vec4 color;
+
+void main() {
+    vec2 coord = gl_PointCoord * 2.0 - 1.0;
+    if (dot(coord, coord) > 1.0) {
+        discard;
+    }
+    color = vec4(point_color, 1.0);
+}
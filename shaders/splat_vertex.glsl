@@ -0,0 +1,24 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoord;
+layout (location = 3) in vec3 aColor;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 perspective;
+uniform float splat_radius; // World space
+uniform float viewport_height;
+uniform float max_point_size;
+
+out vec3 point_color;
+
+void main() {
+    vec4 view_pos = view * model * vec4(aPos, 1.0);
+    gl_Position = perspective * view_pos;
+    // Project the splat's world space diameter onto the screen, so far points shrink
+    float size = splat_radius * perspective[1][1] * viewport_height / max(-view_pos.z, 0.0001);
+    gl_PointSize = clamp(size, 1.0, max_point_size);
+    point_color = aColor;
+}